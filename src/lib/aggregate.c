@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define MAX_AGGREGATES 16
+#define AGGREGATE_INITIAL_BUCKETS 64
+
+typedef enum {
+    AGG_COUNT,
+    AGG_SUM,
+    AGG_MIN,
+    AGG_MAX,
+    AGG_AVG
+} AggregateFunction;
+
+typedef struct {
+    AggregateFunction function;
+    int column;        // -1 for COUNT(*)
+    char label[80];    // Key used in the JSON output, e.g. "sum_total"
+} AggregateSpec;
+
+// Running state of one aggregate within one group
+typedef struct {
+    long long count;
+    long long integer_sum;
+    double real_sum;
+    int has_real;
+    Value min;
+    Value max;
+} Accumulator;
+
+typedef struct AggregateGroup {
+    unsigned long hash;
+    char *key;                             // Group values separated by '\0'
+    size_t key_length;
+    struct AggregateGroup *next;           // Next group in the same bucket
+    struct AggregateGroup *next_in_order;  // Next group in first-seen order
+    Accumulator accumulators[];
+} AggregateGroup;
+
+typedef struct {
+    AggregateSpec specs[MAX_AGGREGATES];
+    int spec_count;
+    int group_columns[MAX_COLUMNS];
+    int group_count;
+    AggregateGroup **buckets;
+    size_t bucket_count;
+    size_t entry_count;
+    AggregateGroup *first;
+    AggregateGroup *last;
+} HashAggregate;
+
+// Parse "count,sum:total,avg:total" into aggregate specs
+int parseAggregateSpecs(const char *functions, const TableSchema *schema, HashAggregate *aggregate) {
+    char list[256];
+    strncpy(list, functions, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+
+    char *saveptr = NULL;
+    char *item = strtok_r(list, ",", &saveptr);
+    while (item != NULL) {
+        if (aggregate->spec_count == MAX_AGGREGATES) {
+            return 0;
+        }
+        AggregateSpec *spec = &aggregate->specs[aggregate->spec_count++];
+        char *column_name = strchr(item, ':');
+        if (column_name != NULL) {
+            *column_name++ = '\0';
+        }
+
+        if (strcasecmp(item, "count") == 0) spec->function = AGG_COUNT;
+        else if (strcasecmp(item, "sum") == 0) spec->function = AGG_SUM;
+        else if (strcasecmp(item, "min") == 0) spec->function = AGG_MIN;
+        else if (strcasecmp(item, "max") == 0) spec->function = AGG_MAX;
+        else if (strcasecmp(item, "avg") == 0) spec->function = AGG_AVG;
+        else return 0;
+
+        if (column_name == NULL || strcmp(column_name, "*") == 0) {
+            // Only COUNT may be applied to whole rows
+            if (spec->function != AGG_COUNT) {
+                return 0;
+            }
+            spec->column = -1;
+            strcpy(spec->label, "count");
+        } else {
+            spec->column = schemaColumnIndex(schema, column_name);
+            if (spec->column < 0) {
+                return 0;
+            }
+            snprintf(spec->label, sizeof(spec->label), "%.15s_%.63s", item, column_name);
+            for (char *c = spec->label; *c; c++) *c = tolower((unsigned char)*c);
+        }
+        item = strtok_r(NULL, ",", &saveptr);
+    }
+    return aggregate->spec_count > 0;
+}
+
+int parseGroupColumns(const char *group_by, const TableSchema *schema, HashAggregate *aggregate) {
+    char list[256];
+    strncpy(list, group_by, sizeof(list) - 1);
+    list[sizeof(list) - 1] = '\0';
+
+    char *saveptr = NULL;
+    char *column_name = strtok_r(list, ",", &saveptr);
+    while (column_name != NULL) {
+        int index = schemaColumnIndex(schema, column_name);
+        if (index < 0 || aggregate->group_count == MAX_COLUMNS) {
+            return 0;
+        }
+        aggregate->group_columns[aggregate->group_count++] = index;
+        column_name = strtok_r(NULL, ",", &saveptr);
+    }
+    return 1;
+}
+
+void growAggregateBuckets(HashAggregate *aggregate) {
+    size_t bucket_count = aggregate->bucket_count ? aggregate->bucket_count * 2 : AGGREGATE_INITIAL_BUCKETS;
+    AggregateGroup **buckets = calloc(bucket_count, sizeof(AggregateGroup *));
+    for (AggregateGroup *group = aggregate->first; group != NULL; group = group->next_in_order) {
+        size_t slot = group->hash & (bucket_count - 1);
+        group->next = buckets[slot];
+        buckets[slot] = group;
+    }
+    free(aggregate->buckets);
+    aggregate->buckets = buckets;
+    aggregate->bucket_count = bucket_count;
+}
+
+const char *groupField(const HashAggregate *aggregate, int i, char **fields, int field_count) {
+    int column = aggregate->group_columns[i];
+    return column < field_count ? fields[column] : "";
+}
+
+// Whether a group's key holds the row's group values, compared one field at
+// a time so that no copy of the row's key is built for a lookup
+int groupKeyMatches(const HashAggregate *aggregate, const AggregateGroup *group, char **fields, int field_count) {
+    const char *key = group->key;
+    const char *end = group->key + group->key_length;
+    for (int i = 0; i < aggregate->group_count; i++) {
+        const char *value = groupField(aggregate, i, fields, field_count);
+        size_t length = strlen(value);
+        if ((size_t)(end - key) < length + 1 || memcmp(key, value, length + 1) != 0) {
+            return 0;
+        }
+        key += length + 1;
+    }
+    return 1;
+}
+
+// Find the group for a row, creating it on first sight
+AggregateGroup *findAggregateGroup(HashAggregate *aggregate, char **fields, int field_count) {
+    unsigned long hash = 0;
+    size_t key_length = 0;
+    for (int i = 0; i < aggregate->group_count; i++) {
+        const char *value = groupField(aggregate, i, fields, field_count);
+        size_t length = strlen(value);
+        hash = hash * 31 + hash_bytes(value, length);
+        key_length += length + 1;
+    }
+
+    if (aggregate->buckets != NULL) {
+        AggregateGroup *group = aggregate->buckets[hash & (aggregate->bucket_count - 1)];
+        for (; group != NULL; group = group->next) {
+            if (group->hash == hash && group->key_length == key_length && groupKeyMatches(aggregate, group, fields, field_count)) {
+                return group;
+            }
+        }
+    }
+
+    if (aggregate->entry_count >= aggregate->bucket_count) {
+        growAggregateBuckets(aggregate);
+    }
+    AggregateGroup *group = calloc(1, sizeof(AggregateGroup) + aggregate->spec_count * sizeof(Accumulator));
+    group->hash = hash;
+    group->key = malloc(key_length + 1);
+    group->key_length = key_length;
+    char *key = group->key;
+    for (int i = 0; i < aggregate->group_count; i++) {
+        const char *value = groupField(aggregate, i, fields, field_count);
+        size_t length = strlen(value) + 1;
+        memcpy(key, value, length);
+        key += length;
+    }
+
+    size_t slot = hash & (aggregate->bucket_count - 1);
+    group->next = aggregate->buckets[slot];
+    aggregate->buckets[slot] = group;
+    if (aggregate->last != NULL) {
+        aggregate->last->next_in_order = group;
+    } else {
+        aggregate->first = group;
+    }
+    aggregate->last = group;
+    aggregate->entry_count++;
+    return group;
+}
+
+// Min/max text values must outlive the row buffer they were read from
+void keepValue(Value *target, const Value *value) {
+    if (target->type == TYPE_TEXT && !target->is_null) {
+        free((char *)target->text);
+    }
+    *target = *value;
+    if (value->type == TYPE_TEXT) {
+        target->text = strdup(value->text);
+    }
+}
+
+void accumulateRow(HashAggregate *aggregate, const TableSchema *schema, char **fields, int field_count) {
+    AggregateGroup *group = findAggregateGroup(aggregate, fields, field_count);
+
+    for (int i = 0; i < aggregate->spec_count; i++) {
+        AggregateSpec *spec = &aggregate->specs[i];
+        Accumulator *accumulator = &group->accumulators[i];
+
+        if (spec->column < 0) {
+            accumulator->count++;
+            continue;
+        }
+        const char *field = spec->column < field_count ? fields[spec->column] : "";
+        Value value = parseValue(field, schema->columns[spec->column].type);
+        if (value.is_null) {
+            continue;
+        }
+        if (spec->function == AGG_SUM || spec->function == AGG_AVG) {
+            // Text columns take part in SUM/AVG only where they hold numbers
+            if (value.type == TYPE_TEXT) {
+                value = parseValue(field, TYPE_REAL);
+                if (value.type == TYPE_TEXT) {
+                    continue;
+                }
+            }
+            if (value.type == TYPE_INTEGER) {
+                accumulator->integer_sum += value.integer;
+            } else {
+                accumulator->has_real = 1;
+            }
+            accumulator->real_sum += value.real;
+        }
+        if (spec->function == AGG_MIN && (accumulator->count == 0 || compareValues(&value, &accumulator->min) < 0)) {
+            keepValue(&accumulator->min, &value);
+        }
+        if (spec->function == AGG_MAX && (accumulator->count == 0 || compareValues(&value, &accumulator->max) > 0)) {
+            keepValue(&accumulator->max, &value);
+        }
+        accumulator->count++;
+    }
+}
+
+// Render one aggregate result as text; returns the type it should be read as.
+// An empty buffer means NULL (no non-null input for SUM/MIN/MAX/AVG).
+ColumnType formatAggregateResult(const AggregateSpec *spec, const Accumulator *accumulator, char *buffer, size_t size) {
+    buffer[0] = '\0';
+    if (spec->function == AGG_COUNT) {
+        snprintf(buffer, size, "%lld", accumulator->count);
+        return TYPE_INTEGER;
+    }
+    if (accumulator->count == 0) {
+        return TYPE_TEXT;
+    }
+    if (spec->function == AGG_SUM && !accumulator->has_real) {
+        snprintf(buffer, size, "%lld", accumulator->integer_sum);
+        return TYPE_INTEGER;
+    }
+    if (spec->function == AGG_SUM || spec->function == AGG_AVG) {
+        double result = spec->function == AGG_SUM ? accumulator->real_sum : accumulator->real_sum / accumulator->count;
+        snprintf(buffer, size, "%.15g", result);
+        return TYPE_REAL;
+    }
+
+    const Value *value = spec->function == AGG_MIN ? &accumulator->min : &accumulator->max;
+    if (value->type == TYPE_INTEGER) {
+        snprintf(buffer, size, "%lld", value->integer);
+    } else if (value->type == TYPE_REAL) {
+        snprintf(buffer, size, "%.15g", value->real);
+    } else {
+        snprintf(buffer, size, "%s", value->text);
+    }
+    return value->type;
+}
+
+void writeAggregateGroup(JsonWriter *out, const HashAggregate *aggregate, const TableSchema *schema, const AggregateGroup *group) {
+    json_char(out, '{');
+    const char *key = group->key;
+    for (int i = 0; i < aggregate->group_count; i++) {
+        json_key(out, schema->columns[aggregate->group_columns[i]].name);
+        json_string(out, key);
+        json_char(out, ',');
+        key += strlen(key) + 1;
+    }
+
+    char result[256];
+    for (int i = 0; i < aggregate->spec_count; i++) {
+        const AggregateSpec *spec = &aggregate->specs[i];
+        if (i > 0) json_char(out, ',');
+        json_key(out, spec->label);
+
+        ColumnType type = formatAggregateResult(spec, &group->accumulators[i], result, sizeof(result));
+        if (result[0] == '\0') {
+            json_raw(out, "null");
+        } else if (type == TYPE_TEXT) {
+            json_string(out, result);
+        } else {
+            json_raw(out, result);
+        }
+    }
+    json_char(out, '}');
+}
+
+void freeHashAggregate(HashAggregate *aggregate) {
+    AggregateGroup *group = aggregate->first;
+    while (group != NULL) {
+        AggregateGroup *next = group->next_in_order;
+        for (int i = 0; i < aggregate->spec_count; i++) {
+            Accumulator *accumulator = &group->accumulators[i];
+            if (accumulator->min.type == TYPE_TEXT && accumulator->count > 0) free((char *)accumulator->min.text);
+            if (accumulator->max.type == TYPE_TEXT && accumulator->count > 0) free((char *)accumulator->max.text);
+        }
+        free(group->key);
+        free(group);
+        group = next;
+    }
+    free(aggregate->buckets);
+}
+
+// Compute COUNT/SUM/MIN/MAX/AVG over a table, optionally grouped by columns.
+// Returns a JSON array (one object per group) or NULL if the request is invalid.
+char *aggregateTableData(const char *database_name, const char *table_name, const char *functions, const char *group_by) {
+    TableSchema schema;
+    if (!loadTableSchema(database_name, table_name, &schema)) {
+        return NULL;
+    }
+
+    HashAggregate aggregate;
+    memset(&aggregate, 0, sizeof(aggregate));
+    if (!parseAggregateSpecs(functions, &schema, &aggregate) || !parseGroupColumns(group_by, &schema, &aggregate)) {
+        return NULL;
+    }
+
+    TableCursor cursor;
+    if (!openTableCursor(&cursor, database_name, table_name)) {
+        return NULL;
+    }
+    while (nextTableRow(&cursor)) {
+        accumulateRow(&aggregate, &schema, cursor.fields, cursor.field_count);
+    }
+    closeTableCursor(&cursor);
+
+    // An ungrouped aggregate always yields one row, even over an empty table
+    if (aggregate.group_count == 0 && aggregate.first == NULL) {
+        findAggregateGroup(&aggregate, NULL, 0);
+    }
+
+    JsonWriter out;
+    json_init(&out);
+    json_char(&out, '[');
+    for (AggregateGroup *group = aggregate.first; group != NULL; group = group->next_in_order) {
+        writeAggregateGroup(&out, &aggregate, &schema, group);
+        countMetric(METRIC_ROWS_RETURNED, 1);
+        if (group->next_in_order != NULL) {
+            json_char(&out, ',');
+        }
+    }
+    json_char(&out, ']');
+
+    freeHashAggregate(&aggregate);
+    return json_finish(&out);
+}
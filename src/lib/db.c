@@ -2,28 +2,927 @@
 #include <stdlib.h>
 #include <unistd.h> 
 #include <string.h>
+#include <strings.h>
 #include <dirent.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "constants.c"
 #include "utils.c"
+#include "metrics.c"
+#include "slowlog.c"
+#include "scan.c"
+#include "uring.c"
+
+
+// Per-table version counters. The catalog version moves whenever a table's
+// definition (its columns or indexes) changes, so anything derived from a
+// schema, such as a cached query plan, can tell that it is stale; the data
+// version moves on every write, for anything derived from the rows. Next
+// to them is the size of the table's rows, as a cursor last found it plus
+// what was inserted since; only a hint, since updates and deletes, and other
+// processes' writes, go uncounted until the next full scan.
+typedef struct TableVersion {
+    char database_name[256];
+    char table_name[64];
+    unsigned long catalog;
+    unsigned long data;
+    int sized;    // A cursor has been through the rows
+    size_t size;  // Bytes of the rows, blank lines included
+    // On the database's own entry (empty table name): the shared counters as
+    // this process last saw them
+    unsigned long shared_catalog;
+    unsigned long shared_data;
+    struct TableVersion *next;
+} TableVersion;
+
+TableVersion *table_versions = NULL;
+pthread_mutex_t table_versions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define SHARED_VERSION_SLOTS 1024
+
+// When several server processes serve the same files, every write is also
+// counted in memory shared between them, one pair of counters per hash slot
+// of the database name. A process that finds a slot has moved on has missed
+// another process's write, and moves its own versions for that database on
+// so that whatever it built from the old rows or schema goes stale just as
+// after a local write. NULL while this is the only process.
+typedef struct {
+    unsigned long catalog;
+    unsigned long data;
+} SharedVersion;
+
+SharedVersion *shared_versions = NULL;
+
+// Set up the shared counters; called before the server processes are forked
+int shareDatabaseVersions(void) {
+    void *memory = mmap(NULL, SHARED_VERSION_SLOTS * sizeof(SharedVersion), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return 0;
+    }
+    shared_versions = memory;
+    return 1;
+}
+
+// Called with table_versions_lock held
+TableVersion *findTableVersion(const char *database_name, const char *table_name) {
+    TableVersion *entry = table_versions;
+    while (entry != NULL && (strcmp(entry->table_name, table_name) != 0 || strcmp(entry->database_name, database_name) != 0)) {
+        entry = entry->next;
+    }
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(TableVersion));
+        snprintf(entry->database_name, sizeof(entry->database_name), "%s", database_name);
+        snprintf(entry->table_name, sizeof(entry->table_name), "%s", table_name);
+        entry->next = table_versions;
+        table_versions = entry;
+    }
+    return entry;
+}
+
+SharedVersion *sharedVersionSlot(const char *database_name) {
+    return &shared_versions[hash_bytes(database_name, strlen(database_name)) % SHARED_VERSION_SLOTS];
+}
+
+// Catch up with the writes other processes made to a database. Called with
+// table_versions_lock held.
+void syncSharedVersions(const char *database_name) {
+    if (shared_versions == NULL) {
+        return;
+    }
+    SharedVersion *slot = sharedVersionSlot(database_name);
+    unsigned long catalog = __atomic_load_n(&slot->catalog, __ATOMIC_ACQUIRE);
+    unsigned long data = __atomic_load_n(&slot->data, __ATOMIC_ACQUIRE);
+    TableVersion *seen = findTableVersion(database_name, "");
+    if (catalog == seen->shared_catalog && data == seen->shared_data) {
+        return;
+    }
+    for (TableVersion *entry = table_versions; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->database_name, database_name) == 0) {
+            entry->catalog += catalog != seen->shared_catalog;
+            entry->data++;
+        }
+    }
+    seen->shared_catalog = catalog;
+    seen->shared_data = data;
+}
+
+// Count a local write in the shared counters. When nobody else wrote in the
+// meantime this process moves its own view along, so that it does not take
+// its own write for someone else's. Called with table_versions_lock held.
+void publishSharedVersion(const char *database_name, int catalog_changed) {
+    if (shared_versions == NULL) {
+        return;
+    }
+    syncSharedVersions(database_name);
+    SharedVersion *slot = sharedVersionSlot(database_name);
+    TableVersion *seen = findTableVersion(database_name, "");
+    if (catalog_changed && __atomic_fetch_add(&slot->catalog, 1, __ATOMIC_RELEASE) == seen->shared_catalog) {
+        seen->shared_catalog++;
+    }
+    if (__atomic_fetch_add(&slot->data, 1, __ATOMIC_RELEASE) == seen->shared_data) {
+        seen->shared_data++;
+    }
+}
+
+unsigned long catalogVersion(const char *database_name, const char *table_name) {
+    pthread_mutex_lock(&table_versions_lock);
+    syncSharedVersions(database_name);
+    unsigned long version = findTableVersion(database_name, table_name)->catalog;
+    pthread_mutex_unlock(&table_versions_lock);
+    return version;
+}
+
+unsigned long dataVersion(const char *database_name, const char *table_name) {
+    pthread_mutex_lock(&table_versions_lock);
+    syncSharedVersions(database_name);
+    unsigned long version = findTableVersion(database_name, table_name)->data;
+    pthread_mutex_unlock(&table_versions_lock);
+    return version;
+}
+
+// Mark a table's rows as changed
+void bumpDataVersion(const char *database_name, const char *table_name) {
+    pthread_mutex_lock(&table_versions_lock);
+    findTableVersion(database_name, table_name)->data++;
+    publishSharedVersion(database_name, 0);
+    pthread_mutex_unlock(&table_versions_lock);
+}
+
+// Mark a table's definition, and with it its rows, as changed; a NULL table
+// means every table of the database
+void bumpCatalogVersion(const char *database_name, const char *table_name) {
+    pthread_mutex_lock(&table_versions_lock);
+    if (table_name != NULL) {
+        TableVersion *entry = findTableVersion(database_name, table_name);
+        entry->catalog++;
+        entry->data++;
+        entry->sized = 0;
+    } else {
+        for (TableVersion *entry = table_versions; entry != NULL; entry = entry->next) {
+            if (strcmp(entry->database_name, database_name) == 0) {
+                entry->catalog++;
+                entry->data++;
+                entry->sized = 0;
+            }
+        }
+    }
+    publishSharedVersion(database_name, 1);
+    pthread_mutex_unlock(&table_versions_lock);
+}
+
+// The entry a cursor notes the size of its table's rows in once it has read
+// them all. Entries are never freed.
+TableVersion *tableVersionEntry(const char *database_name, const char *table_name) {
+    pthread_mutex_lock(&table_versions_lock);
+    TableVersion *entry = findTableVersion(database_name, table_name);
+    pthread_mutex_unlock(&table_versions_lock);
+    return entry;
+}
+
+void noteTableSize(TableVersion *entry, size_t size) {
+    pthread_mutex_lock(&table_versions_lock);
+    entry->sized = 1;
+    entry->size = size;
+    pthread_mutex_unlock(&table_versions_lock);
+}
+
+// Count rows just inserted into a table's size
+void growTableSize(const char *database_name, const char *table_name, size_t length) {
+    pthread_mutex_lock(&table_versions_lock);
+    findTableVersion(database_name, table_name)->size += length;
+    pthread_mutex_unlock(&table_versions_lock);
+}
+
+// The size of a table's rows, as noted, or -1 while no cursor has been
+// through them
+long tableSize(const char *database_name, const char *table_name) {
+    pthread_mutex_lock(&table_versions_lock);
+    TableVersion *entry = findTableVersion(database_name, table_name);
+    long size = entry->sized ? (long)entry->size : -1;
+    pthread_mutex_unlock(&table_versions_lock);
+    return size;
+}
+
+// One reader-writer lock per database file. Readers (cursors, schema loads,
+// index scans) share it for as long as they look at the file; anything that
+// changes the file holds it exclusively, so a reader never sees a half
+// written file and two writers never lose each other's rows. glibc's default
+// rwlock prefers readers, so a thread may take the read lock again while it
+// already holds it (a join opens two cursors on one file). When other server
+// processes share the files, an fcntl lock on the file itself extends this
+// to them.
+typedef struct DatabaseLock {
+    char database_name[256];
+    pthread_rwlock_t lock;
+    struct DatabaseLock *next;
+} DatabaseLock;
+
+DatabaseLock *database_locks = NULL;
+pthread_mutex_t database_locks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_rwlock_t *databaseLock(const char *database_name) {
+    pthread_mutex_lock(&database_locks_lock);
+    DatabaseLock *entry = database_locks;
+    while (entry != NULL && strcmp(entry->database_name, database_name) != 0) {
+        entry = entry->next;
+    }
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(DatabaseLock));
+        snprintf(entry->database_name, sizeof(entry->database_name), "%s", database_name);
+        pthread_rwlock_init(&entry->lock, NULL);
+        entry->next = database_locks;
+        database_locks = entry;
+    }
+    pthread_mutex_unlock(&database_locks_lock);
+    return &entry->lock;
+}
+
+// A database lock as held by one reader or writer
+typedef struct {
+    pthread_rwlock_t *lock;
+    int file;  // Descriptor holding the lock on the database file, or -1
+} DatabaseHold;
+
+// Take an fcntl lock on a database file for the other server processes.
+// These are open file description locks, which belong to the descriptor: the
+// threads of this process exclude each other with them too, and closing the
+// file elsewhere in the process does not drop them. Writers may replace the
+// file by renaming a new one over it, so a lock on what turns out to be the
+// old file is retried on the new one. -1 when there is no file to lock.
+int lockDatabaseFile(const char *database_name, short type) {
+    char *filename = database_path(NULL, database_name);
+    int file;
+    while ((file = open(filename, O_RDWR | O_CLOEXEC)) >= 0) {
+        struct flock region = {.l_type = type, .l_whence = SEEK_SET};
+        int locked;
+        while ((locked = fcntl(file, F_OFD_SETLKW, &region)) != 0 && errno == EINTR) {
+        }
+        struct stat held, current;
+        if (locked == 0 && fstat(file, &held) == 0 && stat(filename, &current) == 0 &&
+            held.st_dev == current.st_dev && held.st_ino == current.st_ino) {
+            break;
+        }
+        close(file);
+        if (locked != 0) {
+            file = -1;
+            break;
+        }
+    }
+    free(filename);
+    return file;
+}
+
+DatabaseHold lockDatabase(const char *database_name, int exclusive) {
+    DatabaseHold hold = {databaseLock(database_name), -1};
+    if (exclusive) {
+        pthread_rwlock_wrlock(hold.lock);
+    } else {
+        pthread_rwlock_rdlock(hold.lock);
+    }
+    if (shared_versions != NULL) {
+        hold.file = lockDatabaseFile(database_name, exclusive ? F_WRLCK : F_RDLCK);
+    }
+    return hold;
+}
+
+DatabaseHold readLockDatabase(const char *database_name) {
+    return lockDatabase(database_name, 0);
+}
+
+DatabaseHold writeLockDatabase(const char *database_name) {
+    return lockDatabase(database_name, 1);
+}
+
+void unlockDatabase(DatabaseHold *hold) {
+    if (hold->file >= 0) {
+        close(hold->file);  // Which releases the file lock
+    }
+    pthread_rwlock_unlock(hold->lock);
+    hold->lock = NULL;
+    hold->file = -1;
+}
+
+#define MAX_COLUMNS 64
+
+// Storage class of a column, derived from the declared type in "# Columns:"
+typedef enum {
+    TYPE_TEXT,
+    TYPE_INTEGER,
+    TYPE_REAL
+} ColumnType;
+
+typedef struct {
+    char name[64];
+    ColumnType type;
+} Column;
+
+typedef struct {
+    Column columns[MAX_COLUMNS];
+    int column_count;
+    int indexed[MAX_COLUMNS];  // Set for columns listed in "# Index:" lines
+} TableSchema;
+
+#define SCAN_BLOCK_SIZE (64 * 1024)
+
+// The next chunk of a table file, read through the thread's io_uring while
+// the rows before it are parsed
+typedef struct {
+    char *data;
+    long offset;      // File offset of data[0]
+    size_t length;    // Bytes the read returned
+    size_t consumed;  // Bytes already copied into the cursor's block
+    int pending;      // Read submitted and not yet completed
+    int result;
+} ReadAhead;
+
+// Cursor over the rows of one table in the [TABLE_VALUE_BEGIN] block. Rows
+// are read a block at a time and cut along the block's delimiter index.
+typedef struct {
+    FILE *file;
+    char *line;
+    size_t line_capacity;
+    long row_offset;  // File offset of the current row
+    char *fields[MAX_COLUMNS];
+    int field_count;
+    int in_table;
+
+    char *block;
+    size_t block_capacity;
+    size_t block_length;
+    long block_offset;  // File offset of block[0]
+    size_t row_start;   // Block offset of the next unread line
+    uint32_t *delimiters;
+    size_t delimiter_count;
+    size_t next_delimiter;
+    int at_end_of_file;
+    long read_offset;   // File offset the next read starts at
+    ReadAhead *ahead;   // NULL when reads go straight through pread
+    DatabaseHold hold;  // Database read lock held until the cursor closes
+    unsigned long rows_read;  // Counted into the metrics when the cursor closes
+    long values_offset;       // File offset of the table's first row
+    TableVersion *version;    // Where the size of the rows is noted
+} TableCursor;
+
+// Ring for the table reads of the calling thread, created on first use.
+// NULL when io_uring is off or could not be set up here.
+__thread Uring scan_ring;
+__thread int scan_ring_state = 0;  // 0 untried, 1 ready, -1 unavailable
+
+Uring *scanRing(void) {
+    if (!io_uring_enabled || scan_ring_state < 0) {
+        return NULL;
+    }
+    if (scan_ring_state == 0) {
+        scan_ring_state = uringInit(&scan_ring, 32) ? 1 : -1;
+        if (scan_ring_state < 0) {
+            return NULL;
+        }
+    }
+    return &scan_ring;
+}
+
+// Wait for the read of ahead. Completions for other cursors on this thread,
+// such as the other side of a join, are recorded on the way. Returns 0 if
+// the ring broke and the read may still be in flight.
+int awaitReadAhead(Uring *ring, ReadAhead *ahead) {
+    while (ahead->pending) {
+        struct io_uring_cqe *cqe = uringCompletion(ring);
+        if (cqe == NULL) {
+            if (uringSubmit(ring, 1, -1) < 0 && errno != EAGAIN && errno != EBUSY) {
+                return 0;
+            }
+            continue;
+        }
+        ReadAhead *done = (ReadAhead *)(uintptr_t)cqe->user_data;
+        if (done != NULL) {
+            done->result = cqe->res;
+            done->pending = 0;
+        }
+        uringSeen(ring);
+    }
+    return 1;
+}
+
+// Start reading the chunk at read_offset into the staging buffer
+void startReadAhead(TableCursor *cursor) {
+    Uring *ring = scanRing();
+    ReadAhead *ahead = cursor->ahead;
+    ahead->offset = cursor->read_offset;
+    ahead->length = 0;
+    ahead->consumed = 0;
+    ahead->result = 0;
+    if (!uringQueueRead(ring, fileno(cursor->file), ahead->data, SCAN_BLOCK_SIZE, ahead->offset, (uintptr_t)ahead)) {
+        ahead->result = -EAGAIN;
+        return;
+    }
+    ahead->pending = 1;
+    uringSubmit(ring, 0, 0);
+}
+
+// Read up to length bytes at read_offset into buffer, from the read-ahead
+// chunk when there is one
+ssize_t readCursorChunk(TableCursor *cursor, char *buffer, size_t length) {
+    ReadAhead *ahead = cursor->ahead;
+    if (ahead != NULL && !awaitReadAhead(&scan_ring, ahead)) {
+        // The kernel may still write into the chunk, so it is given up on
+        // rather than freed; the scan finishes with plain reads
+        cursor->ahead = ahead = NULL;
+    }
+    if (ahead != NULL) {
+        if (ahead->result >= 0 && ahead->length == 0) {
+            ahead->length = (size_t)ahead->result;
+        }
+        if (ahead->result >= 0 && ahead->offset == cursor->read_offset) {
+            size_t available = ahead->length - ahead->consumed;
+            size_t copied = available < length ? available : length;
+            memcpy(buffer, ahead->data + ahead->consumed, copied);
+            ahead->consumed += copied;
+            cursor->read_offset += copied;
+            // Once the chunk is used up, fetch the next one while the caller parses this
+            if (ahead->consumed == ahead->length && ahead->length > 0) {
+                startReadAhead(cursor);
+            }
+            return (ssize_t)copied;
+        }
+        if (ahead->result < 0 && ahead->result != -EAGAIN) {
+            // The ring failed; finish the scan with plain reads
+            free(ahead->data);
+            free(ahead);
+            cursor->ahead = NULL;
+        }
+    }
+    ssize_t read;
+    do {
+        read = pread(fileno(cursor->file), buffer, length, cursor->read_offset);
+    } while (read < 0 && errno == EINTR);
+    if (read > 0) {
+        cursor->read_offset += read;
+        if (cursor->ahead != NULL) {
+            startReadAhead(cursor);
+        }
+    }
+    return read;
+}
+
+ColumnType parseColumnType(const char *type) {
+    if (strncasecmp(type, "INT", 3) == 0) {
+        return TYPE_INTEGER;
+    }
+    if (strncasecmp(type, "REAL", 4) == 0 || strncasecmp(type, "FLOAT", 5) == 0 ||
+        strncasecmp(type, "DOUBLE", 6) == 0 || strncasecmp(type, "NUMERIC", 7) == 0) {
+        return TYPE_REAL;
+    }
+    return TYPE_TEXT;
+}
+
+// Check whether a "# Table: <name>" line names the given table
+int isTableHeader(const char *line, const char *table_name) {
+    if (strncmp(line, "# Table:", 8) != 0) {
+        return 0;
+    }
+    const char *name = line + 8;
+    while (*name == ' ') name++;
+    size_t length = strlen(name);
+    while (length > 0 && (name[length - 1] == '\n' || name[length - 1] == '\r' || name[length - 1] == ' ')) {
+        length--;
+    }
+    return length == strlen(table_name) && strncmp(name, table_name, length) == 0;
+}
+
+int schemaColumnIndex(const TableSchema *schema, const char *column_name) {
+    for (int i = 0; i < schema->column_count; i++) {
+        if (strcmp(schema->columns[i].name, column_name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Read the column names, types and indexes of a table. Returns 1 if the table
+// exists. The caller holds the database lock.
+int readTableSchema(const char *database_name, const char *table_name, TableSchema *schema) {
+    char *filename = database_path(NULL, database_name);
+    FILE *file = fopen(filename, "r");
+    free(filename);
+    if (file == NULL) {
+        return 0;
+    }
+
+    char *line = NULL;
+    size_t capacity = 0;
+    int in_table_schema = 0, found_schema = 0, loaded = 0;
+    memset(schema, 0, sizeof(*schema));
+
+    while (getline(&line, &capacity, file) != -1) {
+        if (strstr(line, "[TABLE_BEGIN]") != NULL) {
+            in_table_schema = 1;
+            continue;
+        }
+        if (strstr(line, "[TABLE_END]") != NULL) {
+            break;
+        }
+        if (!in_table_schema) {
+            continue;
+        }
+        if (strncmp(line, "# Table:", 8) == 0) {
+            if (loaded) {
+                break;
+            }
+            found_schema = isTableHeader(line, table_name);
+            continue;
+        }
+        if (loaded && strncmp(line, "# Index:", 8) == 0) {
+            char name[64] = "";
+            sscanf(line + 8, "%63s", name);
+            int column = schemaColumnIndex(schema, name);
+            if (column >= 0) {
+                schema->indexed[column] = 1;
+            }
+            continue;
+        }
+        if (found_schema && strncmp(line, "# Columns:", 10) == 0) {
+            // "name TYPE, name TYPE, ..."
+            const char *definitions = line + 10;
+            FieldSpan spans[MAX_COLUMNS];
+            int count = tokenize_line(definitions, strcspn(definitions, "\r\n"), ',', spans, MAX_COLUMNS);
+            for (int i = 0; i < count; i++) {
+                FieldSpan definition = trim_span(definitions, spans[i]);
+                if (definition.length == 0) {
+                    continue;
+                }
+                const char *name = definitions + definition.offset;
+                size_t name_length = 0;
+                while (name_length < definition.length && !isspace((unsigned char)name[name_length])) name_length++;
+                Column *column = &schema->columns[schema->column_count++];
+                snprintf(column->name, sizeof(column->name), "%.*s", (int)name_length, name);
+                column->type = parseColumnType(name + name_length + strspn(name + name_length, " \t"));
+            }
+            loaded = 1;
+        }
+    }
+
+    free(line);
+    fclose(file);
+    return loaded;
+}
+
+int loadTableSchema(const char *database_name, const char *table_name, TableSchema *schema) {
+    DatabaseHold hold = readLockDatabase(database_name);
+    int loaded = readTableSchema(database_name, table_name, schema);
+    unlockDatabase(&hold);
+    return loaded;
+}
+
+// Split a row in place on ',' and point fields at each value
+int splitRowFields(char *line, char **fields) {
+    FieldSpan spans[MAX_COLUMNS];
+    int field_count = tokenize_line(line, strlen(line), ',', spans, MAX_COLUMNS);
+    for (int i = 0; i < field_count; i++) {
+        fields[i] = line + spans[i].offset;
+        fields[i][spans[i].length] = '\0';
+    }
+    return field_count;
+}
+
+int openTableCursor(TableCursor *cursor, const char *database_name, const char *table_name) {
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->hold = readLockDatabase(database_name);
+    char *filename = database_path(NULL, database_name);
+    cursor->file = fopen(filename, "r");
+    free(filename);
+    if (cursor->file == NULL) {
+        unlockDatabase(&cursor->hold);
+        return 0;
+    }
+
+    // Position the cursor on the line after the table's value header
+    int in_table_values = 0;
+    while (getline(&cursor->line, &cursor->line_capacity, cursor->file) != -1) {
+        if (strstr(cursor->line, "[TABLE_VALUE_BEGIN]") != NULL) {
+            in_table_values = 1;
+        } else if (strstr(cursor->line, "[TABLE_VALUE_END]") != NULL) {
+            break;
+        } else if (in_table_values && isTableHeader(cursor->line, table_name)) {
+            cursor->in_table = 1;
+            break;
+        }
+    }
+    cursor->block_offset = ftell(cursor->file);
+    cursor->read_offset = cursor->block_offset;
+    cursor->values_offset = cursor->block_offset;
+    countMetric(METRIC_FILE_BYTES_READ, cursor->block_offset);
+    if (cursor->in_table) {
+        cursor->version = tableVersionEntry(database_name, table_name);
+    }
+
+    // From here on the file is read at read_offset, by pread or by the ring
+    if (cursor->in_table && scanRing() != NULL) {
+        cursor->ahead = calloc(1, sizeof(ReadAhead));
+        cursor->ahead->data = malloc(SCAN_BLOCK_SIZE);
+        startReadAhead(cursor);
+    }
+    return 1;
+}
+
+// Keep the unread tail of the block, append the next chunk of the file and
+// index the delimiters of the whole block again
+void fillCursorBlock(TableCursor *cursor) {
+    if (cursor->row_start > 0) {
+        memmove(cursor->block, cursor->block + cursor->row_start, cursor->block_length - cursor->row_start);
+    }
+    cursor->block_offset += cursor->row_start;
+    cursor->block_length -= cursor->row_start;
+    cursor->row_start = 0;
+
+    // A line longer than the block needs a bigger block; one byte stays free
+    // to terminate a last line that has no newline
+    if (cursor->block_capacity - cursor->block_length < 2) {
+        cursor->block_capacity = cursor->block_capacity ? cursor->block_capacity * 2 : SCAN_BLOCK_SIZE;
+        cursor->block = realloc(cursor->block, cursor->block_capacity);
+        cursor->delimiters = realloc(cursor->delimiters, cursor->block_capacity * sizeof(uint32_t));
+    }
+    uint64_t waited = phaseStart();
+    ssize_t read = readCursorChunk(cursor, cursor->block + cursor->block_length, cursor->block_capacity - cursor->block_length - 1);
+    phaseEnd(PHASE_READ, waited);
+    if (read > 0) {
+        countMetric(METRIC_FILE_BYTES_READ, read);
+    }
+    if (read <= 0) {
+        cursor->at_end_of_file = 1;
+        read = 0;
+    }
+    cursor->block_length += read;
+    cursor->delimiter_count = indexDelimiters(cursor->block, cursor->block_length, cursor->delimiters);
+    cursor->next_delimiter = 0;
+}
+
+int nextTableRow(TableCursor *cursor) {
+    long values_end = 0;
+    while (cursor->in_table) {
+        // The line ends at the next indexed newline; the commas before it split its fields
+        size_t first = cursor->next_delimiter;
+        size_t end = first;
+        while (end < cursor->delimiter_count && cursor->block[cursor->delimiters[end]] != '\n') {
+            end++;
+        }
+        size_t line_end;
+        if (end < cursor->delimiter_count) {
+            line_end = cursor->delimiters[end];
+        } else if (!cursor->at_end_of_file) {
+            fillCursorBlock(cursor);
+            continue;
+        } else if (cursor->row_start < cursor->block_length) {
+            line_end = cursor->block_length;
+        } else {
+            values_end = cursor->block_offset + cursor->block_length;
+            break;
+        }
+
+        char *line = cursor->block + cursor->row_start;
+        cursor->row_offset = cursor->block_offset + cursor->row_start;
+        cursor->row_start = line_end + 1;
+        cursor->next_delimiter = end + 1;
+        cursor->block[line_end] = '\0';
+        if (strncmp(line, "# Table:", 8) == 0 || strstr(line, "[TABLE_VALUE_END]") != NULL) {
+            values_end = cursor->row_offset;
+            break;
+        }
+        if (is_empty_line(line)) {
+            continue;
+        }
+
+        int field_count = 0;
+        char *field = line;
+        for (size_t i = first; i < end && field_count < MAX_COLUMNS - 1; i++) {
+            cursor->fields[field_count++] = field;
+            cursor->block[cursor->delimiters[i]] = '\0';
+            field = cursor->block + cursor->delimiters[i] + 1;
+        }
+        cursor->fields[field_count++] = field;
+        cursor->field_count = field_count;
+        cursor->rows_read++;
+        return 1;
+    }
+    if (cursor->in_table) {
+        noteTableSize(cursor->version, values_end - cursor->values_offset);  // Just read the last row
+    }
+    cursor->in_table = 0;
+    return 0;
+}
+
+void closeTableCursor(TableCursor *cursor) {
+    countMetric(METRIC_ROWS_SCANNED, cursor->rows_read);
+    if (cursor->ahead != NULL) {
+        // The kernel may still be writing into the staging buffer
+        if (awaitReadAhead(&scan_ring, cursor->ahead)) {
+            free(cursor->ahead->data);
+            free(cursor->ahead);
+        }
+    }
+    if (cursor->file != NULL) {
+        fclose(cursor->file);
+    }
+    free(cursor->line);
+    free(cursor->block);
+    free(cursor->delimiters);
+    if (cursor->hold.lock != NULL) {
+        unlockDatabase(&cursor->hold);
+    }
+    memset(cursor, 0, sizeof(*cursor));
+}
+
+// A field interpreted according to its column type. Text points into the row.
+typedef struct {
+    ColumnType type;
+    int is_null;
+    long long integer;
+    double real;
+    const char *text;
+} Value;
+
+Value parseValue(const char *field, ColumnType type) {
+    Value value = {TYPE_TEXT, 0, 0, 0.0, field};
+    char *end = NULL;
+
+    if (field == NULL || *field == '\0') {
+        value.is_null = 1;
+        return value;
+    }
+    if (type == TYPE_INTEGER) {
+        value.integer = strtoll(field, &end, 10);
+        if (*end == '\0') {
+            value.type = TYPE_INTEGER;
+            value.real = (double)value.integer;
+            return value;
+        }
+    }
+    if (type == TYPE_INTEGER || type == TYPE_REAL) {
+        value.real = strtod(field, &end);
+        if (*end == '\0') {
+            value.type = TYPE_REAL;
+            return value;
+        }
+    }
+    // Not a valid number for the column, keep it as text
+    return value;
+}
+
+// Order values: NULL first, then numbers, then text
+int compareValues(const Value *a, const Value *b) {
+    if (a->is_null || b->is_null) {
+        return b->is_null - a->is_null;
+    }
+    int a_numeric = a->type != TYPE_TEXT, b_numeric = b->type != TYPE_TEXT;
+    if (a_numeric != b_numeric) {
+        return a_numeric ? -1 : 1;
+    }
+    if (!a_numeric) {
+        return strcmp(a->text, b->text);
+    }
+    if (a->type == TYPE_INTEGER && b->type == TYPE_INTEGER) {
+        return (a->integer > b->integer) - (a->integer < b->integer);
+    }
+    return (a->real > b->real) - (a->real < b->real);
+}
+
+typedef enum {
+    ROW_KEEP,
+    ROW_REPLACE,
+    ROW_DELETE
+} RowAction;
+
+// Decides the fate of one row; for ROW_REPLACE it repoints fields at new values
+typedef RowAction (*RowVisitor)(char **fields, int field_count, void *context);
+
+// Copy a database file to a temp file beside it, then move it into place
+FILE *openRewriteFile(const char *filename, char *temp_path, size_t temp_path_size) {
+    snprintf(temp_path, temp_path_size, "%s.XXXXXX", filename);
+    int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        perror("Unable to create temp file");
+        return NULL;
+    }
+    struct stat st;
+    if (stat(filename, &st) == 0) {
+        fchmod(fd, st.st_mode & 0777);
+    }
+    return fdopen(fd, "w");
+}
+
+int commitRewriteFile(FILE *temp_file, const char *temp_path, const char *filename, int changed) {
+    long written = ftell(temp_file);
+    if (fclose(temp_file) != 0 || !changed) {
+        unlink(temp_path);
+        return 0;
+    }
+    if (rename(temp_path, filename) != 0) {
+        perror("Unable to replace database file");
+        unlink(temp_path);
+        return 0;
+    }
+    countMetric(METRIC_FILE_BYTES_WRITTEN, written > 0 ? written : 0);
+    return 1;
+}
+
+// Stream a database file through visitor for every row of table_name and
+// replace the file if any row was rewritten or dropped. Returns the number of
+// rows changed, or -1 if the file could not be rewritten.
+int rewriteTableRows(const char *database_name, const char *table_name, RowVisitor visitor, void *context) {
+    DatabaseHold hold = writeLockDatabase(database_name);
+    char *filename = database_path(NULL, database_name);
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        free(filename);
+        unlockDatabase(&hold);
+        return -1;
+    }
+    char temp_path[512];
+    FILE *temp_file = openRewriteFile(filename, temp_path, sizeof(temp_path));
+    if (temp_file == NULL) {
+        fclose(file);
+        free(filename);
+        unlockDatabase(&hold);
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t capacity = 0;
+    int in_table_values = 0, in_table = 0, changed = 0;
+    char *fields[MAX_COLUMNS];
+
+    while (getline(&line, &capacity, file) != -1) {
+        if (strstr(line, "[TABLE_VALUE_BEGIN]") != NULL) {
+            in_table_values = 1;
+        } else if (strstr(line, "[TABLE_VALUE_END]") != NULL) {
+            in_table_values = in_table = 0;
+        } else if (in_table_values && strncmp(line, "# Table:", 8) == 0) {
+            in_table = isTableHeader(line, table_name);
+        } else if (in_table && !is_empty_line(line)) {
+            trim_newlines(line);
+            int field_count = splitRowFields(line, fields);
+            RowAction action = visitor(fields, field_count, context);
+            if (action != ROW_KEEP) {
+                changed++;
+            }
+            if (action != ROW_DELETE) {
+                for (int i = 0; i < field_count; i++) {
+                    if (i > 0) fputc(',', temp_file);
+                    fputs(fields[i], temp_file);
+                }
+                fputc('\n', temp_file);
+            }
+            continue;
+        }
+        fputs(line, temp_file);
+    }
 
+    free(line);
+    countMetric(METRIC_FILE_BYTES_READ, ftell(file));
+    fclose(file);
+    if (!commitRewriteFile(temp_file, temp_path, filename, changed) && changed) {
+        changed = -1;
+    }
+    free(filename);
+    if (changed > 0) {
+        bumpDataVersion(database_name, table_name);
+    }
+    unlockDatabase(&hold);
+    return changed;
+}
 
 // Function to create a new database (if it doesn't already exist)
-int createDB(const char *database_name) {
+int createDB(Arena *arena, const char *database_name) {
     char sanitized_name[256];
     char *filename = "";
 
     sanitize_str(database_name, sanitized_name, sizeof(sanitized_name), ".db");
-    filename = database_path(sanitized_name);
-    // Check if the database file already exists
-    if (access(filename, F_OK) == 0) {
+    filename = database_path(arena, sanitized_name);
+    DatabaseHold hold = writeLockDatabase(database_name);
+    // Claim the file, failing if it already exists; another server process
+    // creating it at the same moment cannot both succeed
+    int created = open(filename, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (created < 0) {
+        unlockDatabase(&hold);
         return 0; // File exists, return 0
     }
+    if (shared_versions != NULL) {
+        // Keep the other processes out until the file has its layout
+        struct flock region = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+        fcntl(created, F_OFD_SETLK, &region);
+        hold.file = created;
+    } else {
+        close(created);
+    }
     // If the database doesn't exist, create a new one
     writeToFile(filename, DB_HEADER);
-    appendToFile(filename, concat("\nName: ",sanitized_name));
+    appendToFile(filename, concat(arena, "\nName: ",sanitized_name));
     appendToFile(filename, DB_BODY);
-    free(filename);
+    unlockDatabase(&hold);
     // Insert Version Data
     return 1; // Indicate that the database was created successfully
 }
@@ -39,8 +938,9 @@ char *listDB(const char *directory) {
     }
 
     // Initializing the JSON response structure
-    char *json = (char *)malloc(1024); // Allocate some initial space
-    strcpy(json, "{\"database\":[");
+    JsonWriter json;
+    json_init(&json);
+    json_raw(&json, "{\"database\":[");
 
     int firstFile = 1; // To handle the commas correctly
 
@@ -48,32 +948,35 @@ char *listDB(const char *directory) {
         // Check if the file has a ".db" extension
         if (strstr(entry->d_name, ".db") != NULL) {
             if (!firstFile) {
-                strcat(json, ",");
+                json_char(&json, ',');
             }
             firstFile = 0;
-            strcat(json, "\"");
-            strcat(json, entry->d_name);
-            strcat(json, "\"");
+            json_string(&json, entry->d_name);
         }
     }
     closedir(dp);
     // Close the JSON array and structure
-    strcat(json, "]}");
-    return json;
+    json_raw(&json, "]}");
+    return json_finish(&json);
 }
 
 // Delete DB
-int deleteDB(const char *database_name) {
+int deleteDB(Arena *arena, const char *database_name) {
     char *filepath = "";
-    filepath = database_path(database_name);
+    filepath = database_path(arena, database_name);
+    DatabaseHold hold = writeLockDatabase(database_name);
     // Attempt to delete the file
-    if (remove(filepath) == 0) {
+    int removed = remove(filepath) == 0;
+    if (removed) {
+        bumpCatalogVersion(database_name, NULL);
+    }
+    unlockDatabase(&hold);
+    if (removed) {
         return 0;  // File successfully deleted
     } else {
         perror("Error deleting file");
         return 1;  // File deletion failed
     }
-    free(filepath);
 }
 
 // Function to generate schema string with sanitized table name
@@ -144,9 +1047,11 @@ int tableExists(const char *filename, const char *table_name) {
     return 0; // Schema not found
 }
 
-int createTable(const char *database_name, const char *table_name, const char *columns[], const char *types[], int column_count) {
+// Add a table's schema and empty values block to the file. The caller holds
+// the database's write lock.
+int appendTableSchema(Arena *arena, const char *database_name, const char *table_name, const char *columns[], const char *types[], int column_count) {
     char *filename = "";
-    filename = database_path(database_name);
+    filename = database_path(arena, database_name);
 
     // Check if the table already exists
     if (tableExists(filename, table_name)) {
@@ -181,6 +1086,7 @@ int createTable(const char *database_name, const char *table_name, const char *c
     }
 
     fread(file_content, 1, content_size, file); // Read the entire file content
+    countMetric(METRIC_FILE_BYTES_READ, content_size);
     file_content[content_size] = '\0'; // Null-terminate the string
 
     // Find the positions of [TABLE_BEGIN] and [TABLE_END]
@@ -192,7 +1098,7 @@ int createTable(const char *database_name, const char *table_name, const char *c
     // First append the schema between [TABLE_BEGIN] and [TABLE_END]
     if (begin_pos != NULL && end_pos != NULL && begin_pos < end_pos) {
         // Create new content for schema insertion
-        size_t new_size = content_size + strlen(schema) + 1;
+        size_t new_size = content_size + strlen(schema) + 3;  // Two newlines and the terminator
         char *new_content = (char *)malloc(new_size);
         if (new_content == NULL) {
             perror("Unable to allocate memory for new content");
@@ -258,6 +1164,7 @@ int createTable(const char *database_name, const char *table_name, const char *c
         rewind(file); // Move back to the beginning of the file
         fputs(new_content_with_table_info, file); // Write the final content
         ftruncate(fileno(file), ftell(file)); // Truncate the file to the new length
+        countMetric(METRIC_FILE_BYTES_WRITTEN, ftell(file));
 
         // Clean up
         free(new_content_with_table_info);
@@ -269,13 +1176,18 @@ int createTable(const char *database_name, const char *table_name, const char *c
 
     free(file_content); // Free the final content memory
     fclose(file); // Close the file
-    free(filename);
+    bumpCatalogVersion(database_name, table_name);
     return 1; // Indicate success
 }
 
-int insertTableValues(const char *database_name, const char *table_name, const char *values) {
+// Add a row line under the table's header. The caller holds the database's
+// write lock.
+void indexInsertedRows(const char *database_name, const char *table_name, unsigned long previous_version,
+                       long offset, const char *values, const struct stat *before, const struct stat *after);
+
+int insertRowLine(Arena *arena, const char *database_name, const char *table_name, const char *values) {
     char *filename = "";
-    filename = database_path(database_name);
+    filename = database_path(arena, database_name);
 
     if (tableExists(filename, table_name) <= 0) {
         return 0; // Indicate that the table does not exists
@@ -287,6 +1199,10 @@ int insertTableValues(const char *database_name, const char *table_name, const c
         perror("Unable to open file for reading and writing");
         return 0;
     }
+    unsigned long previous_version = dataVersion(database_name, table_name);
+    struct stat before;
+    fstat(fileno(file), &before);
+    long inserted_at = -1;
 
     // Read the entire content of the file
     fseek(file, 0, SEEK_END); // Move to the end of the file
@@ -301,6 +1217,7 @@ int insertTableValues(const char *database_name, const char *table_name, const c
     }
 
     fread(file_content, 1, content_size, file); // Read the entire file content
+    countMetric(METRIC_FILE_BYTES_READ, content_size);
     file_content[content_size] = '\0'; // Null-terminate the string
 
     // Find the positions of [TABLE_VALUE_BEGIN] and [TABLE_VALUE_END]
@@ -345,6 +1262,8 @@ int insertTableValues(const char *database_name, const char *table_name, const c
             rewind(file); // Move back to the beginning of the file
             fputs(new_content, file); // Write new content
             ftruncate(fileno(file), ftell(file)); // Truncate the file to the new length
+            countMetric(METRIC_FILE_BYTES_WRITTEN, ftell(file));
+            inserted_at = prefix_length;
 
             // Clean up
             free(new_content);
@@ -352,700 +1271,158 @@ int insertTableValues(const char *database_name, const char *table_name, const c
     }
     free(file_content); // Free the content memory
     fclose(file); // Close the file
-    free(filename);
+    bumpDataVersion(database_name, table_name);
+    if (inserted_at >= 0) {
+        growTableSize(database_name, table_name, strlen(values) + 1);
+    }
+    struct stat after;
+    if (inserted_at >= 0 && stat(filename, &after) == 0) {
+        indexInsertedRows(database_name, table_name, previous_version, inserted_at, values, &before, &after);
+    }
     return 1; // Indicate success
 }
 
-char* fetchTableData(const char *database_name, const char *table_name) {
-    // Allocate memory for filename
-    char *filename = malloc(256);
-    if (!filename) {
-        perror("Memory allocation failed");
-        return NULL;
-    }
+int createTable(Arena *arena, const char *database_name, const char *table_name, const char *columns[], const char *types[], int column_count) {
+    DatabaseHold hold = writeLockDatabase(database_name);
+    int created = appendTableSchema(arena, database_name, table_name, columns, types, column_count);
+    unlockDatabase(&hold);
+    return created;
+}
 
-    strcpy(filename, database_path(database_name));
+int insertTableValues(Arena *arena, const char *database_name, const char *table_name, const char *values) {
+    DatabaseHold hold = writeLockDatabase(database_name);
+    int inserted = insertRowLine(arena, database_name, table_name, values);
+    unlockDatabase(&hold);
+    return inserted;
+}
 
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        perror("Unable to open file");
-        free(filename);  // Free memory before returning
-        return NULL;
+// Write a row as a JSON object keyed by the schema's column names
+void writeRowObject(JsonWriter *out, const TableSchema *schema, char **fields) {
+    json_char(out, '{');
+    for (int i = 0; i < schema->column_count; i++) {
+        FieldSpan value = trim_span(fields[i], (FieldSpan){0, strlen(fields[i])});
+        if (i > 0) json_char(out, ',');
+        json_key(out, schema->columns[i].name);
+        json_string_n(out, fields[i] + value.offset, value.length);
     }
+    json_char(out, '}');
+}
 
-    char line[256];
-    int in_table_values = 0;
-    int found_table = 0;
-    int in_table_schema = 0;
-    int found_schema = 0;
-
-    // Allocate empty strings for schema_data and table_data
-    char *table_data = calloc(1, sizeof(char));
-    char *schema_data = calloc(1, sizeof(char));
-
-    if (!table_data || !schema_data) {
-        perror("Memory allocation failed");
-        free(filename);
-        fclose(file);
-        return NULL;
-    }
-
-    // Read the file line by line
-    while (fgets(line, sizeof(line), file)) {
-        if (strstr(line, "[TABLE_VALUE_BEGIN]") != NULL) {
-            in_table_values = 1;
-            continue;
-        }
-        if (strstr(line, "[TABLE_VALUE_END]") != NULL) {
-            in_table_values = 0;
-            found_table = 0;
-            continue;
-        }
-        if (strstr(line, "[TABLE_BEGIN]") != NULL) {
-            in_table_schema = 1;
-            continue;
-        }
-        if (strstr(line, "[TABLE_END]") != NULL) {
-            in_table_schema = 0;
-            found_schema = 0;
-            continue;
-        }
-
-        // Table Schema Section
-        if (in_table_schema) {
-            if (strstr(line, table_name) != NULL) {
-                found_schema = 1;
-            } else if (found_schema) {
-                if (strstr(line, "# Columns: ") != NULL) {
-                    schema_data = concat(schema_data, line);
-                }
-            }
-        }
-
-        // Table Values Section
-        if (in_table_values) {
-            if (strstr(line, table_name) != NULL) {
-                found_table = 1;
-            } else if (found_table) {
-                if (strstr(line, "# Table: ") == NULL) {
-                    table_data = concat(table_data, line);
-                }
-            }
-        }
-    }
-
-    fclose(file);
-    // If no table values were found, return an empty array "[]"
-    if (strcmp(table_data, "") == 0 || strcmp(schema_data, "") == 0 || strlen(table_data) < 2) {
-        free(table_data);
-        free(schema_data);
-        free(filename);
-        return strdup("[]");  // Return an empty array
-    }
-
-    // Replace unwanted string in schema
-    schema_data = replaceString(schema_data, "# Columns: ", "");
-
-    // Split schema into fields
-    int count = 0;
-    char **result = split_string(schema_data, ",", &count);
-
-    // Allocate memory for fields
-    char *fields = calloc(1, sizeof(char));
-    if (!fields) {
-        perror("Memory allocation failed");
-        free(table_data);
-        free(schema_data);
-        free(filename);
-        free(result);
-        return NULL;
-    }
-
-    // Build fields string
-    for (int i = 0; i < count; i++) {
-        int count_ = 0;
-        char **trim_result = split_string(trim(result[i]), " ", &count_);
-        fields = concat(fields, trim_result[0]);
-        if (i < count - 1) {
-            fields = concat(fields, ",");
-        }
-        free(trim_result);  // Free the result from split
-        free(result[i]);    // Free each token from split
-    }
-
-    free(result);  // Free the array of tokens
-    free(schema_data);
-
-    // Get the JSON output
-    char *json_output = map_fields_to_json(fields, trim(table_data));
-
-    // Free allocated memory
-    free(fields);
-    free(table_data);
-    free(filename);
-
-    // Return the final JSON output
-    return json_output;
-}
-
-char* fetchFilteredTableData(const char *database_name, const char *table_name, const char *check_field, const char *check_value) {
-    // Allocate memory for filename
-    char *filename = malloc(256);
-    if (!filename) {
-        perror("Memory allocation failed");
-        return NULL;
-    }
-
-    strcpy(filename, database_path(database_name));
-
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
+// Write the rows of a table as a JSON array, only those whose check_field
+// equals check_value when a filter is given. Rows are split in the cursor's
+// line buffer, so the scan allocates nothing per row. Returns 0, having
+// written nothing, if the database cannot be read.
+int scanTableData(JsonWriter *out, const char *database_name, const char *table_name, const char *check_field, const char *check_value) {
+    TableCursor cursor;
+    if (!openTableCursor(&cursor, database_name, table_name)) {
         perror("Unable to open file");
-        free(filename);
-        return NULL;
+        return 0;
     }
-
-    char line[256];
-    int in_table_values = 0;
-    int found_table = 0;
-    int in_table_schema = 0;
-    int found_schema = 0;
-    int schema_parsed = 0;  // Ensure schema is only parsed once
-
-    char *table_data = calloc(1, sizeof(char));
-    char *schema_data = calloc(1, sizeof(char));
-
-    if (!table_data || !schema_data) {
-        perror("Memory allocation failed");
-        free(filename);
-        fclose(file);
-        return NULL;
+    TableSchema schema;
+    int check_index = -1;
+    if (!loadTableSchema(database_name, table_name, &schema) ||
+        (check_field != NULL && (check_index = schemaColumnIndex(&schema, check_field)) < 0)) {
+        closeTableCursor(&cursor);
+        json_raw(out, "[]");
+        return 1;
     }
 
-    // Read the file line by line
-    while (fgets(line, sizeof(line), file)) {
-        // Only process the schema for the specific table, and stop once it's found and processed
-        if (!schema_parsed) {
-            if (strstr(line, "[TABLE_BEGIN]") != NULL) {
-                in_table_schema = 1;
-                continue;
-            }
-            if (strstr(line, "[TABLE_END]") != NULL) {
-                in_table_schema = 0;
-                found_schema = 0;
-                continue;
-            }
-            if (in_table_schema && strstr(line, table_name) != NULL) {
-                found_schema = 1;
-                continue;
-            }
-            if (found_schema && strstr(line, "# Columns: ") != NULL) {
-                schema_data = concat(schema_data, line);
-                schema_parsed = 1;  // Mark schema as parsed to avoid reprocessing
-                continue;
-            }
-        }
-
-        // Only process the values for the specific table
-        if (strstr(line, "[TABLE_VALUE_BEGIN]") != NULL) {
-            in_table_values = 1;
-            continue;
-        }
-        if (strstr(line, "[TABLE_VALUE_END]") != NULL) {
-            in_table_values = 0;
-            found_table = 0;
+    json_char(out, '[');
+    int first = 1;
+    unsigned long returned = 0;
+    while (nextTableRow(&cursor)) {
+        // Rows that do not fit the schema are skipped
+        if (cursor.field_count != schema.column_count) {
             continue;
         }
-        if (in_table_values && strstr(line, table_name) != NULL) {
-            found_table = 1;
+        if (check_index >= 0 && strcmp(cursor.fields[check_index], check_value) != 0) {
             continue;
         }
-        if (found_table && strstr(line, "# Table: ") == NULL) {
-            table_data = concat(table_data, line);
-        }
-    }
-
-    fclose(file);
-
-    if (strcmp(table_data, "") == 0 || strcmp(schema_data, "") == 0 || strlen(table_data) < 2) {
-        free(table_data);
-        free(schema_data);
-        free(filename);
-        return strdup("[]");  // Return an empty array
-    }
-
-    schema_data = replaceString(schema_data, "# Columns: ", "");
-
-    // Split schema into fields
-    int count = 0;
-    char **result = split_string(schema_data, ",", &count);
-    char *fields = calloc(1, sizeof(char));
-
-    for (int i = 0; i < count; i++) {
-        int count_ = 0;
-        char **trim_result = split_string(trim(result[i]), " ", &count_);
-        fields = concat(fields, trim_result[0]);
-        if (i < count - 1) {
-            fields = concat(fields, ",");
+        if (!first) {
+            json_char(out, ',');
         }
-        free(trim_result);
-        free(result[i]);
+        writeRowObject(out, &schema, cursor.fields);
+        first = 0;
+        returned++;
+        json_flush_point(out);
     }
+    json_char(out, ']');
+    countMetric(METRIC_ROWS_RETURNED, returned);
+    closeTableCursor(&cursor);
+    return 1;
+}
 
-    free(result);
-    free(schema_data);
-
-    // Prepare to filter data based on check_field and check_value
-    int filtered_count = 0;
-    char *filtered_data = calloc(1, sizeof(char));
-    char **rows = split_string(trim(table_data), "\n", &filtered_count);
-    int check_index = -1;
+int fetchTableData(JsonWriter *out, const char *database_name, const char *table_name) {
+    return scanTableData(out, database_name, table_name, NULL, NULL);
+}
 
-    // Find the index of the check_field in the schema
-    char **schema_fields = split_string(fields, ",", &count);
-    for (int i = 0; i < count; i++) {
-        if (strcmp(schema_fields[i], check_field) == 0) {
-            check_index = i;
-            break;
-        }
-    }
+int fetchFilteredTableData(JsonWriter *out, const char *database_name, const char *table_name, const char *check_field, const char *check_value) {
+    return scanTableData(out, database_name, table_name, check_field, check_value);
+}
 
-    // Filter rows based on the check_field and check_value
-    for (int i = 0; i < filtered_count; i++) {
-        char **data_fields = split_string(trim(rows[i]), ",", &count);
-        if (check_index != -1 && strcmp(data_fields[check_index], check_value) == 0) {
-            filtered_data = concat(filtered_data, rows[i]);
-            strcat(filtered_data, "\n");
-        }
-        for (int j = 0; j < count; j++) {
-            free(data_fields[j]);
-        }
-        free(data_fields);
+// Rows whose check column equals check_value, and the new value for an update
+typedef struct {
+    int check_index;
+    const char *check_value;
+    int update_index;
+    const char *update_value;
+} FieldMatch;
+
+RowAction updateMatchingRow(char **fields, int field_count, void *context) {
+    FieldMatch *match = context;
+    if (match->check_index >= field_count || match->update_index >= field_count ||
+        strcmp(fields[match->check_index], match->check_value) != 0) {
+        return ROW_KEEP;
     }
+    fields[match->update_index] = (char *)match->update_value;
+    return ROW_REPLACE;
+}
 
-    free(rows);
-
-    if (strlen(filtered_data) < 2) {
-        // Free allocated memory
-        free(fields);
-        free(table_data);
-        free(filename);
-        free(filtered_data);
-        free(schema_fields);
-        return strdup("[]");
+RowAction deleteMatchingRow(char **fields, int field_count, void *context) {
+    FieldMatch *match = context;
+    if (match->check_index >= field_count || strcmp(fields[match->check_index], match->check_value) != 0) {
+        return ROW_KEEP;
     }
-
-    // Get the JSON output
-    char *json_output = map_fields_to_json(fields, trim(filtered_data));
-
-    // Free allocated memory
-    free(fields);
-    free(table_data);
-    free(filename);
-    free(filtered_data);
-    free(schema_fields);
-
-    return json_output;
+    return ROW_DELETE;
 }
 
-
 int updateTableData(const char *database_name, const char *table_name, const char *check_field, const char *check_value, const char *update_field, const char *update_value) {
-   char *update_check = fetchFilteredTableData(database_name, table_name, check_field, check_value);
-   // Check for errors
-   if (update_check == NULL) {
-       free(update_check);
-       return 0;
-   }
-
-   if(strcmp(update_check, "[]") == 0) {
-	free(update_check);
-	return 0;
-   }
-
-   free(update_check);
-
-    char *filename = malloc(256);
-    if (!filename) {
-        perror("Memory allocation failed for filename");
+    TableSchema schema;
+    if (!loadTableSchema(database_name, table_name, &schema)) {
         return 0;
     }
-
-    // Construct the file path
-    strcpy(filename, database_path(database_name));
-
-    // Open the original file for reading
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        perror("Unable to open file");
-        free(filename);
+    FieldMatch match = {
+        schemaColumnIndex(&schema, check_field), check_value,
+        schemaColumnIndex(&schema, update_field), update_value
+    };
+    if (match.check_index < 0 || match.update_index < 0) {
         return 0;
     }
-
-    // Create a temporary file for writing
-    FILE *temp_file = tmpfile();
-    if (temp_file == NULL) {
-        perror("Unable to create temp file");
-        fclose(file);
-        free(filename);
-        return 0;
-    }
-
-    char line[256];
-    int in_table_values = 0, found_table = 0, in_table_schema = 0, found_schema = 0;
-    char *schema_data = NULL;
-    int schema_field_count = 0;
-    char *schema_fields = NULL;
-
-    char updated_line[256];
-    int record_found = 0, update_index = -1, check_index = -1;
-
-    // Read the original file and write to temp file
-    while (fgets(line, sizeof(line), file)) {
-        // Handle [TABLE_VALUE_BEGIN] and [TABLE_VALUE_END] blocks
-        if (strstr(line, "[TABLE_VALUE_BEGIN]") != NULL) {
-            in_table_values = 1;
-            fputs(line, temp_file);
-            continue;
-        }
-        if (strstr(line, "[TABLE_VALUE_END]") != NULL) {
-            in_table_values = 0;
-            fputs(line, temp_file);
-            continue;
-        }
-
-        // Handle [TABLE_BEGIN] and [TABLE_END] blocks
-        if (strstr(line, "[TABLE_BEGIN]") != NULL) {
-            in_table_schema = 1;
-            found_schema = 0;
-            fputs(line, temp_file);
-            continue;
-        }
-        if (strstr(line, "[TABLE_END]") != NULL) {
-            in_table_schema = 0;
-            found_schema = 0;
-            fputs(line, temp_file);
-            continue;
-        }
-
-        // Table Schema Section: extract schema and avoid duplicating lines
-        if (in_table_schema) {
-            if (strstr(line, table_name) != NULL && !found_schema) {
-                found_schema = 1;
-                fputs(line, temp_file);
-                continue;
-            }
-
-            if (found_schema && strstr(line, "# Columns: ") != NULL) {
-                schema_data = strdup(line);
-                trim_newlines(schema_data);
-                schema_data = replaceString(schema_data, "# Columns: ", "");
-
-                char **result = split_string(schema_data, ",", &schema_field_count);
-                // Build schema field names
-                schema_fields = malloc(256); // Ensure sufficient space
-                schema_fields[0] = '\0'; // Initialize to empty string
-
-                for (int i = 0; i < schema_field_count; i++) {
-                    int count_ = 0;
-                    char **trim_result = split_string(trim(result[i]), " ", &count_);
-                    strcat(schema_fields, trim_result[0]);
-                    if (i < schema_field_count - 1) {
-                        strcat(schema_fields, ",");
-                    }
-                    free(trim_result);
-                    free(result[i]);
-                }
-                free(result);
-                free(schema_data);
-
-                fputs(line, temp_file); // Write the schema line only once
-                continue;
-            }
-        }
-
-        // Table values section
-        if (in_table_values) {
-            if (strstr(line, table_name) != NULL) {
-                found_table = 1;
-                fputs(line, temp_file);
-                continue;
-            }
-
-            if (found_table) {
-                int field_count = 0;
-                char **fields = split_string(trim(line), ",", &field_count);
-
-                // Find the schema index for check and update fields
-                if (check_index == -1 || update_index == -1) {
-                    char **schema = split_string(trim(schema_fields), ",", &field_count);
-                    for (int i = 0; i < field_count; i++) {
-                        if (strcmp(schema[i], check_field) == 0) {
-                            check_index = i;
-                        }
-                        if (strcmp(schema[i], update_field) == 0) {
-                            update_index = i;
-                        }
-                    }
-                    free(schema);
-                }
-
-                // If check_field matches, update the value
-                if (strcmp(fields[check_index], check_value) == 0) {
-                    record_found = 1;
-                    free(fields[update_index]); // Free the old value before updating
-                    fields[update_index] = strdup(update_value); // Allocate new memory
-
-                    // Rebuild the updated line
-                    strcpy(updated_line, "");
-                    for (int i = 0; i < field_count; i++) {
-                        strcat(updated_line, fields[i]);
-                        if (i < field_count - 1) {
-                            strcat(updated_line, ",");
-                        }
-                    }
-                    trim_newlines(updated_line);
-                    strcat(updated_line, "\n");
-
-                    fputs(updated_line, temp_file);  // Write updated line to temp file
-                } else {
-                    // Write original line if no match
-                    fputs(line, temp_file);
-                }
-
-                // Free memory for fields
-                for (int i = 0; i < field_count; i++) {
-                    free(fields[i]);
-                }
-                free(fields);
-            }
-        } else {
-            // Copy any other non-relevant lines
-            fputs(line, temp_file);
-        }
-    }
-
-    // Close the original file
-    fclose(file);
-
-    // Replace the original file with the temp file
-    if (record_found) {
-        // Open the original file for writing
-        file = fopen(filename, "w");
-        if (file == NULL) {
-            perror("Unable to open original file for writing");
-            fclose(temp_file);
-            free(filename);
-            return 0;
-        }
-
-        // Rewind temp file to beginning and copy its content to the original file
-        rewind(temp_file);
-        while (fgets(line, sizeof(line), temp_file)) {
-            fputs(line, file);
-        }
-    }
-
-    // Close temp file and original file
-    fclose(temp_file);
-    fclose(file);
-    free(filename);
-    free(schema_fields); // Free schema_fields if allocated
-
-    return record_found;
+    return rewriteTableRows(database_name, table_name, updateMatchingRow, &match) > 0;
 }
 
 int deleteTableData(const char *database_name, const char *table_name, const char *check_field, const char *check_value) {
-    char *filename = malloc(256);
-    if (!filename) {
-        perror("Memory allocation failed for filename");
-        return 0;
-    }
-
-    // Construct the file path
-    strcpy(filename, database_path(database_name));
-
-    // Open the original file for reading
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        perror("Unable to open file");
-        free(filename);
+    TableSchema schema;
+    if (!loadTableSchema(database_name, table_name, &schema)) {
         return 0;
     }
-
-    // Create a temporary file for writing
-    FILE *temp_file = tmpfile();
-    if (temp_file == NULL) {
-        perror("Unable to create temp file");
-        fclose(file);
-        free(filename);
+    FieldMatch match = {schemaColumnIndex(&schema, check_field), check_value, -1, NULL};
+    if (match.check_index < 0) {
         return 0;
     }
-
-    // Buffers and variables for schema and value processing
-    char line[256];
-    int in_table_values = 0, found_table = 0, in_table_schema = 0, found_schema = 0;
-    char *schema_data = "";
-    int schema_field_count = 0;
-    char *schema_fields = "";
-    int record_found = 0, check_index = -1;
-
-    // Read the original file and write to temp file
-    while (fgets(line, sizeof(line), file)) {
-        // Handle [TABLE_VALUE_BEGIN] and [TABLE_VALUE_END] blocks
-        if (strstr(line, "[TABLE_VALUE_BEGIN]") != NULL) {
-            in_table_values = 1;
-            fputs(line, temp_file);
-            continue;
-        }
-        if (strstr(line, "[TABLE_VALUE_END]") != NULL) {
-            in_table_values = 0;
-            fputs(line, temp_file);
-            continue;
-        }
-
-        // Handle [TABLE_BEGIN] and [TABLE_END] blocks
-        if (strstr(line, "[TABLE_BEGIN]") != NULL) {
-            in_table_schema = 1;
-            found_schema = 0;  // Reset flag for each table
-            fputs(line, temp_file); // Write [TABLE_BEGIN] line
-            continue;
-        }
-        if (strstr(line, "[TABLE_END]") != NULL) {
-            in_table_schema = 0;
-            found_schema = 0;
-            fputs(line, temp_file); // Write [TABLE_END] line
-            continue;
-        }
-
-        // Table Schema Section: extract schema
-        if (in_table_schema) {
-            if (strstr(line, table_name) != NULL && !found_schema) {
-                found_schema = 1;  // Found the target table
-                fputs(line, temp_file);  // Write the table name line only once
-                continue;
-            }
-
-            // Process schema if we found the correct table
-            if (found_schema && strstr(line, "# Columns: ") != NULL) {
-                // Parse and save the schema data
-                schema_data = strdup(line);
-                trim_newlines(schema_data);
-                schema_data = replaceString(schema_data, "# Columns: ", "");
-
-                char **result = split_string(schema_data, ",", &schema_field_count);
-                // Build schema field names
-                for (int i = 0; i < schema_field_count; i++) {
-                    int count_ = 0;
-                    char **trim_result = split_string(trim(result[i]), " ", &count_);
-                    schema_fields = concat(schema_fields, trim_result[0]);
-                    if (i < schema_field_count - 1) {
-                        schema_fields = concat(schema_fields, ",");
-                    }
-                    free(trim_result);
-                    free(result[i]);
-                }
-                free(result);
-                free(schema_data);
-
-                fputs(line, temp_file);  // Write the schema line only once
-                continue;
-            }
-        }
-
-        // Table values section
-        if (in_table_values) {
-            if (strstr(line, table_name) != NULL) {
-                found_table = 1;
-                fputs(line, temp_file);  // Copy table name line
-                continue;
-            }
-
-            if (found_table) {
-                int field_count = 0;
-                char **fields = split_string(trim(line), ",", &field_count);
-
-                // Find the schema index for the check field
-                if (check_index == -1) {
-                    char **schema = split_string(trim(schema_fields), ",", &field_count);
-                    for (int i = 0; i < field_count; i++) {
-                        if (strcmp(schema[i], check_field) == 0) {
-                            check_index = i;
-                        }
-                    }
-                    free(schema);
-                }
-
-                // Check if the line matches the deletion criteria
-                if (check_index != -1 && strcmp(fields[check_index], check_value) == 0) {
-                    record_found = 1; // Record to be deleted found
-                } else {
-                    // Write the original line if it does not match
-                    fputs(line, temp_file);
-                }
-
-                // Free memory for fields
-                for (int i = 0; i < field_count; i++) {
-                    free(fields[i]);
-                }
-                free(fields);
-            }
-        } else {
-            // Copy any other non-relevant lines
-            fputs(line, temp_file);
-        }
-    }
-
-    // Close the original file
-    fclose(file);
-
-    // If no records were found, free resources and return 0
-    if (!record_found) {
-        fclose(temp_file);
-        free(schema_fields);
-        free(filename);
-        return 0;
-    }
-
-    // Replace the original file with the temp file if any records were deleted
-    // Open the original file for writing
-    file = fopen(filename, "w");
-    if (file == NULL) {
-        perror("Unable to open original file for writing");
-        fclose(temp_file);
-        free(filename);
-        return 0;
-    }
-
-    // Rewind temp file to beginning and copy its content to the original file
-    rewind(temp_file);
-    while (fgets(line, sizeof(line), temp_file)) {
-        fputs(line, file);
-    }
-
-    // Close temp file and original file
-    fclose(temp_file);
-    fclose(file);
-    free(schema_fields);
-    free(filename);
-
-    return 1; // Return 1 if record was found and deleted
+    return rewriteTableRows(database_name, table_name, deleteMatchingRow, &match) > 0;
 }
 
-int deleteTable(const char *database_name, const char *table_name) {
-    char *filename = malloc(256);
-    if (!filename) {
-        perror("Memory allocation failed");
-        return 0; // Indicate failure
-    }
-
+// Drop a table's schema and values from the file. The caller holds the
+// database's write lock.
+int removeTable(Arena *arena, const char *database_name, const char *table_name) {
     // Construct the file path
-    strcpy(filename, database_path(database_name)); // Example path
+    char *filename = database_path(arena, database_name);
 
     // Open the original file for reading
     FILE *file = fopen(filename, "r");
     if (file == NULL) {
         perror("Unable to open file");
-        free(filename);
         return 0; // Indicate failure
     }
 
@@ -1054,7 +1431,6 @@ int deleteTable(const char *database_name, const char *table_name) {
     if (temp_file == NULL) {
         perror("Unable to create temp file");
         fclose(file);
-        free(filename);
         return 0; // Indicate failure
     }
 
@@ -1097,9 +1473,9 @@ int deleteTable(const char *database_name, const char *table_name) {
 
         // Skip schema lines for the found table
         if (skip_schema) {
-            // Skip the "# Columns:" line
-            if (strstr(line, "# Columns:") != NULL) {
-                continue; // Skip the "# Columns:" line
+            // Skip the "# Columns:" and "# Index:" lines
+            if (strstr(line, "# Columns:") != NULL || strstr(line, "# Index:") != NULL) {
+                continue;
             }
 
             // Check for an empty line to set after_columns flag
@@ -1144,7 +1520,6 @@ int deleteTable(const char *database_name, const char *table_name) {
         if (file == NULL) {
             perror("Unable to open original file for writing");
             fclose(temp_file);
-            free(filename);
             return 0; // Indicate failure
         }
 
@@ -1154,6 +1529,7 @@ int deleteTable(const char *database_name, const char *table_name) {
             fputs(line, file);
         }
 
+        countMetric(METRIC_FILE_BYTES_WRITTEN, ftell(file));
         fclose(file);
     } else {
 	found_table = 0;
@@ -1161,29 +1537,39 @@ int deleteTable(const char *database_name, const char *table_name) {
 
     // Close the temp file
     fclose(temp_file);
-    free(filename);
     if(found_table == 0){
       return found_table;
     } else {
+    bumpCatalogVersion(database_name, table_name);
     remove_extra_empty_lines(filename);
     return found_table; // Return whether the table was found and deleted
     }
 
 }
 
-char *listTable(const char* database_name) {
-    char filename[256];
-    strcpy(filename, database_path(database_name));  // Ensure database_path returns a valid path
+int deleteTable(Arena *arena, const char *database_name, const char *table_name) {
+    DatabaseHold hold = writeLockDatabase(database_name);
+    int deleted = removeTable(arena, database_name, table_name);
+    unlockDatabase(&hold);
+    return deleted;
+}
+
+char *listTable(Arena *arena, const char* database_name) {
+    char *filename = database_path(arena, database_name);
+    DatabaseHold hold = readLockDatabase(database_name);
     FILE* file = fopen(filename, "r");
     if (file == NULL) {
+        unlockDatabase(&hold);
         perror("Unable to open file");
         return NULL;
     }
 
     char line[256];
     int in_table_block = 0;
-    char* tables[1000];
     int table_count = 0;
+    JsonWriter json;
+    json_init(&json);
+    json_raw(&json, "{ \"tables\": [");
 
     while (fgets(line, sizeof(line), file)) {
         char* trimmed_line = trim(line);  // Ensure trim is working correctly
@@ -1204,36 +1590,74 @@ char *listTable(const char* database_name) {
             // Extract table name after "# Table: "
             char* table_name = trimmed_line + strlen("# Table:");
             table_name = trim(table_name);  // Ensure proper trimming of the table name
-	    tables[table_count] = strdup(table_name);  // Dynamically allocate memory for the table name
+            if (table_count > 0) {
+                json_char(&json, ',');
+            }
+            json_string(&json, table_name);
 	    table_count++;
         }
     }
 
     fclose(file);
+    unlockDatabase(&hold);
 
-    // Create a JSON string to return the table names
-    char* json_result = (char*)malloc(1024);  // Ensure the buffer size is enough
-    if (json_result == NULL) {
-        perror("Unable to allocate memory");
-        return NULL;
+    json_raw(&json, "] }");
+    return json_finish(&json);
+}
+
+// Write the "# Index:" line. The caller holds the database's write lock.
+int addIndexLine(const char *database_name, const char *table_name, const char *column_name) {
+    TableSchema schema;
+    if (!readTableSchema(database_name, table_name, &schema)) {
+        return 0;
+    }
+    int column = schemaColumnIndex(&schema, column_name);
+    if (column < 0 || schema.indexed[column]) {
+        return 0;
     }
-    strcpy(json_result, "{ \"tables\": [");
 
-    for (int i = 0; i < table_count; i++) {
-        strcat(json_result, "\"");
-        strcat(json_result, tables[i]);
-        strcat(json_result, "\"");
-        if (i < table_count - 1) {
-            strcat(json_result, ",");
-        }
-        free(tables[i]);  // Free the dynamically allocated memory
+    char *filename = database_path(NULL, database_name);
+    FILE *file = fopen(filename, "r");
+    char temp_path[512];
+    FILE *temp_file = file != NULL ? openRewriteFile(filename, temp_path, sizeof(temp_path)) : NULL;
+    if (temp_file == NULL) {
+        if (file != NULL) fclose(file);
+        free(filename);
+        return 0;
     }
 
-    strcat(json_result, "] }");
+    char *line = NULL;
+    size_t capacity = 0;
+    int in_table_schema = 0, found_schema = 0, added = 0;
+    while (getline(&line, &capacity, file) != -1) {
+        fputs(line, temp_file);
+        if (strstr(line, "[TABLE_BEGIN]") != NULL) {
+            in_table_schema = 1;
+        } else if (strstr(line, "[TABLE_END]") != NULL) {
+            in_table_schema = 0;
+        } else if (in_table_schema && strncmp(line, "# Table:", 8) == 0) {
+            found_schema = isTableHeader(line, table_name);
+        } else if (found_schema && !added && strncmp(line, "# Columns:", 10) == 0) {
+            fprintf(temp_file, "# Index: %s\n", column_name);
+            added = 1;
+        }
+    }
 
-    if (table_count == 0) {
-        strcpy(json_result, "{ \"tables\": [] }");
+    free(line);
+    fclose(file);
+    added = commitRewriteFile(temp_file, temp_path, filename, added);
+    free(filename);
+    if (added) {
+        bumpCatalogVersion(database_name, table_name);
     }
+    return added;
+}
 
-    return json_result;
+// Record an index on a column as a "# Index:" line in the table's schema.
+// Returns 1 if the index was added, 0 if it exists or the column is unknown.
+int createTableIndex(const char *database_name, const char *table_name, const char *column_name) {
+    DatabaseHold hold = writeLockDatabase(database_name);
+    int added = addIndexLine(database_name, table_name, column_name);
+    unlockDatabase(&hold);
+    return added;
 }
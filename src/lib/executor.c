@@ -0,0 +1,908 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Pull-based query execution. Each physical operator yields one row per
+// call to next() in fields/field_count, described by its output schema.
+typedef struct Operator Operator;
+struct Operator {
+    int (*next)(Operator *self);
+    void (*close)(Operator *self);
+    Operator *child;
+    TableSchema schema;
+    char **fields;
+    int field_count;
+    int failed;  // next() returned 0 because it could not go on, not because the rows ran out
+};
+
+typedef struct {
+    Operator base;
+    TableCursor cursor;
+} ScanOperator;
+
+typedef struct {
+    Operator base;
+    FILE *file;
+    char *line;
+    size_t line_capacity;
+    long *offsets;
+    size_t offset_count;
+    size_t next_offset;
+    char *row[MAX_COLUMNS];
+    DatabaseHold hold;  // Database read lock, keeping the offsets valid
+} IndexScanOperator;
+
+// Values bound to a statement's ? placeholders for one execution
+typedef struct {
+    const char *texts[MAX_PARAMETERS];
+    Value values[MAX_PARAMETERS];  // Texts typed like the columns they are compared with
+    int count;
+} Bindings;
+
+typedef struct {
+    Operator base;
+    const Expr *predicate;
+    const Bindings *bindings;
+} FilterOperator;
+
+typedef struct {
+    Operator base;
+    int columns[MAX_COLUMNS];
+    char *row[MAX_COLUMNS];
+} ProjectOperator;
+
+typedef struct {
+    Operator base;
+    HashAggregate aggregate;
+    int consumed;
+    AggregateGroup *group;
+    char *row[MAX_COLUMNS + MAX_AGGREGATES];
+    char results[MAX_AGGREGATES][256];
+} AggregateOperator;
+
+typedef struct {
+    Operator base;
+    RowSorter sorter;
+    int sorted;
+    char *line;
+    char *row[MAX_COLUMNS];
+} SortOperator;
+
+typedef struct {
+    Operator base;
+    long remaining;
+} LimitOperator;
+
+void closeOperator(Operator *op) {
+    if (op == NULL) {
+        return;
+    }
+    closeOperator(op->child);
+    if (op->close != NULL) {
+        op->close(op);
+    }
+    free(op);
+}
+
+// Typed value of a literal expression, taken from the bindings for a placeholder
+const Value *literalValue(const Expr *literal, const Bindings *bindings) {
+    return literal->literal.parameter ? &bindings->values[literal->literal.parameter - 1] : &literal->value;
+}
+
+const char *literalText(const Literal *literal, const Bindings *bindings) {
+    return literal->parameter ? bindings->texts[literal->parameter - 1] : literal->text;
+}
+
+// Evaluate a resolved WHERE expression against a row
+int evaluateExpr(const Expr *expr, const TableSchema *schema, char **fields, int field_count, const Bindings *bindings) {
+    switch (expr->type) {
+        case EXPR_AND:
+            return evaluateExpr(expr->left, schema, fields, field_count, bindings) &&
+                   evaluateExpr(expr->right, schema, fields, field_count, bindings);
+        case EXPR_OR:
+            return evaluateExpr(expr->left, schema, fields, field_count, bindings) ||
+                   evaluateExpr(expr->right, schema, fields, field_count, bindings);
+        case EXPR_NOT:
+            return !evaluateExpr(expr->left, schema, fields, field_count, bindings);
+        case EXPR_COMPARE: {
+            int column = expr->left->column;
+            Value value = parseValue(column < field_count ? fields[column] : "", schema->columns[column].type);
+            const Value *literal = literalValue(expr->right, bindings);
+            // Comparisons with NULL are never true
+            if (value.is_null || literal->is_null) {
+                return 0;
+            }
+            int result = compareValues(&value, literal);
+            switch (expr->op) {
+                case CMP_EQ: return result == 0;
+                case CMP_NE: return result != 0;
+                case CMP_LT: return result < 0;
+                case CMP_LE: return result <= 0;
+                case CMP_GT: return result > 0;
+                case CMP_GE: return result >= 0;
+            }
+            return 0;
+        }
+        default:
+            return 0;
+    }
+}
+
+// Resolve column names and type literals against the column they are compared
+// with; placeholders record that type for binding
+int resolveExpr(Expr *expr, const TableSchema *schema, ColumnType *parameter_types, char *error, size_t error_size) {
+    if (expr == NULL) {
+        return 1;
+    }
+    if (expr->type == EXPR_COMPARE) {
+        int column = schemaColumnIndex(schema, expr->left->name);
+        if (column < 0) {
+            snprintf(error, error_size, "Unknown column '%s'", expr->left->name);
+            return 0;
+        }
+        expr->left->column = column;
+        const Literal *literal = &expr->right->literal;
+        if (literal->parameter) {
+            parameter_types[literal->parameter - 1] = schema->columns[column].type;
+        } else {
+            expr->right->value = parseValue(literal->text, schema->columns[column].type);
+        }
+        return 1;
+    }
+    return resolveExpr(expr->left, schema, parameter_types, error, error_size) &&
+           resolveExpr(expr->right, schema, parameter_types, error, error_size);
+}
+
+int nextScan(Operator *self) {
+    ScanOperator *scan = (ScanOperator *)self;
+    if (!nextTableRow(&scan->cursor)) {
+        return 0;
+    }
+    self->fields = scan->cursor.fields;
+    self->field_count = scan->cursor.field_count;
+    return 1;
+}
+
+void closeScan(Operator *self) {
+    closeTableCursor(&((ScanOperator *)self)->cursor);
+}
+
+Operator *newScan(const char *database_name, const char *table_name, const TableSchema *schema) {
+    ScanOperator *scan = calloc(1, sizeof(ScanOperator));
+    if (!openTableCursor(&scan->cursor, database_name, table_name)) {
+        free(scan);
+        return NULL;
+    }
+    scan->base.next = nextScan;
+    scan->base.close = closeScan;
+    scan->base.schema = *schema;
+    return &scan->base;
+}
+
+int nextIndexScan(Operator *self) {
+    IndexScanOperator *scan = (IndexScanOperator *)self;
+    while (scan->next_offset < scan->offset_count) {
+        fseek(scan->file, scan->offsets[scan->next_offset++], SEEK_SET);
+        if (getline(&scan->line, &scan->line_capacity, scan->file) == -1) {
+            return 0;
+        }
+        trim_newlines(scan->line);
+        if (is_empty_line(scan->line)) {
+            continue;
+        }
+        self->field_count = splitRowFields(scan->line, scan->row);
+        self->fields = scan->row;
+        return 1;
+    }
+    return 0;
+}
+
+void closeIndexScan(Operator *self) {
+    IndexScanOperator *scan = (IndexScanOperator *)self;
+    if (scan->file != NULL) {
+        fclose(scan->file);
+    }
+    free(scan->line);
+    free(scan->offsets);
+    unlockDatabase(&scan->hold);
+}
+
+int compareOffsets(const void *a, const void *b) {
+    long left = *(const long *)a, right = *(const long *)b;
+    return (left > right) - (left < right);
+}
+
+// Fetch only the rows whose indexed column equals key
+Operator *newIndexScan(const char *database_name, const char *table_name, const TableSchema *schema, int column, const Value *key) {
+    DatabaseHold hold = readLockDatabase(database_name);
+    ColumnIndex *index = getColumnIndex(database_name, table_name, column, schema->columns[column].type);
+    if (index == NULL) {
+        unlockDatabase(&hold);
+        return NULL;
+    }
+    IndexScanOperator *scan = calloc(1, sizeof(IndexScanOperator));
+    scan->hold = hold;
+    const IndexEntry *entry = lookupColumnIndex(index, key);
+    if (entry != NULL) {
+        // Visit matches in file order, like a full scan would; rows inserted
+        // since the index was built were added last but lie first
+        scan->offset_count = entry->offset_count;
+        scan->offsets = malloc(entry->offset_count * sizeof(long));
+        for (size_t i = 0; i < entry->offset_count; i++) {
+            scan->offsets[i] = entry->offsets[i] + index->shift;
+        }
+        qsort(scan->offsets, scan->offset_count, sizeof(long), compareOffsets);
+    }
+    pthread_mutex_unlock(&index->lock);
+
+    char *filename = database_path(NULL, database_name);
+    scan->file = fopen(filename, "r");
+    free(filename);
+    if (scan->file == NULL) {
+        free(scan->offsets);
+        free(scan);
+        unlockDatabase(&hold);
+        return NULL;
+    }
+    scan->base.next = nextIndexScan;
+    scan->base.close = closeIndexScan;
+    scan->base.schema = *schema;
+    return &scan->base;
+}
+
+int nextFilter(Operator *self) {
+    FilterOperator *filter = (FilterOperator *)self;
+    Operator *child = self->child;
+    while (child->next(child)) {
+        if (evaluateExpr(filter->predicate, &child->schema, child->fields, child->field_count, filter->bindings)) {
+            self->fields = child->fields;
+            self->field_count = child->field_count;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+Operator *newFilter(Operator *child, const Expr *predicate, const Bindings *bindings) {
+    FilterOperator *filter = calloc(1, sizeof(FilterOperator));
+    filter->base.next = nextFilter;
+    filter->base.child = child;
+    filter->base.schema = child->schema;
+    filter->predicate = predicate;
+    filter->bindings = bindings;
+    return &filter->base;
+}
+
+int nextProject(Operator *self) {
+    ProjectOperator *project = (ProjectOperator *)self;
+    Operator *child = self->child;
+    if (!child->next(child)) {
+        return 0;
+    }
+    for (int i = 0; i < self->schema.column_count; i++) {
+        int column = project->columns[i];
+        project->row[i] = column < child->field_count ? child->fields[column] : "";
+    }
+    self->fields = project->row;
+    self->field_count = self->schema.column_count;
+    return 1;
+}
+
+Operator *newProject(Operator *child, const int *columns, int column_count) {
+    ProjectOperator *project = calloc(1, sizeof(ProjectOperator));
+    project->base.next = nextProject;
+    project->base.child = child;
+    for (int i = 0; i < column_count; i++) {
+        project->columns[i] = columns[i];
+        project->base.schema.columns[i] = child->schema.columns[columns[i]];
+    }
+    project->base.schema.column_count = column_count;
+    return &project->base;
+}
+
+int nextAggregate(Operator *self) {
+    AggregateOperator *op = (AggregateOperator *)self;
+    HashAggregate *aggregate = &op->aggregate;
+    Operator *child = self->child;
+
+    if (!op->consumed) {
+        while (child->next(child)) {
+            accumulateRow(aggregate, &child->schema, child->fields, child->field_count);
+        }
+        // Without GROUP BY an aggregate yields one row even over no input
+        if (aggregate->group_count == 0 && aggregate->first == NULL) {
+            findAggregateGroup(aggregate, NULL, 0);
+        }
+        op->consumed = 1;
+        op->group = aggregate->first;
+    } else if (op->group != NULL) {
+        op->group = op->group->next_in_order;
+    }
+    if (op->group == NULL) {
+        return 0;
+    }
+
+    char *key = op->group->key;
+    for (int i = 0; i < aggregate->group_count; i++) {
+        op->row[i] = key;
+        key += strlen(key) + 1;
+    }
+    for (int i = 0; i < aggregate->spec_count; i++) {
+        formatAggregateResult(&aggregate->specs[i], &op->group->accumulators[i], op->results[i], sizeof(op->results[i]));
+        op->row[aggregate->group_count + i] = op->results[i];
+    }
+    self->fields = op->row;
+    self->field_count = self->schema.column_count;
+    return 1;
+}
+
+void closeAggregate(Operator *self) {
+    freeHashAggregate(&((AggregateOperator *)self)->aggregate);
+}
+
+// Output schema of an aggregate column, as rendered by formatAggregateResult
+ColumnType aggregateResultType(const AggregateSpec *spec, const TableSchema *input) {
+    switch (spec->function) {
+        case AGG_COUNT: return TYPE_INTEGER;
+        case AGG_AVG: return TYPE_REAL;
+        case AGG_SUM: return input->columns[spec->column].type == TYPE_INTEGER ? TYPE_INTEGER : TYPE_REAL;
+        default: return input->columns[spec->column].type;
+    }
+}
+
+// Rows of an aggregate are its grouping columns followed by one column per spec
+void aggregateOutputSchema(const TableSchema *input, const int *group_columns, int group_count,
+                           const AggregateSpec *specs, int spec_count, TableSchema *output) {
+    memset(output, 0, sizeof(*output));
+    for (int i = 0; i < group_count; i++) {
+        output->columns[output->column_count++] = input->columns[group_columns[i]];
+    }
+    for (int i = 0; i < spec_count; i++) {
+        Column *column = &output->columns[output->column_count++];
+        snprintf(column->name, sizeof(column->name), "%.63s", specs[i].label);
+        column->type = aggregateResultType(&specs[i], input);
+    }
+}
+
+Operator *newAggregate(Operator *child, const int *group_columns, int group_count, const AggregateSpec *specs, int spec_count) {
+    AggregateOperator *op = calloc(1, sizeof(AggregateOperator));
+    op->base.next = nextAggregate;
+    op->base.close = closeAggregate;
+    op->base.child = child;
+    aggregateOutputSchema(&child->schema, group_columns, group_count, specs, spec_count, &op->base.schema);
+
+    HashAggregate *aggregate = &op->aggregate;
+    memcpy(aggregate->group_columns, group_columns, group_count * sizeof(int));
+    aggregate->group_count = group_count;
+    memcpy(aggregate->specs, specs, spec_count * sizeof(AggregateSpec));
+    aggregate->spec_count = spec_count;
+    return &op->base;
+}
+
+int nextSort(Operator *self) {
+    SortOperator *sort = (SortOperator *)self;
+    Operator *child = self->child;
+    if (!sort->sorted) {
+        while (child->next(child)) {
+            if (!addSortRow(&sort->sorter, child->fields, child->field_count)) {
+                break;
+            }
+        }
+        sort->sorted = 1;
+        if (!finishRowSorter(&sort->sorter)) {
+            self->failed = 1;
+            return 0;
+        }
+    }
+
+    const char *line = nextSortedRow(&sort->sorter);
+    if (line == NULL) {
+        self->failed = sort->sorter.failed;
+        return 0;
+    }
+    free(sort->line);
+    sort->line = strdup(line);
+    self->field_count = splitRowFields(sort->line, sort->row);
+    self->fields = sort->row;
+    return 1;
+}
+
+void closeSort(Operator *self) {
+    SortOperator *sort = (SortOperator *)self;
+    freeRowSorter(&sort->sorter);
+    free(sort->line);
+}
+
+Operator *newSort(Operator *child, int column, int descending) {
+    SortOperator *sort = calloc(1, sizeof(SortOperator));
+    sort->base.next = nextSort;
+    sort->base.close = closeSort;
+    sort->base.child = child;
+    sort->base.schema = child->schema;
+    initRowSorter(&sort->sorter, column, child->schema.columns[column].type, descending);
+    return &sort->base;
+}
+
+int nextLimit(Operator *self) {
+    LimitOperator *limit = (LimitOperator *)self;
+    Operator *child = self->child;
+    if (limit->remaining <= 0 || !child->next(child)) {
+        return 0;
+    }
+    limit->remaining--;
+    self->fields = child->fields;
+    self->field_count = child->field_count;
+    return 1;
+}
+
+Operator *newLimit(Operator *child, long count) {
+    LimitOperator *limit = calloc(1, sizeof(LimitOperator));
+    limit->base.next = nextLimit;
+    limit->base.child = child;
+    limit->base.schema = child->schema;
+    limit->remaining = count;
+    return &limit->base;
+}
+
+// Everything about a statement that does not depend on parameter values:
+// resolved columns, the result shape and the access path. A plan is built
+// once and may then be executed any number of times with fresh bindings.
+typedef struct {
+    Statement *statement;
+    TableSchema schema;
+    ColumnType parameter_types[MAX_PARAMETERS];
+
+    // SELECT
+    int grouped;
+    int group_columns[MAX_COLUMNS];
+    AggregateSpec specs[MAX_AGGREGATES];
+    int spec_count;
+    int projection[MAX_COLUMNS];
+    const Expr *indexable;  // "column = literal" conjunct served by an index
+    int order_column;       // Position in the (aggregated) rows, -1 when unordered
+
+    // INSERT and UPDATE target columns
+    int positions[MAX_COLUMNS];
+    int value_count;
+
+    int references;  // Holders of the plan: its cache entry and running executions
+} QueryPlan;
+
+void freeQueryPlan(QueryPlan *plan) {
+    if (plan == NULL) {
+        return;
+    }
+    freeStatement(plan->statement);
+    free(plan);
+}
+
+void retainQueryPlan(QueryPlan *plan) {
+    __atomic_add_fetch(&plan->references, 1, __ATOMIC_RELAXED);
+}
+
+// Drop one reference; the last holder frees the plan
+void releaseQueryPlan(QueryPlan *plan) {
+    if (plan != NULL && __atomic_sub_fetch(&plan->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        freeQueryPlan(plan);
+    }
+}
+
+// Find a "column = literal" conjunct on an indexed column
+const Expr *findIndexablePredicate(const Expr *expr, const TableSchema *schema) {
+    if (expr == NULL) {
+        return NULL;
+    }
+    if (expr->type == EXPR_AND) {
+        const Expr *found = findIndexablePredicate(expr->left, schema);
+        return found != NULL ? found : findIndexablePredicate(expr->right, schema);
+    }
+    if (expr->type == EXPR_COMPARE && expr->op == CMP_EQ && schema->indexed[expr->left->column]) {
+        return expr;
+    }
+    return NULL;
+}
+
+// Resolve the select list, grouping, ordering and access path of a SELECT
+int planSelect(QueryPlan *plan, char *error, size_t error_size) {
+    Statement *statement = plan->statement;
+    const TableSchema *schema = &plan->schema;
+
+    int has_aggregates = 0;
+    for (int i = 0; i < statement->item_count; i++) {
+        has_aggregates |= statement->items[i].type == ITEM_AGGREGATE;
+    }
+    plan->grouped = has_aggregates || statement->group_count > 0;
+    if (plan->grouped && statement->select_all) {
+        snprintf(error, error_size, "SELECT * cannot be combined with GROUP BY");
+        return 0;
+    }
+    for (int i = 0; i < statement->group_count; i++) {
+        plan->group_columns[i] = schemaColumnIndex(schema, statement->group_by[i]);
+        if (plan->group_columns[i] < 0) {
+            snprintf(error, error_size, "Unknown column '%s'", statement->group_by[i]);
+            return 0;
+        }
+    }
+    for (int i = 0; i < statement->item_count; i++) {
+        SelectItem *item = &statement->items[i];
+        int column = item->column[0] ? schemaColumnIndex(schema, item->column) : -1;
+        if (item->column[0] && column < 0) {
+            snprintf(error, error_size, "Unknown column '%s'", item->column);
+            return 0;
+        }
+        if (!plan->grouped) {
+            plan->projection[i] = column;
+        } else if (item->type == ITEM_COLUMN) {
+            // Plain columns of a grouped query must be grouping columns
+            plan->projection[i] = -1;
+            for (int g = 0; g < statement->group_count; g++) {
+                if (plan->group_columns[g] == column) plan->projection[i] = g;
+            }
+            if (plan->projection[i] < 0) {
+                snprintf(error, error_size, "Column '%s' must appear in GROUP BY", item->column);
+                return 0;
+            }
+        } else {
+            if (plan->spec_count == MAX_AGGREGATES) {
+                snprintf(error, error_size, "Too many aggregates");
+                return 0;
+            }
+            AggregateSpec *spec = &plan->specs[plan->spec_count];
+            static const char *names[] = {"count", "sum", "min", "max", "avg"};
+            spec->function = item->function;
+            spec->column = column;
+            if (column < 0) {
+                snprintf(spec->label, sizeof(spec->label), "count");
+            } else {
+                snprintf(spec->label, sizeof(spec->label), "%s_%s", names[item->function], item->column);
+            }
+            plan->projection[i] = statement->group_count + plan->spec_count++;
+        }
+    }
+    if (statement->group_count + plan->spec_count > MAX_COLUMNS) {
+        snprintf(error, error_size, "Too many result columns");
+        return 0;
+    }
+
+    // ORDER BY names a column of the rows reaching the sort
+    plan->order_column = -1;
+    if (statement->order_by[0] != '\0') {
+        TableSchema sorted = *schema;
+        if (plan->grouped) {
+            aggregateOutputSchema(schema, plan->group_columns, statement->group_count, plan->specs, plan->spec_count, &sorted);
+        }
+        plan->order_column = schemaColumnIndex(&sorted, statement->order_by);
+        if (plan->order_column < 0) {
+            snprintf(error, error_size, "Unknown ORDER BY column '%s'", statement->order_by);
+            return 0;
+        }
+    }
+
+    // Access path: an index lookup when WHERE pins an indexed column
+    plan->indexable = findIndexablePredicate(statement->where, schema);
+    return 1;
+}
+
+// Map the target columns of an INSERT or UPDATE onto schema positions
+int planTargetColumns(QueryPlan *plan, char *error, size_t error_size) {
+    Statement *statement = plan->statement;
+    int listed = statement->column_count > 0;
+    plan->value_count = listed ? statement->column_count : plan->schema.column_count;
+    for (int i = 0; i < plan->value_count; i++) {
+        plan->positions[i] = listed ? schemaColumnIndex(&plan->schema, statement->columns[i]) : i;
+        if (plan->positions[i] < 0) {
+            snprintf(error, error_size, "Unknown column '%s'", statement->columns[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Plan a parsed statement, taking ownership of it. Returns NULL and fills
+// error if the statement refers to an unknown table or column.
+QueryPlan *planQuery(const char *database_name, Statement *statement, char *error, size_t error_size) {
+    QueryPlan *plan = calloc(1, sizeof(QueryPlan));
+    plan->statement = statement;
+    plan->references = 1;
+    for (int i = 0; i < MAX_PARAMETERS; i++) {
+        plan->parameter_types[i] = TYPE_TEXT;
+    }
+
+    if (!loadTableSchema(database_name, statement->table, &plan->schema)) {
+        snprintf(error, error_size, "Unknown table '%s'", statement->table);
+        freeQueryPlan(plan);
+        return NULL;
+    }
+    int planned = resolveExpr(statement->where, &plan->schema, plan->parameter_types, error, error_size);
+    if (planned) {
+        switch (statement->type) {
+            case STATEMENT_SELECT:
+                planned = planSelect(plan, error, error_size);
+                break;
+            case STATEMENT_INSERT:
+            case STATEMENT_UPDATE:
+                planned = planTargetColumns(plan, error, error_size);
+                break;
+            case STATEMENT_DELETE:
+                break;
+            case STATEMENT_CREATE_INDEX:
+                if (schemaColumnIndex(&plan->schema, statement->columns[0]) < 0) {
+                    snprintf(error, error_size, "Unknown column '%s'", statement->columns[0]);
+                    planned = 0;
+                }
+                break;
+        }
+    }
+    if (!planned) {
+        freeQueryPlan(plan);
+        return NULL;
+    }
+    return plan;
+}
+
+// Type the texts bound to a plan's placeholders
+int bindParameters(const QueryPlan *plan, char **texts, int count, Bindings *bindings, char *error, size_t error_size) {
+    if (count != plan->statement->parameter_count) {
+        snprintf(error, error_size, "Expected %d parameters, got %d", plan->statement->parameter_count, count);
+        return 0;
+    }
+    bindings->count = count;
+    for (int i = 0; i < count; i++) {
+        bindings->texts[i] = texts[i];
+        bindings->values[i] = parseValue(texts[i], plan->parameter_types[i]);
+    }
+    return 1;
+}
+
+// Build the operator tree for a planned SELECT:
+//   (index-)scan -> filter -> aggregate -> sort -> limit -> project
+Operator *openSelect(const char *database_name, const QueryPlan *plan, const Bindings *bindings, char *error, size_t error_size) {
+    const Statement *statement = plan->statement;
+    Operator *root = NULL;
+    if (plan->indexable != NULL) {
+        root = newIndexScan(database_name, statement->table, &plan->schema, plan->indexable->left->column,
+                            literalValue(plan->indexable->right, bindings));
+    }
+    if (root == NULL) {
+        root = newScan(database_name, statement->table, &plan->schema);
+    }
+    if (root == NULL) {
+        snprintf(error, error_size, "Unable to read table '%s'", statement->table);
+        return NULL;
+    }
+    if (statement->where != NULL) {
+        root = newFilter(root, statement->where, bindings);
+    }
+    if (plan->grouped) {
+        root = newAggregate(root, plan->group_columns, statement->group_count, plan->specs, plan->spec_count);
+    }
+    if (plan->order_column >= 0) {
+        root = newSort(root, plan->order_column, statement->order_descending);
+    }
+    if (statement->limit >= 0) {
+        root = newLimit(root, statement->limit);
+    }
+    if (!statement->select_all) {
+        root = newProject(root, plan->projection, statement->item_count);
+    }
+    return root;
+}
+
+// Write a value as a JSON number where its column type allows, else a string
+void writeTypedJson(JsonWriter *out, const char *field, ColumnType type) {
+    Value value = parseValue(field, type);
+    if (value.is_null) {
+        json_raw(out, "null");
+    } else if (value.type == TYPE_INTEGER) {
+        json_long(out, value.integer);
+    } else if (value.type == TYPE_TEXT) {
+        json_string(out, field);
+    } else {
+        json_raw(out, field);
+    }
+}
+
+// Whether an operator in the tree stopped early on a failure
+int operatorFailed(const Operator *op) {
+    for (; op != NULL; op = op->child) {
+        if (op->failed) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Stop a SELECT whose operators failed. Part of the result may have been
+// streamed out already, so the caller must not finish the response.
+int failSelect(Operator *root, char *error, size_t error_size) {
+    snprintf(error, error_size, "Sorting failed: a temporary run file could not be written or read back");
+    closeOperator(root);
+    return 0;
+}
+
+int executeSelect(JsonWriter *out, OutputFormat format, const char *database_name, const QueryPlan *plan, const Bindings *bindings, char *error, size_t error_size) {
+    Operator *root = openSelect(database_name, plan, bindings, error, error_size);
+    if (root == NULL) {
+        return 0;
+    }
+
+    unsigned long returned = 0;
+    if (format == OUTPUT_BINARY) {
+        wireColumns(out, &root->schema);
+        while (root->next(root)) {
+            wireRow(out, &root->schema, root->fields, root->field_count);
+            returned++;
+            json_flush_point(out);
+        }
+        countMetric(METRIC_ROWS_RETURNED, returned);
+        if (operatorFailed(root)) {
+            return failSelect(root, error, error_size);
+        }
+        wireEndRows(out);
+        closeOperator(root);
+        return 1;
+    }
+
+    json_char(out, '[');
+    int first = 1;
+    while (root->next(root)) {
+        json_raw(out, first ? "{" : ",{");
+        for (int i = 0; i < root->schema.column_count; i++) {
+            if (i > 0) json_char(out, ',');
+            json_key(out, root->schema.columns[i].name);
+            writeTypedJson(out, i < root->field_count ? root->fields[i] : "", root->schema.columns[i].type);
+        }
+        json_char(out, '}');
+        first = 0;
+        returned++;
+        json_flush_point(out);
+    }
+    countMetric(METRIC_ROWS_RETURNED, returned);
+    if (operatorFailed(root)) {
+        return failSelect(root, error, error_size);
+    }
+    json_char(out, ']');
+    closeOperator(root);
+    return 1;
+}
+
+// Stored values cannot carry the row and field separators
+int validStoredValue(const char *value) {
+    return value == NULL || strpbrk(value, ",\n\r") == NULL;
+}
+
+// A row given as comma-separated text must stay on its one line
+int validStoredRow(const char *row) {
+    return row == NULL || strpbrk(row, "\n\r") == NULL;
+}
+
+// Table and column names and types are written into the table's header
+int validStoredNames(const char *table_name, const char *const columns[], const char *const types[], int column_count) {
+    if (!validStoredValue(table_name)) {
+        return 0;
+    }
+    for (int i = 0; i < column_count; i++) {
+        if (!validStoredValue(columns[i]) || !validStoredValue(types[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Every row is checked before any is written, and all of them go into the
+// table in one locked write, so a bad row leaves the table untouched
+int executeInsert(Arena *arena, const char *database_name, const QueryPlan *plan, const Bindings *bindings, char *error, size_t error_size) {
+    const Statement *statement = plan->statement;
+    const char **rows = arena_alloc(arena, sizeof(const char *) * statement->value_rows * plan->schema.column_count);
+    memset(rows, 0, sizeof(const char *) * statement->value_rows * plan->schema.column_count);
+    size_t block_length = 0;
+    for (int r = 0; r < statement->value_rows; r++) {
+        const Literal *values = statement->values + r * MAX_COLUMNS;
+        const char **row = rows + r * plan->schema.column_count;
+        for (int i = 0; i < plan->value_count; i++) {
+            const char *value = literalText(&values[i], bindings);
+            if (!validStoredValue(value)) {
+                snprintf(error, error_size, "Values may not contain commas or line breaks");
+                return -1;
+            }
+            row[plan->positions[i]] = value;
+        }
+        for (int i = 0; i < plan->schema.column_count; i++) {
+            block_length += (row[i] != NULL ? strlen(row[i]) : 0) + 1;  // The field and its separator
+        }
+    }
+
+    // The rows one per line, in the order given
+    char *block = arena_alloc(arena, block_length + 1);
+    char *end = block;
+    for (int r = 0; r < statement->value_rows; r++) {
+        const char **row = rows + r * plan->schema.column_count;
+        if (r > 0) *end++ = '\n';
+        for (int i = 0; i < plan->schema.column_count; i++) {
+            if (i > 0) *end++ = ',';
+            if (row[i] != NULL) end = stpcpy(end, row[i]);
+        }
+    }
+    *end = '\0';
+    return insertTableValues(arena, database_name, statement->table, block) > 0 ? statement->value_rows : 0;
+}
+
+typedef struct {
+    const QueryPlan *plan;
+    const Bindings *bindings;
+    const char *values[MAX_COLUMNS];
+} RowUpdate;
+
+RowAction updateVisitor(char **fields, int field_count, void *context) {
+    RowUpdate *update = context;
+    const QueryPlan *plan = update->plan;
+    const Statement *statement = plan->statement;
+    if (statement->where != NULL && !evaluateExpr(statement->where, &plan->schema, fields, field_count, update->bindings)) {
+        return ROW_KEEP;
+    }
+    if (statement->type == STATEMENT_DELETE) {
+        return ROW_DELETE;
+    }
+    for (int i = 0; i < plan->value_count; i++) {
+        if (plan->positions[i] < field_count) {
+            fields[plan->positions[i]] = (char *)update->values[i];
+        }
+    }
+    return ROW_REPLACE;
+}
+
+// UPDATE and DELETE share one streaming rewrite of the table
+int executeRewrite(const char *database_name, const QueryPlan *plan, const Bindings *bindings, char *error, size_t error_size) {
+    const Statement *statement = plan->statement;
+    RowUpdate update = {plan, bindings, {0}};
+    if (statement->type == STATEMENT_UPDATE) {
+        for (int i = 0; i < plan->value_count; i++) {
+            const char *value = literalText(&statement->values[i], bindings);
+            if (!validStoredValue(value)) {
+                snprintf(error, error_size, "Values may not contain commas or line breaks");
+                return -1;
+            }
+            update.values[i] = value != NULL ? value : "";
+        }
+    }
+
+    int changed = rewriteTableRows(database_name, statement->table, updateVisitor, &update);
+    if (changed < 0) {
+        snprintf(error, error_size, "Unable to rewrite table '%s'", statement->table);
+    }
+    return changed;
+}
+
+// Execute a plan with its placeholders bound. SELECT writes a JSON array of
+// rows, other statements {"rows_affected": n}; on failure error is filled in
+// and 0 returned, with nothing written unless a SELECT failed part way.
+// Scratch memory for writes comes from the request's arena.
+int executePlan(Arena *arena, JsonWriter *out, OutputFormat format, const char *database_name, const QueryPlan *plan, const Bindings *bindings, char *error, size_t error_size) {
+    const Statement *statement = plan->statement;
+    int affected = -1;
+    switch (statement->type) {
+        case STATEMENT_SELECT:
+            return executeSelect(out, format, database_name, plan, bindings, error, error_size);
+        case STATEMENT_INSERT:
+            affected = executeInsert(arena, database_name, plan, bindings, error, error_size);
+            break;
+        case STATEMENT_UPDATE:
+        case STATEMENT_DELETE:
+            affected = executeRewrite(database_name, plan, bindings, error, error_size);
+            break;
+        case STATEMENT_CREATE_INDEX:
+            affected = createTableIndex(database_name, statement->table, statement->columns[0]);
+            break;
+    }
+    if (affected < 0) {
+        return 0;
+    }
+    if (format == OUTPUT_BINARY) {
+        wireAffected(out, affected);
+        return 1;
+    }
+    json_raw(out, "{\"rows_affected\": ");
+    json_long(out, affected);
+    json_char(out, '}');
+    return 1;
+}
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define INDEX_INITIAL_BUCKETS 256
+
+// Rows sharing one key value, as file offsets of their lines
+typedef struct IndexEntry {
+    unsigned long hash;
+    char *key_text;
+    Value key;
+    long *offsets;
+    size_t offset_count;
+    size_t offset_capacity;
+    struct IndexEntry *next;
+} IndexEntry;
+
+// In-memory hash index over one column of a table. Indexes are declared by
+// "# Index:" schema lines and built on first use. The table's data version
+// tells when a write to the table itself has made the index stale; an insert
+// carries it along instead (see indexInsertedRows). Writes to the other
+// tables of the file only move the table's rows as a whole, so the stat
+// signature of the file just says when to look up where they went.
+typedef struct ColumnIndex {
+    char database_name[256];
+    char table_name[64];
+    int column;
+    ColumnType type;
+
+    unsigned long data_version;  // Of the table, as the offsets stand for it
+    long block_start;            // File offset of the line after the table's header
+    long shift;                  // Added to every stored offset to find its row
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec modified;
+
+    pthread_mutex_t lock;  // Held while the index is built or read
+    IndexEntry **buckets;
+    size_t bucket_count;
+    size_t entry_count;
+    struct ColumnIndex *next;
+} ColumnIndex;
+
+// Indexes are shared by every thread and never freed. column_indexes_lock
+// only guards the list; each index has its own lock, so that rebuilding one
+// never holds up lookups in another. A caller that also holds the database's
+// read lock keeps the offsets it got valid until it lets go, since no write
+// can land in between.
+ColumnIndex *column_indexes = NULL;
+pthread_mutex_t column_indexes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void clearColumnIndex(ColumnIndex *index) {
+    for (size_t i = 0; i < index->bucket_count; i++) {
+        IndexEntry *entry = index->buckets[i];
+        while (entry != NULL) {
+            IndexEntry *next = entry->next;
+            free(entry->key_text);
+            free(entry->offsets);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(index->buckets);
+    index->buckets = NULL;
+    index->bucket_count = 0;
+    index->entry_count = 0;
+}
+
+void addIndexOffset(ColumnIndex *index, const char *field, long offset) {
+    Value key = parseValue(field, index->type);
+    if (key.is_null) {
+        return;
+    }
+    unsigned long hash = hashValue(&key);
+    IndexEntry *entry = index->buckets[hash & (index->bucket_count - 1)];
+    while (entry != NULL && (entry->hash != hash || compareValues(&entry->key, &key) != 0)) {
+        entry = entry->next;
+    }
+
+    if (entry == NULL) {
+        if (index->entry_count >= index->bucket_count) {
+            size_t bucket_count = index->bucket_count * 2;
+            IndexEntry **buckets = calloc(bucket_count, sizeof(IndexEntry *));
+            for (size_t i = 0; i < index->bucket_count; i++) {
+                IndexEntry *existing = index->buckets[i];
+                while (existing != NULL) {
+                    IndexEntry *next = existing->next;
+                    size_t slot = existing->hash & (bucket_count - 1);
+                    existing->next = buckets[slot];
+                    buckets[slot] = existing;
+                    existing = next;
+                }
+            }
+            free(index->buckets);
+            index->buckets = buckets;
+            index->bucket_count = bucket_count;
+        }
+        entry = calloc(1, sizeof(IndexEntry));
+        entry->hash = hash;
+        entry->key_text = strdup(field);
+        entry->key = parseValue(entry->key_text, index->type);
+        size_t slot = hash & (index->bucket_count - 1);
+        entry->next = index->buckets[slot];
+        index->buckets[slot] = entry;
+        index->entry_count++;
+    }
+
+    if (entry->offset_count == entry->offset_capacity) {
+        entry->offset_capacity = entry->offset_capacity ? entry->offset_capacity * 2 : 4;
+        entry->offsets = realloc(entry->offsets, entry->offset_capacity * sizeof(long));
+    }
+    entry->offsets[entry->offset_count++] = offset;
+}
+
+int sameFileState(const ColumnIndex *index, const struct stat *st) {
+    return index->device == st->st_dev && index->inode == st->st_ino && index->size == st->st_size &&
+           index->modified.tv_sec == st->st_mtim.tv_sec && index->modified.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+void noteFileState(ColumnIndex *index, const struct stat *st) {
+    index->device = st->st_dev;
+    index->inode = st->st_ino;
+    index->size = st->st_size;
+    index->modified = st->st_mtim;
+}
+
+int buildColumnIndex(ColumnIndex *index, unsigned long data_version, const struct stat *st) {
+    clearColumnIndex(index);
+    index->bucket_count = INDEX_INITIAL_BUCKETS;
+    index->buckets = calloc(index->bucket_count, sizeof(IndexEntry *));
+
+    TableCursor cursor;
+    if (!openTableCursor(&cursor, index->database_name, index->table_name)) {
+        return 0;
+    }
+    index->block_start = cursor.in_table ? cursor.block_offset : -1;
+    index->shift = 0;
+    while (nextTableRow(&cursor)) {
+        if (index->column < cursor.field_count) {
+            addIndexOffset(index, cursor.fields[index->column], cursor.row_offset);
+        }
+    }
+    closeTableCursor(&cursor);
+
+    index->data_version = data_version;
+    noteFileState(index, st);
+    return 1;
+}
+
+// Where the table's rows now start, or -1 if it has none. Only reads the
+// file up to the table's header.
+long findTableBlock(const char *database_name, const char *table_name) {
+    char *filename = database_path(NULL, database_name);
+    FILE *file = fopen(filename, "r");
+    free(filename);
+    if (file == NULL) {
+        return -1;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    int in_table_values = 0;
+    long start = -1;
+    while (getline(&line, &capacity, file) != -1) {
+        if (strstr(line, "[TABLE_VALUE_BEGIN]") != NULL) {
+            in_table_values = 1;
+        } else if (strstr(line, "[TABLE_VALUE_END]") != NULL) {
+            break;
+        } else if (in_table_values && isTableHeader(line, table_name)) {
+            start = ftell(file);
+            break;
+        }
+    }
+    countMetric(METRIC_FILE_BYTES_READ, ftell(file));
+    free(line);
+    fclose(file);
+    return start;
+}
+
+// Find the index of a column, adding an empty one on first use
+ColumnIndex *findColumnIndex(const char *database_name, const char *table_name, int column, ColumnType type) {
+    pthread_mutex_lock(&column_indexes_lock);
+    ColumnIndex *index = column_indexes;
+    while (index != NULL && (index->column != column || strcmp(index->table_name, table_name) != 0 ||
+                             strcmp(index->database_name, database_name) != 0)) {
+        index = index->next;
+    }
+    if (index == NULL) {
+        index = calloc(1, sizeof(ColumnIndex));
+        snprintf(index->database_name, sizeof(index->database_name), "%s", database_name);
+        snprintf(index->table_name, sizeof(index->table_name), "%s", table_name);
+        index->column = column;
+        index->type = type;
+        pthread_mutex_init(&index->lock, NULL);
+        index->next = column_indexes;
+        column_indexes = index;
+    }
+    pthread_mutex_unlock(&column_indexes_lock);
+    return index;
+}
+
+// Return an up-to-date index for a column, building or rebuilding it as
+// needed, with its lock held; the caller unlocks it once done reading
+ColumnIndex *getColumnIndex(const char *database_name, const char *table_name, int column, ColumnType type) {
+    char *filename = database_path(NULL, database_name);
+    struct stat st;
+    int found = stat(filename, &st) == 0;
+    free(filename);
+    if (!found) {
+        return NULL;
+    }
+
+    ColumnIndex *index = findColumnIndex(database_name, table_name, column, type);
+    pthread_mutex_lock(&index->lock);
+    unsigned long data_version = dataVersion(database_name, table_name);
+    if (index->buckets != NULL && index->data_version == data_version && !sameFileState(index, &st)) {
+        // Another table was written: follow this one's rows to where they moved
+        long block_start = findTableBlock(database_name, table_name);
+        if (block_start >= 0 && index->block_start >= 0) {
+            index->shift += block_start - index->block_start;
+            index->block_start = block_start;
+            noteFileState(index, &st);
+        }
+    }
+    if (index->buckets == NULL || index->data_version != data_version || !sameFileState(index, &st)) {
+        if (!buildColumnIndex(index, data_version, &st)) {
+            pthread_mutex_unlock(&index->lock);
+            return NULL;
+        }
+    }
+    return index;
+}
+
+// Carry a database's indexes over an insert of rows (values, each line ending
+// in a newline once stored) at offset, the start of table_name's rows,
+// without reading the file: whatever lay past offset moved along by their
+// length. Indexes that were not current before the insert are left to be
+// rebuilt. Called by insertRowLine, with the write lock still held, once the
+// table's data version has been bumped from previous_version.
+void indexInsertedRows(const char *database_name, const char *table_name, unsigned long previous_version,
+                       long offset, const char *values, const struct stat *before, const struct stat *after) {
+    long length = strlen(values) + 1;
+    pthread_mutex_lock(&column_indexes_lock);
+    ColumnIndex *first = column_indexes;  // Indexes are only ever added at the head
+    pthread_mutex_unlock(&column_indexes_lock);
+    for (ColumnIndex *index = first; index != NULL; index = index->next) {
+        if (strcmp(index->database_name, database_name) != 0) {
+            continue;
+        }
+        pthread_mutex_lock(&index->lock);
+        int own = strcmp(index->table_name, table_name) == 0;
+        unsigned long version = own ? previous_version : dataVersion(database_name, index->table_name);
+        if (index->buckets == NULL || index->data_version != version || !sameFileState(index, before) || index->block_start < 0) {
+            pthread_mutex_unlock(&index->lock);
+            continue;
+        }
+        if (own) {
+            index->shift += length;  // The old rows now follow the new ones
+            char *rows = strdup(values);
+            char *fields[MAX_COLUMNS];
+            long row_offset = offset;
+            for (char *line = rows; line != NULL; ) {
+                char *newline = strchr(line, '\n');
+                if (newline != NULL) {
+                    *newline = '\0';
+                }
+                long next_offset = row_offset + strlen(line) + 1;
+                if (!is_empty_line(line)) {
+                    int field_count = splitRowFields(line, fields);
+                    if (index->column < field_count) {
+                        addIndexOffset(index, fields[index->column], row_offset - index->shift);
+                    }
+                }
+                row_offset = next_offset;
+                line = newline != NULL ? newline + 1 : NULL;
+            }
+            free(rows);
+            index->data_version = dataVersion(database_name, table_name);
+        } else if (index->block_start > offset) {
+            index->block_start += length;
+            index->shift += length;
+        }
+        noteFileState(index, after);
+        pthread_mutex_unlock(&index->lock);
+    }
+}
+
+// Offsets of the rows whose indexed column equals key, or NULL if none
+const IndexEntry *lookupColumnIndex(const ColumnIndex *index, const Value *key) {
+    if (key->is_null || index->bucket_count == 0) {
+        return NULL;
+    }
+    unsigned long hash = hashValue(key);
+    for (IndexEntry *entry = index->buckets[hash & (index->bucket_count - 1)]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && compareValues(&entry->key, key) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define JOIN_INITIAL_BUCKETS 256
+
+// One row of the build side, fields stored back to back separated by '\0'
+typedef struct JoinEntry {
+    unsigned long hash;
+    Value key;
+    char *data;
+    int field_count;
+    int matched;
+    struct JoinEntry *next;           // Next entry in the same bucket
+    struct JoinEntry *next_in_order;  // Next entry in input order
+} JoinEntry;
+
+typedef struct {
+    JoinEntry **buckets;
+    size_t bucket_count;
+    size_t entry_count;
+    JoinEntry *first;
+    JoinEntry *last;
+} JoinTable;
+
+// Hash a key so that equal values hash alike, e.g. INTEGER 1 and REAL 1.0
+unsigned long hashValue(const Value *value) {
+    if (value->type == TYPE_TEXT) {
+        return hash_bytes(value->text, strlen(value->text));
+    }
+    double real = value->real == 0.0 ? 0.0 : value->real;  // Fold -0.0 into 0.0
+    return hash_bytes((const char *)&real, sizeof(real));
+}
+
+// Whether the left table is no larger than the right, to pick the build
+// side. The sizes are the ones noted next to the tables' data versions, so
+// no file is read; a table no cursor has been through yet counts as the
+// larger, and the left is built when neither has been. A join reads both
+// tables to the end, which notes both sizes for the next one.
+int leftTableSmaller(const char *database_name, const char *left_table, const char *right_table) {
+    long left_size = tableSize(database_name, left_table);
+    long right_size = tableSize(database_name, right_table);
+    return right_size < 0 || (left_size >= 0 && left_size <= right_size);
+}
+
+// Rows with a NULL key can never match; they are only kept (outside the
+// buckets) when a LEFT join needs to emit them
+void insertJoinEntry(JoinTable *table, char **fields, int field_count, int key_column, ColumnType key_type, int keep_unmatchable) {
+    Value key = parseValue(key_column < field_count ? fields[key_column] : "", key_type);
+    if (key.is_null && !keep_unmatchable) {
+        return;
+    }
+
+    size_t length = 0;
+    for (int i = 0; i < field_count; i++) {
+        length += strlen(fields[i]) + 1;
+    }
+    JoinEntry *entry = calloc(1, sizeof(JoinEntry));
+    entry->data = malloc(length);
+    entry->field_count = field_count;
+    char *end = entry->data;
+    for (int i = 0; i < field_count; i++) {
+        if (i == key_column && !key.is_null) {
+            key.text = end;
+        }
+        end = stpcpy(end, fields[i]) + 1;
+    }
+    entry->key = key;
+    entry->hash = hashValue(&key);
+
+    if (table->entry_count >= table->bucket_count) {
+        size_t bucket_count = table->bucket_count ? table->bucket_count * 2 : JOIN_INITIAL_BUCKETS;
+        JoinEntry **buckets = calloc(bucket_count, sizeof(JoinEntry *));
+        for (JoinEntry *existing = table->first; existing != NULL; existing = existing->next_in_order) {
+            if (existing->key.is_null) {
+                continue;
+            }
+            size_t slot = existing->hash & (bucket_count - 1);
+            existing->next = buckets[slot];
+            buckets[slot] = existing;
+        }
+        free(table->buckets);
+        table->buckets = buckets;
+        table->bucket_count = bucket_count;
+    }
+    if (!key.is_null) {
+        size_t slot = entry->hash & (table->bucket_count - 1);
+        entry->next = table->buckets[slot];
+        table->buckets[slot] = entry;
+    }
+    if (table->last != NULL) {
+        table->last->next_in_order = entry;
+    } else {
+        table->first = entry;
+    }
+    table->last = entry;
+    table->entry_count++;
+}
+
+void freeJoinTable(JoinTable *table) {
+    JoinEntry *entry = table->first;
+    while (entry != NULL) {
+        JoinEntry *next = entry->next_in_order;
+        free(entry->data);
+        free(entry);
+        entry = next;
+    }
+    free(table->buckets);
+}
+
+// Unpack a build-side entry into field pointers
+int joinEntryFields(const JoinEntry *entry, char **fields) {
+    char *field = entry->data;
+    for (int i = 0; i < entry->field_count; i++) {
+        fields[i] = field;
+        field += strlen(field) + 1;
+    }
+    return entry->field_count;
+}
+
+void writeJoinSide(JsonWriter *out, const char *table_name, const TableSchema *schema, char **fields, int field_count, int leading_comma) {
+    size_t prefix_length = strlen(table_name);
+    for (int i = 0; i < schema->column_count; i++) {
+        if (i > 0 || leading_comma) json_char(out, ',');
+        // "table.column"
+        size_t name_length = strlen(schema->columns[i].name);
+        char key[prefix_length + name_length + 2];
+        memcpy(key, table_name, prefix_length);
+        key[prefix_length] = '.';
+        memcpy(key + prefix_length + 1, schema->columns[i].name, name_length + 1);
+        json_key(out, key);
+        if (fields == NULL) {
+            json_raw(out, "null");
+        } else {
+            json_string(out, i < field_count ? fields[i] : "");
+        }
+    }
+}
+
+// Write one joined row; a NULL side is emitted as nulls (LEFT JOIN misses)
+void writeJoinedRow(JsonWriter *out, int *first,
+                    const char *left_table, const TableSchema *left_schema, char **left_fields, int left_count,
+                    const char *right_table, const TableSchema *right_schema, char **right_fields, int right_count) {
+    if (!*first) {
+        json_char(out, ',');
+    }
+    *first = 0;
+
+    json_char(out, '{');
+    writeJoinSide(out, left_table, left_schema, left_fields, left_count, 0);
+    writeJoinSide(out, right_table, right_schema, right_fields, right_count, left_schema->column_count > 0);
+    json_char(out, '}');
+    countMetric(METRIC_ROWS_RETURNED, 1);
+    json_flush_point(out);
+}
+
+// Equality join of two tables of one database on left_column = right_column.
+// The hash table is built on the smaller input and probed with the larger
+// one; for a LEFT join unmatched left rows are emitted with null right fields.
+// Writes a JSON array, or returns 0 having written nothing if a table or
+// column is unknown.
+int joinTableData(JsonWriter *out, const char *database_name, const char *left_table, const char *right_table, const char *left_column, const char *right_column, int left_join) {
+    TableSchema left_schema, right_schema;
+    if (!loadTableSchema(database_name, left_table, &left_schema) || !loadTableSchema(database_name, right_table, &right_schema)) {
+        return 0;
+    }
+    int left_key = schemaColumnIndex(&left_schema, left_column);
+    int right_key = schemaColumnIndex(&right_schema, right_column);
+    if (left_key < 0 || right_key < 0) {
+        return 0;
+    }
+
+    int build_left = leftTableSmaller(database_name, left_table, right_table);
+    const char *build_table = build_left ? left_table : right_table;
+    const char *probe_table = build_left ? right_table : left_table;
+    const TableSchema *build_schema = build_left ? &left_schema : &right_schema;
+    const TableSchema *probe_schema = build_left ? &right_schema : &left_schema;
+    int build_key = build_left ? left_key : right_key;
+    int probe_key = build_left ? right_key : left_key;
+
+    // Build phase
+    JoinTable table;
+    memset(&table, 0, sizeof(table));
+    TableCursor cursor;
+    if (!openTableCursor(&cursor, database_name, build_table)) {
+        return 0;
+    }
+    while (nextTableRow(&cursor)) {
+        insertJoinEntry(&table, cursor.fields, cursor.field_count, build_key, build_schema->columns[build_key].type, left_join && build_left);
+    }
+    closeTableCursor(&cursor);
+
+    json_char(out, '[');
+    int first = 1;
+
+    // Probe phase
+    char *build_fields[MAX_COLUMNS];
+    if (openTableCursor(&cursor, database_name, probe_table)) {
+        while (nextTableRow(&cursor)) {
+            int matched = 0;
+            Value key = parseValue(probe_key < cursor.field_count ? cursor.fields[probe_key] : "", probe_schema->columns[probe_key].type);
+            if (!key.is_null && table.bucket_count > 0) {
+                unsigned long hash = hashValue(&key);
+                for (JoinEntry *entry = table.buckets[hash & (table.bucket_count - 1)]; entry != NULL; entry = entry->next) {
+                    if (entry->hash != hash || compareValues(&entry->key, &key) != 0) {
+                        continue;
+                    }
+                    matched = entry->matched = 1;
+                    int build_count = joinEntryFields(entry, build_fields);
+                    if (build_left) {
+                        writeJoinedRow(out, &first, left_table, &left_schema, build_fields, build_count,
+                                       right_table, &right_schema, cursor.fields, cursor.field_count);
+                    } else {
+                        writeJoinedRow(out, &first, left_table, &left_schema, cursor.fields, cursor.field_count,
+                                       right_table, &right_schema, build_fields, build_count);
+                    }
+                }
+            }
+            if (left_join && !build_left && !matched) {
+                writeJoinedRow(out, &first, left_table, &left_schema, cursor.fields, cursor.field_count,
+                               right_table, &right_schema, NULL, 0);
+            }
+        }
+        closeTableCursor(&cursor);
+    }
+
+    // Left rows in the build table that found no partner
+    if (left_join && build_left) {
+        for (JoinEntry *entry = table.first; entry != NULL; entry = entry->next_in_order) {
+            if (!entry->matched) {
+                int build_count = joinEntryFields(entry, build_fields);
+                writeJoinedRow(out, &first, left_table, &left_schema, build_fields, build_count,
+                               right_table, &right_schema, NULL, 0);
+            }
+        }
+    }
+
+    json_char(out, ']');
+    freeJoinTable(&table);
+    return 1;
+}
@@ -0,0 +1,325 @@
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+// Server counters, exported by GET /metrics in the Prometheus text format.
+// Every thread counts into a slot of its own, so counting is a plain load
+// and store on a line no other thread writes; a scrape adds the slots up.
+// The slots are in memory shared by the server processes, claimed as their
+// threads first count something, so whichever process answers the scrape
+// reports for all of them, and a process that is restarted does not take
+// its counts with it.
+
+typedef enum {
+    METRIC_BYTES_RECEIVED,
+    METRIC_BYTES_SENT,
+    METRIC_CONNECTIONS_OPENED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_ROWS_SCANNED,
+    METRIC_ROWS_RETURNED,
+    METRIC_FILE_BYTES_READ,
+    METRIC_FILE_BYTES_WRITTEN,
+    METRIC_PLAN_CACHE_HITS,
+    METRIC_PLAN_CACHE_MISSES,
+    METRIC_RESULT_CACHE_HITS,
+    METRIC_RESULT_CACHE_MISSES,
+    METRIC_COUNT
+} Metric;
+
+#define METRICS_ROUTES 48           // Route slots; the caller maps its routes onto them
+#define METRICS_LATENCY_BUCKETS 20  // Powers of two from 16us to about 8s, then +Inf
+#define METRICS_SLOTS 256           // Threads across all processes; later ones share the last slot
+
+// Status codes counted apiece; any other lands in the last column
+const int metrics_status_codes[] = {200, 203, 400, 401, 404};
+#define METRICS_STATUSES (int)(sizeof(metrics_status_codes) / sizeof(metrics_status_codes[0]) + 1)
+
+typedef struct {
+    _Atomic uint64_t responses[METRICS_STATUSES];
+    _Atomic uint64_t latency[METRICS_LATENCY_BUCKETS + 1];
+    _Atomic uint64_t latency_micros;
+} RouteMetrics;
+
+typedef struct {
+    _Atomic uint64_t counters[METRIC_COUNT];
+    RouteMetrics routes[METRICS_ROUTES];
+} ThreadMetrics;
+
+typedef struct {
+    _Atomic int claimed;
+    ThreadMetrics slots[METRICS_SLOTS];
+} MetricsRegion;
+
+// What the request this thread is running has cost so far. Phases are
+// monotonic clock time: parse covers everything before the route handler
+// runs, read and write the handler's waits on database files and on the
+// client socket, and process the rest of the handler, which is filtering
+// rows and serializing them.
+typedef enum {
+    PHASE_PARSE,
+    PHASE_READ,
+    PHASE_PROCESS,
+    PHASE_WRITE,
+    PHASE_COUNT
+} RequestPhase;
+
+const char *request_phase_names[PHASE_COUNT] = {"parse", "read", "process", "write"};
+
+typedef struct {
+    int active;
+    int report;  // The client asked for the stats with its response
+    uint64_t started;
+    uint64_t handler_started;
+    uint64_t phase_micros[PHASE_COUNT];
+    uint64_t rows_scanned;
+    uint64_t rows_returned;
+    uint64_t bytes_read;
+    unsigned long allocations_at_start;
+} RequestStats;
+
+__thread RequestStats request_stats;
+
+MetricsRegion *metrics_region = NULL;
+__thread ThreadMetrics *thread_metrics = NULL;
+__thread int thread_metrics_shared = 0;  // The slot is the overflow one other threads also count into
+
+// Map the slots; called before the server processes are forked. Counting is
+// a no-op until then.
+int initMetrics(void) {
+    void *memory = mmap(NULL, sizeof(MetricsRegion), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return 0;
+    }
+    metrics_region = memory;
+    return 1;
+}
+
+ThreadMetrics *threadMetrics(void) {
+    if (thread_metrics == NULL && metrics_region != NULL) {
+        int slot = atomic_fetch_add(&metrics_region->claimed, 1);
+        if (slot >= METRICS_SLOTS - 1) {
+            slot = METRICS_SLOTS - 1;
+            thread_metrics_shared = 1;
+        }
+        thread_metrics = &metrics_region->slots[slot];
+    }
+    return thread_metrics;
+}
+
+void addToCounter(_Atomic uint64_t *counter, uint64_t amount) {
+    if (thread_metrics_shared) {
+        atomic_fetch_add_explicit(counter, amount, memory_order_relaxed);
+    } else {
+        // Only this thread writes the slot; readers see the old or new value
+        atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+}
+
+void countMetric(Metric metric, uint64_t amount) {
+    ThreadMetrics *metrics = threadMetrics();
+    if (metrics != NULL) {
+        addToCounter(&metrics->counters[metric], amount);
+    }
+    if (request_stats.active) {
+        if (metric == METRIC_ROWS_SCANNED) request_stats.rows_scanned += amount;
+        else if (metric == METRIC_ROWS_RETURNED) request_stats.rows_returned += amount;
+        else if (metric == METRIC_FILE_BYTES_READ) request_stats.bytes_read += amount;
+    }
+}
+
+uint64_t monotonicMicros(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Start counting for a request on this thread
+void beginRequestStats(int report) {
+    memset(&request_stats, 0, sizeof(request_stats));
+    request_stats.active = 1;
+    request_stats.report = report;
+    request_stats.started = monotonicMicros();
+    request_stats.allocations_at_start = thread_allocations;
+}
+
+// The route handler is about to run; what came before was parsing
+void markHandlerStart(void) {
+    if (request_stats.active) {
+        request_stats.handler_started = monotonicMicros();
+        request_stats.phase_micros[PHASE_PARSE] = request_stats.handler_started - request_stats.started;
+    }
+}
+
+// Clock reading to time a wait with, or 0 when no request is being counted
+uint64_t phaseStart(void) {
+    return request_stats.active ? monotonicMicros() : 0;
+}
+
+void phaseEnd(RequestPhase phase, uint64_t started) {
+    if (request_stats.active && started != 0) {
+        request_stats.phase_micros[phase] += monotonicMicros() - started;
+    }
+}
+
+// Bring the process phase up to now: the handler's time not spent waiting
+void settleRequestStats(void) {
+    if (!request_stats.active || request_stats.handler_started == 0) {
+        return;
+    }
+    uint64_t handler = monotonicMicros() - request_stats.handler_started;
+    uint64_t waiting = request_stats.phase_micros[PHASE_READ] + request_stats.phase_micros[PHASE_WRITE];
+    request_stats.phase_micros[PHASE_PROCESS] = handler > waiting ? handler - waiting : 0;
+}
+
+void endRequestStats(void) {
+    request_stats.active = 0;
+}
+
+// The stats so far as "name=value" pairs
+void describeRequestStats(char *out, size_t size) {
+    settleRequestStats();
+    size_t length = 0;
+    for (int i = 0; i < PHASE_COUNT && length < size; i++) {
+        length += snprintf(out + length, size - length, "%s_us=%llu; ", request_phase_names[i],
+                           (unsigned long long)request_stats.phase_micros[i]);
+    }
+    if (length < size) {
+        snprintf(out + length, size - length, "rows_scanned=%llu; rows_returned=%llu; bytes_read=%llu; allocations=%lu",
+                 (unsigned long long)request_stats.rows_scanned, (unsigned long long)request_stats.rows_returned,
+                 (unsigned long long)request_stats.bytes_read, thread_allocations - request_stats.allocations_at_start);
+    }
+}
+
+// The stats for the X-SimpleDB-Stats header. Returns 0 when the client did
+// not ask for them.
+int formatRequestStats(char *out, size_t size) {
+    if (!request_stats.active || !request_stats.report) {
+        return 0;
+    }
+    describeRequestStats(out, size);
+    return 1;
+}
+
+// Record a response: the route slot that answered, its HTTP status code and
+// how long it took
+void countResponse(int route, int status, uint64_t micros) {
+    ThreadMetrics *metrics = threadMetrics();
+    if (metrics == NULL) {
+        return;
+    }
+    RouteMetrics *route_metrics = &metrics->routes[route < METRICS_ROUTES ? route : METRICS_ROUTES - 1];
+    int column = 0;
+    while (column < METRICS_STATUSES - 1 && metrics_status_codes[column] != status) {
+        column++;
+    }
+    addToCounter(&route_metrics->responses[column], 1);
+    // Bucket i holds durations up to 16us << i
+    int bucket = micros <= 16 ? 0 : 64 - __builtin_clzll((micros - 1) >> 4);
+    addToCounter(&route_metrics->latency[bucket < METRICS_LATENCY_BUCKETS ? bucket : METRICS_LATENCY_BUCKETS], 1);
+    addToCounter(&route_metrics->latency_micros, micros);
+}
+
+uint64_t sumCounter(size_t offset) {
+    int slots = atomic_load(&metrics_region->claimed);
+    if (slots > METRICS_SLOTS) {
+        slots = METRICS_SLOTS;
+    }
+    uint64_t total = 0;
+    for (int i = 0; i < slots; i++) {
+        total += atomic_load_explicit((_Atomic uint64_t *)((char *)&metrics_region->slots[i] + offset), memory_order_relaxed);
+    }
+    return total;
+}
+
+#define METRIC_OFFSET(field) offsetof(ThreadMetrics, field)
+
+void writeMetricLine(JsonWriter *out, const char *format, ...) {
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    json_raw_n(out, line, length < (int)sizeof(line) ? (size_t)length : sizeof(line) - 1);
+}
+
+void writeCounter(JsonWriter *out, const char *name, const char *help, uint64_t value) {
+    writeMetricLine(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, (unsigned long long)value);
+}
+
+void writeCacheMetrics(JsonWriter *out, const char *cache, Metric hits, Metric misses) {
+    uint64_t hit_count = sumCounter(METRIC_OFFSET(counters[hits]));
+    uint64_t miss_count = sumCounter(METRIC_OFFSET(counters[misses]));
+    writeMetricLine(out, "# HELP simpledb_%s_hits_total Lookups answered from the %s.\n# TYPE simpledb_%s_hits_total counter\nsimpledb_%s_hits_total %llu\n",
+                    cache, cache, cache, cache, (unsigned long long)hit_count);
+    writeMetricLine(out, "# HELP simpledb_%s_misses_total Lookups the %s could not answer.\n# TYPE simpledb_%s_misses_total counter\nsimpledb_%s_misses_total %llu\n",
+                    cache, cache, cache, cache, (unsigned long long)miss_count);
+    writeMetricLine(out, "# HELP simpledb_%s_hit_ratio Share of lookups answered from the %s.\n# TYPE simpledb_%s_hit_ratio gauge\nsimpledb_%s_hit_ratio %.6f\n",
+                    cache, cache, cache, cache, hit_count + miss_count > 0 ? (double)hit_count / (hit_count + miss_count) : 0.0);
+}
+
+// Write every metric in the Prometheus text format. route_names label the
+// route slots; only routes and status codes that have been seen appear.
+void writeMetrics(JsonWriter *out, const char *const *route_names, int route_count) {
+    if (metrics_region == NULL) {
+        return;
+    }
+    json_raw(out, "# HELP simpledb_requests_total Requests answered, by route and status code.\n# TYPE simpledb_requests_total counter\n");
+    for (int route = 0; route < route_count && route < METRICS_ROUTES; route++) {
+        for (int column = 0; column < METRICS_STATUSES; column++) {
+            uint64_t count = sumCounter(METRIC_OFFSET(routes[route].responses[column]));
+            if (count == 0) {
+                continue;
+            }
+            char code[8];
+            if (column < METRICS_STATUSES - 1) {
+                snprintf(code, sizeof(code), "%d", metrics_status_codes[column]);
+            } else {
+                snprintf(code, sizeof(code), "other");
+            }
+            writeMetricLine(out, "simpledb_requests_total{route=\"%s\",code=\"%s\"} %llu\n", route_names[route], code, (unsigned long long)count);
+        }
+    }
+
+    json_raw(out, "# HELP simpledb_request_duration_seconds Time to handle a request, by route.\n# TYPE simpledb_request_duration_seconds histogram\n");
+    for (int route = 0; route < route_count && route < METRICS_ROUTES; route++) {
+        uint64_t cumulative = 0;
+        uint64_t buckets[METRICS_LATENCY_BUCKETS + 1];
+        for (int bucket = 0; bucket <= METRICS_LATENCY_BUCKETS; bucket++) {
+            buckets[bucket] = sumCounter(METRIC_OFFSET(routes[route].latency[bucket]));
+            cumulative += buckets[bucket];
+        }
+        if (cumulative == 0) {
+            continue;
+        }
+        cumulative = 0;
+        for (int bucket = 0; bucket < METRICS_LATENCY_BUCKETS; bucket++) {
+            cumulative += buckets[bucket];
+            writeMetricLine(out, "simpledb_request_duration_seconds_bucket{route=\"%s\",le=\"%.6f\"} %llu\n",
+                            route_names[route], (16ULL << bucket) / 1e6, (unsigned long long)cumulative);
+        }
+        cumulative += buckets[METRICS_LATENCY_BUCKETS];
+        writeMetricLine(out, "simpledb_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %llu\n", route_names[route], (unsigned long long)cumulative);
+        writeMetricLine(out, "simpledb_request_duration_seconds_sum{route=\"%s\"} %.6f\n", route_names[route],
+                        sumCounter(METRIC_OFFSET(routes[route].latency_micros)) / 1e6);
+        writeMetricLine(out, "simpledb_request_duration_seconds_count{route=\"%s\"} %llu\n", route_names[route], (unsigned long long)cumulative);
+    }
+
+    writeCounter(out, "simpledb_received_bytes_total", "Bytes read from client connections.", sumCounter(METRIC_OFFSET(counters[METRIC_BYTES_RECEIVED])));
+    writeCounter(out, "simpledb_sent_bytes_total", "Bytes written to client connections.", sumCounter(METRIC_OFFSET(counters[METRIC_BYTES_SENT])));
+    uint64_t opened = sumCounter(METRIC_OFFSET(counters[METRIC_CONNECTIONS_OPENED]));
+    uint64_t closed = sumCounter(METRIC_OFFSET(counters[METRIC_CONNECTIONS_CLOSED]));
+    writeCounter(out, "simpledb_connections_total", "Client connections accepted.", opened);
+    writeMetricLine(out, "# HELP simpledb_open_connections Client connections open now.\n# TYPE simpledb_open_connections gauge\nsimpledb_open_connections %llu\n",
+                    (unsigned long long)(opened > closed ? opened - closed : 0));
+    writeCounter(out, "simpledb_rows_scanned_total", "Rows read from tables.", sumCounter(METRIC_OFFSET(counters[METRIC_ROWS_SCANNED])));
+    writeCounter(out, "simpledb_rows_returned_total", "Rows written into responses.", sumCounter(METRIC_OFFSET(counters[METRIC_ROWS_RETURNED])));
+    writeCounter(out, "simpledb_file_read_bytes_total", "Bytes read from database files.", sumCounter(METRIC_OFFSET(counters[METRIC_FILE_BYTES_READ])));
+    writeCounter(out, "simpledb_file_written_bytes_total", "Bytes written to database files.", sumCounter(METRIC_OFFSET(counters[METRIC_FILE_BYTES_WRITTEN])));
+    writeCacheMetrics(out, "plan_cache", METRIC_PLAN_CACHE_HITS, METRIC_PLAN_CACHE_MISSES);
+    writeCacheMetrics(out, "result_cache", METRIC_RESULT_CACHE_HITS, METRIC_RESULT_CACHE_MISSES);
+}
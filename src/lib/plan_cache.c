@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define PLAN_CACHE_BUCKETS 256
+#define SHARED_STATEMENT_SLOTS 1024
+#define SHARED_STATEMENT_SIZE 4096  // Longest statement text other processes can run
+
+size_t plan_cache_capacity = 128;  // Plans kept before the least recently used is evicted
+
+// A planned statement, found by database and normalised query text (for
+// /query and /prepare) or by its handle (for /execute). The plan is rebuilt
+// from the text whenever the catalog version of its table has moved on.
+typedef struct CachedPlan {
+    char *database_name;
+    char *sql;
+    unsigned long hash;
+    unsigned long handle;
+    unsigned long catalog_version;
+    QueryPlan *plan;  // NULL while the statement cannot be planned
+    struct CachedPlan *next_by_text;
+    struct CachedPlan *next_by_handle;
+    struct CachedPlan *newer;
+    struct CachedPlan *older;
+} CachedPlan;
+
+typedef struct {
+    CachedPlan *by_text[PLAN_CACHE_BUCKETS];
+    CachedPlan *by_handle[PLAN_CACHE_BUCKETS];
+    CachedPlan *newest;
+    CachedPlan *oldest;
+    size_t count;
+    unsigned long next_handle;
+} PlanCache;
+
+// plan_cache_lock guards the entries and their plan pointers. Executions run
+// outside it on a reference to the plan, so an entry may be replanned or
+// evicted while an older plan of it is still running elsewhere.
+PlanCache plan_cache;
+pthread_mutex_t plan_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// With several server processes a client may prepare a statement on one and
+// execute it on another, so handles are drawn from a counter in shared memory
+// and each statement's text is kept there too, in the slot its handle picks.
+// A process that does not know a handle plans the text from its slot. Newer
+// handles take over the slots of older ones, which are then forgotten, like
+// those evicted from a process's own cache. NULL while this is the only
+// process.
+typedef struct {
+    unsigned long sequence;  // Odd while the slot is being written
+    unsigned long handle;
+    char database_name[256];
+    char sql[SHARED_STATEMENT_SIZE];
+} SharedStatement;
+
+typedef struct {
+    unsigned long next_handle;
+    SharedStatement slots[SHARED_STATEMENT_SLOTS];
+} SharedStatements;
+
+SharedStatements *shared_statements = NULL;
+
+// Set up the shared statements; called before the server processes are forked
+int shareStatements(void) {
+    void *memory = mmap(NULL, sizeof(SharedStatements), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return 0;
+    }
+    shared_statements = memory;
+    return 1;
+}
+
+// Hand out the handle for a newly planned statement, leaving its text where
+// the other processes can find it. Text too long for a slot is not shared;
+// only this process knows that handle.
+unsigned long newStatementHandle(const char *database_name, const char *sql) {
+    if (shared_statements == NULL) {
+        return ++plan_cache.next_handle;
+    }
+    unsigned long handle = __atomic_add_fetch(&shared_statements->next_handle, 1, __ATOMIC_RELAXED);
+    if (strlen(database_name) >= sizeof(shared_statements->slots[0].database_name) || strlen(sql) >= SHARED_STATEMENT_SIZE) {
+        return handle;
+    }
+    SharedStatement *slot = &shared_statements->slots[handle % SHARED_STATEMENT_SLOTS];
+    unsigned long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    do {
+        sequence &= ~1UL;  // Wait out a writer that holds the slot
+    } while (!__atomic_compare_exchange_n(&slot->sequence, &sequence, sequence + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    slot->handle = handle;
+    strcpy(slot->database_name, database_name);
+    strcpy(slot->sql, sql);
+    __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+    return handle;
+}
+
+// Copy out the text of a statement another process prepared. Returns 0 when
+// the handle was never shared or its slot has been taken over.
+int findSharedStatement(unsigned long handle, char *database_name, char *sql) {
+    if (shared_statements == NULL) {
+        return 0;
+    }
+    SharedStatement *slot = &shared_statements->slots[handle % SHARED_STATEMENT_SLOTS];
+    while (1) {
+        unsigned long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1) {
+            continue;
+        }
+        int found = slot->handle == handle;
+        if (found) {
+            memcpy(database_name, slot->database_name, sizeof(slot->database_name));
+            memcpy(sql, slot->sql, sizeof(slot->sql));
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence) {
+            return found;
+        }
+    }
+}
+
+// Collapse whitespace outside string literals and drop a trailing ';' so
+// that trivially different spellings of a query share one plan
+char *normalizeQuery(const char *sql) {
+    char *normalized = malloc(strlen(sql) + 1);
+    char *out = normalized;
+    int in_string = 0, pending_space = 0;
+    for (const char *p = sql; *p; p++) {
+        if (!in_string && isspace((unsigned char)*p)) {
+            pending_space = out != normalized;
+            continue;
+        }
+        if (pending_space) {
+            *out++ = ' ';
+            pending_space = 0;
+        }
+        if (*p == '\'') {
+            in_string = !in_string;
+        }
+        *out++ = *p;
+    }
+    while (out > normalized && (out[-1] == ';' || out[-1] == ' ')) {
+        out--;
+    }
+    *out = '\0';
+    return normalized;
+}
+
+unsigned long planCacheHash(const char *database_name, const char *sql) {
+    return hash_bytes(sql, strlen(sql)) * 31 + hash_bytes(database_name, strlen(database_name));
+}
+
+void unlinkCachedPlan(CachedPlan *entry) {
+    CachedPlan **link = &plan_cache.by_text[entry->hash % PLAN_CACHE_BUCKETS];
+    while (*link != entry) link = &(*link)->next_by_text;
+    *link = entry->next_by_text;
+
+    link = &plan_cache.by_handle[entry->handle % PLAN_CACHE_BUCKETS];
+    while (*link != entry) link = &(*link)->next_by_handle;
+    *link = entry->next_by_handle;
+
+    if (entry->newer != NULL) entry->newer->older = entry->older;
+    else plan_cache.newest = entry->older;
+    if (entry->older != NULL) entry->older->newer = entry->newer;
+    else plan_cache.oldest = entry->newer;
+    plan_cache.count--;
+}
+
+void freeCachedPlan(CachedPlan *entry) {
+    releaseQueryPlan(entry->plan);
+    free(entry->database_name);
+    free(entry->sql);
+    free(entry);
+}
+
+// Move an entry to the most recently used end
+void touchCachedPlan(CachedPlan *entry) {
+    if (plan_cache.newest == entry) {
+        return;
+    }
+    if (entry->newer != NULL) entry->newer->older = entry->older;
+    if (entry->older != NULL) entry->older->newer = entry->newer;
+    else plan_cache.oldest = entry->newer;
+    entry->newer = NULL;
+    entry->older = plan_cache.newest;
+    plan_cache.newest->newer = entry;
+    plan_cache.newest = entry;
+}
+
+// Parse and plan the entry's text again if its table's definition changed
+int refreshCachedPlan(CachedPlan *entry, char *error, size_t error_size) {
+    if (entry->plan != NULL &&
+        entry->catalog_version == catalogVersion(entry->database_name, entry->plan->statement->table)) {
+        return 1;
+    }
+    releaseQueryPlan(entry->plan);
+    entry->plan = NULL;
+
+    Statement *statement = parseStatement(entry->sql, error, error_size);
+    if (statement == NULL) {
+        return 0;
+    }
+    entry->catalog_version = catalogVersion(entry->database_name, statement->table);
+    entry->plan = planQuery(entry->database_name, statement, error, error_size);
+    return entry->plan != NULL;
+}
+
+// Find or plan the cache entry for a query. A new entry takes handle, when
+// another process already gave the statement one, or else a new handle.
+// Statements that fail to parse or plan are not cached. Called with
+// plan_cache_lock held.
+CachedPlan *acquireCachedPlan(const char *database_name, const char *sql, unsigned long handle, char *error, size_t error_size) {
+    char *normalized = normalizeQuery(sql);
+    unsigned long hash = planCacheHash(database_name, normalized);
+    CachedPlan *entry = plan_cache.by_text[hash % PLAN_CACHE_BUCKETS];
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->sql, normalized) != 0 ||
+                             strcmp(entry->database_name, database_name) != 0)) {
+        entry = entry->next_by_text;
+    }
+    if (entry != NULL) {
+        free(normalized);
+        countMetric(METRIC_PLAN_CACHE_HITS, 1);
+        touchCachedPlan(entry);
+        return refreshCachedPlan(entry, error, error_size) ? entry : NULL;
+    }
+
+    countMetric(METRIC_PLAN_CACHE_MISSES, 1);
+    entry = calloc(1, sizeof(CachedPlan));
+    entry->database_name = strdup(database_name);
+    entry->sql = normalized;
+    entry->hash = hash;
+    if (!refreshCachedPlan(entry, error, error_size)) {
+        freeCachedPlan(entry);
+        return NULL;
+    }
+
+    entry->handle = handle != 0 ? handle : newStatementHandle(database_name, normalized);
+    entry->next_by_text = plan_cache.by_text[hash % PLAN_CACHE_BUCKETS];
+    plan_cache.by_text[hash % PLAN_CACHE_BUCKETS] = entry;
+    entry->next_by_handle = plan_cache.by_handle[entry->handle % PLAN_CACHE_BUCKETS];
+    plan_cache.by_handle[entry->handle % PLAN_CACHE_BUCKETS] = entry;
+    entry->older = plan_cache.newest;
+    if (plan_cache.newest != NULL) plan_cache.newest->newer = entry;
+    else plan_cache.oldest = entry;
+    plan_cache.newest = entry;
+    plan_cache.count++;
+
+    // Never evict the entry being handed out
+    while (plan_cache.count > plan_cache_capacity && plan_cache.oldest != entry) {
+        CachedPlan *oldest = plan_cache.oldest;
+        unlinkCachedPlan(oldest);
+        freeCachedPlan(oldest);
+    }
+    return entry;
+}
+
+// Called with plan_cache_lock held
+CachedPlan *findCachedPlan(unsigned long handle) {
+    CachedPlan *entry = plan_cache.by_handle[handle % PLAN_CACHE_BUCKETS];
+    while (entry != NULL && entry->handle != handle) {
+        entry = entry->next_by_handle;
+    }
+    return entry;
+}
+
+// Take a reference to the current plan of a query; release it when done
+QueryPlan *checkoutCachedPlan(const char *database_name, const char *sql, unsigned long *handle, char *error, size_t error_size) {
+    pthread_mutex_lock(&plan_cache_lock);
+    CachedPlan *entry = acquireCachedPlan(database_name, sql, 0, error, error_size);
+    QueryPlan *plan = NULL;
+    if (entry != NULL) {
+        plan = entry->plan;
+        retainQueryPlan(plan);
+        if (handle != NULL) {
+            *handle = entry->handle;
+        }
+    }
+    pthread_mutex_unlock(&plan_cache_lock);
+    return plan;
+}
+
+// Run one SQL statement against a database, reusing the cached plan of an
+// identical earlier query, with params bound to its placeholders. SELECT
+// writes a JSON array of rows, other statements {"rows_affected": n}, or
+// their binary forms (see wire.c). Returns 0 and fills error on failure.
+int executeQuery(Arena *arena, JsonWriter *out, OutputFormat format, const char *database_name, const char *sql, char **params, int param_count, char *error, size_t error_size) {
+    QueryPlan *plan = checkoutCachedPlan(database_name, sql, NULL, error, error_size);
+    if (plan == NULL) {
+        return 0;
+    }
+    Bindings bindings;
+    int executed = bindParameters(plan, params, param_count, &bindings, error, error_size) &&
+                   executePlan(arena, out, format, database_name, plan, &bindings, error, error_size);
+    releaseQueryPlan(plan);
+    return executed;
+}
+
+// Plan a statement for repeated execution. Returns its handle, or 0 with
+// error filled in if it cannot be planned.
+unsigned long prepareQuery(const char *database_name, const char *sql, int *parameter_count, char *error, size_t error_size) {
+    unsigned long handle = 0;
+    QueryPlan *plan = checkoutCachedPlan(database_name, sql, &handle, error, error_size);
+    if (plan == NULL) {
+        return 0;
+    }
+    *parameter_count = plan->statement->parameter_count;
+    releaseQueryPlan(plan);
+    return handle;
+}
+
+// Split comma-separated parameter values; an empty value binds NULL
+int splitParameters(Arena *arena, const char *params, char **texts) {
+    return splitRowFields(arena_strdup(arena, params), texts);
+}
+
+// Execute a prepared statement with one text per placeholder (NULL binds
+// NULL). *found is cleared when the handle is unknown or was evicted.
+int executePrepared(Arena *arena, JsonWriter *out, OutputFormat format, unsigned long handle, char **params, int param_count, int *found, char *error, size_t error_size) {
+    pthread_mutex_lock(&plan_cache_lock);
+    CachedPlan *entry = findCachedPlan(handle);
+    countMetric(entry != NULL ? METRIC_PLAN_CACHE_HITS : METRIC_PLAN_CACHE_MISSES, 1);
+    if (entry != NULL) {
+        *found = 1;
+        touchCachedPlan(entry);
+        if (!refreshCachedPlan(entry, error, error_size)) {
+            pthread_mutex_unlock(&plan_cache_lock);
+            return 0;
+        }
+    } else {
+        // Prepared by another server process
+        char *shared_database = arena_alloc(arena, sizeof(shared_statements->slots[0].database_name));
+        char *shared_sql = arena_alloc(arena, SHARED_STATEMENT_SIZE);
+        *found = findSharedStatement(handle, shared_database, shared_sql);
+        if (!*found) {
+            pthread_mutex_unlock(&plan_cache_lock);
+            snprintf(error, error_size, "Unknown statement %lu, prepare it again", handle);
+            return 0;
+        }
+        entry = acquireCachedPlan(shared_database, shared_sql, handle, error, error_size);
+        if (entry == NULL) {
+            pthread_mutex_unlock(&plan_cache_lock);
+            return 0;
+        }
+    }
+    QueryPlan *plan = entry->plan;
+    retainQueryPlan(plan);
+    char *database_name = arena_strdup(arena, entry->database_name);
+    pthread_mutex_unlock(&plan_cache_lock);
+
+    Bindings bindings;
+    int executed = bindParameters(plan, params, param_count, &bindings, error, error_size) &&
+                   executePlan(arena, out, format, database_name, plan, &bindings, error, error_size);
+    releaseQueryPlan(plan);
+    return executed;
+}
+
+// The database and text of a prepared statement, for the slow log. Returns 0
+// when neither this process nor the others know the handle.
+int preparedStatementText(Arena *arena, unsigned long handle, char **database_name, char **sql) {
+    pthread_mutex_lock(&plan_cache_lock);
+    CachedPlan *entry = findCachedPlan(handle);
+    if (entry != NULL) {
+        *database_name = arena_strdup(arena, entry->database_name);
+        *sql = arena_strdup(arena, entry->sql);
+    }
+    pthread_mutex_unlock(&plan_cache_lock);
+    if (entry != NULL) {
+        return 1;
+    }
+    *database_name = arena_alloc(arena, sizeof(shared_statements->slots[0].database_name));
+    *sql = arena_alloc(arena, SHARED_STATEMENT_SIZE);
+    return findSharedStatement(handle, *database_name, *sql);
+}
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define RESULT_CACHE_INITIAL_BUCKETS 256
+
+size_t result_cache_budget = 16 * 1024 * 1024;  // Bytes of responses kept in memory
+size_t result_file_budget = 256 * 1024 * 1024;  // Bytes of large responses kept in files
+
+// A finished response body for one read of one table, valid for as long as
+// the table's data version has not moved on. Bodies too big to hold in
+// memory are kept in an unlinked file instead and sent from it with sendfile.
+typedef struct CachedResult {
+    char *key;
+    unsigned long hash;
+    unsigned long data_version;
+    char *body;       // NULL for a body kept in a file
+    int file;         // The file, or -1
+    size_t file_size;
+    size_t size;  // Bytes charged against the memory budget
+    struct CachedResult *next;
+    struct CachedResult *newer;
+    struct CachedResult *older;
+} CachedResult;
+
+typedef struct {
+    CachedResult **buckets;
+    size_t bucket_count;
+    size_t count;
+    size_t size;
+    size_t file_size;
+    CachedResult *newest;
+    CachedResult *oldest;
+} ResultCache;
+
+ResultCache result_cache;
+pthread_mutex_t result_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Called with result_cache_lock held, like everything below that touches the
+// cache
+void removeCachedResult(CachedResult *entry) {
+    CachedResult **link = &result_cache.buckets[entry->hash & (result_cache.bucket_count - 1)];
+    while (*link != entry) link = &(*link)->next;
+    *link = entry->next;
+
+    if (entry->newer != NULL) entry->newer->older = entry->older;
+    else result_cache.newest = entry->older;
+    if (entry->older != NULL) entry->older->newer = entry->newer;
+    else result_cache.oldest = entry->newer;
+
+    result_cache.count--;
+    result_cache.size -= entry->size;
+    if (entry->file >= 0) {
+        close(entry->file);
+        result_cache.file_size -= entry->file_size;
+    }
+    free(entry->key);
+    free(entry->body);
+    free(entry);
+}
+
+CachedResult *findCachedResult(const char *key, unsigned long hash) {
+    if (result_cache.bucket_count == 0) {
+        return NULL;
+    }
+    CachedResult *entry = result_cache.buckets[hash & (result_cache.bucket_count - 1)];
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+// The entry for key if it is still current, moved to the most recently used
+// end; an entry the table has been written since is dropped
+CachedResult *useCachedResult(const char *key, const char *database_name, const char *table_name) {
+    unsigned long data_version = dataVersion(database_name, table_name);
+    CachedResult *entry = findCachedResult(key, hash_bytes(key, strlen(key)));
+    if (entry == NULL) {
+        return NULL;
+    }
+    if (entry->data_version != data_version) {
+        removeCachedResult(entry);
+        return NULL;
+    }
+    if (result_cache.newest != entry) {
+        entry->newer->older = entry->older;
+        if (entry->older != NULL) entry->older->newer = entry->newer;
+        else result_cache.oldest = entry->newer;
+        entry->newer = NULL;
+        entry->older = result_cache.newest;
+        result_cache.newest->newer = entry;
+        result_cache.newest = entry;
+    }
+    return entry;
+}
+
+// Cached response for key, copied into the arena so that another thread's
+// eviction cannot pull it away, or NULL if there is none, it is kept in a
+// file or the table was written since
+const char *lookupCachedResult(Arena *arena, const char *key, const char *database_name, const char *table_name) {
+    pthread_mutex_lock(&result_cache_lock);
+    CachedResult *entry = useCachedResult(key, database_name, table_name);
+    char *body = entry != NULL && entry->body != NULL ? arena_strdup(arena, entry->body) : NULL;
+    pthread_mutex_unlock(&result_cache_lock);
+    if (body != NULL) {
+        countMetric(METRIC_RESULT_CACHE_HITS, 1);
+    }
+    return body;
+}
+
+// Cached response for key kept in a file: a descriptor of the caller's own to
+// send from and close, with the body's size in *size. -1 if there is none.
+int lookupCachedFile(const char *key, const char *database_name, const char *table_name, size_t *size) {
+    pthread_mutex_lock(&result_cache_lock);
+    CachedResult *entry = useCachedResult(key, database_name, table_name);
+    int file = entry != NULL && entry->file >= 0 ? dup(entry->file) : -1;
+    if (file >= 0) {
+        *size = entry->file_size;
+    }
+    pthread_mutex_unlock(&result_cache_lock);
+    // Callers look here after memory, so a miss here is a miss of both
+    countMetric(file >= 0 ? METRIC_RESULT_CACHE_HITS : METRIC_RESULT_CACHE_MISSES, 1);
+    return file;
+}
+
+// An anonymous file in the database directory, gone once it is closed
+int createScratchFile(void) {
+    int file = open(DB_DIRECTORY, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (file < 0) {
+        // Filesystems without O_TMPFILE: create a file and unlink it at once
+        char path[] = DB_DIRECTORY "/.result-XXXXXX";
+        file = mkostemp(path, O_CLOEXEC);
+        if (file >= 0) {
+            unlink(path);
+        }
+    }
+    return file;
+}
+
+// A file for a response too large to keep in memory, or -1 when files are
+// not cached
+int createResultFile(void) {
+    if (result_file_budget == 0) {
+        return -1;
+    }
+    return createScratchFile();
+}
+
+// Add an entry, evicting the least recently used ones to stay within both
+// byte budgets. Called with result_cache_lock held.
+void insertCachedResult(const char *key, unsigned long hash, unsigned long data_version, char *body, int file, size_t file_size) {
+    size_t size = sizeof(CachedResult) + strlen(key) + (body != NULL ? strlen(body) : 0) + 2;
+    CachedResult *existing = findCachedResult(key, hash);
+    if (existing != NULL) {
+        removeCachedResult(existing);
+    }
+    while (result_cache.size + size > result_cache_budget) {
+        removeCachedResult(result_cache.oldest);
+    }
+    CachedResult *victim = result_cache.oldest;
+    while (file >= 0 && result_cache.file_size + file_size > result_file_budget) {
+        while (victim->file < 0) victim = victim->newer;
+        CachedResult *newer = victim->newer;
+        removeCachedResult(victim);
+        victim = newer;
+    }
+
+    if (result_cache.count >= result_cache.bucket_count) {
+        size_t bucket_count = result_cache.bucket_count ? result_cache.bucket_count * 2 : RESULT_CACHE_INITIAL_BUCKETS;
+        CachedResult **buckets = calloc(bucket_count, sizeof(CachedResult *));
+        for (CachedResult *entry = result_cache.newest; entry != NULL; entry = entry->older) {
+            size_t slot = entry->hash & (bucket_count - 1);
+            entry->next = buckets[slot];
+            buckets[slot] = entry;
+        }
+        free(result_cache.buckets);
+        result_cache.buckets = buckets;
+        result_cache.bucket_count = bucket_count;
+    }
+
+    CachedResult *entry = calloc(1, sizeof(CachedResult));
+    entry->key = strdup(key);
+    entry->hash = hash;
+    entry->data_version = data_version;
+    entry->body = body;
+    entry->file = file;
+    entry->file_size = file_size;
+    entry->size = size;
+
+    size_t slot = hash & (result_cache.bucket_count - 1);
+    entry->next = result_cache.buckets[slot];
+    result_cache.buckets[slot] = entry;
+    entry->older = result_cache.newest;
+    if (result_cache.newest != NULL) result_cache.newest->newer = entry;
+    else result_cache.oldest = entry;
+    result_cache.newest = entry;
+    result_cache.count++;
+    result_cache.size += size;
+    if (file >= 0) {
+        result_cache.file_size += file_size;
+    }
+}
+
+// Remember a response computed while the table was at data_version
+void storeCachedResult(const char *key, unsigned long data_version, const char *body) {
+    if (sizeof(CachedResult) + strlen(key) + strlen(body) + 2 > result_cache_budget) {
+        return;
+    }
+    pthread_mutex_lock(&result_cache_lock);
+    insertCachedResult(key, hash_bytes(key, strlen(key)), data_version, strdup(body), -1, 0);
+    pthread_mutex_unlock(&result_cache_lock);
+}
+
+// Remember a response written to file (from createResultFile), taking the
+// descriptor over; it is closed right away if the file does not fit
+void storeCachedFile(const char *key, unsigned long data_version, int file, size_t size) {
+    if (size > result_file_budget || sizeof(CachedResult) + strlen(key) + 2 > result_cache_budget) {
+        close(file);
+        return;
+    }
+    pthread_mutex_lock(&result_cache_lock);
+    insertCachedResult(key, hash_bytes(key, strlen(key)), data_version, NULL, file, size);
+    pthread_mutex_unlock(&result_cache_lock);
+}
@@ -0,0 +1,106 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+// Delimiter indexing for row scans. A kernel finds every ',' and '\n' in a
+// block and writes their offsets, in increasing order, to positions (which
+// must have room for length entries). Fields and rows are then cut from the
+// index instead of walking the block a byte at a time.
+typedef size_t (*DelimiterIndexer)(const char *data, size_t length, uint32_t *positions);
+
+size_t indexDelimitersScalar(const char *data, size_t length, uint32_t *positions) {
+    size_t count = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (data[i] == ',' || data[i] == '\n') {
+            positions[count++] = (uint32_t)i;
+        }
+    }
+    return count;
+}
+
+#ifdef SCAN_X86
+// Append the set bits of a match mask as offsets from base
+static inline size_t appendMaskPositions(uint64_t mask, size_t base, uint32_t *positions, size_t count) {
+    while (mask != 0) {
+        positions[count++] = (uint32_t)(base + __builtin_ctzll(mask));
+        mask &= mask - 1;
+    }
+    return count;
+}
+
+__attribute__((target("sse2")))
+size_t indexDelimitersSse2(const char *data, size_t length, uint32_t *positions) {
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0, i = 0;
+    for (; i + 64 <= length; i += 64) {
+        uint64_t mask = 0;
+        for (int part = 0; part < 4; part++) {
+            __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i + part * 16));
+            __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(chunk, comma), _mm_cmpeq_epi8(chunk, newline));
+            mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(hits) << (part * 16);
+        }
+        count = appendMaskPositions(mask, i, positions, count);
+    }
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(chunk, comma), _mm_cmpeq_epi8(chunk, newline));
+        count = appendMaskPositions((uint16_t)_mm_movemask_epi8(hits), i, positions, count);
+    }
+    size_t tail = indexDelimitersScalar(data + i, length - i, positions + count);
+    for (size_t j = count; j < count + tail; j++) {
+        positions[j] += (uint32_t)i;
+    }
+    return count + tail;
+}
+
+__attribute__((target("avx2")))
+size_t indexDelimitersAvx2(const char *data, size_t length, uint32_t *positions) {
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0, i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m256i low = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i high = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+        uint32_t low_mask = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(low, comma), _mm256_cmpeq_epi8(low, newline)));
+        uint32_t high_mask = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(high, comma), _mm256_cmpeq_epi8(high, newline)));
+        count = appendMaskPositions((uint64_t)high_mask << 32 | low_mask, i, positions, count);
+    }
+    size_t tail = indexDelimitersSse2(data + i, length - i, positions + count);
+    for (size_t j = count; j < count + tail; j++) {
+        positions[j] += (uint32_t)i;
+    }
+    return count + tail;
+}
+#endif
+
+DelimiterIndexer delimiter_indexer = NULL;
+pthread_once_t delimiter_indexer_once = PTHREAD_ONCE_INIT;
+
+// Pick the widest kernel the CPU supports
+DelimiterIndexer selectDelimiterIndexer(void) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return indexDelimitersAvx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return indexDelimitersSse2;
+    }
+#endif
+    return indexDelimitersScalar;
+}
+
+void initDelimiterIndexer(void) {
+    delimiter_indexer = selectDelimiterIndexer();
+}
+
+size_t indexDelimiters(const char *data, size_t length, uint32_t *positions) {
+    pthread_once(&delimiter_indexer_once, initDelimiterIndexer);
+    return delimiter_indexer(data, length, positions);
+}
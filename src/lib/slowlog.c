@@ -0,0 +1,206 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+extern int write_all(int fd, const char *data, size_t length);
+
+// The slow query log: requests that take longer than slow_query_millis are
+// written, one line each, to slow_log_path. A request only formats its line
+// into a slot of a lock-free ring; a background thread drains the ring to
+// the file, so the request never waits on the disk or on another request. A
+// line that finds the ring full is dropped and counted instead. When the
+// file outgrows slow_log_size it is renamed to path.1 and a new one begun.
+
+#define SLOW_LOG_SLOTS 1024          // Lines waiting for the writer; a power of two
+#define SLOW_LOG_LINE_SIZE 1536      // Room for the longest line
+#define SLOW_LOG_NAME_SIZE 64        // Bytes of a database or table name kept
+#define SLOW_LOG_PREDICATE_SIZE 400  // Bytes of the predicate kept
+#define SLOW_LOG_DRAIN_MICROS 50000  // How long the writer sleeps when the ring is empty
+
+int slow_query_millis = -1;  // Requests slower than this are logged; -1 logs none
+char slow_log_path[256] = "slow.log";
+size_t slow_log_size = 16 * 1024 * 1024;  // Bytes before the file is rotated
+
+// A slot is free for the request that claims position p when its sequence
+// is p, and holds a line for the writer when it is p + 1
+typedef struct {
+    atomic_size_t sequence;
+    char line[SLOW_LOG_LINE_SIZE];
+} SlowLogSlot;
+
+typedef struct {
+    SlowLogSlot slots[SLOW_LOG_SLOTS];
+    atomic_size_t head;  // Next position a request claims
+    size_t tail;         // Next position the writer takes; only it touches this
+    atomic_ulong dropped;
+    int file;
+} SlowLog;
+
+SlowLog slow_log = {.file = -1};
+
+// Whether the request this thread is running has been slow enough to log
+int requestIsSlow(void) {
+    if (slow_query_millis < 0 || !request_stats.active) {
+        return 0;
+    }
+    return monotonicMicros() - request_stats.started >= (uint64_t)slow_query_millis * 1000;
+}
+
+// Copy text into out as the inside of a double-quoted string, escaping what
+// would break the line
+size_t quoteLogText(char *out, size_t size, const char *text, size_t limit) {
+    size_t length = 0;
+    for (size_t i = 0; text != NULL && text[i] != '\0' && i < limit && length + 3 < size; i++) {
+        char c = text[i];
+        if (c == '"' || c == '\\') {
+            out[length++] = '\\';
+            out[length++] = c;
+        } else if (c == '\n' || c == '\r' || c == '\t') {
+            out[length++] = ' ';
+        } else {
+            out[length++] = c;
+        }
+    }
+    out[length] = '\0';
+    return length;
+}
+
+// Claim a slot and write the running request's line into it. Any field may
+// be NULL.
+void logSlowRequest(const char *route, const char *database_name, const char *table_name, const char *predicate) {
+    size_t position = atomic_load_explicit(&slow_log.head, memory_order_relaxed);
+    SlowLogSlot *slot;
+    while (1) {
+        slot = &slow_log.slots[position % SLOW_LOG_SLOTS];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&slow_log.head, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            atomic_fetch_add_explicit(&slow_log.dropped, 1, memory_order_relaxed);  // The writer is behind
+            return;
+        } else {
+            position = atomic_load_explicit(&slow_log.head, memory_order_relaxed);
+        }
+    }
+
+    uint64_t total = monotonicMicros() - request_stats.started;
+    char stats[256];
+    describeRequestStats(stats, sizeof(stats));
+    char quoted_database[SLOW_LOG_NAME_SIZE * 2 + 1];
+    char quoted_table[SLOW_LOG_NAME_SIZE * 2 + 1];
+    char quoted_predicate[SLOW_LOG_PREDICATE_SIZE * 2 + 1];
+    quoteLogText(quoted_database, sizeof(quoted_database), database_name, SLOW_LOG_NAME_SIZE);
+    quoteLogText(quoted_table, sizeof(quoted_table), table_name, SLOW_LOG_NAME_SIZE);
+    quoteLogText(quoted_predicate, sizeof(quoted_predicate), predicate, SLOW_LOG_PREDICATE_SIZE);
+    time_t now = time(NULL);
+    struct tm utc;
+    char timestamp[32];
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&now, &utc));
+    snprintf(slot->line, sizeof(slot->line),
+             "%s route=\"%.64s\" database=\"%s\" table=\"%s\" predicate=\"%s\" total_us=%llu; %s\n",
+             timestamp, route != NULL ? route : "", quoted_database, quoted_table, quoted_predicate,
+             (unsigned long long)total, stats);
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+}
+
+int openSlowLogFile(void) {
+    return open(slow_log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+}
+
+// Start a new file once this one is full. Worker processes share the path,
+// so one may find another has rotated it already: then it only reopens.
+void rotateSlowLog(void) {
+    struct stat current;
+    struct stat named;
+    if (fstat(slow_log.file, &current) != 0) {
+        return;
+    }
+    int renamed = stat(slow_log_path, &named) != 0 || named.st_ino != current.st_ino;
+    if (!renamed && (size_t)current.st_size < slow_log_size) {
+        return;
+    }
+    if (!renamed) {
+        char rotated[sizeof(slow_log_path) + 2];
+        snprintf(rotated, sizeof(rotated), "%s.1", slow_log_path);
+        rename(slow_log_path, rotated);
+    }
+    int file = openSlowLogFile();
+    if (file >= 0) {
+        close(slow_log.file);
+        slow_log.file = file;
+    }
+}
+
+// Write out the lines waiting in the ring. Returns how many there were.
+int drainSlowLog(void) {
+    char batch[64 * 1024];
+    size_t length = 0;
+    int count = 0;
+    while (1) {
+        SlowLogSlot *slot = &slow_log.slots[slow_log.tail % SLOW_LOG_SLOTS];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != slow_log.tail + 1) {
+            break;
+        }
+        size_t line_length = strlen(slot->line);
+        if (length + line_length > sizeof(batch)) {
+            write_all(slow_log.file, batch, length);
+            length = 0;
+        }
+        memcpy(batch + length, slot->line, line_length);
+        length += line_length;
+        atomic_store_explicit(&slot->sequence, slow_log.tail + SLOW_LOG_SLOTS, memory_order_release);
+        slow_log.tail++;
+        count++;
+    }
+    unsigned long dropped = atomic_exchange_explicit(&slow_log.dropped, 0, memory_order_relaxed);
+    if (dropped > 0 && length + 128 <= sizeof(batch)) {
+        length += snprintf(batch + length, sizeof(batch) - length, "# %lu slow requests dropped, the log could not keep up\n", dropped);
+    }
+    if (length > 0) {
+        write_all(slow_log.file, batch, length);
+        rotateSlowLog();
+    }
+    return count;
+}
+
+void *slowLogWriter(void *unused) {
+    (void)unused;
+    struct timespec pause = {0, SLOW_LOG_DRAIN_MICROS * 1000};
+    while (1) {
+        if (drainSlowLog() == 0) {
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Open the log and start its writer, if a threshold is set. Threads do not
+// survive fork, so each worker process starts its own.
+int startSlowLog(void) {
+    if (slow_query_millis < 0) {
+        return 1;
+    }
+    for (size_t i = 0; i < SLOW_LOG_SLOTS; i++) {
+        atomic_init(&slow_log.slots[i].sequence, i);
+    }
+    slow_log.file = openSlowLogFile();
+    if (slow_log.file < 0) {
+        return 0;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, slowLogWriter, NULL) != 0) {
+        return 0;
+    }
+    pthread_detach(thread);
+    return 1;
+}
@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Bytes of row data a sort may hold in memory before spilling a run to disk
+size_t sort_memory_limit = 64 * 1024 * 1024;
+
+typedef struct {
+    char *line;        // Row with fields joined by ',', followed by the key text
+    Value key;
+    size_t sequence;   // Input position, keeps the sort stable
+} SortRow;
+
+// Head of a sorted run file during the k-way merge
+typedef struct {
+    FILE *file;
+    char *line;
+    size_t line_capacity;
+    char *key_text;
+    Value key;
+    int run;
+} MergeHead;
+
+typedef struct {
+    int key_column;
+    ColumnType key_type;
+    int descending;
+
+    SortRow *rows;
+    size_t row_count;
+    size_t row_capacity;
+    size_t memory_used;
+    size_t sequence;
+
+    FILE **runs;
+    int run_count;
+    int failed;  // A run could not be written or read back; the output is incomplete
+
+    // Output state
+    size_t next_row;
+    MergeHead *heads;
+    int head_count;
+    char *merged_line;
+} RowSorter;
+
+void initRowSorter(RowSorter *sorter, int key_column, ColumnType key_type, int descending) {
+    memset(sorter, 0, sizeof(*sorter));
+    sorter->key_column = key_column;
+    sorter->key_type = key_type;
+    sorter->descending = descending;
+}
+
+int compareSortRows(const void *a, const void *b, void *context) {
+    const SortRow *left = a, *right = b;
+    int result = compareValues(&left->key, &right->key);
+    if (*(int *)context) {
+        result = -result;
+    }
+    if (result == 0) {
+        result = (left->sequence > right->sequence) - (left->sequence < right->sequence);
+    }
+    return result;
+}
+
+// Drop the buffered rows after a failed spill; the sort cannot finish
+int failSortRun(RowSorter *sorter, FILE *run, size_t written) {
+    for (size_t i = written; i < sorter->row_count; i++) {
+        free(sorter->rows[i].line);
+    }
+    if (run != NULL) {
+        fclose(run);
+    }
+    sorter->row_count = 0;
+    sorter->memory_used = 0;
+    sorter->failed = 1;
+    return 0;
+}
+
+// Sort the buffered rows and write them out as one run under DB_DIRECTORY
+int spillSortRun(RowSorter *sorter) {
+    char template[] = DB_DIRECTORY "/.sort-XXXXXX";
+    int fd = mkstemp(template);
+    if (fd < 0) {
+        perror("Unable to create sort run file");
+        return failSortRun(sorter, NULL, 0);
+    }
+    unlink(template);  // The run only lives as long as the open descriptor
+    FILE *run = fdopen(fd, "w+");
+    if (run == NULL) {
+        close(fd);
+        return failSortRun(sorter, NULL, 0);
+    }
+
+    qsort_r(sorter->rows, sorter->row_count, sizeof(SortRow), compareSortRows, &sorter->descending);
+    for (size_t i = 0; i < sorter->row_count; i++) {
+        int written = fputs(sorter->rows[i].line, run) >= 0 && fputc('\n', run) != EOF;
+        free(sorter->rows[i].line);
+        if (!written) {
+            perror("Unable to write sort run file");
+            return failSortRun(sorter, run, i + 1);
+        }
+    }
+    if (fflush(run) != 0) {
+        perror("Unable to write sort run file");
+        return failSortRun(sorter, run, sorter->row_count);
+    }
+    rewind(run);
+
+    sorter->runs = realloc(sorter->runs, (sorter->run_count + 1) * sizeof(FILE *));
+    sorter->runs[sorter->run_count++] = run;
+    sorter->row_count = 0;
+    sorter->memory_used = 0;
+    return 1;
+}
+
+int addSortRow(RowSorter *sorter, char **fields, int field_count) {
+    size_t length = 0;
+    for (int i = 0; i < field_count; i++) {
+        length += strlen(fields[i]) + 1;
+    }
+    const char *key_field = sorter->key_column < field_count ? fields[sorter->key_column] : "";
+    size_t key_length = strlen(key_field);
+
+    char *line = malloc(length + key_length + 1);
+    char *end = line;
+    for (int i = 0; i < field_count; i++) {
+        if (i > 0) *end++ = ',';
+        end = stpcpy(end, fields[i]);
+    }
+    char *key_text = end + 1;
+    memcpy(key_text, key_field, key_length + 1);
+
+    if (sorter->row_count == sorter->row_capacity) {
+        sorter->row_capacity = sorter->row_capacity ? sorter->row_capacity * 2 : 1024;
+        sorter->rows = realloc(sorter->rows, sorter->row_capacity * sizeof(SortRow));
+    }
+    SortRow *row = &sorter->rows[sorter->row_count++];
+    row->line = line;
+    row->key = parseValue(key_text, sorter->key_type);
+    row->sequence = sorter->sequence++;
+
+    sorter->memory_used += length + key_length + 1 + sizeof(SortRow);
+    if (sorter->memory_used > sort_memory_limit) {
+        return spillSortRun(sorter);
+    }
+    return 1;
+}
+
+int readMergeHead(RowSorter *sorter, MergeHead *head) {
+    if (getline(&head->line, &head->line_capacity, head->file) == -1) {
+        if (ferror(head->file)) {
+            sorter->failed = 1;
+        }
+        return 0;
+    }
+    trim_newlines(head->line);
+
+    // Copy the key field out of the line; the line itself is returned intact
+    const char *field = head->line;
+    for (int i = 0; i < sorter->key_column && field != NULL; i++) {
+        field = strchr(field, ',');
+        if (field != NULL) field++;
+    }
+    free(head->key_text);
+    head->key_text = strdup(field != NULL ? field : "");
+    char *comma = strchr(head->key_text, ',');
+    if (comma != NULL) *comma = '\0';
+    head->key = parseValue(head->key_text, sorter->key_type);
+    return 1;
+}
+
+int compareMergeHeads(const RowSorter *sorter, const MergeHead *a, const MergeHead *b) {
+    int result = compareValues(&a->key, &b->key);
+    if (sorter->descending) {
+        result = -result;
+    }
+    return result != 0 ? result : a->run - b->run;
+}
+
+void siftMergeHead(RowSorter *sorter, int index) {
+    for (;;) {
+        int smallest = index;
+        int left = 2 * index + 1, right = left + 1;
+        if (left < sorter->head_count && compareMergeHeads(sorter, &sorter->heads[left], &sorter->heads[smallest]) < 0) smallest = left;
+        if (right < sorter->head_count && compareMergeHeads(sorter, &sorter->heads[right], &sorter->heads[smallest]) < 0) smallest = right;
+        if (smallest == index) {
+            return;
+        }
+        MergeHead swap = sorter->heads[index];
+        sorter->heads[index] = sorter->heads[smallest];
+        sorter->heads[smallest] = swap;
+        index = smallest;
+    }
+}
+
+// Called once all rows are added: sort in memory, or spill and set up the
+// merge. Returns 0 if a run could not be written.
+int finishRowSorter(RowSorter *sorter) {
+    if (sorter->failed) {
+        return 0;
+    }
+    if (sorter->run_count == 0) {
+        qsort_r(sorter->rows, sorter->row_count, sizeof(SortRow), compareSortRows, &sorter->descending);
+        return 1;
+    }
+    if (sorter->row_count > 0 && !spillSortRun(sorter)) {
+        return 0;
+    }
+
+    sorter->heads = calloc(sorter->run_count, sizeof(MergeHead));
+    for (int i = 0; i < sorter->run_count; i++) {
+        MergeHead *head = &sorter->heads[sorter->head_count];
+        head->file = sorter->runs[i];
+        head->run = i;
+        if (readMergeHead(sorter, head)) {
+            sorter->head_count++;
+        } else {
+            free(head->line);
+            free(head->key_text);
+        }
+    }
+    for (int i = sorter->head_count / 2 - 1; i >= 0; i--) {
+        siftMergeHead(sorter, i);
+    }
+    return 1;
+}
+
+// Next row in sorted order, or NULL when done. The returned line is only
+// valid until the following call.
+const char *nextSortedRow(RowSorter *sorter) {
+    if (sorter->run_count == 0) {
+        if (sorter->next_row == sorter->row_count) {
+            return NULL;
+        }
+        return sorter->rows[sorter->next_row++].line;
+    }
+
+    if (sorter->head_count == 0) {
+        return NULL;
+    }
+    // Hand out the smallest head; its successor is read on the next call
+    free(sorter->merged_line);
+    MergeHead *head = &sorter->heads[0];
+    sorter->merged_line = head->line;
+    head->line = NULL;
+    head->line_capacity = 0;
+
+    if (!readMergeHead(sorter, head)) {
+        free(head->line);
+        free(head->key_text);
+        sorter->heads[0] = sorter->heads[--sorter->head_count];
+    }
+    if (sorter->head_count > 0) {
+        siftMergeHead(sorter, 0);
+    }
+    return sorter->merged_line;
+}
+
+void freeRowSorter(RowSorter *sorter) {
+    // Rows already handed out by the in-memory path are freed here too
+    for (size_t i = 0; i < sorter->row_count; i++) {
+        free(sorter->rows[i].line);
+    }
+    free(sorter->rows);
+    for (int i = 0; i < sorter->head_count; i++) {
+        free(sorter->heads[i].line);
+        free(sorter->heads[i].key_text);
+    }
+    free(sorter->heads);
+    free(sorter->merged_line);
+    for (int i = 0; i < sorter->run_count; i++) {
+        fclose(sorter->runs[i]);
+    }
+    free(sorter->runs);
+    memset(sorter, 0, sizeof(*sorter));
+}
+
+// Parse "column[:asc|:desc]" against the table schema
+int parseOrderBy(const char *order_by, const TableSchema *schema, int *column, int *descending) {
+    char name[128];
+    strncpy(name, order_by, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    *descending = 0;
+
+    char *direction = strchr(name, ':');
+    if (direction != NULL) {
+        *direction++ = '\0';
+        if (strcasecmp(direction, "desc") == 0) {
+            *descending = 1;
+        } else if (strcasecmp(direction, "asc") != 0) {
+            return 0;
+        }
+    }
+    *column = schemaColumnIndex(schema, name);
+    return *column >= 0;
+}
+
+// Write one comma-separated row as a JSON object keyed by column name
+void writeRowJson(JsonWriter *out, const TableSchema *schema, const char *line) {
+    json_char(out, '{');
+    const char *field = line;
+    for (int i = 0; i < schema->column_count; i++) {
+        const char *comma = field != NULL ? strchr(field, ',') : NULL;
+        size_t length = field == NULL ? 0 : comma != NULL ? (size_t)(comma - field) : strlen(field);
+
+        if (i > 0) json_char(out, ',');
+        json_key(out, schema->columns[i].name);
+        json_string_n(out, field != NULL ? field : "", length);
+        field = comma != NULL ? comma + 1 : NULL;
+    }
+    json_char(out, '}');
+}
+
+// Fetch a table's rows ordered by a column, optionally filtered on
+// check_field == check_value. Tables larger than sort_memory_limit are sorted
+// externally. Writes a JSON array, or returns 0 having written nothing if
+// the table is unknown or, with a message in error, the request is wrong.
+// Returns -1, with a message in error, if sorting failed, by when part of
+// the array may have been written.
+int fetchOrderedTableData(JsonWriter *out, const char *database_name, const char *table_name, const char *check_field, const char *check_value, const char *order_by, char *error, size_t error_size) {
+    TableSchema schema;
+    if (!loadTableSchema(database_name, table_name, &schema)) {
+        return 0;
+    }
+
+    int key_column = -1, descending = 0, check_index = -1;
+    if (!parseOrderBy(order_by, &schema, &key_column, &descending)) {
+        snprintf(error, error_size, "Unknown order_by '%s': expected a column, optionally followed by :asc or :desc", order_by);
+        return 0;
+    }
+    if (check_field != NULL) {
+        check_index = schemaColumnIndex(&schema, check_field);
+        if (check_index < 0) {
+            json_raw(out, "[]");
+            return 1;
+        }
+    }
+
+    TableCursor cursor;
+    if (!openTableCursor(&cursor, database_name, table_name)) {
+        return 0;
+    }
+    RowSorter sorter;
+    initRowSorter(&sorter, key_column, schema.columns[key_column].type, descending);
+    while (nextTableRow(&cursor)) {
+        if (check_index >= 0 && (check_index >= cursor.field_count || strcmp(cursor.fields[check_index], check_value) != 0)) {
+            continue;
+        }
+        if (!addSortRow(&sorter, cursor.fields, cursor.field_count)) {
+            break;
+        }
+    }
+    closeTableCursor(&cursor);
+    if (!finishRowSorter(&sorter)) {
+        freeRowSorter(&sorter);
+        snprintf(error, error_size, "Sorting failed: a temporary run file could not be written");
+        return -1;
+    }
+
+    json_char(out, '[');
+    const char *line;
+    int first = 1;
+    unsigned long returned = 0;
+    while ((line = nextSortedRow(&sorter)) != NULL) {
+        if (!first) json_char(out, ',');
+        writeRowJson(out, &schema, line);
+        first = 0;
+        returned++;
+        json_flush_point(out);
+    }
+    countMetric(METRIC_ROWS_RETURNED, returned);
+    if (sorter.failed) {
+        freeRowSorter(&sorter);
+        snprintf(error, error_size, "Sorting failed: a temporary run file could not be read back");
+        return -1;
+    }
+    json_char(out, ']');
+
+    freeRowSorter(&sorter);
+    return 1;
+}
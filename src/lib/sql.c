@@ -0,0 +1,585 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+// SQL subset accepted by POST /query:
+//
+//   SELECT * | item, ... FROM table [WHERE expr] [GROUP BY col, ...]
+//          [ORDER BY col [ASC|DESC]] [LIMIT n]
+//   INSERT INTO table [(col, ...)] VALUES (literal, ...), ...
+//   UPDATE table SET col = literal, ... [WHERE expr]
+//   DELETE FROM table [WHERE expr]
+//   CREATE INDEX ON table (col)
+//
+// where item is a column or COUNT(*), COUNT/SUM/MIN/MAX/AVG(col), and expr
+// combines col <op> literal comparisons with AND, OR, NOT and parentheses.
+// Any literal may be a ? placeholder, numbered left to right and bound to a
+// value each time a prepared statement is executed.
+
+#define SQL_NAME_SIZE 64
+#define MAX_INSERT_ROWS 1024
+#define MAX_PARAMETERS 64
+
+typedef enum {
+    TOKEN_END,
+    TOKEN_IDENT,
+    TOKEN_NUMBER,
+    TOKEN_STRING,
+    TOKEN_SYMBOL
+} TokenType;
+
+typedef struct {
+    TokenType type;
+    const char *start;
+    size_t length;
+} Token;
+
+typedef enum {
+    EXPR_COLUMN,
+    EXPR_LITERAL,
+    EXPR_COMPARE,
+    EXPR_AND,
+    EXPR_OR,
+    EXPR_NOT
+} ExprType;
+
+typedef enum {
+    CMP_EQ,
+    CMP_NE,
+    CMP_LT,
+    CMP_LE,
+    CMP_GT,
+    CMP_GE
+} CompareOp;
+
+// Literal text, or a reference to the nth ? placeholder
+typedef struct {
+    char *text;     // NULL for the NULL literal and for placeholders
+    int parameter;  // 1-based placeholder number, 0 for a constant
+} Literal;
+
+typedef struct Expr {
+    ExprType type;
+    CompareOp op;
+    char name[SQL_NAME_SIZE];  // EXPR_COLUMN
+    int column;                // Resolved by the planner
+    Literal literal;           // EXPR_LITERAL
+    Value value;               // Constant literal typed against the column it is compared with
+    struct Expr *left;
+    struct Expr *right;
+} Expr;
+
+typedef enum {
+    ITEM_COLUMN,
+    ITEM_AGGREGATE
+} SelectItemType;
+
+typedef struct {
+    SelectItemType type;
+    AggregateFunction function;
+    char column[SQL_NAME_SIZE];  // Empty for COUNT(*)
+} SelectItem;
+
+typedef enum {
+    STATEMENT_SELECT,
+    STATEMENT_INSERT,
+    STATEMENT_UPDATE,
+    STATEMENT_DELETE,
+    STATEMENT_CREATE_INDEX
+} StatementType;
+
+typedef struct {
+    StatementType type;
+    char table[SQL_NAME_SIZE];
+
+    // SELECT
+    int select_all;
+    SelectItem items[MAX_COLUMNS];
+    int item_count;
+    Expr *where;
+    char group_by[MAX_COLUMNS][SQL_NAME_SIZE];
+    int group_count;
+    char order_by[SQL_NAME_SIZE];
+    int order_descending;
+    long limit;  // -1 when absent
+
+    // INSERT, UPDATE and CREATE INDEX column lists
+    char columns[MAX_COLUMNS][SQL_NAME_SIZE];
+    int column_count;
+
+    // INSERT rows and UPDATE assignments (one row)
+    Literal *values;
+    int value_rows;
+
+    int parameter_count;
+} Statement;
+
+typedef struct {
+    const char *input;
+    const char *position;
+    Token token;
+    int parameter_count;
+    char error[256];
+} SqlParser;
+
+// Whether only whitespace follows p
+int onlySpaceAfter(const char *p) {
+    while (isspace((unsigned char)*p)) p++;
+    return *p == '\0';
+}
+
+void nextToken(SqlParser *parser) {
+    const char *p = parser->position;
+    while (isspace((unsigned char)*p)) p++;
+
+    Token *token = &parser->token;
+    token->start = p;
+    // A trailing ';' ends the statement; one with more after it is a symbol
+    // the parser will reject, since only one statement runs at a time
+    if (*p == '\0' || (*p == ';' && onlySpaceAfter(p + 1))) {
+        token->type = TOKEN_END;
+        token->length = 0;
+    } else if (isalpha((unsigned char)*p) || *p == '_') {
+        while (isalnum((unsigned char)*p) || *p == '_') p++;
+        token->type = TOKEN_IDENT;
+    } else if (isdigit((unsigned char)*p) || ((*p == '-' || *p == '.') && (isdigit((unsigned char)p[1]) || p[1] == '.'))) {
+        p++;
+        while (isdigit((unsigned char)*p) || *p == '.' || *p == 'e' || *p == 'E') p++;
+        token->type = TOKEN_NUMBER;
+    } else if (*p == '\'') {
+        // '' inside a string stands for one quote
+        p++;
+        while (*p && !(*p == '\'' && p[1] != '\'')) {
+            p += (*p == '\'') ? 2 : 1;
+        }
+        if (*p == '\'') p++;
+        token->type = TOKEN_STRING;
+    } else if ((p[0] == '<' && (p[1] == '=' || p[1] == '>')) || ((p[0] == '>' || p[0] == '!') && p[1] == '=')) {
+        p += 2;
+        token->type = TOKEN_SYMBOL;
+    } else {
+        p++;
+        token->type = TOKEN_SYMBOL;
+    }
+    token->length = p - token->start;
+    parser->position = p;
+}
+
+int tokenIs(const SqlParser *parser, const char *text) {
+    const Token *token = &parser->token;
+    return (token->type == TOKEN_IDENT || token->type == TOKEN_SYMBOL) &&
+           token->length == strlen(text) && strncasecmp(token->start, text, token->length) == 0;
+}
+
+int sqlError(SqlParser *parser, const char *message) {
+    if (parser->error[0] == '\0') {
+        snprintf(parser->error, sizeof(parser->error), "%s near '%.*s'", message,
+                 (int)(parser->token.length > 32 ? 32 : parser->token.length), parser->token.start);
+    }
+    return 0;
+}
+
+// Consume the current token if it matches
+int acceptToken(SqlParser *parser, const char *text) {
+    if (!tokenIs(parser, text)) {
+        return 0;
+    }
+    nextToken(parser);
+    return 1;
+}
+
+int expectToken(SqlParser *parser, const char *text) {
+    if (!tokenIs(parser, text)) {
+        char message[64];
+        snprintf(message, sizeof(message), "Expected %s", text);
+        return sqlError(parser, message);
+    }
+    nextToken(parser);
+    return 1;
+}
+
+int parseName(SqlParser *parser, char *name) {
+    if (parser->token.type != TOKEN_IDENT || parser->token.length >= SQL_NAME_SIZE) {
+        return sqlError(parser, "Expected a name");
+    }
+    memcpy(name, parser->token.start, parser->token.length);
+    name[parser->token.length] = '\0';
+    nextToken(parser);
+    return 1;
+}
+
+// Literal of the current token; NULL yields a NULL text
+int parseLiteral(SqlParser *parser, Literal *literal) {
+    Token *token = &parser->token;
+    literal->text = NULL;
+    literal->parameter = 0;
+    if (tokenIs(parser, "?")) {
+        if (parser->parameter_count == MAX_PARAMETERS) {
+            return sqlError(parser, "Too many parameters");
+        }
+        literal->parameter = ++parser->parameter_count;
+    } else if (token->type == TOKEN_NUMBER) {
+        literal->text = strndup(token->start, token->length);
+    } else if (token->type == TOKEN_STRING) {
+        if (token->length < 2 || token->start[token->length - 1] != '\'') {
+            return sqlError(parser, "Unterminated string");
+        }
+        char *value = malloc(token->length);
+        size_t length = 0;
+        for (size_t i = 1; i + 1 < token->length; i++) {
+            value[length++] = token->start[i];
+            if (token->start[i] == '\'') i++;
+        }
+        value[length] = '\0';
+        literal->text = value;
+    } else if (!tokenIs(parser, "NULL")) {
+        return sqlError(parser, "Expected a literal");
+    }
+    nextToken(parser);
+    return 1;
+}
+
+void freeExpr(Expr *expr) {
+    if (expr == NULL) {
+        return;
+    }
+    freeExpr(expr->left);
+    freeExpr(expr->right);
+    free(expr->literal.text);
+    free(expr);
+}
+
+Expr *parseOr(SqlParser *parser);
+
+Expr *parseComparison(SqlParser *parser) {
+    if (tokenIs(parser, "(")) {
+        nextToken(parser);
+        Expr *inner = parseOr(parser);
+        if (inner == NULL || !expectToken(parser, ")")) {
+            freeExpr(inner);
+            return NULL;
+        }
+        return inner;
+    }
+
+    Expr *column = calloc(1, sizeof(Expr));
+    column->type = EXPR_COLUMN;
+    if (!parseName(parser, column->name)) {
+        free(column);
+        return NULL;
+    }
+
+    static const char *operators[] = {"=", "!=", "<", "<=", ">", ">=", "<>"};
+    static const CompareOp ops[] = {CMP_EQ, CMP_NE, CMP_LT, CMP_LE, CMP_GT, CMP_GE, CMP_NE};
+    int op = -1;
+    for (int i = 0; i < 7; i++) {
+        if (tokenIs(parser, operators[i])) op = i;
+    }
+    if (op < 0) {
+        free(column);
+        sqlError(parser, "Expected a comparison operator");
+        return NULL;
+    }
+    nextToken(parser);
+
+    Expr *literal = calloc(1, sizeof(Expr));
+    literal->type = EXPR_LITERAL;
+    if (!parseLiteral(parser, &literal->literal)) {
+        free(column);
+        free(literal);
+        return NULL;
+    }
+
+    Expr *compare = calloc(1, sizeof(Expr));
+    compare->type = EXPR_COMPARE;
+    compare->op = ops[op];
+    compare->left = column;
+    compare->right = literal;
+    return compare;
+}
+
+Expr *parseNot(SqlParser *parser) {
+    if (tokenIs(parser, "NOT")) {
+        nextToken(parser);
+        Expr *operand = parseNot(parser);
+        if (operand == NULL) {
+            return NULL;
+        }
+        Expr *expr = calloc(1, sizeof(Expr));
+        expr->type = EXPR_NOT;
+        expr->left = operand;
+        return expr;
+    }
+    return parseComparison(parser);
+}
+
+Expr *parseBinary(SqlParser *parser, const char *keyword, ExprType type, Expr *(*operand)(SqlParser *)) {
+    Expr *left = operand(parser);
+    while (left != NULL && tokenIs(parser, keyword)) {
+        nextToken(parser);
+        Expr *right = operand(parser);
+        if (right == NULL) {
+            freeExpr(left);
+            return NULL;
+        }
+        Expr *expr = calloc(1, sizeof(Expr));
+        expr->type = type;
+        expr->left = left;
+        expr->right = right;
+        left = expr;
+    }
+    return left;
+}
+
+Expr *parseAnd(SqlParser *parser) {
+    return parseBinary(parser, "AND", EXPR_AND, parseNot);
+}
+
+Expr *parseOr(SqlParser *parser) {
+    return parseBinary(parser, "OR", EXPR_OR, parseAnd);
+}
+
+int parseWhere(SqlParser *parser, Statement *statement) {
+    if (!tokenIs(parser, "WHERE")) {
+        return 1;
+    }
+    nextToken(parser);
+    statement->where = parseOr(parser);
+    return statement->where != NULL;
+}
+
+int parseSelectItem(SqlParser *parser, SelectItem *item) {
+    static const char *functions[] = {"COUNT", "SUM", "MIN", "MAX", "AVG"};
+    static const AggregateFunction codes[] = {AGG_COUNT, AGG_SUM, AGG_MIN, AGG_MAX, AGG_AVG};
+
+    for (int i = 0; i < 5; i++) {
+        if (!tokenIs(parser, functions[i])) {
+            continue;
+        }
+        // A column may share its name with a function, so look for '('
+        const char *after = parser->position;
+        while (isspace((unsigned char)*after)) after++;
+        if (*after != '(') {
+            break;
+        }
+        item->type = ITEM_AGGREGATE;
+        item->function = codes[i];
+        nextToken(parser);
+        nextToken(parser);
+        if (tokenIs(parser, "*")) {
+            if (codes[i] != AGG_COUNT) {
+                return sqlError(parser, "Only COUNT accepts *");
+            }
+            item->column[0] = '\0';
+            nextToken(parser);
+        } else if (!parseName(parser, item->column)) {
+            return 0;
+        }
+        return expectToken(parser, ")");
+    }
+    item->type = ITEM_COLUMN;
+    return parseName(parser, item->column);
+}
+
+int parseNameList(SqlParser *parser, char names[][SQL_NAME_SIZE], int *count) {
+    do {
+        if (*count == MAX_COLUMNS) {
+            return sqlError(parser, "Too many columns");
+        }
+        if (!parseName(parser, names[(*count)++])) {
+            return 0;
+        }
+    } while (acceptToken(parser, ","));
+    return 1;
+}
+
+int parseSelect(SqlParser *parser, Statement *statement) {
+    statement->type = STATEMENT_SELECT;
+    statement->limit = -1;
+    nextToken(parser);
+
+    if (tokenIs(parser, "*")) {
+        statement->select_all = 1;
+        nextToken(parser);
+    } else {
+        do {
+            if (statement->item_count == MAX_COLUMNS) {
+                return sqlError(parser, "Too many select items");
+            }
+            if (!parseSelectItem(parser, &statement->items[statement->item_count++])) {
+                return 0;
+            }
+        } while (acceptToken(parser, ","));
+    }
+
+    if (!expectToken(parser, "FROM") || !parseName(parser, statement->table) || !parseWhere(parser, statement)) {
+        return 0;
+    }
+    if (tokenIs(parser, "GROUP")) {
+        nextToken(parser);
+        if (!expectToken(parser, "BY") || !parseNameList(parser, statement->group_by, &statement->group_count)) {
+            return 0;
+        }
+    }
+    if (tokenIs(parser, "ORDER")) {
+        nextToken(parser);
+        if (!expectToken(parser, "BY") || !parseName(parser, statement->order_by)) {
+            return 0;
+        }
+        if (tokenIs(parser, "DESC")) {
+            statement->order_descending = 1;
+            nextToken(parser);
+        } else if (tokenIs(parser, "ASC")) {
+            nextToken(parser);
+        }
+    }
+    if (tokenIs(parser, "LIMIT")) {
+        nextToken(parser);
+        if (parser->token.type != TOKEN_NUMBER) {
+            return sqlError(parser, "Expected a row count");
+        }
+        statement->limit = strtol(parser->token.start, NULL, 10);
+        nextToken(parser);
+    }
+    return 1;
+}
+
+int parseInsert(SqlParser *parser, Statement *statement) {
+    statement->type = STATEMENT_INSERT;
+    nextToken(parser);
+    if (!expectToken(parser, "INTO") || !parseName(parser, statement->table)) {
+        return 0;
+    }
+    if (tokenIs(parser, "(")) {
+        nextToken(parser);
+        if (!parseNameList(parser, statement->columns, &statement->column_count) || !expectToken(parser, ")")) {
+            return 0;
+        }
+    }
+    if (!expectToken(parser, "VALUES")) {
+        return 0;
+    }
+
+    // Rows are stored as value_rows x MAX_COLUMNS literals
+    do {
+        if (statement->value_rows == MAX_INSERT_ROWS) {
+            return sqlError(parser, "Too many rows");
+        }
+        statement->values = realloc(statement->values, (statement->value_rows + 1) * MAX_COLUMNS * sizeof(Literal));
+        Literal *row = statement->values + statement->value_rows++ * MAX_COLUMNS;
+        memset(row, 0, MAX_COLUMNS * sizeof(Literal));
+        if (!expectToken(parser, "(")) {
+            return 0;
+        }
+        int count = 0;
+        do {
+            if (count == MAX_COLUMNS) {
+                return sqlError(parser, "Too many values");
+            }
+            if (!parseLiteral(parser, &row[count++])) {
+                return 0;
+            }
+        } while (acceptToken(parser, ","));
+        if (!expectToken(parser, ")")) {
+            return 0;
+        }
+        if (statement->column_count > 0 && count != statement->column_count) {
+            return sqlError(parser, "Value count does not match column count");
+        }
+    } while (acceptToken(parser, ","));
+    return 1;
+}
+
+int parseUpdate(SqlParser *parser, Statement *statement) {
+    statement->type = STATEMENT_UPDATE;
+    nextToken(parser);
+    if (!parseName(parser, statement->table) || !expectToken(parser, "SET")) {
+        return 0;
+    }
+    statement->values = calloc(MAX_COLUMNS, sizeof(Literal));
+    statement->value_rows = 1;
+    do {
+        if (statement->column_count == MAX_COLUMNS) {
+            return sqlError(parser, "Too many assignments");
+        }
+        if (!parseName(parser, statement->columns[statement->column_count]) || !expectToken(parser, "=") ||
+            !parseLiteral(parser, &statement->values[statement->column_count])) {
+            return 0;
+        }
+        statement->column_count++;
+    } while (acceptToken(parser, ","));
+    return parseWhere(parser, statement);
+}
+
+int parseDelete(SqlParser *parser, Statement *statement) {
+    statement->type = STATEMENT_DELETE;
+    nextToken(parser);
+    if (!expectToken(parser, "FROM") || !parseName(parser, statement->table)) {
+        return 0;
+    }
+    return parseWhere(parser, statement);
+}
+
+int parseCreateIndex(SqlParser *parser, Statement *statement) {
+    statement->type = STATEMENT_CREATE_INDEX;
+    nextToken(parser);
+    if (!expectToken(parser, "INDEX")) {
+        return 0;
+    }
+    // An index name is accepted for familiarity but indexes are keyed by column
+    if (!tokenIs(parser, "ON")) {
+        char ignored[SQL_NAME_SIZE];
+        if (!parseName(parser, ignored)) {
+            return 0;
+        }
+    }
+    if (!expectToken(parser, "ON") || !parseName(parser, statement->table) || !expectToken(parser, "(") ||
+        !parseName(parser, statement->columns[0]) || !expectToken(parser, ")")) {
+        return 0;
+    }
+    statement->column_count = 1;
+    return 1;
+}
+
+void freeStatement(Statement *statement) {
+    if (statement == NULL) {
+        return;
+    }
+    freeExpr(statement->where);
+    for (int i = 0; i < statement->value_rows * MAX_COLUMNS; i++) {
+        free(statement->values[i].text);
+    }
+    free(statement->values);
+    free(statement);
+}
+
+// Parse one SQL statement. On failure returns NULL and fills error.
+Statement *parseStatement(const char *sql, char *error, size_t error_size) {
+    SqlParser parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.input = sql;
+    parser.position = sql;
+    nextToken(&parser);
+
+    Statement *statement = calloc(1, sizeof(Statement));
+    int parsed;
+    if (tokenIs(&parser, "SELECT")) parsed = parseSelect(&parser, statement);
+    else if (tokenIs(&parser, "INSERT")) parsed = parseInsert(&parser, statement);
+    else if (tokenIs(&parser, "UPDATE")) parsed = parseUpdate(&parser, statement);
+    else if (tokenIs(&parser, "DELETE")) parsed = parseDelete(&parser, statement);
+    else if (tokenIs(&parser, "CREATE")) parsed = parseCreateIndex(&parser, statement);
+    else parsed = sqlError(&parser, "Unsupported statement");
+
+    if (parsed && parser.token.type != TOKEN_END) {
+        parsed = sqlError(&parser, "Unexpected input");
+    }
+    if (!parsed) {
+        snprintf(error, error_size, "%s", parser.error);
+        freeStatement(statement);
+        return NULL;
+    }
+    statement->parameter_count = parser.parameter_count;
+    return statement;
+}
@@ -0,0 +1,215 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring driver over the raw system calls. A ring is used by one
+// thread only: the network thread has one for the event loop and every
+// thread that scans tables gets its own for read-ahead. Anything the ring
+// cannot do, or a kernel without io_uring, falls back to the plain calls.
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned entries;
+    unsigned queued;  // Entries filled in since the last submit
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Uring;
+
+int io_uring_enabled = 0;  // Set by "io_uring=1" once a ring is known to work
+
+int uringSetup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int uringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+void uringRelease(Uring *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Set up a ring with room for entries submissions. The kernel must map both
+// rings at once and take a timeout with a wait (5.11 or later); returns 0
+// when it does not.
+int uringInit(Uring *ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = uringSetup(entries, &params);
+    if (ring->fd < 0) {
+        return 0;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        uringRelease(ring);
+        return 0;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;  // One mapping serves both
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        uringRelease(ring);
+        return 0;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(sq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(sq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(sq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(sq + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    return 1;
+}
+
+// Whether this kernel, and whatever sandbox the server runs in, lets us use
+// io_uring at all
+int uringSupported(void) {
+    Uring ring;
+    if (!uringInit(&ring, 4)) {
+        return 0;
+    }
+    uringRelease(&ring);
+    return 1;
+}
+
+// Hand the queued entries to the kernel and, with wait set, block until a
+// completion is ready or timeout_ms passes (-1 for no limit)
+int uringSubmit(Uring *ring, int wait, int timeout_ms) {
+    unsigned flags = 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec timeout;
+    void *argp = NULL;
+    size_t arg_size = 0;
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        memset(&arg, 0, sizeof(arg));
+        if (timeout_ms >= 0) {
+            timeout.tv_sec = timeout_ms / 1000;
+            timeout.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            arg.ts = (unsigned long long)(uintptr_t)&timeout;
+        }
+        argp = &arg;
+        arg_size = sizeof(arg);
+    }
+    while (1) {
+        int submitted = uringEnter(ring->fd, ring->queued, wait ? 1 : 0, flags, argp, arg_size);
+        if (submitted >= 0) {
+            ring->queued -= (unsigned)submitted < ring->queued ? (unsigned)submitted : ring->queued;
+            return submitted;
+        }
+        if (errno == ETIME) {
+            ring->queued = 0;  // The entries went in; only the wait ran out
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// The next free submission entry, cleared; the queue is flushed to the
+// kernel first when it is full
+struct io_uring_sqe *uringEntry(Uring *ring) {
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries) {
+        uringSubmit(ring, 0, 0);
+        if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->entries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return sqe;
+}
+
+// The oldest unseen completion, or NULL if there is none yet
+struct io_uring_cqe *uringCompletion(Uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uringSeen(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Queue a read of length bytes at offset into buffer; the completion carries
+// user_data
+int uringQueueRead(Uring *ring, int fd, void *buffer, size_t length, off_t offset, unsigned long long user_data) {
+    struct io_uring_sqe *sqe = uringEntry(ring);
+    if (sqe == NULL) {
+        return 0;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)buffer;
+    sqe->len = (unsigned)length;
+    sqe->off = (unsigned long long)offset;
+    sqe->user_data = user_data;
+    return 1;
+}
+
+// Queue a one-shot readiness watch on fd for the poll events in mask
+int uringQueuePoll(Uring *ring, int fd, unsigned mask, unsigned long long user_data) {
+    struct io_uring_sqe *sqe = uringEntry(ring);
+    if (sqe == NULL) {
+        return 0;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = mask;
+    sqe->user_data = user_data;
+    return 1;
+}
+
+// Queue the cancellation of the watch queued with user_data
+int uringQueuePollRemove(Uring *ring, unsigned long long user_data) {
+    struct io_uring_sqe *sqe = uringEntry(ring);
+    if (sqe == NULL) {
+        return 0;
+    }
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = 0;  // Its own completion is of no interest
+    return 1;
+}
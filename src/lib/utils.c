@@ -4,6 +4,7 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include "constants.c"
 
@@ -69,12 +70,105 @@ int create_directory(const char *dir_name) {
     return 0; // Return 0 on success
 }
 
-char* concat(const char* str1, const char* str2){
-    char* result;
-    asprintf(&result, "%s%s", str1, str2);
+// Bump-pointer allocator for memory that only lives as long as one request.
+// Allocations are never freed one by one; arena_reset drops them all at once
+// and keeps the first block for the next request. The helpers below take an
+// arena and fall back to malloc when it is NULL, in which case the caller
+// frees the result as before.
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock *blocks;  // Newest first
+} Arena;
+
+#define ARENA_BLOCK_SIZE (16 * 1024)
+#define ARENA_ALIGNMENT 16
+
+// Allocations this thread has asked for, from arenas or by growing a
+// JsonWriter; a request's share is the difference across it
+__thread unsigned long thread_allocations = 0;
+
+void *arena_alloc(Arena *arena, size_t size) {
+    thread_allocations++;
+    if (arena == NULL) {
+        return malloc(size);
+    }
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    ArenaBlock *block = arena->blocks;
+    if (block == NULL || block->used + size > block->size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        block->size = block_size;
+        block->used = 0;
+        // Keep the partly used block in front when the new one is a one-off
+        // for a single large allocation
+        if (arena->blocks != NULL && size > ARENA_BLOCK_SIZE) {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+    void *memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
+
+char *arena_strndup(Arena *arena, const char *str, size_t length) {
+    char *copy = arena_alloc(arena, length + 1);
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+char *arena_strdup(Arena *arena, const char *str) {
+    return arena_strndup(arena, str, strlen(str));
+}
+
+char *arena_printf(Arena *arena, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    char *result = arena_alloc(arena, length + 1);
+    va_start(args, format);
+    vsnprintf(result, length + 1, format, args);
+    va_end(args);
     return result;
 }
 
+// Drop everything allocated so far, keeping one block for reuse
+void arena_reset(Arena *arena) {
+    ArenaBlock *block = arena->blocks;
+    if (block == NULL) {
+        return;
+    }
+    while (block->next != NULL) {
+        ArenaBlock *next = block->next;
+        block->next = next->next;
+        free(next);
+    }
+    block->used = 0;
+}
+
+void arena_release(Arena *arena) {
+    while (arena->blocks != NULL) {
+        ArenaBlock *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
+
+char* concat(Arena *arena, const char* str1, const char* str2){
+    return arena_printf(arena, "%s%s", str1, str2);
+}
+
 // Function to trim leading and trailing whitespaces
 char* trim(char* str) {
     char* end;
@@ -117,7 +211,7 @@ void trim_newlines(char* str) {
     }
 }
 
-char *replaceString(const char *str, const char *oldWord, const char *newWord) {
+char *replaceString(Arena *arena, const char *str, const char *oldWord, const char *newWord) {
     char *result;
     int i, count = 0;
     int newWordLen = strlen(newWord);
@@ -132,7 +226,7 @@ char *replaceString(const char *str, const char *oldWord, const char *newWord) {
     }
 
     // Allocate memory for the new string
-    result = (char *)malloc(i + count * (newWordLen - oldWordLen) + 1);
+    result = (char *)arena_alloc(arena, i + count * (newWordLen - oldWordLen) + 1);
 
     if (result == NULL) {
         printf("Memory allocation failed.\n");
@@ -155,139 +249,90 @@ char *replaceString(const char *str, const char *oldWord, const char *newWord) {
     return result;
 }
 
-char **split_string(const char* str, const char* delimiter, int* count) {
+char **split_string(Arena *arena, const char* str, const char* delimiter, int* count) {
+    *count = 0;
+    if (str == NULL) {
+        return NULL;
+    }
     // Make a copy of the input string since strtok modifies the string
-    char* str_copy = strdup(str);
+    char* str_copy = arena_strdup(arena, str);
 
     // Count how many tokens we will get
-    *count = 0;
-    char* temp = strdup(str);
-    char* token = strtok(temp, delimiter);
-    while (token != NULL) {
+    for (const char *p = str; *p; ) {
+        p += strspn(p, delimiter);
+        if (*p == '\0') {
+            break;
+        }
         (*count)++;
-        token = strtok(NULL, delimiter);
+        p += strcspn(p, delimiter);
     }
-    free(temp);
 
-    // Allocate memory for storing the tokens
-    char** tokens = (char**)malloc((*count) * sizeof(char*));
+    // Allocate memory for storing the tokens, with room for a NULL after the
+    // last one so callers may look one past the end
+    char** tokens = (char**)arena_alloc(arena, (*count + 1) * sizeof(char*));
     if (tokens == NULL) {
-        free(str_copy);
         return NULL; // Memory allocation failed
     }
 
-    // Split the string and store the tokens
+    // Split the string and store the tokens. With an arena they point into
+    // its copy of the string; without one each token is its own allocation.
     int index = 0;
-    token = strtok(str_copy, delimiter);
+    char *save = NULL;
+    char *token = strtok_r(str_copy, delimiter, &save);
     while (token != NULL) {
-        tokens[index++] = strdup(token); // Duplicate token for safe storage
-        token = strtok(NULL, delimiter);
+        tokens[index++] = arena != NULL ? token : strdup(token);
+        token = strtok_r(NULL, delimiter, &save);
     }
+    tokens[index] = NULL;
 
-    free(str_copy); // Free the copy of the original string
+    if (arena == NULL) {
+        free(str_copy);
+    }
 
     return tokens;
 }
 
-// Function to map fields to values and return JSON
-char* map_fields_to_json(const char* fields, const char* values) {
-    int fieldCount = 0, lineCount = 0;
-
-    // Split fields
-    char** fieldTokens = split_string(trim(fields), ",", &fieldCount);
-    // Split values by newline to get multiple lines
-    char** valueTokens = split_string(trim(values), "\n", &lineCount);
-
-    // Check if the first line has the same number of values as fields
-    int countMatcher = 0;
-    split_string(valueTokens[0], ",", &countMatcher);
-
-    // Check if field and value counts match
-    if (fieldCount != countMatcher) {
-        printf("Field and value counts do not match.\n");
-        // Free allocated memory
-        for (int i = 0; i < fieldCount; i++) {
-            free(fieldTokens[i]);
-        }
-        free(fieldTokens);
-        free(valueTokens);
-        return NULL;
-    }
-
-    // Start building the JSON string
-    char* jsonResult = strdup("[");
+// Byte range of one field within a line
+typedef struct {
+    size_t offset;
+    size_t length;
+} FieldSpan;
 
-    for (int i = 0; i < lineCount; i++) {
-        int valueCount = 0;
-        char** lineValue = split_string(trim(valueTokens[i]), ",", &valueCount);
-
-        // Check if the lineValue count matches fieldCount
-        if (valueCount != fieldCount) {
-            printf("Field count and value count do not match for line %d.\n", i);
-            for (int j = 0; j < valueCount; j++) {
-                free(lineValue[j]);
-            }
-            free(lineValue);
-            continue; // Skip this line if it doesn't match
-        }
-
-        // Start building the JSON object for the current line
-        char* jsonLine = strdup("{");
-        for (int j = 0; j < fieldCount; j++) {
-            // Create JSON key-value pair
-            char* key = trim(fieldTokens[j]);
-            char* value = trim(lineValue[j]);
-
-            // Append key and value to JSON line
-            char* jsonPair = concat(concat("\"", key), "\":\"");
-            jsonPair = concat(jsonPair, value);
-            jsonPair = concat(jsonPair, "\"");
-
-            // Append to result JSON line
-            jsonLine = concat(concat(jsonLine, jsonPair), (j == fieldCount - 1) ? "" : ",");
-
-            // Free temporary JSON pair
-            free(jsonPair);
-        }
-
-        // Close JSON object
-        jsonLine = concat(jsonLine, "}");
-
-        // Append the JSON object to the result
-        jsonResult = concat(concat(jsonResult, jsonLine), (i == lineCount - 1) ? "" : ",");
-
-        // Free allocated memory for the line JSON
-        free(jsonLine);
-
-        // Free line values
-        for (int j = 0; j < valueCount; j++) {
-            free(lineValue[j]);
+// Split a line at each delimiter without copying or allocating. Unlike
+// split_string, empty fields are kept. Returns the field count; once
+// max_fields is reached the last span runs to the end of the line.
+int tokenize_line(const char *line, size_t length, char delimiter, FieldSpan *spans, int max_fields) {
+    int count = 0;
+    size_t start = 0;
+    while (count < max_fields - 1) {
+        const char *found = memchr(line + start, delimiter, length - start);
+        if (found == NULL) {
+            break;
         }
-        free(lineValue);
+        spans[count].offset = start;
+        spans[count].length = found - line - start;
+        count++;
+        start = found - line + 1;
     }
-    // Close JSON array
-    jsonResult = concat(jsonResult, "]");
+    spans[count].offset = start;
+    spans[count].length = length - start;
+    return count + 1;
+}
 
-    // Free allocated memory for tokens
-    for (int i = 0; i < fieldCount; i++) {
-        free(fieldTokens[i]);
+// Narrow a span to exclude surrounding whitespace
+FieldSpan trim_span(const char *line, FieldSpan span) {
+    while (span.length > 0 && isspace((unsigned char)line[span.offset])) {
+        span.offset++;
+        span.length--;
     }
-    free(fieldTokens);
-
-    for (int i = 0; i < lineCount; i++) {
-        free(valueTokens[i]);
+    while (span.length > 0 && isspace((unsigned char)line[span.offset + span.length - 1])) {
+        span.length--;
     }
-    free(valueTokens);
-
-    return jsonResult;
+    return span;
 }
 
-
-char* database_path(char* filename) {
-    char* path = concat(DB_DIRECTORY, "/");
-    path = concat(path, filename);
-    path = concat(path, ".db");
-    return path;
+char* database_path(Arena *arena, const char* filename) {
+    return arena_printf(arena, "%s/%s.db", DB_DIRECTORY, filename);
 }
 
 // Function to count the number of words in a line
@@ -384,59 +429,485 @@ void initialize(){
     }
 }
 
-// Function to extract a value from a JSON string by key
-char *extract_json_value(const char *json, const char *key) {
-    char *start = NULL;
-    char *end = NULL;
-    char *value = NULL;
+// Request bodies are parsed once into a flat index of the top-level keys.
+// The body is copied into the request arena and every key and value is
+// NUL-terminated in place in that copy, so looking a key up never allocates
+// and unescaped strings are never copied again. String values with escapes
+// are decoded in place (decoding only ever shortens them); arrays, objects
+// and other scalars keep their JSON text.
+#define JSON_MAX_FIELDS 32
+#define JSON_MAX_DEPTH 32
+
+typedef enum {
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_BOOLEAN,
+    JSON_NULL,
+    JSON_ARRAY,
+    JSON_OBJECT
+} JsonType;
+
+typedef struct {
+    char *key;
+    JsonType type;
+    char *text;
+    size_t length;
+} JsonField;
+
+typedef struct {
+    JsonField fields[JSON_MAX_FIELDS];
+    int count;
+    int valid;  // The body was a well-formed JSON object
+} JsonRequest;
+
+void skip_json_space(char **p) {
+    while (**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r') {
+        (*p)++;
+    }
+}
 
-    // Create a key string to search for (including the quotes and colon)
-    char search_key[256];
-    snprintf(search_key, sizeof(search_key), "\"%s\"", key);
+int is_hex_digit(char c) {
+    return isxdigit((unsigned char)c) != 0;
+}
 
-    // Find the key in the JSON string
-    start = strstr(json, search_key);
-    if (!start) {
-        return NULL; // Key not found
+// Step over a string starting at its opening quote
+int scan_json_string(char **p) {
+    char *s = *p + 1;
+    while (*s != '"') {
+        if ((unsigned char)*s < 0x20) {
+            return 0;  // Unterminated, or a raw control character
+        }
+        if (*s == '\\') {
+            s++;
+            if (*s == 'u') {
+                if (!is_hex_digit(s[1]) || !is_hex_digit(s[2]) || !is_hex_digit(s[3]) || !is_hex_digit(s[4])) {
+                    return 0;
+                }
+                s += 4;
+            } else if (strchr("\"\\/bfnrt", *s) == NULL || *s == '\0') {
+                return 0;
+            }
+        }
+        s++;
     }
+    *p = s + 1;
+    return 1;
+}
 
-    // Move to the colon after the key
-    start = strchr(start, ':');
-    if (!start) {
-        return NULL; // Malformed JSON (no colon found)
+int scan_json_number(char **p) {
+    char *s = *p;
+    if (*s == '-') s++;
+    if (*s == '0') {
+        s++;
+    } else if (isdigit((unsigned char)*s)) {
+        while (isdigit((unsigned char)*s)) s++;
+    } else {
+        return 0;
+    }
+    if (*s == '.') {
+        s++;
+        if (!isdigit((unsigned char)*s)) return 0;
+        while (isdigit((unsigned char)*s)) s++;
     }
-    start++; // Move past the colon
+    if (*s == 'e' || *s == 'E') {
+        s++;
+        if (*s == '+' || *s == '-') s++;
+        if (!isdigit((unsigned char)*s)) return 0;
+        while (isdigit((unsigned char)*s)) s++;
+    }
+    *p = s;
+    return 1;
+}
 
-    // Skip any whitespace characters
-    while (*start == ' ' || *start == '\t' || *start == '\n') {
-        start++;
+// Step over any value, checking it is well formed
+int scan_json_value(char **p, JsonType *type, int depth) {
+    if (depth > JSON_MAX_DEPTH) {
+        return 0;
+    }
+    char *s = *p;
+    switch (*s) {
+        case '"':
+            *type = JSON_STRING;
+            return scan_json_string(p);
+        case '{':
+        case '[': {
+            char close = *s == '{' ? '}' : ']';
+            *type = *s == '{' ? JSON_OBJECT : JSON_ARRAY;
+            s++;
+            skip_json_space(&s);
+            if (*s == close) {
+                *p = s + 1;
+                return 1;
+            }
+            while (1) {
+                JsonType item_type;
+                if (close == '}') {
+                    if (*s != '"' || !scan_json_string(&s)) return 0;
+                    skip_json_space(&s);
+                    if (*s++ != ':') return 0;
+                    skip_json_space(&s);
+                }
+                if (!scan_json_value(&s, &item_type, depth + 1)) return 0;
+                skip_json_space(&s);
+                if (*s == close) {
+                    *p = s + 1;
+                    return 1;
+                }
+                if (*s++ != ',') return 0;
+                skip_json_space(&s);
+            }
+        }
+        case 't':
+        case 'f':
+            *type = JSON_BOOLEAN;
+            if (strncmp(s, "true", 4) == 0) { *p = s + 4; return 1; }
+            if (strncmp(s, "false", 5) == 0) { *p = s + 5; return 1; }
+            return 0;
+        case 'n':
+            *type = JSON_NULL;
+            if (strncmp(s, "null", 4) == 0) { *p = s + 4; return 1; }
+            return 0;
+        default:
+            *type = JSON_NUMBER;
+            return scan_json_number(p);
+    }
+}
+
+size_t encode_utf8(unsigned long code, char *out) {
+    if (code < 0x80) {
+        out[0] = (char)code;
+        return 1;
+    }
+    if (code < 0x800) {
+        out[0] = (char)(0xC0 | code >> 6);
+        out[1] = (char)(0x80 | (code & 0x3F));
+        return 2;
+    }
+    if (code < 0x10000) {
+        out[0] = (char)(0xE0 | code >> 12);
+        out[1] = (char)(0x80 | (code >> 6 & 0x3F));
+        out[2] = (char)(0x80 | (code & 0x3F));
+        return 3;
     }
+    out[0] = (char)(0xF0 | code >> 18);
+    out[1] = (char)(0x80 | (code >> 12 & 0x3F));
+    out[2] = (char)(0x80 | (code >> 6 & 0x3F));
+    out[3] = (char)(0x80 | (code & 0x3F));
+    return 4;
+}
 
-    // Check if the value is a string (starts with a quote)
-    if (*start == '\"') {
-        start++; // Skip the opening quote
-        end = strchr(start, '\"'); // Find the closing quote
-        if (!end) {
-            return NULL; // No closing quote found
+// Decode the escapes of a scanned string in place. Returns the new length.
+size_t unescape_json_string(char *str, size_t length) {
+    char *in = memchr(str, '\\', length);
+    if (in == NULL) {
+        return length;
+    }
+    char *end = str + length;
+    char *out = in;
+    while (in < end) {
+        if (*in != '\\') {
+            *out++ = *in++;
+            continue;
         }
-    } else {
-        // If not a string, find the next comma or closing brace
-        end = strpbrk(start, ",}");
-        if (!end) {
-            return NULL; // No valid delimiter found
+        in++;
+        switch (*in++) {
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u': {
+                unsigned long code = strtoul((char[]){in[0], in[1], in[2], in[3], '\0'}, NULL, 16);
+                in += 4;
+                // A surrogate pair spells one code point outside the BMP
+                if (code >= 0xD800 && code < 0xDC00 && in + 6 <= end && in[0] == '\\' && in[1] == 'u') {
+                    unsigned long low = strtoul((char[]){in[2], in[3], in[4], in[5], '\0'}, NULL, 16);
+                    if (low >= 0xDC00 && low < 0xE000) {
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        in += 6;
+                    }
+                }
+                out += encode_utf8(code, out);
+                break;
+            }
+            default: *out++ = in[-1];  // \" \\ and \/
         }
     }
+    return out - str;
+}
 
-    // Allocate memory for the extracted value
-    size_t value_length = end - start;
-    value = (char *)malloc(value_length + 1);
-    if (!value) {
-        return NULL; // Memory allocation failed
+// Parse a request body that must be a JSON object. Returns 0 if it is not
+// valid JSON; request->count is then 0 and every lookup misses. Members
+// past JSON_MAX_FIELDS are validated but not indexed.
+int parse_json_request(Arena *arena, const char *body, JsonRequest *request) {
+    request->count = 0;
+    request->valid = 0;
+    char *copy = arena_strdup(arena, body);
+    char *p = copy;
+    skip_json_space(&p);
+    char *start = p;
+    JsonType type;
+    if (*p != '{' || !scan_json_value(&p, &type, 0)) {
+        return 0;
+    }
+    skip_json_space(&p);
+    if (*p != '\0') {
+        return 0;
+    }
+
+    // The object is known to be well formed, so walk its members again to
+    // record their spans. Terminators are only written once every span is
+    // known, since each one lands on the delimiter that follows a span.
+    char *key_ends[JSON_MAX_FIELDS];
+    char *value_ends[JSON_MAX_FIELDS];
+    p = start + 1;
+    skip_json_space(&p);
+    while (*p == '"' && request->count < JSON_MAX_FIELDS) {
+        JsonField *field = &request->fields[request->count];
+        field->key = p + 1;
+        scan_json_string(&p);
+        key_ends[request->count] = p - 1;
+        skip_json_space(&p);
+        p++;  // ':'
+        skip_json_space(&p);
+        char *value = p;
+        scan_json_value(&p, &field->type, 0);
+        if (field->type == JSON_STRING) {
+            field->text = value + 1;
+            value_ends[request->count] = p - 1;
+        } else {
+            field->text = value;
+            value_ends[request->count] = p;
+        }
+        request->count++;
+        skip_json_space(&p);
+        if (*p == ',') p++;
+        skip_json_space(&p);
+    }
+
+    for (int i = 0; i < request->count; i++) {
+        JsonField *field = &request->fields[i];
+        *key_ends[i] = '\0';
+        *value_ends[i] = '\0';
+        field->length = value_ends[i] - field->text;
+        field->key[unescape_json_string(field->key, key_ends[i] - field->key)] = '\0';
+        if (field->type == JSON_STRING) {
+            field->length = unescape_json_string(field->text, field->length);
+            field->text[field->length] = '\0';
+        }
+    }
+    request->valid = 1;
+    return 1;
+}
+
+const JsonField *json_field(const JsonRequest *request, const char *key) {
+    for (int i = 0; i < request->count; i++) {
+        if (strcmp(request->fields[i].key, key) == 0) {
+            return &request->fields[i];
+        }
+    }
+    return NULL;
+}
+
+// Text of a top-level value: decoded for strings, JSON text otherwise.
+// NULL when the key is absent or the value is null.
+char *json_value(const JsonRequest *request, const char *key) {
+    const JsonField *field = json_field(request, key);
+    return field != NULL && field->type != JSON_NULL ? field->text : NULL;
+}
+
+// The items of an array value as decoded strings (NULL for null items), or
+// NULL with *count 0 if the value is not an array
+char **json_array_items(Arena *arena, const JsonField *field, int *count) {
+    *count = 0;
+    if (field == NULL || field->type != JSON_ARRAY) {
+        return NULL;
+    }
+    char *text = arena_strndup(arena, field->text, field->length);
+    char **items = arena_alloc(arena, (field->length / 2 + 1) * sizeof(char *));
+    char *p = text + 1;
+    skip_json_space(&p);
+    while (*p != ']') {
+        char *value = p;
+        JsonType type;
+        scan_json_value(&p, &type, 0);
+        char *end = p;
+        skip_json_space(&p);
+        char delimiter = *p;
+        if (type == JSON_STRING) {
+            value[0] = '\0';
+            value++;
+            end[-1] = '\0';
+            value[unescape_json_string(value, end - 1 - value)] = '\0';
+            items[(*count)++] = value;
+        } else {
+            *end = '\0';
+            items[(*count)++] = type == JSON_NULL ? NULL : value;
+        }
+        if (delimiter == ']') {
+            break;
+        }
+        p++;  // ','
+        skip_json_space(&p);
+    }
+    items[*count] = NULL;
+    return items;
+}
+
+// FNV-1a hash of a byte range
+unsigned long hash_bytes(const char *data, size_t length) {
+    unsigned long hash = 14695981039346656037UL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+// Growable output buffer for building JSON in a single pass. Appends are
+// amortised constant time and strings are escaped as they are copied in, so
+// a response is never re-scanned or re-copied while it is being built.
+// A writer may also stream: with flush set, json_flush_point hands the
+// buffer to it whenever flush_at bytes have built up, and flush empties it.
+typedef struct JsonWriter {
+    char *data;
+    size_t length;
+    size_t capacity;
+    void (*flush)(struct JsonWriter *writer);
+    size_t flush_at;
+    void *context;
+} JsonWriter;
+
+#define JSON_WRITER_INITIAL_CAPACITY 256
+
+void json_init(JsonWriter *writer) {
+    writer->data = NULL;
+    writer->length = 0;
+    writer->capacity = 0;
+    writer->flush = NULL;
+    writer->flush_at = 0;
+    writer->context = NULL;
+}
+
+// Called between rows by anything writing a long array, so that a streaming
+// writer never holds much more than flush_at bytes
+void json_flush_point(JsonWriter *writer) {
+    if (writer->flush != NULL && writer->length >= writer->flush_at) {
+        writer->flush(writer);
+    }
+}
+
+// Make room for extra more bytes plus the terminating NUL
+void json_reserve(JsonWriter *writer, size_t extra) {
+    size_t needed = writer->length + extra + 1;
+    if (needed <= writer->capacity) {
+        return;
+    }
+    size_t capacity = writer->capacity ? writer->capacity : JSON_WRITER_INITIAL_CAPACITY;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    thread_allocations++;
+    writer->data = realloc(writer->data, capacity);
+    writer->capacity = capacity;
+}
+
+// Append bytes that are already valid JSON
+void json_raw_n(JsonWriter *writer, const char *data, size_t length) {
+    json_reserve(writer, length);
+    memcpy(writer->data + writer->length, data, length);
+    writer->length += length;
+}
+
+void json_raw(JsonWriter *writer, const char *data) {
+    json_raw_n(writer, data, strlen(data));
+}
+
+void json_char(JsonWriter *writer, char c) {
+    json_reserve(writer, 1);
+    writer->data[writer->length++] = c;
+}
+
+// Append a byte range as a quoted JSON string. Runs of characters that need
+// no escaping are copied in one go.
+void json_string_n(JsonWriter *writer, const char *str, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    json_reserve(writer, length + 2);
+    writer->data[writer->length++] = '"';
+    size_t run = 0;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)str[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        json_raw_n(writer, str + run, i - run);
+        run = i + 1;
+        switch (c) {
+            case '"': json_raw_n(writer, "\\\"", 2); break;
+            case '\\': json_raw_n(writer, "\\\\", 2); break;
+            case '\n': json_raw_n(writer, "\\n", 2); break;
+            case '\r': json_raw_n(writer, "\\r", 2); break;
+            case '\t': json_raw_n(writer, "\\t", 2); break;
+            default: {
+                char escape[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+                json_raw_n(writer, escape, sizeof(escape));
+            }
+        }
+    }
+    json_raw_n(writer, str + run, length - run);
+    json_char(writer, '"');
+}
+
+void json_string(JsonWriter *writer, const char *str) {
+    json_string_n(writer, str, strlen(str));
+}
+
+// Append an integer, formatting its digits straight into the buffer
+void json_long(JsonWriter *writer, long long value) {
+    char digits[24];
+    int count = 0;
+    unsigned long long magnitude = value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+    do {
+        digits[count++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    json_reserve(writer, count + 1);
+    if (value < 0) {
+        writer->data[writer->length++] = '-';
     }
+    while (count > 0) {
+        writer->data[writer->length++] = digits[--count];
+    }
+}
 
-    // Copy the value into the allocated memory
-    strncpy(value, start, value_length);
-    value[value_length] = '\0'; // Null-terminate the string
+// Append "key": ready for the value
+void json_key(JsonWriter *writer, const char *key) {
+    json_string(writer, key);
+    json_char(writer, ':');
+}
+
+// NUL-terminate and hand over the buffer; the writer is left empty
+char *json_finish(JsonWriter *writer) {
+    json_reserve(writer, 0);
+    writer->data[writer->length] = '\0';
+    char *data = writer->data;
+    json_init(writer);
+    return data;
+}
 
-    return value; // Return the extracted value
+void json_free(JsonWriter *writer) {
+    free(writer->data);
+    json_init(writer);
+}
+
+// Parse a byte size such as "512K", "64M" or "1G"
+size_t parse_size(const char *str) {
+    char *end = NULL;
+    unsigned long long size = strtoull(str, &end, 10);
+    switch (toupper((unsigned char)*end)) {
+        case 'G': size *= 1024;  // fall through
+        case 'M': size *= 1024;  // fall through
+        case 'K': size *= 1024;
+    }
+    return (size_t)size;
 }
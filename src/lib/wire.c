@@ -0,0 +1,108 @@
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+// Encoding of the binary protocol's payloads. Numbers are big-endian and
+// strings carry a length prefix; the bytes go into a JsonWriter, which here
+// is only a growable buffer with a flush hook.
+//
+// A row set is:
+//   u8 WIRE_RESULT_ROWS, u16 column count,
+//   per column: u8 type (WIRE_INTEGER, WIRE_REAL, WIRE_TEXT), string16 name,
+//   per row: u8 1, then per column one value,
+//   u8 0 after the last row.
+// A value is u8 WIRE_NULL; u8 WIRE_INTEGER, i64; u8 WIRE_REAL, f64 (IEEE
+// bits as u64); or u8 WIRE_TEXT, string32.
+// A write's result is u8 WIRE_RESULT_AFFECTED, i64 rows affected.
+typedef enum {
+    WIRE_NULL = 0,
+    WIRE_INTEGER = 1,
+    WIRE_REAL = 2,
+    WIRE_TEXT = 3
+} WireType;
+
+#define WIRE_RESULT_ROWS 1
+#define WIRE_RESULT_AFFECTED 2
+#define WIRE_NULL_STRING 0xFFFF  // A string16 length that stands for NULL
+
+// How a query writes its result
+typedef enum {
+    OUTPUT_JSON,
+    OUTPUT_BINARY
+} OutputFormat;
+
+void wireU8(JsonWriter *out, uint8_t value) {
+    json_char(out, (char)value);
+}
+
+void wireU16(JsonWriter *out, uint16_t value) {
+    uint16_t big = htobe16(value);
+    json_raw_n(out, (const char *)&big, sizeof(big));
+}
+
+void wireU32(JsonWriter *out, uint32_t value) {
+    uint32_t big = htobe32(value);
+    json_raw_n(out, (const char *)&big, sizeof(big));
+}
+
+void wireU64(JsonWriter *out, uint64_t value) {
+    uint64_t big = htobe64(value);
+    json_raw_n(out, (const char *)&big, sizeof(big));
+}
+
+// A string of up to 64KB: u16 length, then the bytes
+void wireString16(JsonWriter *out, const char *str, size_t length) {
+    if (length > 0xFFFE) {
+        length = 0xFFFE;
+    }
+    wireU16(out, (uint16_t)length);
+    json_raw_n(out, str, length);
+}
+
+void wireString32(JsonWriter *out, const char *str, size_t length) {
+    wireU32(out, (uint32_t)length);
+    json_raw_n(out, str, length);
+}
+
+void wireColumns(JsonWriter *out, const TableSchema *schema) {
+    wireU8(out, WIRE_RESULT_ROWS);
+    wireU16(out, (uint16_t)schema->column_count);
+    for (int i = 0; i < schema->column_count; i++) {
+        const Column *column = &schema->columns[i];
+        wireU8(out, column->type == TYPE_INTEGER ? WIRE_INTEGER : column->type == TYPE_REAL ? WIRE_REAL : WIRE_TEXT);
+        wireString16(out, column->name, strlen(column->name));
+    }
+}
+
+// One row, each field typed by its column the way the JSON output types it:
+// a field that does not parse as its column's number is sent as text
+void wireRow(JsonWriter *out, const TableSchema *schema, char **fields, int field_count) {
+    wireU8(out, 1);
+    for (int i = 0; i < schema->column_count; i++) {
+        const char *field = i < field_count ? fields[i] : "";
+        Value value = parseValue(field, schema->columns[i].type);
+        if (value.is_null) {
+            wireU8(out, WIRE_NULL);
+        } else if (value.type == TYPE_INTEGER) {
+            wireU8(out, WIRE_INTEGER);
+            wireU64(out, (uint64_t)value.integer);
+        } else if (value.type == TYPE_REAL) {
+            uint64_t bits;
+            memcpy(&bits, &value.real, sizeof(bits));
+            wireU8(out, WIRE_REAL);
+            wireU64(out, bits);
+        } else {
+            wireU8(out, WIRE_TEXT);
+            wireString32(out, field, strlen(field));
+        }
+    }
+}
+
+void wireEndRows(JsonWriter *out) {
+    wireU8(out, 0);
+}
+
+void wireAffected(JsonWriter *out, long long affected) {
+    wireU8(out, WIRE_RESULT_AFFECTED);
+    wireU64(out, (uint64_t)affected);
+}
@@ -0,0 +1,223 @@
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "http.h"
+
+void http_request_init(HttpRequest *request) {
+    memset(request, 0, sizeof(*request));
+}
+
+HttpSpan http_span(size_t offset, size_t length) {
+    HttpSpan span = {offset, length};
+    return span;
+}
+
+// Split the request line into method, target and version, and the target
+// into path and query parameters. A line without a target leaves it empty,
+// which routes answer as an unknown path.
+void http_parse_request_line(HttpRequest *request, const char *input, size_t start, size_t end) {
+    size_t at = start;
+    size_t method_end = at;
+    while (method_end < end && input[method_end] != ' ') method_end++;
+    request->method = http_span(at, method_end - at);
+    at = method_end;
+    while (at < end && input[at] == ' ') at++;
+    size_t target_end = at;
+    while (target_end < end && input[target_end] != ' ') target_end++;
+    request->target = http_span(at, target_end - at);
+    at = target_end;
+    while (at < end && input[at] == ' ') at++;
+    request->version = http_span(at, end - at);
+    request->http11 = end - at >= 8 && strncmp(input + at, "HTTP/1.1", 8) == 0;
+    request->keep_alive = request->http11;
+
+    const char *target = input + request->target.offset;
+    const char *question = memchr(target, '?', request->target.length);
+    size_t path_length = question != NULL ? (size_t)(question - target) : request->target.length;
+    request->path = http_span(request->target.offset, path_length);
+    if (question == NULL) {
+        return;
+    }
+    size_t query_start = request->target.offset + path_length + 1;
+    request->query = http_span(query_start, target_end - query_start);
+
+    // name=value pairs separated by '&'; a bare name has an empty value
+    for (size_t pair = query_start; pair < target_end && request->parameter_count < HTTP_MAX_PARAMETERS; ) {
+        const char *amp = memchr(input + pair, '&', target_end - pair);
+        size_t pair_end = amp != NULL ? (size_t)(amp - input) : target_end;
+        if (pair_end > pair) {
+            const char *equals = memchr(input + pair, '=', pair_end - pair);
+            size_t name_end = equals != NULL ? (size_t)(equals - input) : pair_end;
+            size_t value_start = equals != NULL ? name_end + 1 : pair_end;
+            HttpField *parameter = &request->parameters[request->parameter_count++];
+            parameter->name = http_span(pair, name_end - pair);
+            parameter->value = http_span(value_start, pair_end - value_start);
+        }
+        pair = pair_end + 1;
+    }
+}
+
+// Record one header line. Returns 0, with the status to answer, if it makes
+// the request impossible to frame. Only Content-Length frames a body: a
+// Transfer-Encoding, or a second Content-Length, could have a proxy in front
+// read the body differently and take part of it for a request of its own.
+int http_parse_header(HttpRequest *request, const char *input, size_t start, size_t end) {
+    const char *colon = memchr(input + start, ':', end - start);
+    if (colon == NULL) {
+        return 1;  // Not a header; ignored as before
+    }
+    size_t name_end = colon - input;
+    size_t value_start = name_end + 1;
+    while (value_start < end && (input[value_start] == ' ' || input[value_start] == '\t')) value_start++;
+    size_t value_end = end;
+    while (value_end > value_start && (input[value_end - 1] == ' ' || input[value_end - 1] == '\t')) value_end--;
+    const char *name = input + start;
+    size_t name_length = name_end - start;
+    const char *value = input + value_start;
+    size_t value_length = value_end - value_start;
+
+    if (name_length == 14 && strncasecmp(name, "Content-Length", 14) == 0) {
+        size_t content_length = 0;
+        request->invalid_status = "400 Bad Request";
+        if (value_length == 0 || request->has_content_length) {
+            return 0;
+        }
+        for (size_t i = 0; i < value_length; i++) {
+            if (!isdigit((unsigned char)value[i]) || content_length > ((size_t)-1 - 9) / 10) {
+                return 0;
+            }
+            content_length = content_length * 10 + (value[i] - '0');
+        }
+        request->invalid_status = NULL;
+        request->content_length = content_length;
+        request->has_content_length = 1;
+    } else if (name_length == 17 && strncasecmp(name, "Transfer-Encoding", 17) == 0) {
+        request->invalid_status = "501 Not Implemented";
+        return 0;
+    } else if (name_length == 10 && strncasecmp(name, "Connection", 10) == 0) {
+        // HTTP/1.1 connections persist unless the client sends "close";
+        // HTTP/1.0 ones only when it asks with "keep-alive"
+        if (memmem(value, value_length, "close", 5) != NULL || memmem(value, value_length, "Close", 5) != NULL) {
+            request->keep_alive = 0;
+        } else if (value_length >= 10 && strncasecmp(value, "keep-alive", 10) == 0) {
+            request->keep_alive = 1;
+        }
+    }
+
+    if (request->header_count < HTTP_MAX_HEADERS) {
+        HttpField *header = &request->headers[request->header_count++];
+        header->name = http_span(start, name_length);
+        header->value = http_span(value_start, value_length);
+    }
+    return 1;
+}
+
+// Parse as much of the request at the front of input as has arrived. Lines
+// end in "\r\n" or a bare "\n"; the body is never scanned, only counted.
+HttpParseResult http_parse(HttpRequest *request, const char *input, size_t length) {
+    while (request->state != HTTP_BODY) {
+        const char *newline = memchr(input + request->scanned, '\n', length - request->scanned);
+        if (newline == NULL) {
+            request->scanned = length;
+            return HTTP_INCOMPLETE;
+        }
+        size_t start = request->line_start;
+        size_t next = newline - input + 1;
+        size_t end = newline - input;
+        if (end > start && input[end - 1] == '\r') {
+            end--;
+        }
+        request->scanned = request->line_start = next;
+
+        if (request->state == HTTP_REQUEST_LINE) {
+            if (end == start) {
+                continue;  // Blank lines ahead of a request are skipped
+            }
+            http_parse_request_line(request, input, start, end);
+            request->state = HTTP_HEADERS;
+        } else if (end == start) {
+            request->head_length = next;
+            request->state = HTTP_BODY;
+        } else if (!http_parse_header(request, input, start, end)) {
+            return HTTP_INVALID;
+        }
+    }
+    if (length - request->head_length < request->content_length) {
+        return HTTP_INCOMPLETE;
+    }
+    request->length = request->head_length + request->content_length;
+    return HTTP_COMPLETE;
+}
+
+int http_span_equals(const char *input, HttpSpan span, const char *text) {
+    return strlen(text) == span.length && strncmp(input + span.offset, text, span.length) == 0;
+}
+
+int http_hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Undo percent-encoding, and '+' for a space in query strings, into out,
+// which is always terminated. A '%' not followed by two hex digits is kept
+// as it is. Returns the decoded length.
+size_t http_decode(const char *data, size_t length, int plus_is_space, char *out, size_t out_size) {
+    size_t written = 0;
+    for (size_t i = 0; i < length && written + 1 < out_size; i++) {
+        char c = data[i];
+        if (c == '%' && i + 2 < length) {
+            int high = http_hex_digit(data[i + 1]);
+            int low = http_hex_digit(data[i + 2]);
+            if (high >= 0 && low >= 0) {
+                c = (char)(high << 4 | low);
+                i += 2;
+            }
+        } else if (c == '+' && plus_is_space) {
+            c = ' ';
+        }
+        out[written++] = c;
+    }
+    if (out_size > 0) {
+        out[written] = '\0';
+    }
+    return written;
+}
+
+// The value of the first header called name, compared without case
+const HttpSpan *http_header(const HttpRequest *request, const char *input, const char *name) {
+    size_t name_length = strlen(name);
+    for (int i = 0; i < request->header_count; i++) {
+        const HttpField *header = &request->headers[i];
+        if (header->name.length == name_length && strncasecmp(input + header->name.offset, name, name_length) == 0) {
+            return &header->value;
+        }
+    }
+    return NULL;
+}
+
+// Decode the query parameter called name into out. Returns 0, with out
+// empty, if the query string does not have it.
+int http_query_value(const HttpRequest *request, const char *input, const char *name, char *out, size_t out_size) {
+    size_t name_length = strlen(name);
+    for (int i = 0; i < request->parameter_count; i++) {
+        const HttpField *parameter = &request->parameters[i];
+        // Names are almost never encoded; only decode one that could match
+        char decoded[256];
+        const char *candidate = input + parameter->name.offset;
+        size_t candidate_length = parameter->name.length;
+        if (memchr(candidate, '%', candidate_length) != NULL || memchr(candidate, '+', candidate_length) != NULL) {
+            candidate_length = http_decode(candidate, candidate_length, 1, decoded, sizeof(decoded));
+            candidate = decoded;
+        }
+        if (candidate_length == name_length && memcmp(candidate, name, name_length) == 0) {
+            http_decode(input + parameter->value.offset, parameter->value.length, 1, out, out_size);
+            return 1;
+        }
+    }
+    if (out_size > 0) {
+        out[0] = '\0';
+    }
+    return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stddef.h>
+
+#define HTTP_MAX_HEADERS 32     // Headers past these are still checked for framing, not kept
+#define HTTP_MAX_PARAMETERS 32  // Query string parameters kept
+
+// Bytes of the request, as an offset from its first byte so that the span
+// survives the buffer being moved or grown
+typedef struct {
+    size_t offset;
+    size_t length;
+} HttpSpan;
+
+// A header, or a query parameter, as name and value
+typedef struct {
+    HttpSpan name;
+    HttpSpan value;
+} HttpField;
+
+typedef enum {
+    HTTP_REQUEST_LINE,
+    HTTP_HEADERS,
+    HTTP_BODY
+} HttpParseState;
+
+typedef enum {
+    HTTP_INCOMPLETE,  // More input is needed
+    HTTP_COMPLETE,    // length covers the request, body included
+    HTTP_INVALID      // The request cannot be framed; the connection must close
+} HttpParseResult;
+
+// A request parsed in place. The parser picks up where it stopped each time
+// more input arrives, so a request read in many pieces is scanned once, and
+// it never writes to the input.
+typedef struct {
+    HttpParseState state;
+    size_t scanned;     // Input examined so far
+    size_t line_start;  // Start of the line being read
+
+    HttpSpan method;
+    HttpSpan target;  // Path and query string as sent
+    HttpSpan path;
+    HttpSpan query;
+    HttpSpan version;
+    HttpField headers[HTTP_MAX_HEADERS];
+    int header_count;
+    HttpField parameters[HTTP_MAX_PARAMETERS];
+    int parameter_count;
+
+    size_t head_length;  // Request line and headers, blank line included
+    size_t content_length;
+    int has_content_length;
+    const char *invalid_status;  // What to answer once the request is HTTP_INVALID
+    size_t length;  // The whole request once complete
+    int http11;
+    int keep_alive;
+} HttpRequest;
+
+void http_request_init(HttpRequest *request);
+HttpParseResult http_parse(HttpRequest *request, const char *input, size_t length);
+int http_span_equals(const char *input, HttpSpan span, const char *text);
+size_t http_decode(const char *data, size_t length, int plus_is_space, char *out, size_t out_size);
+const HttpSpan *http_header(const HttpRequest *request, const char *input, const char *name);
+int http_query_value(const HttpRequest *request, const char *input, const char *name, char *out, size_t out_size);
+
+#endif
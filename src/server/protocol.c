@@ -0,0 +1,535 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <endian.h>
+#include <time.h>
+#include "../lib/constants.c"
+#include "protocol.h"
+
+// Binary protocol served on binary_port. Every message is a frame:
+//   u32 length of the rest of the frame, u32 id, u8 opcode (requests) or
+//   u8 status (responses), payload
+// Numbers are big-endian. Request arguments are string16s (u16 length, then
+// the bytes; length 0xFFFF is NULL) unless noted. Responses carry the id of
+// their request and come back in request order, so a client may pipeline as
+// many requests as it likes. A large result comes as WIRE_MORE frames whose
+// payloads are pieces of one byte stream, then a final WIRE_OK frame; row
+// sets and write results are encoded as described in wire.c.
+//
+// A connection sends WIRE_AUTH before anything but WIRE_PING.
+
+#define WIRE_OK 0
+#define WIRE_MORE 1   // Part of the result; more frames with this id follow
+#define WIRE_ERROR 2  // Payload: string16 message
+
+#define WIRE_AUTH 0x01             // username, password
+#define WIRE_PING 0x02
+#define WIRE_LIST_DATABASES 0x10   // -> string32 JSON, as /list/db
+#define WIRE_LIST_TABLES 0x11      // database -> string32 JSON, as /list/table
+#define WIRE_CREATE_DATABASE 0x12  // database
+#define WIRE_DELETE_DATABASE 0x13  // database
+#define WIRE_CREATE_TABLE 0x14     // database, table, u16 count, count * (column, type)
+#define WIRE_DELETE_TABLE 0x15     // database, table
+#define WIRE_FETCH 0x20            // database, table, column, value (NULL for every row) -> rows
+#define WIRE_INSERT 0x21           // database, table, comma-separated values -> affected
+#define WIRE_UPDATE 0x22           // database, table, column, value, new column, new value -> affected
+#define WIRE_DELETE_ROWS 0x23      // database, table, column, value -> affected
+#define WIRE_QUERY 0x30            // database, sql, u16 count, count * parameter -> rows or affected
+#define WIRE_PREPARE 0x31          // database, sql -> u64 statement, u16 parameter count
+#define WIRE_EXECUTE 0x32          // u64 statement, u16 count, count * parameter -> rows or affected
+
+#define WIRE_HEADER_SIZE 9
+#define WIRE_CHUNK_SIZE (256 * 1024)  // Result bytes built up before a WIRE_MORE frame goes out
+#define WIRE_MAX_PARAMETERS 64
+#define WIRE_MAX_COLUMNS 64  // As db.c's MAX_COLUMNS
+
+typedef struct Arena Arena;
+extern void *arena_alloc(Arena *arena, size_t size);
+
+typedef struct JsonWriter {
+    char *data;
+    size_t length;
+    size_t capacity;
+    void (*flush)(struct JsonWriter *writer);
+    size_t flush_at;
+    void *context;
+} JsonWriter;
+typedef enum {
+    OUTPUT_JSON,
+    OUTPUT_BINARY
+} OutputFormat;
+extern void json_init(JsonWriter *writer);
+extern void json_raw_n(JsonWriter *writer, const char *data, size_t length);
+extern void json_reserve(JsonWriter *writer, size_t extra);
+extern void json_free(JsonWriter *writer);
+extern void wireU8(JsonWriter *out, uint8_t value);
+extern void wireU16(JsonWriter *out, uint16_t value);
+extern void wireU32(JsonWriter *out, uint32_t value);
+extern void wireU64(JsonWriter *out, uint64_t value);
+extern void wireString16(JsonWriter *out, const char *str, size_t length);
+extern void wireString32(JsonWriter *out, const char *str, size_t length);
+extern void wireAffected(JsonWriter *out, long long affected);
+
+extern void connection_send_owned(int fd, char *data, size_t length);
+extern char *listDB(const char *directory);
+extern char *listTable(Arena *arena, const char *database_name);
+extern int createDB(Arena *arena, const char *database_name);
+extern int deleteDB(Arena *arena, const char *database_name);
+extern int createTable(Arena *arena, const char *database_name, const char *table_name, const char *columns[], const char *types[], int column_count);
+extern int deleteTable(Arena *arena, const char *database_name, const char *table_name);
+extern int insertTableValues(Arena *arena, const char *database_name, const char *table_name, const char *values);
+extern int updateTableData(const char *database_name, const char *table_name, const char *check_field, const char *check_value, const char *update_field, const char *update_value);
+extern int deleteTableData(const char *database_name, const char *table_name, const char *check_field, const char *check_value);
+extern int validStoredValue(const char *value);
+extern int validStoredRow(const char *row);
+extern int validStoredNames(const char *table_name, const char *const columns[], const char *const types[], int column_count);
+extern int executeQuery(Arena *arena, JsonWriter *out, OutputFormat format, const char *database_name, const char *sql, char **params, int param_count, char *error, size_t error_size);
+extern unsigned long prepareQuery(const char *database_name, const char *sql, int *parameter_count, char *error, size_t error_size);
+extern int executePrepared(Arena *arena, JsonWriter *out, OutputFormat format, unsigned long handle, char **params, int param_count, int *found, char *error, size_t error_size);
+extern int preparedStatementText(Arena *arena, unsigned long handle, char **database_name, char **sql);
+extern char *arena_printf(Arena *arena, const char *format, ...);
+extern void countResponse(int route, int status, unsigned long micros);
+extern void beginRequestStats(int report);
+extern void markHandlerStart(void);
+extern void endRequestStats(void);
+extern int requestIsSlow(void);
+extern void logSlowRequest(const char *route, const char *database_name, const char *table_name, const char *predicate);
+
+// Cursor over a request frame's payload. Reading past the end sets failed
+// and yields zeros and NULLs, so handlers check once at the end.
+typedef struct {
+    Arena *arena;
+    const unsigned char *data;
+    size_t length;
+    size_t at;
+    int failed;
+} FrameReader;
+
+const unsigned char *frame_take(FrameReader *reader, size_t length) {
+    if (reader->failed || reader->length - reader->at < length) {
+        reader->failed = 1;
+        return NULL;
+    }
+    const unsigned char *bytes = reader->data + reader->at;
+    reader->at += length;
+    return bytes;
+}
+
+uint16_t frame_u16(FrameReader *reader) {
+    const unsigned char *bytes = frame_take(reader, 2);
+    return bytes != NULL ? (uint16_t)(bytes[0] << 8 | bytes[1]) : 0;
+}
+
+uint64_t frame_u64(FrameReader *reader) {
+    const unsigned char *bytes = frame_take(reader, 8);
+    uint64_t value = 0;
+    if (bytes != NULL) {
+        memcpy(&value, bytes, 8);
+    }
+    return be64toh(value);
+}
+
+// A string16 copied into the arena and terminated, or NULL
+char *frame_string(FrameReader *reader) {
+    uint16_t length = frame_u16(reader);
+    if (length == 0xFFFF) {
+        return NULL;
+    }
+    const unsigned char *bytes = frame_take(reader, length);
+    if (bytes == NULL) {
+        return NULL;
+    }
+    char *copy = arena_alloc(reader->arena, length + 1);
+    memcpy(copy, bytes, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// u16 count, then that many strings
+int frame_strings(FrameReader *reader, char **strings, int max) {
+    int count = frame_u16(reader);
+    if (count > max) {
+        reader->failed = 1;
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        strings[i] = frame_string(reader);
+    }
+    return count;
+}
+
+// A response being built: the header is reserved at the front of the
+// writer and filled in when the frame goes out. The request's handler also
+// notes what it named, for the slow log.
+typedef struct {
+    int client_socket;
+    uint32_t id;
+    uint8_t status;  // Of the last frame sent
+    const char *database_name;
+    const char *table_name;
+    const char *predicate;  // The SQL, or "column = value"
+    unsigned long statement;  // The prepared statement executed
+} FrameStream;
+
+void begin_frame(JsonWriter *out, FrameStream *stream) {
+    json_init(out);
+    json_reserve(out, WIRE_HEADER_SIZE);
+    out->length = WIRE_HEADER_SIZE;
+    out->context = stream;
+}
+
+// Fill in the header and hand the frame to the connection
+void send_frame(JsonWriter *out, uint8_t status) {
+    FrameStream *stream = out->context;
+    uint32_t length = htobe32((uint32_t)(out->length - 4));
+    uint32_t id = htobe32(stream->id);
+    memcpy(out->data, &length, 4);
+    memcpy(out->data + 4, &id, 4);
+    out->data[8] = (char)status;
+    stream->status = status;
+    connection_send_owned(stream->client_socket, out->data, out->length);
+    out->data = NULL;
+    out->length = out->capacity = 0;
+}
+
+// JsonWriter flush hook: send what the result has so far and start the next frame
+void flush_frame(JsonWriter *out) {
+    send_frame(out, WIRE_MORE);
+    json_reserve(out, out->flush_at);
+    out->length = WIRE_HEADER_SIZE;
+}
+
+// Stream a result of any size through WIRE_MORE frames
+void stream_frames(JsonWriter *out) {
+    out->flush = flush_frame;
+    out->flush_at = WIRE_CHUNK_SIZE;
+}
+
+void send_frame_error(JsonWriter *out, const char *message) {
+    out->length = WIRE_HEADER_SIZE;  // Drop any partial result
+    wireString16(out, message, strlen(message));
+    send_frame(out, WIRE_ERROR);
+}
+
+// Tell a write's outcome: the count it affected, or the error
+void send_frame_result(JsonWriter *out, int succeeded, long long affected, const char *error) {
+    if (succeeded) {
+        wireAffected(out, affected);
+        send_frame(out, WIRE_OK);
+    } else {
+        send_frame_error(out, error);
+    }
+}
+
+// Table and column names go into SQL text, so only plain identifiers pass
+int plain_identifier(const char *name) {
+    if (name == NULL || *name == '\0') {
+        return 0;
+    }
+    for (const char *c = name; *c; c++) {
+        if (!(*c == '_' || (*c >= '0' && *c <= '9') || (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z'))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Opcodes in the order of their metrics slots
+const uint8_t wire_metrics_opcodes[WIRE_METRICS_SLOTS - 1] = {
+    WIRE_AUTH, WIRE_PING, WIRE_LIST_DATABASES, WIRE_LIST_TABLES, WIRE_CREATE_DATABASE, WIRE_DELETE_DATABASE,
+    WIRE_CREATE_TABLE, WIRE_DELETE_TABLE, WIRE_FETCH, WIRE_INSERT, WIRE_UPDATE, WIRE_DELETE_ROWS,
+    WIRE_QUERY, WIRE_PREPARE, WIRE_EXECUTE,
+};
+const char *const wire_metrics_names[WIRE_METRICS_SLOTS] = {
+    "WIRE AUTH", "WIRE PING", "WIRE LIST_DATABASES", "WIRE LIST_TABLES", "WIRE CREATE_DATABASE", "WIRE DELETE_DATABASE",
+    "WIRE CREATE_TABLE", "WIRE DELETE_TABLE", "WIRE FETCH", "WIRE INSERT", "WIRE UPDATE", "WIRE DELETE_ROWS",
+    "WIRE QUERY", "WIRE PREPARE", "WIRE EXECUTE", "WIRE unknown",
+};
+
+// Offset of an opcode's slot from wire_metrics_first
+int wire_metrics_slot(uint8_t opcode) {
+    int slot = 0;
+    while (slot < WIRE_METRICS_SLOTS - 1 && wire_metrics_opcodes[slot] != opcode) {
+        slot++;
+    }
+    return slot;
+}
+
+void answer_frame(struct Arena *arena, const char *frame, size_t length, FrameStream *stream, int *authenticated, const char *username, const char *password) {
+    FrameReader reader = {arena, (const unsigned char *)frame + WIRE_HEADER_SIZE, length - WIRE_HEADER_SIZE, 0, 0};
+    uint8_t opcode = (uint8_t)frame[8];
+    JsonWriter out;
+    begin_frame(&out, stream);
+
+    if (opcode != WIRE_AUTH && opcode != WIRE_PING && !*authenticated) {
+        send_frame_error(&out, "Unauthorized");
+        return;
+    }
+
+    char error[256] = "";
+    switch (opcode) {
+        case WIRE_AUTH: {
+            char *name = frame_string(&reader);
+            char *secret = frame_string(&reader);
+            *authenticated = !reader.failed && name != NULL && secret != NULL &&
+                             strcmp(name, username) == 0 && strcmp(secret, password) == 0;
+            if (*authenticated) {
+                send_frame(&out, WIRE_OK);
+            } else {
+                send_frame_error(&out, "Unauthorized");
+            }
+            return;
+        }
+        case WIRE_PING:
+            send_frame(&out, WIRE_OK);
+            return;
+        case WIRE_LIST_DATABASES: {
+            char *databases = listDB(DB_DIRECTORY);
+            const char *json = databases != NULL ? databases : "null";
+            wireString32(&out, json, strlen(json));
+            free(databases);
+            send_frame(&out, WIRE_OK);
+            return;
+        }
+        case WIRE_LIST_TABLES: {
+            char *database_name = frame_string(&reader);
+            stream->database_name = database_name;
+            if (reader.failed || database_name == NULL) {
+                break;
+            }
+            char *tables = listTable(arena, database_name);
+            const char *json = tables != NULL ? tables : "{\"tables\": []}";
+            wireString32(&out, json, strlen(json));
+            free(tables);
+            send_frame(&out, WIRE_OK);
+            return;
+        }
+        case WIRE_CREATE_DATABASE: {
+            char *database_name = frame_string(&reader);
+            stream->database_name = database_name;
+            if (reader.failed || database_name == NULL) {
+                break;
+            }
+            send_frame_result(&out, createDB(arena, database_name) > 0, 1, "Database already exists");
+            return;
+        }
+        case WIRE_DELETE_DATABASE: {
+            char *database_name = frame_string(&reader);
+            stream->database_name = database_name;
+            if (reader.failed || database_name == NULL) {
+                break;
+            }
+            send_frame_result(&out, deleteDB(arena, database_name) == 0, 1, "Unable to delete database");
+            return;
+        }
+        case WIRE_CREATE_TABLE: {
+            char *database_name = frame_string(&reader);
+            char *table_name = frame_string(&reader);
+            stream->database_name = database_name;
+            stream->table_name = table_name;
+            int column_count = frame_u16(&reader);
+            if (column_count > WIRE_MAX_COLUMNS) {
+                reader.failed = 1;
+            }
+            const char *columns[WIRE_MAX_COLUMNS];
+            const char *types[WIRE_MAX_COLUMNS];
+            for (int i = 0; i < column_count && !reader.failed; i++) {
+                columns[i] = frame_string(&reader);
+                types[i] = frame_string(&reader);
+                if (columns[i] == NULL || types[i] == NULL) {
+                    reader.failed = 1;
+                }
+            }
+            if (reader.failed || database_name == NULL || table_name == NULL || column_count == 0) {
+                break;
+            }
+            if (!validStoredNames(table_name, columns, types, column_count)) {
+                send_frame_error(&out, "Names and types may not contain commas or line breaks");
+                return;
+            }
+            send_frame_result(&out, createTable(arena, database_name, table_name, columns, types, column_count) > 0, 1, "Table already exists");
+            return;
+        }
+        case WIRE_DELETE_TABLE: {
+            char *database_name = frame_string(&reader);
+            char *table_name = frame_string(&reader);
+            stream->database_name = database_name;
+            stream->table_name = table_name;
+            if (reader.failed || database_name == NULL || table_name == NULL) {
+                break;
+            }
+            send_frame_result(&out, deleteTable(arena, database_name, table_name) > 0, 1, "Unable to delete table");
+            return;
+        }
+        case WIRE_FETCH: {
+            char *database_name = frame_string(&reader);
+            char *table_name = frame_string(&reader);
+            char *check_field = frame_string(&reader);
+            char *check_value = frame_string(&reader);
+            stream->database_name = database_name;
+            stream->table_name = table_name;
+            stream->predicate = check_field != NULL ? arena_printf(arena, "%s = %s", check_field, check_value) : NULL;
+            if (reader.failed || database_name == NULL || !plain_identifier(table_name) ||
+                (check_field != NULL && (!plain_identifier(check_field) || check_value == NULL))) {
+                break;
+            }
+            // Through the planner, so that an indexed column is looked up
+            // rather than scanned and the plan is cached
+            char sql[256];
+            if (check_field != NULL) {
+                snprintf(sql, sizeof(sql), "SELECT * FROM %s WHERE %s = ?", table_name, check_field);
+            } else {
+                snprintf(sql, sizeof(sql), "SELECT * FROM %s", table_name);
+            }
+            stream_frames(&out);
+            if (executeQuery(arena, &out, OUTPUT_BINARY, database_name, sql, &check_value, check_field != NULL, error, sizeof(error))) {
+                send_frame(&out, WIRE_OK);
+            } else {
+                send_frame_error(&out, error);
+            }
+            return;
+        }
+        case WIRE_INSERT: {
+            char *database_name = frame_string(&reader);
+            char *table_name = frame_string(&reader);
+            char *values = frame_string(&reader);
+            stream->database_name = database_name;
+            stream->table_name = table_name;
+            if (reader.failed || database_name == NULL || table_name == NULL || values == NULL) {
+                break;
+            }
+            if (!validStoredRow(values)) {
+                send_frame_error(&out, "Values may not contain line breaks");
+                return;
+            }
+            int inserted = insertTableValues(arena, database_name, table_name, values);
+            send_frame_result(&out, inserted > 0, inserted, "Values were not inserted");
+            return;
+        }
+        case WIRE_UPDATE: {
+            char *database_name = frame_string(&reader);
+            char *table_name = frame_string(&reader);
+            char *check_field = frame_string(&reader);
+            char *check_value = frame_string(&reader);
+            char *update_field = frame_string(&reader);
+            char *update_value = frame_string(&reader);
+            stream->database_name = database_name;
+            stream->table_name = table_name;
+            stream->predicate = check_field != NULL ? arena_printf(arena, "%s = %s", check_field, check_value) : NULL;
+            if (reader.failed || database_name == NULL || table_name == NULL || check_field == NULL ||
+                check_value == NULL || update_field == NULL || update_value == NULL) {
+                break;
+            }
+            if (!validStoredValue(update_value)) {
+                send_frame_error(&out, "Values may not contain commas or line breaks");
+                return;
+            }
+            int updated = updateTableData(database_name, table_name, check_field, check_value, update_field, update_value);
+            send_frame_result(&out, updated > 0, updated, "Update failed");
+            return;
+        }
+        case WIRE_DELETE_ROWS: {
+            char *database_name = frame_string(&reader);
+            char *table_name = frame_string(&reader);
+            char *check_field = frame_string(&reader);
+            char *check_value = frame_string(&reader);
+            stream->database_name = database_name;
+            stream->table_name = table_name;
+            stream->predicate = check_field != NULL ? arena_printf(arena, "%s = %s", check_field, check_value) : NULL;
+            if (reader.failed || database_name == NULL || table_name == NULL || check_field == NULL || check_value == NULL) {
+                break;
+            }
+            int deleted = deleteTableData(database_name, table_name, check_field, check_value);
+            send_frame_result(&out, deleted > 0, deleted, "Unable to delete table row");
+            return;
+        }
+        case WIRE_QUERY: {
+            char *database_name = frame_string(&reader);
+            char *sql = frame_string(&reader);
+            stream->database_name = database_name;
+            stream->predicate = sql;
+            char *params[WIRE_MAX_PARAMETERS];
+            int param_count = frame_strings(&reader, params, WIRE_MAX_PARAMETERS);
+            if (reader.failed || database_name == NULL || sql == NULL) {
+                break;
+            }
+            stream_frames(&out);
+            if (executeQuery(arena, &out, OUTPUT_BINARY, database_name, sql, params, param_count, error, sizeof(error))) {
+                send_frame(&out, WIRE_OK);
+            } else {
+                send_frame_error(&out, error);
+            }
+            return;
+        }
+        case WIRE_PREPARE: {
+            char *database_name = frame_string(&reader);
+            char *sql = frame_string(&reader);
+            stream->database_name = database_name;
+            stream->predicate = sql;
+            if (reader.failed || database_name == NULL || sql == NULL) {
+                break;
+            }
+            int parameter_count = 0;
+            unsigned long handle = prepareQuery(database_name, sql, &parameter_count, error, sizeof(error));
+            if (handle == 0) {
+                send_frame_error(&out, error);
+                return;
+            }
+            wireU64(&out, handle);
+            wireU16(&out, (uint16_t)parameter_count);
+            send_frame(&out, WIRE_OK);
+            return;
+        }
+        case WIRE_EXECUTE: {
+            unsigned long handle = frame_u64(&reader);
+            stream->statement = handle;
+            char *params[WIRE_MAX_PARAMETERS];
+            int param_count = frame_strings(&reader, params, WIRE_MAX_PARAMETERS);
+            if (reader.failed) {
+                break;
+            }
+            int found = 0;
+            stream_frames(&out);
+            if (executePrepared(arena, &out, OUTPUT_BINARY, handle, params, param_count, &found, error, sizeof(error))) {
+                send_frame(&out, WIRE_OK);
+            } else {
+                send_frame_error(&out, error);
+            }
+            return;
+        }
+        default:
+            send_frame_error(&out, "Unknown opcode");
+            return;
+    }
+    send_frame_error(&out, "Malformed request");
+}
+
+// Answer a frame, counting it in its opcode's metrics slot and logging it if
+// it was slow, as handle_request does for HTTP
+void handle_frame(struct Arena *arena, const char *frame, size_t length, int client_socket, int *authenticated, const char *username, const char *password) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    beginRequestStats(0);
+    FrameStream stream = {client_socket, 0, WIRE_ERROR, NULL, NULL, NULL, 0};
+    memcpy(&stream.id, frame + 4, 4);
+    stream.id = be32toh(stream.id);
+    uint8_t opcode = (uint8_t)frame[8];
+    int slot = wire_metrics_slot(opcode);
+    markHandlerStart();
+    answer_frame(arena, frame, length, &stream, authenticated, username, password);
+    if (requestIsSlow()) {
+        char *database_name;
+        char *sql;
+        if (stream.statement != 0 && preparedStatementText(arena, stream.statement, &database_name, &sql)) {
+            stream.database_name = database_name;
+            stream.predicate = sql;
+        }
+        logSlowRequest(wire_metrics_names[slot], stream.database_name, stream.table_name, stream.predicate);
+    }
+    endRequestStats();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    // Counted under the HTTP status a route would have answered with
+    int status = stream.status == WIRE_OK ? 200 : *authenticated ? 400 : 401;
+    countResponse(wire_metrics_first + slot, status, (unsigned long)(end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+}
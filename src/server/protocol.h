@@ -0,0 +1,18 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+
+struct Arena;
+
+// The binary protocol's metrics slots, one per opcode and a last one for
+// unknown opcodes, follow the HTTP routes' slots from wire_metrics_first
+#define WIRE_METRICS_SLOTS 16
+extern const char *const wire_metrics_names[WIRE_METRICS_SLOTS];
+extern const int wire_metrics_first;
+
+// Answer one binary protocol frame, length bytes starting with its length
+// field. authenticated is the connection's, set by a successful WIRE_AUTH.
+void handle_frame(struct Arena *arena, const char *frame, size_t length, int client_socket, int *authenticated, const char *username, const char *password);
+
+#endif
@@ -4,560 +4,1243 @@
 #include <stdlib.h>
 #include <sys/socket.h>  // Include this for the 'recv' function
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <time.h>
 #include "../lib/constants.c"
+#include "http.h"
+#include "protocol.h"
 
 #define SUCCESS "200 OK"
 #define UNAUTHORIZED "401 Unauthorized"
 #define BAD_REQUEST "400 Bad Request"
 #define NOT_FOUND "404 Not Found"
+#define SERVER_ERROR "500 Internal Server Error"
 
+typedef struct Arena Arena;
+extern char *arena_printf(Arena *arena, const char *format, ...);
+extern void *arena_alloc(Arena *arena, size_t size);
+extern char *arena_strndup(Arena *arena, const char *str, size_t length);
 
+extern void connection_send(int fd, const char *data, size_t length);
+extern void connection_send_owned(int fd, char *data, size_t length);
+extern void connection_send_file(int fd, int file_fd, size_t offset, size_t length);
+extern int connection_keeps_alive(int fd);
+extern void connection_close_after(int fd);
+extern void connection_abort(int fd);
 extern char *listDB(const char *directory);
-extern char *listTable(const char *database_name); 
-extern char **split_string(const char *str, const char *delimiter, int *count);
-extern char *extract_json_value(const char *json, const char *key);
-extern int createDB(const char *database_name);
-extern int createTable(const char *database_name, const char *table_name, const char *columns[], const char *types[], int column_count);
-extern int insertTableValues(const char *database_name, const char *table_name, const char *values);
+extern char *listTable(Arena *arena, const char *database_name);
+extern char **split_string(Arena *arena, const char *str, const char *delimiter, int *count);
+extern int createDB(Arena *arena, const char *database_name);
+extern int createTable(Arena *arena, const char *database_name, const char *table_name, const char *columns[], const char *types[], int column_count);
+extern int insertTableValues(Arena *arena, const char *database_name, const char *table_name, const char *values);
 extern int updateTableData(const char *database_name, const char *table_name, const char *check_field, const char *check_value, const char *update_field, const char *update_value);
-extern char* fetchTableData(const char *database_name, const char *table_name);
-extern char* fetchFilteredTableData(const char *database_name, const char *table_name, const char *check_field, const char *check_value); 
-extern int deleteDB(const char *database_name); 
-extern int deleteTable(const char *database_name, const char *table_name);
+typedef struct JsonWriter {
+    char *data;
+    size_t length;
+    size_t capacity;
+    void (*flush)(struct JsonWriter *writer);
+    size_t flush_at;
+    void *context;
+} JsonWriter;
+extern int fetchTableData(JsonWriter *out, const char *database_name, const char *table_name);
+extern int fetchFilteredTableData(JsonWriter *out, const char *database_name, const char *table_name, const char *check_field, const char *check_value);
+extern int deleteDB(Arena *arena, const char *database_name);
+extern int deleteTable(Arena *arena, const char *database_name, const char *table_name);
 extern int deleteTableData(const char *database_name, const char *table_name, const char *check_field, const char *check_value);
+extern int fetchOrderedTableData(JsonWriter *out, const char *database_name, const char *table_name, const char *check_field, const char *check_value, const char *order_by, char *error, size_t error_size);
+extern char *aggregateTableData(const char *database_name, const char *table_name, const char *functions, const char *group_by);
+extern void json_init(JsonWriter *writer);
+extern void json_raw(JsonWriter *writer, const char *data);
+extern void json_char(JsonWriter *writer, char c);
+extern void json_string(JsonWriter *writer, const char *str);
+extern void json_long(JsonWriter *writer, long long value);
+extern void json_key(JsonWriter *writer, const char *key);
+extern char *json_finish(JsonWriter *writer);
+extern void json_free(JsonWriter *writer);
+extern void json_reserve(JsonWriter *writer, size_t extra);
 
+#define JSON_MAX_FIELDS 32
+#define MAX_PARAMETERS 64
+
+typedef enum {
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_BOOLEAN,
+    JSON_NULL,
+    JSON_ARRAY,
+    JSON_OBJECT
+} JsonType;
+
+typedef struct {
+    char *key;
+    JsonType type;
+    char *text;
+    size_t length;
+} JsonField;
+
+typedef struct {
+    JsonField fields[JSON_MAX_FIELDS];
+    int count;
+    int valid;  // The body was a well-formed JSON object
+} JsonRequest;
+
+extern int parse_json_request(Arena *arena, const char *body, JsonRequest *request);
+extern const JsonField *json_field(const JsonRequest *request, const char *key);
+extern char *json_value(const JsonRequest *request, const char *key);
+extern char **json_array_items(Arena *arena, const JsonField *field, int *count);
+typedef enum {
+    OUTPUT_JSON,
+    OUTPUT_BINARY
+} OutputFormat;
+extern int executeQuery(Arena *arena, JsonWriter *out, OutputFormat format, const char *database_name, const char *sql, char **params, int param_count, char *error, size_t error_size);
+extern unsigned long prepareQuery(const char *database_name, const char *sql, int *parameter_count, char *error, size_t error_size);
+extern int splitParameters(Arena *arena, const char *params, char **texts);
+extern int executePrepared(Arena *arena, JsonWriter *out, OutputFormat format, unsigned long handle, char **params, int param_count, int *found, char *error, size_t error_size);
+extern int validStoredValue(const char *value);
+extern int validStoredRow(const char *row);
+extern int validStoredNames(const char *table_name, const char *const columns[], const char *const types[], int column_count);
+extern unsigned long dataVersion(const char *database_name, const char *table_name);
+extern const char *lookupCachedResult(Arena *arena, const char *key, const char *database_name, const char *table_name);
+extern void storeCachedResult(const char *key, unsigned long data_version, const char *body);
+extern int lookupCachedFile(const char *key, const char *database_name, const char *table_name, size_t *size);
+extern int createResultFile(void);
+extern void storeCachedFile(const char *key, unsigned long data_version, int file, size_t size);
+extern size_t result_file_budget;
+extern void writeMetrics(JsonWriter *out, const char *const *route_names, int route_count);
+extern void countResponse(int route, int status, unsigned long micros);
+extern int metrics_auth;
+extern void beginRequestStats(int report);
+extern void markHandlerStart(void);
+extern void endRequestStats(void);
+extern int formatRequestStats(char *out, size_t size);
+extern int requestIsSlow(void);
+extern void logSlowRequest(const char *route, const char *database_name, const char *table_name, const char *predicate);
+extern int joinTableData(JsonWriter *out, const char *database_name, const char *left_table, const char *right_table, const char *left_column, const char *right_column, int left_join);
+
+#define STREAM_CHUNK_SIZE (256 * 1024)  // Response bytes built up before a chunk is sent
+
+// Status code of the response this thread is sending, for the metrics
+__thread int response_status = 0;
+
+// Queue the status line and headers; framing is the Content-Length or
+// Transfer-Encoding header, or empty when closing the connection ends the
+// body. A client that asked for the request's stats gets
+// them as a header, or, when the body is chunked and still being produced,
+// the promise of a trailer that end_stream fills in.
+void send_headers(int client_socket, const char *status, const char *content_type, const char *framing) {
+    response_status = atoi(status);
+    char stats[256];
+    char stats_header[300] = "";
+    if (formatRequestStats(stats, sizeof(stats))) {
+        if (strstr(framing, "chunked") != NULL) {
+            snprintf(stats_header, sizeof(stats_header), "Trailer: X-SimpleDB-Stats\r\n");
+        } else {
+            snprintf(stats_header, sizeof(stats_header), "X-SimpleDB-Stats: %s\r\n", stats);
+        }
+    }
+    char header[512];
+    int header_length = snprintf(header, sizeof(header),
+                                 "HTTP/1.1 %s\r\nContent-Type: %s\r\n%s%s%sConnection: %s\r\n\r\n",
+                                 status, content_type, framing, *framing != '\0' ? "\r\n" : "", stats_header,
+                                 connection_keeps_alive(client_socket) ? "keep-alive" : "close");
+    connection_send(client_socket, header, header_length);
+}
+
+void send_length_headers(int client_socket, const char *status, const char *content_type, size_t body_length) {
+    char framing[64];
+    snprintf(framing, sizeof(framing), "Content-Length: %lu", body_length);
+    send_headers(client_socket, status, content_type, framing);
+}
 
 void send_response(int client_socket, const char *status, const char *content_type, const char *body) {
-    char response[1024];
-    sprintf(response, "HTTP/1.1 %s\nContent-Type: %s\nContent-Length: %lu\n\n%s", status, content_type, strlen(body), body);
-    write(client_socket, response, strlen(response));
-}
-
-void get_query_value(const char *query, const char *field, char *result, size_t result_size) {
-    result[0] = '\0';  // Initialize result as an empty string
-
-    char query_copy[256];
-    strncpy(query_copy, query, sizeof(query_copy) - 1);  // Make a copy of the query string
-    query_copy[sizeof(query_copy) - 1] = '\0';  // Ensure null-termination
-
-    char *token = strtok(query_copy, "&");  // Split query by '&'
-    while (token != NULL) {
-        // Find '=' in the current token
-        char *equal_sign = strchr(token, '=');
-        if (equal_sign != NULL) {
-            *equal_sign = '\0';  // Split the token into field and value
-            char *key = token;
-            char *value = equal_sign + 1;
-
-            // Check if the current key matches the requested field
-            if (strcmp(key, field) == 0) {
-                // Copy the value to the result
-                strncpy(result, value, result_size - 1);
-                result[result_size - 1] = '\0';  // Ensure null-termination
-                return;  // Stop searching once we find the field
-            }
+    // Queue the headers and the body separately so large bodies are not truncated
+    size_t body_length = strlen(body);
+    send_length_headers(client_socket, status, content_type, body_length);
+    connection_send(client_socket, body, body_length);
+}
+
+// Send a malloc'd body, handing it to the connection instead of copying it
+void send_owned_response(int client_socket, const char *status, const char *content_type, char *body, size_t body_length) {
+    send_length_headers(client_socket, status, content_type, body_length);
+    connection_send_owned(client_socket, body, body_length);
+}
+
+// Send size bytes of a file as the body; the connection takes file over
+void send_file_response(int client_socket, const char *status, const char *content_type, int file, size_t size) {
+    send_length_headers(client_socket, status, content_type, size);
+    connection_send_file(client_socket, file, 0, size);
+}
+
+// Write all of data to a file
+int write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            return 0;
         }
-        // Move to the next key-value pair
-        token = strtok(NULL, "&");
+        data += written;
+        length -= written;
     }
-    // If field is not found, result will be an empty string
+    return 1;
 }
 
-void handle_request(char *request, int client_socket, char *username, char *password) {
-    char body[1024];  // Buffer to store the body content for POST requests
-    char path[256];  // Buffer to store the request path (without query parameters)
-    char query[256]; // Buffer to store the query string (if any)
-    char content_type[256] = "unknown";  // Default content-type
-    int content_length = 0;  // Store the content length for the body
-    int bytes_read = 0; // Track how much of the body is read
+// Response bodies are built with a JsonWriter as
+// { "status": "...", "key": value, ... }, escaping every string that comes
+// from the request or the database.
+void begin_response(JsonWriter *out, const char *status) {
+    json_init(out);
+    json_raw(out, "{ \"status\": ");
+    json_string(out, status);
+}
 
-    // Initialize the query and body to empty strings
-    query[0] = '\0';
-    body[0] = '\0';
+void response_string(JsonWriter *out, const char *key, const char *value) {
+    json_raw(out, ", ");
+    json_key(out, key);
+    json_string(out, value);
+}
 
-    //printf("Received request - %s\n", request);
+// Add a value that is already JSON
+void response_raw(JsonWriter *out, const char *key, const char *json) {
+    json_raw(out, ", ");
+    json_key(out, key);
+    json_raw(out, json);
+}
 
-    // Parse request line
-    char *method = strtok(request, " ");
-    char *full_path = strtok(NULL, " ");
-    char *http_version = strtok(NULL, "\r\n");
+void response_long(JsonWriter *out, const char *key, long long value) {
+    json_raw(out, ", ");
+    json_key(out, key);
+    json_long(out, value);
+}
 
-    printf("=> (%s) %s [%s]\n", method, full_path, http_version);
+// Echo the request body: as an object when it is one, else as a string
+void response_request(JsonWriter *out, const char *key, const char *body, const JsonRequest *fields) {
+    if (fields->valid) {
+        response_raw(out, key, body);
+    } else {
+        response_string(out, key, body);
+    }
+}
 
-    // Check if the request path is valid
-    if (full_path == NULL) {
-        printf("Invalid path\n");
-        send_response(
-	    client_socket, 
-	    NOT_FOUND, 
-	    "application/json", "{ \"status\": \"404 Not Found\", \"response\": null, \"message\": \"Path not found.\" }");
+char *end_response(JsonWriter *out) {
+    json_raw(out, " }");
+    return json_finish(out);
+}
+
+void send_json_response(int client_socket, const char *status, JsonWriter *out) {
+    json_raw(out, " }");
+    size_t length = out->length;
+    send_owned_response(client_socket, status, "application/json", json_finish(out), length);
+}
+
+// A 200 response whose "response" value is a row set of any size. Rows are
+// written into the JsonWriter, and once STREAM_CHUNK_SIZE bytes build up
+// they are moved out and the writer starts over, so a large result is never
+// held whole. Chunks go out with chunked transfer encoding, each handed to
+// the connection without a copy. A response that is to be cached is copied
+// into a result file on the way, for as long as it fits the cache's budget
+// for files. Responses that stay under one chunk are sent with a
+// Content-Length, as is everything sent to HTTP/1.0 clients, whose bodies
+// are gathered in the result file and sent from it with sendfile. A body too
+// large for the file goes to them as it is produced, without a length, and
+// the connection is closed to end it.
+typedef struct {
+    int client_socket;
+    int chunked_ok;  // The client understands chunked encoding
+    int spill;       // Copy the body to a result file while that works
+    int spill_fd;    // The result file, or -1
+    size_t spilled;  // Bytes of the body written to it
+    int chunked;     // The headers are out and the body is going out in chunks
+    int unframed;    // The headers are out and the body is going out until the close
+} ResponseStream;
+
+void send_chunk_header(int client_socket, size_t length) {
+    char size[32];
+    int size_length = snprintf(size, sizeof(size), "%lx\r\n", length);
+    connection_send(client_socket, size, size_length);
+}
+
+// Send the writer's contents as one chunk, handing its buffer over
+void send_chunk(ResponseStream *stream, JsonWriter *out) {
+    if (out->length == 0) {
+        return;
+    }
+    send_chunk_header(stream->client_socket, out->length);
+    connection_send_owned(stream->client_socket, out->data, out->length);
+    connection_send(stream->client_socket, "\r\n", 2);
+    out->data = NULL;
+    out->length = out->capacity = 0;
+}
+
+// Send the headers of a body that closing the connection ends, then what of
+// it was gathered in the result file
+void begin_unframed(ResponseStream *stream) {
+    connection_close_after(stream->client_socket);
+    send_headers(stream->client_socket, SUCCESS, "application/json", "");
+    if (stream->spilled > 0) {
+        connection_send_file(stream->client_socket, dup(stream->spill_fd), 0, stream->spilled);
+    }
+    stream->unframed = 1;
+}
+
+// Send the writer's contents as they are, handing its buffer over
+void send_unframed(ResponseStream *stream, JsonWriter *out) {
+    if (out->length == 0) {
+        return;
+    }
+    connection_send_owned(stream->client_socket, out->data, out->length);
+    out->data = NULL;
+    out->length = out->capacity = 0;
+}
+
+// Copy the writer's contents to the result file. Once the body outgrows
+// what the cache keeps in files, or the file cannot be written, the copy is
+// given up and 0 returned.
+int spill_chunk(ResponseStream *stream, JsonWriter *out) {
+    if (stream->spill_fd < 0) {
+        stream->spill_fd = createResultFile();
+    }
+    if (stream->spill_fd >= 0 && stream->spilled + out->length <= result_file_budget &&
+        write_all(stream->spill_fd, out->data, out->length)) {
+        stream->spilled += out->length;
+        return 1;
+    }
+    stream->spill = 0;
+    return 0;
+}
+
+void flush_stream(JsonWriter *out) {
+    ResponseStream *stream = out->context;
+    if (!stream->chunked_ok) {
+        // The length must be known before the body: gather it in the result
+        // file, and once the file will not do, send it without one
+        if (!stream->unframed && stream->spill && spill_chunk(stream, out)) {
+            out->length = 0;
+            return;
+        }
+        if (!stream->unframed) {
+            begin_unframed(stream);
+        }
+        send_unframed(stream, out);
+        json_reserve(out, out->flush_at);
         return;
     }
+    if (stream->spill) {
+        spill_chunk(stream, out);  // The chunk goes out whether or not the copy is kept
+    }
+    if (!stream->chunked) {
+        send_headers(stream->client_socket, SUCCESS, "application/json", "Transfer-Encoding: chunked");
+        stream->chunked = 1;
+    }
+    send_chunk(stream, out);
+    json_reserve(out, out->flush_at);
+}
+
+// Open the response and its "response" key, ready for the rows. spill asks
+// for large bodies to be kept in a result file for the cache.
+void begin_stream(JsonWriter *out, ResponseStream *stream, int client_socket, int chunked_ok, int spill) {
+    stream->client_socket = client_socket;
+    stream->chunked_ok = chunked_ok;
+    stream->spill = spill;
+    stream->spill_fd = -1;
+    stream->spilled = 0;
+    stream->chunked = 0;
+    stream->unframed = 0;
+    begin_response(out, SUCCESS);
+    json_raw(out, ", ");
+    json_key(out, "response");
+    out->flush = flush_stream;
+    out->flush_at = STREAM_CHUNK_SIZE;
+    out->context = stream;
+}
+
+// Close the response. A body that never outgrew one chunk is handed back,
+// with its length, for the caller to send and cache; otherwise the rest is
+// sent and NULL returned, leaving spill_fd set when the whole body is in the
+// result file.
+char *end_stream(JsonWriter *out, ResponseStream *stream, size_t *length) {
+    json_raw(out, " }");
+    if (stream->spill_fd < 0 && !stream->chunked && !stream->unframed) {
+        *length = out->length;
+        return json_finish(out);
+    }
 
-    // Parse the query string, if present
-    char *query_start = strchr(full_path, '?');
-    if (query_start != NULL) {
-        size_t path_length = query_start - full_path;
-        strncpy(path, full_path, path_length);
-        path[path_length] = '\0';
-        strncpy(query, query_start + 1, sizeof(query) - 1);
-        query[sizeof(query) - 1] = '\0';
+    if (stream->chunked) {
+        if (stream->spill) {
+            spill_chunk(stream, out);
+        }
+        send_chunk(stream, out);
+        char stats[256];
+        if (formatRequestStats(stats, sizeof(stats))) {
+            char trailer[300];
+            int trailer_length = snprintf(trailer, sizeof(trailer), "0\r\nX-SimpleDB-Stats: %s\r\n\r\n", stats);
+            connection_send(stream->client_socket, trailer, trailer_length);
+        } else {
+            connection_send(stream->client_socket, "0\r\n\r\n", 5);
+        }
+    } else if (stream->unframed) {
+        send_unframed(stream, out);
     } else {
-        strncpy(path, full_path, sizeof(path) - 1);
-        path[sizeof(path) - 1] = '\0';
-    }
-
-    // Parse headers
-    char *header = strtok(NULL, "\r\n");
-    while (header != NULL && strlen(header) > 0) {
-        if (strncmp(header, "Content-Length:", 15) == 0) {
-            content_length = atoi(header + 16);
-        } else if (strncmp(header, "Content-Type:", 13) == 0) {
-            strncpy(content_type, header + 14, sizeof(content_type) - 1);
-            content_type[sizeof(content_type) - 1] = '\0';
+        // The body so far is in the file and the rest in the writer
+        if (stream->spill && spill_chunk(stream, out)) {
+            out->length = 0;
         }
+        send_length_headers(stream->client_socket, SUCCESS, "application/json", stream->spilled + out->length);
+        connection_send_file(stream->client_socket, dup(stream->spill_fd), 0, stream->spilled);
+        if (out->length > 0) {
+            connection_send_owned(stream->client_socket, out->data, out->length);
+            out->data = NULL;
+        }
+    }
+    json_free(out);
+    if (!stream->spill && stream->spill_fd >= 0) {
+        close(stream->spill_fd);  // Only a complete body is worth caching
+        stream->spill_fd = -1;
+    }
+    return NULL;
+}
 
-        header = strtok(NULL, "\r\n");
+// Drop a streamed response that failed. Returns 1 if none of it has reached
+// the client, which can then be sent an error instead; otherwise the
+// connection is cut short.
+int abandon_stream(JsonWriter *out, ResponseStream *stream) {
+    json_free(out);
+    if (stream->spill_fd >= 0) {
+        close(stream->spill_fd);
+        stream->spill_fd = -1;
     }
+    if (stream->chunked || stream->unframed) {
+        connection_abort(stream->client_socket);
+        return 0;
+    }
+    return 1;
+}
 
-    // Check for POST method and read the body
-    if (strcmp(method, "POST") == 0 && content_length > 0) {
-        int total_bytes_read = 0;
-        char buffer[1024];
+// Close a streamed response and send whatever of it has not gone out yet
+void send_stream(JsonWriter *out, ResponseStream *stream) {
+    size_t length;
+    char *response_body = end_stream(out, stream, &length);
+    if (response_body != NULL) {
+        send_owned_response(stream->client_socket, SUCCESS, "application/json", response_body, length);
+    }
+}
 
-        while (total_bytes_read < content_length) {
-            bytes_read = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-            if (bytes_read <= 0) {
-                printf("Error reading body\n");
-                break;
-            }
-            buffer[bytes_read] = '\0';
-            strncat(body, buffer, sizeof(body) - strlen(body) - 1);  // Concatenate the data to the body buffer
-            total_bytes_read += bytes_read;
-        }
+// Report a query error with its message escaped as a JSON string
+void send_query_error(int client_socket, const char *status, const char *database_name, const char *error) {
+    JsonWriter out;
+    begin_response(&out, status);
+    response_raw(&out, "response", "null");
+    response_string(&out, "database", database_name);
+    response_string(&out, "message", error);
+    send_json_response(client_socket, status, &out);
+}
 
-	char *json_start = strchr(body, '{');
-	// Setting the json_start value to the body
-	if (json_start != NULL) {
-	      strncpy(body, json_start, sizeof(body) - 1);  // Copy the JSON to body
-	      body[sizeof(body) - 1] = '\0';  // Ensure null termination
-	    } else {
-	      strcpy(body, "No JSON found");  // Handle the case where no JSON is found
-	  }
-	printf("=> POST Data = %s\n", body);
+// A list given either as a JSON array or as a comma-separated string
+char **request_list(Arena *arena, const JsonRequest *request, const char *key, int *count) {
+    const JsonField *field = json_field(request, key);
+    if (field != NULL && field->type == JSON_ARRAY) {
+        return json_array_items(arena, field, count);
     }
+    return split_string(arena, json_value(request, key), ",", count);
+}
 
-    // Authentication logic
-    char username_from_req[256];
-    char password_from_req[256];
+// What a route handler gets besides the arena and the socket: the request as
+// parsed by handle_request and the path segments after the route's prefix
+typedef struct {
+    const char *input;  // The request as received
+    const HttpRequest *http;
+    const char *path;   // As sent, still percent-encoded
+    const char *body;
+    const JsonRequest *fields;
+    int chunked_ok;
+    char **params;
+    int param_count;
+} RouteRequest;
 
-    get_query_value(query, "username", username_from_req, sizeof(username_from_req));
-    get_query_value(query, "password", password_from_req, sizeof(password_from_req));
+typedef void (*RouteHandler)(Arena *arena, int client_socket, const RouteRequest *request);
 
-    if (strcmp(username_from_req, username) != 0 || strcmp(password_from_req, password) != 0) {
-        send_response(client_socket, UNAUTHORIZED, "application/json", "{\"status\": \"0\",\"response\": \"Unauthorized\"}");
+// The path segment at index after the route's prefix, or NULL
+char *route_param(const RouteRequest *request, int index) {
+    return index < request->param_count ? request->params[index] : NULL;
+}
+
+// Decode a query string parameter into result, or leave it empty
+void route_query_value(const RouteRequest *request, const char *field, char *result, size_t result_size) {
+    http_query_value(request->http, request->input, field, result, result_size);
+}
+
+// Refuse a write whose text would break the lines of the table file
+void send_bad_value(int client_socket, const RouteRequest *request, const char *error) {
+    JsonWriter out;
+    begin_response(&out, BAD_REQUEST);
+    response_request(&out, "data", request->body, request->fields);
+    response_string(&out, "message", error);
+    send_json_response(client_socket, BAD_REQUEST, &out);
+}
+
+
+void route_list_databases(Arena *arena, int client_socket, const RouteRequest *request) {
+    (void)arena;
+    (void)request;
+    char *database_list = listDB(DB_DIRECTORY);
+    JsonWriter out;
+    begin_response(&out, SUCCESS);
+    response_raw(&out, "response", database_list != NULL ? database_list : "null");
+    send_json_response(client_socket, SUCCESS, &out);
+    free(database_list);
+}
+
+// Send a table's rows, only those whose check_field equals check_value when
+// a filter is given, in the order the request's order_by asks for. Repeated
+// reads of an unchanged table are answered from the result cache.
+void send_table_rows(Arena *arena, int client_socket, const RouteRequest *request, const char *database_name,
+                     const char *table_name, const char *check_field, const char *check_value) {
+    char order_by[256];
+    route_query_value(request, "order_by", order_by, sizeof(order_by));
+    char *cache_key = arena_printf(arena, "%s?order_by=%s", request->path, order_by);
+    unsigned long data_version = dataVersion(database_name, table_name);
+    const char *cached = lookupCachedResult(arena, cache_key, database_name, table_name);
+    size_t file_size = 0;
+    int file = cached == NULL ? lookupCachedFile(cache_key, database_name, table_name, &file_size) : -1;
+    if (cached != NULL) {
+        send_response(client_socket, SUCCESS, "application/json", cached);
+        return;
+    }
+    if (file >= 0) {
+        send_file_response(client_socket, SUCCESS, "application/json", file, file_size);
         return;
     }
 
-    // Handle different paths
-    if (strcmp(path, "/list/db") == 0 && strcmp(method, "GET") == 0) {
-        char *database_list = listDB(DB_DIRECTORY);
-        char response_body[600];
-        sprintf(response_body, "{\"status\": \"%s\", \"response\": %s}", SUCCESS, database_list);
-        send_response(client_socket, SUCCESS, "application/json", response_body);
-        free(database_list);
-    } else if (strncmp(path, "/list/table/data/", 16) == 0 && strcmp(method, "GET") == 0) {
-        char data[256];
-        char response_body[1024];
-        sscanf(path + 16, "%s", data);
-	int data_count = 0;
-	char **data_array = split_string(data, "/", &data_count);
-	char *database_name = data_array[0];
-	char *table_name = data_array[1];
-	if(database_name == NULL || table_name == NULL) {
-            sprintf(response_body, "{ \"status\": \"%s\", \"response\": []}", BAD_REQUEST);
-            send_response(client_socket, BAD_REQUEST, "application/json", response_body);
-	      for(int i = 0; i < data_count; i++) {
-		  free(data_array[i]);
-	      }
-	    free(data_array);
-	    return;
-	}
-        char *result = fetchTableData(database_name,table_name);
-        if (result) {
-            sprintf(
-		response_body, 
-		"{ \"status\": \"%s\", \"response\": %s, \"database\": \"%s\" , \"table\": \"%s\"}", 
-		SUCCESS, 
-		result, 
-		database_name,
-		table_name
-		);
-            send_response(client_socket, SUCCESS, "application/json", response_body);
-        } else {
-            sprintf(
-		response_body, 
-		"{ \"status\": \"%s\", \"response\": [], \"database\": \"%s\", \"table\": \"%s\" }", 
-		SUCCESS,
-		database_name,
-		table_name
-		);
-            send_response(client_socket, SUCCESS, "application/json", response_body);
+    JsonWriter out;
+    ResponseStream stream;
+    begin_stream(&out, &stream, client_socket, request->chunked_ok, 1);
+    char error[384] = "";
+    int fetched;
+    if (strlen(order_by) > 0) {
+        fetched = fetchOrderedTableData(&out, database_name, table_name, check_field, check_value, order_by, error, sizeof(error));
+    } else if (check_field != NULL) {
+        fetched = fetchFilteredTableData(&out, database_name, table_name, check_field, check_value);
+    } else {
+        fetched = fetchTableData(&out, database_name, table_name);
+    }
+    if (error[0] != '\0') {
+        if (abandon_stream(&out, &stream)) {
+            const char *status = fetched < 0 ? SERVER_ERROR : BAD_REQUEST;
+            begin_response(&out, status);
+            response_raw(&out, "response", "null");
+            response_string(&out, "database", database_name);
+            response_string(&out, "table", table_name);
+            response_string(&out, "message", error);
+            send_json_response(client_socket, status, &out);
         }
-	  for(int i = 0; i < data_count; i++) {
-	      free(data_array[i]);
-	  }
-	free(data_array);
-        free(result);
-    } else if (strncmp(path, "/list/table/filter/", 18) == 0 && strcmp(method, "GET") == 0) {
-        char data[256];
-        char response_body[1024];
-        sscanf(path + 18, "%s", data);
-	int data_count = 0;
-	char **data_array = split_string(data, "/", &data_count);
-	char *database_name = data_array[0];
-	char *table_name = data_array[1];
-	char *check_field = data_array[2];
-	char *check_value = data_array[3];
-	if(database_name == NULL || table_name == NULL || check_field == NULL || check_value == NULL) {
-            sprintf(response_body, "{ \"status\": \"%s\", \"response\": []}", BAD_REQUEST);
-            send_response(client_socket, BAD_REQUEST, "application/json", response_body);
-	      for(int i = 0; i < data_count; i++) {
-		  free(data_array[i]);
-	      }
-	    free(data_array);
-	    return;
-	}
-	char *result = fetchFilteredTableData(database_name, table_name, check_field, check_value);
+        return;
+    }
+    if (!fetched) {
+        json_raw(&out, "[]");
+    }
+    response_string(&out, "database", database_name);
+    response_string(&out, "table", table_name);
+    size_t length;
+    char *response_body = end_stream(&out, &stream, &length);
+    if (response_body != NULL) {
+        storeCachedResult(cache_key, data_version, response_body);
+        send_owned_response(client_socket, SUCCESS, "application/json", response_body, length);
+    } else if (stream.spill_fd >= 0) {
+        storeCachedFile(cache_key, data_version, stream.spill_fd, stream.spilled);
+    }
+}
+
+void route_list_table_data(Arena *arena, int client_socket, const RouteRequest *request) {
+    char *database_name = route_param(request, 0);
+    char *table_name = route_param(request, 1);
+    if(database_name == NULL || table_name == NULL) {
+        JsonWriter out;
+        begin_response(&out, BAD_REQUEST);
+        response_raw(&out, "response", "[]");
+        send_json_response(client_socket, BAD_REQUEST, &out);
+        return;
+    }
+    send_table_rows(arena, client_socket, request, database_name, table_name, NULL, NULL);
+}
+
+void route_filter_table_data(Arena *arena, int client_socket, const RouteRequest *request) {
+    char *database_name = route_param(request, 0);
+    char *table_name = route_param(request, 1);
+    char *check_field = route_param(request, 2);
+    char *check_value = route_param(request, 3);
+    if(database_name == NULL || table_name == NULL || check_field == NULL || check_value == NULL) {
+        JsonWriter out;
+        begin_response(&out, BAD_REQUEST);
+        response_raw(&out, "response", "[]");
+        send_json_response(client_socket, BAD_REQUEST, &out);
+        return;
+    }
+    send_table_rows(arena, client_socket, request, database_name, table_name, check_field, check_value);
+}
+
+void route_list_tables(Arena *arena, int client_socket, const RouteRequest *request) {
+    const char *database_name = request->param_count > 0 ? request->params[0] : "";
+    char *tresult = listTable(arena, database_name);
+    JsonWriter out;
+    begin_response(&out, SUCCESS);
+    if (tresult) {
+        response_raw(&out, "response", tresult);
+        response_string(&out, "database", database_name);
+    } else {
+        response_raw(&out, "response", "{\"tables\": []}");
+    }
+    send_json_response(client_socket, SUCCESS, &out);
+    free(tresult);
+}
+
+void route_create_database(Arena *arena, int client_socket, const RouteRequest *request) {
+    JsonWriter out;
+    char *database_name = json_value(request->fields, "database_name");
+    if(database_name == NULL || strlen(database_name) == 0) {
+            begin_response(&out, BAD_REQUEST);
+            response_request(&out, "data", request->body, request->fields);
+            send_json_response(client_socket, BAD_REQUEST, &out);
+            return;
+    }
+    int db_create_result = createDB(arena, database_name);
+    // // Check the result and print appropriate message
+    if (db_create_result > 0) {
+        char message[600];
+        snprintf(message, sizeof(message), "Database '%s' created successfully.", database_name);
+        begin_response(&out, SUCCESS);
+        response_request(&out, "response", request->body, request->fields);
+        response_string(&out, "message", message);
+        send_json_response(client_socket, SUCCESS, &out);
+    } else {
+        char message[600];
+        snprintf(message, sizeof(message), "Database '%s' already exists.", database_name);
+        begin_response(&out, "203 Conflict");
+        response_request(&out, "response", request->body, request->fields);
+        response_string(&out, "message", message);
+        send_json_response(client_socket, "203 Conflict", &out);
+    }
+}
+
+void route_create_table(Arena *arena, int client_socket, const RouteRequest *request) {
+    JsonWriter out;
+    char *table_name = json_value(request->fields, "table_name");
+    char *database_name = json_value(request->fields, "database_name");
+    int column_count = 0;
+    int type_count = 0;
+    char **columns = request_list(arena, request->fields, "columns", &column_count);
+    char **types = request_list(arena, request->fields, "types", &type_count);
+    if (
+        table_name == NULL || strlen(table_name) == 0 ||
+        database_name == NULL || strlen(database_name) == 0 ||
+        column_count == 0 || type_count == 0 ||
+        column_count != type_count ||
+        columns == NULL || types == NULL
+        ) {
+            begin_response(&out, BAD_REQUEST);
+            response_request(&out, "data", request->body, request->fields);
+            send_json_response(client_socket, BAD_REQUEST, &out);
+            return;
+    }
+    if (!validStoredNames(table_name, (const char *const *)columns, (const char *const *)types, column_count)) {
+        send_bad_value(client_socket, request, "Names and types may not contain commas or line breaks");
+        return;
+    }
+    int db_table_create_result = createTable(
+          arena,
+          database_name,
+          table_name,
+          (const char **)columns,
+          (const char **)types,
+          column_count
+          );
+     if(db_table_create_result > 0) {
+        char message[600];
+        snprintf(message, sizeof(message), "Database '%s' created successfully.", table_name);
+        begin_response(&out, SUCCESS);
+        response_request(&out, "response", request->body, request->fields);
+        response_string(&out, "message", message);
+        send_json_response(client_socket, SUCCESS, &out);
+    } else {
+        char message[600];
+        snprintf(message, sizeof(message), "Database '%s' already exists.", table_name);
+        begin_response(&out, "203 Conflict");
+        response_request(&out, "response", request->body, request->fields);
+        response_string(&out, "message", message);
+        send_json_response(client_socket, "203 Conflict", &out);
+    }
+}
+
+void route_insert(Arena *arena, int client_socket, const RouteRequest *request) {
+    JsonWriter out;
+    char *table_name = json_value(request->fields, "table_name");
+    char *database_name = json_value(request->fields, "database_name");
+    char *value = json_value(request->fields, "value");
+    if (
+        table_name == NULL || strlen(table_name) == 0 ||
+        database_name == NULL || strlen(database_name) == 0 ||
+        value == NULL || strlen(value) == 0
+        ) {
+            begin_response(&out, BAD_REQUEST);
+            response_request(&out, "data", request->body, request->fields);
+            send_json_response(client_socket, BAD_REQUEST, &out);
+            return;
+    }
+    if (!validStoredRow(value)) {
+        send_bad_value(client_socket, request, "Values may not contain line breaks");
+        return;
+    }
+     int insert_result = insertTableValues(arena, database_name, table_name, value);
+     if(insert_result > 0) {
+        char message[600];
+        snprintf(message, sizeof(message), "Values in Table: '%s' inserted successfully.", table_name);
+        begin_response(&out, SUCCESS);
+        response_request(&out, "response", request->body, request->fields);
+        response_string(&out, "message", message);
+        send_json_response(client_socket, SUCCESS, &out);
+    } else {
+        char message[600];
+        snprintf(message, sizeof(message), "Values in Table: '%s' were not inserted.", table_name);
+        begin_response(&out, "203 Conflict");
+        response_request(&out, "response", request->body, request->fields);
+        response_string(&out, "message", message);
+        send_json_response(client_socket, "203 Conflict", &out);
+    }
+}
+
+void route_update(Arena *arena, int client_socket, const RouteRequest *request) {
+    (void)arena;
+    JsonWriter out;
+    char *table_name = json_value(request->fields, "table_name");
+    char *database_name = json_value(request->fields, "database_name");
+    const char *check_field = json_value(request->fields, "target_field");
+    const char *check_value = json_value(request->fields, "target_value");
+    const char *update_field = json_value(request->fields, "new_field");
+    const char *update_value = json_value(request->fields, "new_value");
+    if (
+        table_name == NULL || strlen(table_name) == 0 ||
+        database_name == NULL || strlen(database_name) == 0 ||
+        check_field == NULL || strlen(check_field) == 0 ||
+        check_value == NULL || strlen(check_value) == 0 ||
+        update_field == NULL || strlen(update_field) == 0 ||
+        update_value == NULL || strlen(update_value) == 0
+        ) {
+            begin_response(&out, BAD_REQUEST);
+            response_request(&out, "data", request->body, request->fields);
+            send_json_response(client_socket, BAD_REQUEST, &out);
+            return;
+    }
+    if (!validStoredValue(update_value)) {
+        send_bad_value(client_socket, request, "Values may not contain commas or line breaks");
+        return;
+    }
+
+             int update_result = updateTableData(
+                 database_name,
+                 table_name,
+                 check_field,
+                 check_value,
+                 update_field,
+                 update_value
+                 );
+    char message[1200];
+    snprintf(
+        message,
+        sizeof(message),
+        "Table: '%s' , Field: '%s',  Value: '%s', Updated Field '%s', NEW_VALUE: '%s'  %s",
+        table_name,
+        check_field,
+        check_value,
+        update_field,
+        update_value,
+        update_result > 0 ? "updated successfully." : "update failed."
+        );
+    begin_response(&out, SUCCESS);
+    response_request(&out, "response", request->body, request->fields);
+    response_string(&out, "message", message);
+    send_json_response(client_socket, SUCCESS, &out);
+}
+
+void route_delete_database(Arena *arena, int client_socket, const RouteRequest *request) {
+    const char *database_name = request->param_count > 0 ? request->params[0] : "";
+    JsonWriter out;
+    int result = deleteDB(arena, database_name);
+    begin_response(&out, SUCCESS);
+    if (result == 0) {
+        response_long(&out, "response", result);
+        response_string(&out, "database", database_name);
+        response_string(&out, "message", "Database deleted successfully.");
+    } else {
+        response_raw(&out, "response", "null");
+        response_string(&out, "database", database_name);
+        response_string(&out, "message", "Unable to delete database.");
+    }
+    send_json_response(client_socket, SUCCESS, &out);
+}
+
+void route_delete_table_data(Arena *arena, int client_socket, const RouteRequest *request) {
+    (void)arena;
+    char *database_name = route_param(request, 0);
+    char *table_name = route_param(request, 1);
+    char *check_field = route_param(request, 2);
+    char *check_value = route_param(request, 3);
+    if (request->param_count < 4) {
+        send_response(client_socket, BAD_REQUEST, "application/json", "{ \"status\": \"400 Bad Request\", \"response\": null}");
+        return;
+    }
+    JsonWriter out;
+    int result = deleteTableData(database_name, table_name, check_field, check_value);
+    begin_response(&out, SUCCESS);
+    if (result) {
+        response_long(&out, "response", result);
+    } else {
+        response_raw(&out, "response", "null");
+    }
+    response_string(&out, "database", database_name);
+    response_string(&out, "table", table_name);
+    response_string(&out, "message", result ? "Table Row deleted successfully." : "Unable to delete Table Row.");
+    response_string(&out, "check_field", check_field);
+    response_string(&out, "check_value", check_value);
+    send_json_response(client_socket, SUCCESS, &out);
+}
+
+void route_delete_table(Arena *arena, int client_socket, const RouteRequest *request) {
+    char *database_name = route_param(request, 0);
+    char *table_name = route_param(request, 1);
+    if (request->param_count < 2) {
+        send_response(client_socket, BAD_REQUEST, "application/json", "{ \"status\": \"400 Bad Request\", \"response\": null}");
+        return;
+    }
+    JsonWriter out;
+    int result = deleteTable(arena, database_name, table_name);
+    begin_response(&out, SUCCESS);
+    if (result > 0) {
+        response_long(&out, "response", result);
+    } else {
+        response_raw(&out, "response", "null");
+    }
+    response_string(&out, "database", database_name);
+    response_string(&out, "table", table_name);
+    response_string(&out, "message", result > 0 ? "Table deleted successfully." : "Unable to delete Table.");
+    send_json_response(client_socket, SUCCESS, &out);
+}
+
+void route_aggregate(Arena *arena, int client_socket, const RouteRequest *request) {
+    (void)arena;
+    char functions[256];
+    char group_by[256];
+    route_query_value(request, "fn", functions, sizeof(functions));
+    route_query_value(request, "group_by", group_by, sizeof(group_by));
+    if (request->param_count < 2 || strlen(functions) == 0) {
+        send_response(client_socket, BAD_REQUEST, "application/json", "{ \"status\": \"400 Bad Request\", \"response\": []}");
+    } else {
+        char *database_name = route_param(request, 0);
+        char *table_name = route_param(request, 1);
+        char *result = aggregateTableData(database_name, table_name, functions, group_by);
+        JsonWriter out;
         if (result != NULL) {
-            sprintf(
-		response_body, 
-		"{ \"status\": \"%s\", \"response\": %s, \"database\": \"%s\" , \"table\": \"%s\"}", 
-		SUCCESS, 
-		result, 
-		database_name,
-		table_name
-		);
-            send_response(client_socket, SUCCESS, "application/json", response_body);
+            begin_response(&out, SUCCESS);
+            response_raw(&out, "response", result);
+            response_string(&out, "database", database_name);
+            response_string(&out, "table", table_name);
+            send_json_response(client_socket, SUCCESS, &out);
         } else {
-            sprintf(
-		response_body, 
-		"{ \"status\": \"%s\", \"response\": [], \"database\": \"%s\", \"table\": \"%s\" }", 
-		SUCCESS,
-		database_name,
-		table_name
-		);
-            send_response(client_socket, SUCCESS, "application/json", response_body);
+            begin_response(&out, BAD_REQUEST);
+            response_raw(&out, "response", "null");
+            response_string(&out, "database", database_name);
+            response_string(&out, "table", table_name);
+            response_string(&out, "message", "Unknown table, column or aggregate function.");
+            send_json_response(client_socket, BAD_REQUEST, &out);
         }
-	  for(int i = 0; i < data_count; i++) {
-	      free(data_array[i]);
-	  }
-	free(data_array);
         free(result);
-    }   else if (strncmp(path, "/list/table/", 12) == 0 && strcmp(method, "GET") == 0) {
-        char database_name[256];
-        sscanf(path + 12, "%s", database_name);
-        char response_body[600];
-        char *tresult = listTable(database_name);
-        if (tresult) {
-            sprintf(response_body, "{ \"status\": \"%s\", \"response\": %s, \"database\": \"%s\"}", SUCCESS, tresult, database_name);
-            send_response(client_socket, SUCCESS, "application/json", response_body);
-        } else {
-            sprintf(response_body, "{ \"status\": \"%s\", \"response\": {\"tables\": []}}", SUCCESS);
-            send_response(client_socket, SUCCESS, "application/json", response_body);
+    }
+}
+
+void route_query(Arena *arena, int client_socket, const RouteRequest *request) {
+    char *database_name = json_value(request->fields, "database_name");
+    char *sql = json_value(request->fields, "query");
+    JsonWriter out;
+    if (database_name == NULL || strlen(database_name) == 0 || sql == NULL || strlen(sql) == 0) {
+        begin_response(&out, BAD_REQUEST);
+        response_request(&out, "data", request->body, request->fields);
+        send_json_response(client_socket, BAD_REQUEST, &out);
+    } else {
+        char error[256] = "";
+        ResponseStream stream;
+        begin_stream(&out, &stream, client_socket, request->chunked_ok, 0);
+        if (executeQuery(arena, &out, OUTPUT_JSON, database_name, sql, NULL, 0, error, sizeof(error))) {
+            response_string(&out, "database", database_name);
+            send_stream(&out, &stream);
+        } else if (abandon_stream(&out, &stream)) {
+            send_query_error(client_socket, BAD_REQUEST, database_name, error);
         }
-        free(tresult);
-    } else if (strcmp(path, "/create/db") == 0 && strcmp(method, "POST") == 0) {
-        char response_body[600];
-	char *database_name = extract_json_value(body, "database_name");
-	if(database_name == NULL && strlen(database_name) <= 1) {
-		sprintf(response_body, "{\"status\": %s, \"data\": %s}", BAD_REQUEST, body);
-		send_response(client_socket, BAD_REQUEST, "application/json", response_body);
-		return;
-	}
-        int db_create_result = createDB(database_name);
-	// // Check the result and print appropriate message
-        if (db_create_result > 0) {
-	    sprintf(
-		response_body, 
-		"{\"status\": %s, \"response\": %s , \"message\": \"Database '%s' created successfully.\"}", 
-		SUCCESS,
-		body,
-		database_name
-		);
-	    send_response(client_socket, SUCCESS , "application/json", response_body);
+    }
+}
+
+void route_prepare(Arena *arena, int client_socket, const RouteRequest *request) {
+    (void)arena;
+    char *database_name = json_value(request->fields, "database_name");
+    char *sql = json_value(request->fields, "query");
+    JsonWriter out;
+    if (database_name == NULL || strlen(database_name) == 0 || sql == NULL || strlen(sql) == 0) {
+        begin_response(&out, BAD_REQUEST);
+        response_request(&out, "data", request->body, request->fields);
+        send_json_response(client_socket, BAD_REQUEST, &out);
+    } else {
+        char error[256] = "";
+        int parameter_count = 0;
+        unsigned long handle = prepareQuery(database_name, sql, &parameter_count, error, sizeof(error));
+        if (handle != 0) {
+            begin_response(&out, SUCCESS);
+            json_raw(&out, ", \"response\": {\"statement\": ");
+            json_long(&out, handle);
+            json_raw(&out, ", \"parameters\": ");
+            json_long(&out, parameter_count);
+            json_char(&out, '}');
+            response_string(&out, "database", database_name);
+            send_json_response(client_socket, SUCCESS, &out);
         } else {
-	    sprintf(
-		response_body, 
-		"{\"status\": \"203 Conflict\", \"response\": %s, \"message\": \"Database '%s' already exists.\"}", 
-		body,
-		database_name
-		);
-	    send_response(client_socket, "203 Conflict", "application/json", response_body);
+            send_query_error(client_socket, BAD_REQUEST, database_name, error);
         }
-	free(database_name);
-    } else if (strcmp(path, "/create/table") == 0 && strcmp(method, "POST") == 0) {
-        char response_body[600];
-	char *table_name = extract_json_value(body, "table_name");
-	char *database_name = extract_json_value(body, "database_name");
-	int column_count = 0;
-	int type_count = 0;
-	char **columns = split_string(extract_json_value(body, "columns"), ",", &column_count);
-	char **types =  split_string(extract_json_value(body, "types"), ",", &type_count);
-        if (
-	    table_name == NULL || strlen(table_name) == 0 || 
-	    database_name == NULL || strlen(database_name) == 0 ||
-	    column_count == 0 || type_count == 0 ||
-	    column_count != type_count || 
-	    columns == NULL || types == NULL
-	    ) {
-		sprintf(response_body, "{\"status\": %s, \"data\": %s}", BAD_REQUEST, body);
-		send_response(client_socket, BAD_REQUEST, "application/json", response_body);
-		free(table_name);
-		free(database_name);
-		free(columns);
-		free(types);
-		return;
-	}
-	int db_table_create_result = createTable(
-	      database_name, 
-	      table_name, 
-	      (const char **)columns, 
-	      (const char **)types, 
-	      column_count
-	      );
- 	 if(db_table_create_result > 0) {
-	    sprintf(
-		response_body, 
-		"{\"status\": %s, \"response\": %s , \"message\": \"Database '%s' created successfully.\"}", 
-		SUCCESS,
-		body,
-		table_name
-		);
-	    send_response(client_socket, SUCCESS , "application/json", response_body);
-        } else {
-	    sprintf(
-		response_body, 
-		"{\"status\": \"203 Conflict\", \"response\": %s, \"message\": \"Database '%s' already exists.\"}", 
-		body,
-		table_name
-		);
-	    send_response(client_socket, "203 Conflict", "application/json", response_body);
+    }
+}
+
+void route_execute(Arena *arena, int client_socket, const RouteRequest *request) {
+    // {"statement": handle, "params": ["value", ...]} or "params": "value,value,..."
+    char *statement = json_value(request->fields, "statement");
+    const JsonField *params_field = json_field(request->fields, "params");
+    char *texts[MAX_PARAMETERS];
+    char **params = texts;
+    int param_count = 0;
+    if (params_field != NULL && params_field->type == JSON_ARRAY) {
+        params = json_array_items(arena, params_field, &param_count);
+    } else if (params_field != NULL && params_field->type != JSON_NULL) {
+        param_count = splitParameters(arena, params_field->text, texts);
+    }
+    JsonWriter out;
+    unsigned long handle = statement != NULL ? strtoul(statement, NULL, 10) : 0;
+    if (handle == 0) {
+        begin_response(&out, BAD_REQUEST);
+        response_request(&out, "data", request->body, request->fields);
+        send_json_response(client_socket, BAD_REQUEST, &out);
+    } else {
+        char error[256] = "";
+        int found = 0;
+        ResponseStream stream;
+        begin_stream(&out, &stream, client_socket, request->chunked_ok, 0);
+        if (executePrepared(arena, &out, OUTPUT_JSON, handle, params, param_count, &found, error, sizeof(error))) {
+            response_long(&out, "statement", handle);
+            send_stream(&out, &stream);
+        } else if (abandon_stream(&out, &stream)) {
+            send_query_error(client_socket, found ? BAD_REQUEST : NOT_FOUND, "", error);
         }
-	free(table_name);
-	free(database_name);
-	free(columns);
-	free(types);
-    } else if (strcmp(path, "/insert") == 0 && strcmp(method, "POST") == 0) {
-        char response_body[600];
-	char *table_name = extract_json_value(body, "table_name");
-	char *database_name = extract_json_value(body, "database_name");
-	char *value = extract_json_value(body, "value");
-        if (
-	    table_name == NULL || strlen(table_name) == 0 || 
-	    database_name == NULL || strlen(database_name) == 0 ||
-	    value == NULL || strlen(value) == 0
-	    ) {
-		sprintf(response_body, "{\"status\": %s, \"data\": %s}", BAD_REQUEST, body);
-		send_response(client_socket, BAD_REQUEST, "application/json", response_body);
-		free(table_name);
-		free(database_name);
-		free(value);
-		return;
-	}
-	 int insert_result = insertTableValues(database_name, table_name, value);
- 	 if(insert_result > 0) {
-	    sprintf(
-		response_body, 
-		"{\"status\": %s, \"response\": %s , \"message\": \"Values in Table: '%s' inserted successfully.\"}", 
-		SUCCESS,
-		body,
-		table_name
-		);
-	    send_response(client_socket, SUCCESS , "application/json", response_body);
+    }
+}
+
+void route_join(Arena *arena, int client_socket, const RouteRequest *request) {
+    (void)arena;
+    char on[256];
+    char type[32];
+    route_query_value(request, "on", on, sizeof(on));
+    route_query_value(request, "type", type, sizeof(type));
+    // on=left_column:right_column, or on=column when both sides share the name
+    char *right_column = strchr(on, ':');
+    if (right_column != NULL) {
+        *right_column++ = '\0';
+    } else {
+        right_column = on;
+    }
+    int left_join = strcmp(type, "left") == 0;
+    if (request->param_count < 3 || strlen(on) == 0 || strlen(right_column) == 0 || (strlen(type) > 0 && !left_join && strcmp(type, "inner") != 0)) {
+        send_response(client_socket, BAD_REQUEST, "application/json", "{ \"status\": \"400 Bad Request\", \"response\": []}");
+    } else {
+        char *database_name = route_param(request, 0);
+        char *left_table = route_param(request, 1);
+        char *right_table = route_param(request, 2);
+        JsonWriter out;
+        ResponseStream stream;
+        begin_stream(&out, &stream, client_socket, request->chunked_ok, 0);
+        if (joinTableData(&out, database_name, left_table, right_table, on, right_column, left_join)) {
+            response_string(&out, "database", database_name);
+            json_raw(&out, ", \"tables\": [");
+            json_string(&out, left_table);
+            json_raw(&out, ", ");
+            json_string(&out, right_table);
+            json_char(&out, ']');
+            send_stream(&out, &stream);
         } else {
-	    sprintf(
-		response_body, 
-		"{\"status\": \"203 Conflict\", \"response\": %s, \"message\": \"Values in Table: '%s' were not inserted.\"}", 
-		body,
-		table_name
-		);
-	    send_response(client_socket, "203 Conflict", "application/json", response_body);
+            json_free(&out);
+            begin_response(&out, BAD_REQUEST);
+            response_raw(&out, "response", "null");
+            response_string(&out, "database", database_name);
+            response_string(&out, "message", "Unknown table or join column.");
+            send_json_response(client_socket, BAD_REQUEST, &out);
         }
-	free(table_name);
-	free(database_name);
-	free(value);
-    } else if (strcmp(path, "/update") == 0 && strcmp(method, "POST") == 0) {
-        char response_body[600];
-	char *table_name = extract_json_value(body, "table_name");
-	char *database_name = extract_json_value(body, "database_name");
-	const char *check_field = extract_json_value(body, "target_field");
-	const char *check_value = extract_json_value(body, "target_value");
-	const char *update_field = extract_json_value(body, "new_field");
-	const char *update_value = extract_json_value(body, "new_value");
-        if (
-	    table_name == NULL || strlen(table_name) == 0 || 
-	    database_name == NULL || strlen(database_name) == 0 ||
-	    check_field == NULL || strlen(check_field) == 0 ||
-	    check_value == NULL || strlen(check_value) == 0 ||
-	    update_field == NULL || strlen(update_field) == 0 ||
-	    update_value == NULL || strlen(update_value) == 0
-	    ) {
-		sprintf(response_body, "{\"status\": %s, \"data\": %s}", BAD_REQUEST, body);
-		send_response(client_socket, BAD_REQUEST, "application/json", response_body);
-		free(table_name);
-		free(database_name);
-		free(check_field);
-		free(check_value);
-		free(update_field);
-		free(update_value);
-		return;
-	}
-		
-		 int update_result = updateTableData(
-		     database_name, 
-		     table_name, 
-		     check_field, 
-		     check_value, 
-		     update_field, 
-		     update_value
-		     );
- 	 if(update_result > 0) {
-	    sprintf(
-		response_body, 
-		"{\"status\": %s, \"response\": %s , \"message\": \"Table: '%s' , Field: '%s',  Value: '%s', Updated Field '%s', NEW_VALUE: '%s'  updated successfully.\"}", 
-		SUCCESS,
-		body,
-		table_name,
-		check_field,
-		check_value,
-		update_field,
-		update_value
-		);
-	    send_response(client_socket, SUCCESS , "application/json", response_body);
-        } else {
-	    sprintf(
-		response_body, 
-		"{\"status\": %s, \"response\": %s , \"message\": \"Table: '%s' , Field: '%s',  Value: '%s', Updated Field '%s', NEW_VALUE: '%s'  update failed.\"}", 
-		SUCCESS,
-		body,
-		table_name,
-		check_field,
-		check_value,
-		update_field,
-		update_value
-		);
-	    send_response(client_socket, SUCCESS , "application/json", response_body);
+    }
+}
+
+typedef enum {
+    METHOD_GET,
+    METHOD_POST,
+    METHOD_DELETE,
+    METHOD_COUNT
+} RouteMethod;
+
+// A pattern is a path of fixed segments; one ending in "/*" also takes any
+// segments after them as parameters
+typedef struct {
+    RouteMethod method;
+    const char *pattern;
+    RouteHandler handler;
+} Route;
+
+void route_metrics(Arena *arena, int client_socket, const RouteRequest *request);
+
+const Route routes[] = {
+    {METHOD_GET, "/list/db", route_list_databases},
+    {METHOD_GET, "/list/table/*", route_list_tables},
+    {METHOD_GET, "/list/table/data/*", route_list_table_data},
+    {METHOD_GET, "/list/table/filter/*", route_filter_table_data},
+    {METHOD_POST, "/create/db", route_create_database},
+    {METHOD_POST, "/create/table", route_create_table},
+    {METHOD_POST, "/insert", route_insert},
+    {METHOD_POST, "/update", route_update},
+    {METHOD_DELETE, "/delete/db/*", route_delete_database},
+    {METHOD_DELETE, "/delete/table/*", route_delete_table},
+    {METHOD_DELETE, "/delete/table/data/*", route_delete_table_data},
+    {METHOD_GET, "/aggregate/*", route_aggregate},
+    {METHOD_POST, "/query", route_query},
+    {METHOD_POST, "/prepare", route_prepare},
+    {METHOD_POST, "/execute", route_execute},
+    {METHOD_GET, "/join/*", route_join},
+    {METHOD_GET, "/metrics", route_metrics},
+};
+
+#define ROUTE_COUNT (int)(sizeof(routes) / sizeof(routes[0]))
+#define ROUTE_UNMATCHED ROUTE_COUNT  // Metrics slot of requests no route took
+#define METRICS_SLOT_COUNT (ROUTE_COUNT + 1 + WIRE_METRICS_SLOTS)
+
+const int wire_metrics_first = ROUTE_COUNT + 1;
+
+// The route table as a trie of path segments, so that dispatch walks the
+// path once and the most specific route wins whatever the table's order
+typedef struct RouteNode {
+    char *segment;
+    struct RouteNode *children;
+    struct RouteNode *next;  // Sibling under the same parent
+    const Route *exact[METHOD_COUNT];     // Routes ending at this segment
+    const Route *prefixed[METHOD_COUNT];  // Routes taking the segments below as parameters
+} RouteNode;
+
+RouteNode route_root;
+pthread_once_t route_trie_once = PTHREAD_ONCE_INIT;
+const char *route_names[METRICS_SLOT_COUNT];  // "METHOD pattern", labelling the routes' metrics
+
+RouteNode *route_child(RouteNode *node, const char *segment, size_t length, int create) {
+    for (RouteNode *child = node->children; child != NULL; child = child->next) {
+        if (strlen(child->segment) == length && strncmp(child->segment, segment, length) == 0) {
+            return child;
         }
-	free(table_name);
-	free(database_name);
-	free(check_field);
-	free(check_value);
-	free(update_field);
-	free(update_value);
-    } else if (strncmp(path, "/delete/db/", 11) == 0 && strcmp(method, "DELETE") == 0) {
-        char database_name[256];
-        sscanf(path + 11, "%s", database_name);
-        char response_body[600];
- 	int result = deleteDB(database_name);
-        if (result == 0) {
-            sprintf(
-		response_body, 
-		"{ \"status\": \"%s\", \"response\": %d, \"database\": \"%s\", \"message\": \"%s\" }", 
-		SUCCESS, 
-		result, 
-		database_name,
-		"Database deleted successfully."
-		);
-            send_response(client_socket, SUCCESS, "application/json", response_body);
-        } else {
-            sprintf(
-		response_body, 
-		"{ \"status\": \"%s\", \"response\": null, \"database\": \"%s\", \"message\": \"%s\" }", 
-		SUCCESS,
-		database_name,
-		"Unable to delete database."
-		);
-            send_response(client_socket, SUCCESS, "application/json", response_body);
+    }
+    if (!create) {
+        return NULL;
+    }
+    RouteNode *child = calloc(1, sizeof(RouteNode));
+    child->segment = strndup(segment, length);
+    child->next = node->children;
+    node->children = child;
+    return child;
+}
+
+void build_route_trie(void) {
+    static const char *method_names[METHOD_COUNT] = {"GET", "POST", "DELETE"};
+    for (int i = 0; i < ROUTE_COUNT; i++) {
+        char name[128];
+        snprintf(name, sizeof(name), "%s %s", method_names[routes[i].method], routes[i].pattern);
+        route_names[i] = strdup(name);
+        RouteNode *node = &route_root;
+        const char *segment = routes[i].pattern;
+        int prefixed = 0;
+        while (*segment != '\0') {
+            segment += strspn(segment, "/");
+            size_t length = strcspn(segment, "/");
+            if (length == 1 && *segment == '*') {
+                prefixed = 1;
+                break;
+            }
+            if (length > 0) {
+                node = route_child(node, segment, length, 1);
+            }
+            segment += length;
         }
-    }  else if (strncmp(path, "/delete/table/data/", 19) == 0 && strcmp(method, "DELETE") == 0) {
-	char data[256];
-        sscanf(path + 19, "%s", data);
-	int data_count = 0;
-	char **data_array = split_string(data, "/", &data_count);
-	char *database_name = data_array[0];
-	char *table_name = data_array[1];
-	char *check_field = data_array[2];
-	char *check_value = data_array[3];
-        char response_body[600];
- 	int result = deleteTableData(database_name, table_name, check_field, check_value);
-        if (result) {
-            sprintf(
-		response_body, 
-		"{ \"status\": \"%s\", \"response\": %d, \"database\": \"%s\", \"table\": \"%s\", \"message\": \"%s\", \"check_field\": \"%s\", \"check_value\": \"%s\" }", 
-		SUCCESS, 
-		result, 
-		database_name,
-		table_name,
-		"Table Row deleted successfully.",
-		check_field,
-		check_value
-		);
-            send_response(client_socket, SUCCESS, "application/json", response_body);
+        if (prefixed) {
+            node->prefixed[routes[i].method] = &routes[i];
         } else {
-            sprintf(
-		response_body, 
-		"{ \"status\": \"%s\", \"response\": null, \"database\": \"%s\", \"table\": \"%s\", \"message\": \"%s\", \"check_field\": \"%s\", \"check_value\": \"%s\" }", 
-		SUCCESS,
-		database_name,
-		table_name,
-		"Unable to delete Table Row.",
-		check_field,
-		check_value
-		);
-            send_response(client_socket, SUCCESS, "application/json", response_body);
+            node->exact[routes[i].method] = &routes[i];
         }
-	for (int i = 0; i < data_count; i++) {
-		free(data_array[i]);
-	}
-    } else if (strncmp(path, "/delete/table/", 14) == 0 && strcmp(method, "DELETE") == 0) {
-	char data[256];
-        sscanf(path + 14, "%s", data);
-	int data_count = 0;
-	char **data_array = split_string(data, "/", &data_count);
-	char *database_name = data_array[0];
-	char *table_name = data_array[1];
-        char response_body[600];
- 	int result = deleteTable(database_name, table_name);
-        if (result > 0) {
-            sprintf(
-		response_body, 
-		"{ \"status\": \"%s\", \"response\": %d, \"database\": \"%s\", \"table\": \"%s\", \"message\": \"%s\" }", 
-		SUCCESS, 
-		result, 
-		database_name,
-		table_name,
-		"Table deleted successfully."
-		);
-            send_response(client_socket, SUCCESS, "application/json", response_body);
-        } else {
-            sprintf(
-		response_body, 
-		"{ \"status\": \"%s\", \"response\": null, \"database\": \"%s\", \"table\": \"%s\", \"message\": \"%s\" }", 
-		SUCCESS,
-		database_name,
-		table_name,
-		"Unable to delete Table."
-		);
-            send_response(client_socket, SUCCESS, "application/json", response_body);
+    }
+    route_names[ROUTE_UNMATCHED] = "unmatched";
+    for (int i = 0; i < WIRE_METRICS_SLOTS; i++) {
+        route_names[wire_metrics_first + i] = wire_metrics_names[i];
+    }
+}
+
+RouteMethod parse_method(const char *method) {
+    if (strcmp(method, "GET") == 0) return METHOD_GET;
+    if (strcmp(method, "POST") == 0) return METHOD_POST;
+    if (strcmp(method, "DELETE") == 0) return METHOD_DELETE;
+    return METHOD_COUNT;
+}
+
+// Find the route for a method and path. The path's segments after the
+// matched prefix are cut into request->params and only then decoded, so an
+// encoded '/' stays inside its segment.
+const Route *find_route(Arena *arena, const char *method, const char *path, RouteRequest *request) {
+    pthread_once(&route_trie_once, build_route_trie);
+    RouteMethod route_method = parse_method(method);
+    if (route_method == METHOD_COUNT) {
+        return NULL;
+    }
+
+    // Descend while the segments match, remembering the deepest prefix route
+    RouteNode *node = &route_root;
+    const Route *route = NULL;
+    const char *rest = NULL;  // Path after the deepest prefix route's segments
+    const char *segment = path;
+    while (node != NULL) {
+        if (node->prefixed[route_method] != NULL) {
+            route = node->prefixed[route_method];
+            rest = segment;
+        }
+        segment += strspn(segment, "/");
+        size_t length = strcspn(segment, "/");
+        if (length == 0) {
+            if (node->exact[route_method] != NULL) {
+                request->param_count = 0;
+                return node->exact[route_method];
+            }
+            break;
+        }
+        node = route_child(node, segment, length, 0);
+        segment += length;
+    }
+    if (route == NULL) {
+        return NULL;
+    }
+    request->params = split_string(arena, rest, "/", &request->param_count);
+    for (int i = 0; i < request->param_count; i++) {
+        char *param = request->params[i];
+        http_decode(param, strlen(param), 0, param, strlen(param) + 1);
+    }
+    return route;
+}
+
+// Counters for every route and the server as a whole, in the Prometheus
+// text format
+void route_metrics(Arena *arena, int client_socket, const RouteRequest *request) {
+    (void)arena;
+    (void)request;
+    JsonWriter out;
+    json_init(&out);
+    writeMetrics(&out, route_names, METRICS_SLOT_COUNT);
+    size_t length = out.length;
+    send_owned_response(client_socket, SUCCESS, "text/plain; version=0.0.4", json_finish(&out), length);
+}
+
+
+// Put a request that ran past the slow query threshold in the slow log,
+// with the database, table and predicate it named: the path's parameters
+// for the GET and DELETE routes, the JSON body's fields for the POST ones
+void log_slow_request(Arena *arena, int slot, const RouteRequest *request) {
+    const char *database_name = request->param_count > 0 ? route_param(request, 0) : json_value(request->fields, "database_name");
+    const char *table_name = request->param_count > 1 ? route_param(request, 1) : json_value(request->fields, "table_name");
+    const char *predicate = json_value(request->fields, "query");
+    const char *target_field = json_value(request->fields, "target_field");
+    if (request->param_count > 3) {
+        predicate = arena_printf(arena, "%s = %s", route_param(request, 2), route_param(request, 3));
+    } else if (target_field != NULL) {
+        predicate = arena_printf(arena, "%s = %s", target_field, json_value(request->fields, "target_value"));
+    }
+    logSlowRequest(route_names[slot], database_name, table_name, predicate);
+}
+
+// Answer one request. Returns the metrics slot of the route that took it.
+int dispatch_request(Arena *arena, char *input, const HttpRequest *request, int client_socket, char *username, char *password) {
+    // Only HTTP/1.1 clients understand a chunked response
+    int chunked_ok = request->http11;
+
+    // Check if the request path is valid
+    if (request->target.length == 0) {
+        send_response(
+	    client_socket, 
+	    NOT_FOUND, 
+	    "application/json", "{ \"status\": \"404 Not Found\", \"response\": null, \"message\": \"Path not found.\" }");
+        return ROUTE_UNMATCHED;
+    }
+    char *method = arena_strndup(arena, input + request->method.offset, request->method.length);
+    char *path = arena_strndup(arena, input + request->path.offset, request->path.length);
+
+    // The server hands over the whole request, body included, however long,
+    // and ends it with a terminator
+    const char *body = input + request->head_length;
+
+    // Check for POST method and keep the JSON part of the body
+    if (strcmp(method, "POST") == 0 && request->content_length > 0) {
+	const char *json_start = strchr(body, '{');
+	// Setting the json_start value to the body
+	if (json_start != NULL) {
+	      body = json_start;  // The JSON runs to the end of the request
+	    } else {
+	      body = "No JSON found";  // Handle the case where no JSON is found
+	  }
+    }
+
+    // Index the body's fields once; a body that is not a JSON object has none
+    JsonRequest fields;
+    parse_json_request(arena, body, &fields);
+
+    RouteRequest route_request = {input, request, path, body, &fields, chunked_ok, NULL, 0};
+    const Route *route = find_route(arena, method, path, &route_request);
+    int slot = route != NULL ? (int)(route - routes) : ROUTE_UNMATCHED;
+
+    // Authentication logic; metrics may be left open to a scraper
+    char username_from_req[256];
+    char password_from_req[256];
+
+    http_query_value(request, input, "username", username_from_req, sizeof(username_from_req));
+    http_query_value(request, input, "password", password_from_req, sizeof(password_from_req));
+
+    int open_route = route != NULL && route->handler == route_metrics && !metrics_auth;
+    if (!open_route && (strcmp(username_from_req, username) != 0 || strcmp(password_from_req, password) != 0)) {
+        send_response(client_socket, UNAUTHORIZED, "application/json", "{\"status\": \"0\",\"response\": \"Unauthorized\"}");
+        return slot;
+    }
+
+    // Handle different paths
+    markHandlerStart();
+    if (route != NULL) {
+        route->handler(arena, client_socket, &route_request);
+        if (requestIsSlow()) {
+            log_slow_request(arena, slot, &route_request);
         }
-	for (int i = 0; i < data_count; i++) {
-		free(data_array[i]);
-	}
     } else {
         send_response(
 	    client_socket, 
 	    NOT_FOUND, 
 	    "application/json", "{ \"status\": \"404 Not Found\", \"response\": null, \"message\": \"Path not found.\" }");
     }
+    return slot;
+}
+
+void handle_request(Arena *arena, char *input, const HttpRequest *request, int client_socket, char *username, char *password) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    response_status = 0;
+    // The client opts in to the request's stats with stats=1
+    char stats[8];
+    http_query_value(request, input, "stats", stats, sizeof(stats));
+    beginRequestStats(strcmp(stats, "1") == 0);
+    int slot = dispatch_request(arena, input, request, client_socket, username, password);
+    endRequestStats();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    countResponse(slot, response_status,
+                  (unsigned long)(end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
 }
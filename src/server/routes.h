@@ -1,7 +1,11 @@
 #ifndef ROUTES_H
 #define ROUTES_H
 
-void handle_request(char *request, int client_socket, char *username, char *password);
+#include "http.h"
+
+struct Arena;
+
+void handle_request(struct Arena *arena, char *input, const HttpRequest *request, int client_socket, char *username, char *password);
 
 #endif
 
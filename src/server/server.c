@@ -5,32 +5,1160 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <signal.h>  // For signal handling
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include "routes.h"
+#include "protocol.h"
 #include "server.h"  // Include this for function declaration
 #include "../lib/db.c"
+#include "../lib/aggregate.c"
+#include "../lib/sort.c"
+#include "../lib/join.c"
+#include "../lib/index.c"
+#include "../lib/wire.c"
+#include "../lib/sql.c"
+#include "../lib/executor.c"
+#include "../lib/plan_cache.c"
+#include "../lib/result_cache.c"
 
-#define BUFFER_SIZE 1024
+#define READ_CHUNK_SIZE 4096
+#define OUTPUT_HIGH_WATER (1024 * 1024)  // Queued response bytes past which a handler writes to the socket, then a file
+#define OUTPUT_IOV_BATCH 64  // Segments handed to one writev
+#define MAX_EVENTS 256
+#define TASK_QUEUE_SIZE 1024  // Requests in flight on the workers; a power of two
 
 int server_fd;  // Global variable to store the server socket descriptor
+int binary_fd = -1;  // Listening socket of the binary protocol, if enabled
+int unix_fd = -1;    // Listening Unix domain socket for clients on this host, if enabled
+char unix_socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)] = "";
+int epoll_fd = -1;
+char *server_username;  // Credentials from the config, checked by every route
+char *server_password;
+int idle_timeout = 60;  // Seconds a connection may sit without traffic
+size_t max_request_size = 64 * 1024 * 1024;  // Larger requests are dropped; 0 for no limit
+int metrics_auth = 1;  // GET /metrics asks for the credentials like every route; "metrics_auth=0" opens it
+Arena loop_arena;  // Scratch memory for requests run on the network thread
+
+// Readiness of the sockets the network thread serves, kept by epoll or, with
+// io_uring=1, by one-shot poll requests on a ring. The ring has the loop arm,
+// move and drop its watches and wait for the next events in one system call
+// rather than one per change.
+typedef struct {
+    uint32_t events;      // Poll events the fd is watched for; 0 when it is not
+    uint32_t generation;  // Told apart from cancelled watches on a reused fd
+    int armed;            // A poll request for it is in the kernel
+    int queued;           // On the list to arm at the next wait
+} Watch;
+
+Uring event_ring;
+int event_ring_ready = 0;
+Watch *watches = NULL;
+size_t watch_slots = 0;
+int *unarmed = NULL;  // Fds to arm before the next wait
+size_t unarmed_count = 0, unarmed_capacity = 0;
+
+Watch *watch_for(int fd) {
+    if ((size_t)fd >= watch_slots) {
+        size_t slots = watch_slots ? watch_slots : 1024;
+        while (slots <= (size_t)fd) {
+            slots *= 2;
+        }
+        watches = realloc(watches, slots * sizeof(Watch));
+        for (size_t i = watch_slots; i < slots; i++) {
+            watches[i] = (Watch){.generation = 1};  // user_data 0 stays free for removals
+        }
+        watch_slots = slots;
+    }
+    return &watches[fd];
+}
+
+uint64_t watch_data(int fd, const Watch *watch) {
+    return (uint64_t)watch->generation << 32 | (uint32_t)fd;
+}
+
+// Cancel the poll request in the kernel, if any; its completion is ignored
+void disarm_watch(int fd, Watch *watch) {
+    if (watch->armed) {
+        uringQueuePollRemove(&event_ring, watch_data(fd, watch));
+        watch->armed = 0;
+    }
+    watch->generation++;
+}
+
+void queue_watch(int fd, Watch *watch) {
+    if (watch->queued) {
+        return;
+    }
+    if (unarmed_count == unarmed_capacity) {
+        unarmed_capacity = unarmed_capacity ? unarmed_capacity * 2 : 256;
+        unarmed = realloc(unarmed, unarmed_capacity * sizeof(int));
+    }
+    unarmed[unarmed_count++] = fd;
+    watch->queued = 1;
+}
+
+void watch_fd(int fd, uint32_t events) {
+    if (!event_ring_ready) {
+        struct epoll_event event = {.events = events, .data.fd = fd};
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        return;
+    }
+    Watch *watch = watch_for(fd);
+    watch->events = events;
+    queue_watch(fd, watch);
+}
+
+// Watch an fd for different events
+void rewatch_fd(int fd, uint32_t events) {
+    if (!event_ring_ready) {
+        struct epoll_event event = {.events = events, .data.fd = fd};
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+        return;
+    }
+    Watch *watch = watch_for(fd);
+    disarm_watch(fd, watch);
+    watch->events = events;
+    queue_watch(fd, watch);
+}
+
+void unwatch_fd(int fd) {
+    if (!event_ring_ready) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        return;
+    }
+    Watch *watch = watch_for(fd);
+    disarm_watch(fd, watch);
+    watch->events = 0;
+}
+
+// Wait up to timeout milliseconds (-1 for no limit) and store the fds that
+// became ready. Returns how many did, or -1 with errno set.
+int wait_for_events(int *ready_fds, int max, int timeout) {
+    if (!event_ring_ready) {
+        struct epoll_event events[MAX_EVENTS];
+        int ready = epoll_wait(epoll_fd, events, max < MAX_EVENTS ? max : MAX_EVENTS, timeout);
+        for (int i = 0; i < ready; i++) {
+            ready_fds[i] = events[i].data.fd;
+        }
+        return ready;
+    }
+
+    // Arm the watches added or fired since the last wait, then submit them
+    // together with the wait itself
+    for (size_t i = 0; i < unarmed_count; i++) {
+        Watch *watch = &watches[unarmed[i]];
+        watch->queued = 0;
+        if (watch->events != 0 && !watch->armed) {
+            uringQueuePoll(&event_ring, unarmed[i], watch->events, watch_data(unarmed[i], watch));
+            watch->armed = 1;
+        }
+    }
+    unarmed_count = 0;
+    if (uringSubmit(&event_ring, 1, timeout) < 0 && errno != EBUSY && errno != EAGAIN) {
+        return -1;
+    }
+
+    int ready = 0;
+    struct io_uring_cqe *cqe;
+    while (ready < max && (cqe = uringCompletion(&event_ring)) != NULL) {
+        int fd = (int)(uint32_t)cqe->user_data;
+        uint32_t generation = (uint32_t)(cqe->user_data >> 32);
+        uringSeen(&event_ring);
+        if (generation == 0 || (size_t)fd >= watch_slots) {
+            continue;
+        }
+        Watch *watch = &watches[fd];
+        if (watch->generation != generation || !watch->armed) {
+            continue;  // Cancelled by a later change
+        }
+        // One-shot: it is armed again before the next wait if still wanted
+        watch->armed = 0;
+        queue_watch(fd, watch);
+        ready_fds[ready++] = fd;
+    }
+    return ready;
+}
+
+// Set up the readiness backend the configuration asks for
+void open_poller(void) {
+    if (io_uring_enabled) {
+        event_ring_ready = uringInit(&event_ring, MAX_EVENTS);
+        if (event_ring_ready) {
+            return;
+        }
+        printf("=> io_uring could not be set up, using epoll\n");
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+typedef enum {
+    CONNECTION_READING,
+    CONNECTION_HANDLING,  // A worker owns the connection until it hands it back
+    CONNECTION_WRITING
+} ConnectionState;
+
+typedef enum {
+    SEGMENT_BUFFERED,  // Bytes copied into the connection's output buffer
+    SEGMENT_OWNED,     // A malloc'd buffer a route handed over, freed once sent
+    SEGMENT_FILE       // A region of a file, sent with sendfile and closed once sent
+} SegmentKind;
+
+// One piece of a queued response. A response is usually headers copied into
+// the output buffer followed by a body handed over whole, so that neither is
+// copied again on the way out.
+typedef struct {
+    SegmentKind kind;
+    char *data;     // The owned buffer
+    int file_fd;    // The file
+    size_t offset;  // Into the output buffer, or into the file
+    size_t length;
+    size_t sent;
+} OutputSegment;
+
+// One client socket. Bytes are read into input until a whole request has
+// arrived; the response is queued as segments and written out with writev
+// and sendfile as fast as the socket takes it. Neither side ever blocks the
+// loop. A persistent connection then goes back to reading, serving any
+// requests the client pipelined behind the first straight from input.
+typedef struct Connection {
+    int fd;
+    ConnectionState state;
+    char *input;
+    size_t input_length;
+    size_t input_capacity;
+    HttpRequest http;       // Parse state of the request at the front of input
+    int binary;             // Speaks the binary protocol rather than HTTP
+    int authenticated;      // A binary connection has sent valid credentials
+    size_t request_length;  // Bytes of input taken by the request being served
+    char request_end;       // Byte at input[request_length] while it is cut off
+    int keep_alive;         // Read the next request once this response is out
+    int watching_output;    // Registered for EPOLLOUT rather than EPOLLIN
+    int output_failed;      // The client stopped taking the response part way
+    int responded;          // Something was queued for the request being run
+    char *output;
+    size_t output_length;
+    size_t output_capacity;
+    OutputSegment *segments;
+    int segment_count;
+    int segment_capacity;
+    int segment_first;      // First segment not yet fully sent
+    size_t output_pending;  // Bytes of buffered and owned segments not yet sent
+    int overflowing;        // The running handler's output goes to overflow_fd
+    int overflow_fd;        // Unlinked file holding what the socket had no room for
+    size_t overflow_length;
+    int overflow_segment;   // Segment sending the end of overflow_fd
+
+    // Idle list, least recently active first; a connection a worker is
+    // running is not on it
+    time_t last_active;
+    struct Connection *newer;
+    struct Connection *older;
+} Connection;
+
+// Open connections indexed by file descriptor
+Connection **connections = NULL;
+size_t connection_slots = 0;
+Connection *least_active = NULL;
+Connection *most_active = NULL;
+
+time_t monotonic_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+void unlink_idle(Connection *connection) {
+    if (connection->newer != NULL) connection->newer->older = connection->older;
+    else if (most_active == connection) most_active = connection->older;
+    if (connection->older != NULL) connection->older->newer = connection->newer;
+    else if (least_active == connection) least_active = connection->newer;
+    connection->newer = connection->older = NULL;
+}
+
+// Note traffic on a connection, moving it to the most recently active end
+void touch_connection(Connection *connection) {
+    connection->last_active = monotonic_seconds();
+    if (most_active == connection) {
+        return;
+    }
+    unlink_idle(connection);
+    connection->older = most_active;
+    if (most_active != NULL) most_active->newer = connection;
+    else least_active = connection;
+    most_active = connection;
+}
+
+Connection *open_connection(int fd) {
+    if ((size_t)fd >= connection_slots) {
+        size_t slots = connection_slots ? connection_slots : 1024;
+        while (slots <= (size_t)fd) {
+            slots *= 2;
+        }
+        connections = realloc(connections, slots * sizeof(Connection *));
+        memset(connections + connection_slots, 0, (slots - connection_slots) * sizeof(Connection *));
+        connection_slots = slots;
+    }
+    Connection *connection = calloc(1, sizeof(Connection));
+    connection->fd = fd;
+    connection->state = CONNECTION_READING;
+    connections[fd] = connection;
+    touch_connection(connection);
+    countMetric(METRIC_CONNECTIONS_OPENED, 1);
+    return connection;
+}
+
+void release_segment(OutputSegment *segment) {
+    if (segment->kind == SEGMENT_OWNED) {
+        free(segment->data);
+    } else if (segment->kind == SEGMENT_FILE) {
+        close(segment->file_fd);
+    }
+}
+
+// Drop whatever of the response has not gone out
+void discard_output(Connection *connection) {
+    for (int i = connection->segment_first; i < connection->segment_count; i++) {
+        release_segment(&connection->segments[i]);
+    }
+    connection->segment_count = connection->segment_first = 0;
+    connection->output_length = connection->output_pending = 0;
+}
+
+void close_connection(Connection *connection) {
+    countMetric(METRIC_CONNECTIONS_CLOSED, 1);
+    unlink_idle(connection);
+    unwatch_fd(connection->fd);
+    close(connection->fd);
+    connections[connection->fd] = NULL;
+    free(connection->input);
+    discard_output(connection);
+    free(connection->output);
+    free(connection->segments);
+    free(connection);
+}
+
+// Connection whose request this thread is running. Route handlers only know
+// the socket, and the connections array may be regrown by the network thread
+// while a worker runs, so the worker does not look itself up there.
+__thread Connection *current_connection = NULL;
+
+// Write queued segments, runs of buffered and owned ones with one writev and
+// file regions with sendfile, until the socket is full. Returns 0 once all of
+// them are out, 1 while waiting for the socket and -1 on failure; progressed
+// is set when anything was written.
+int write_segments(Connection *connection, int *progressed) {
+    while (connection->segment_first < connection->segment_count) {
+        OutputSegment *segment = &connection->segments[connection->segment_first];
+        ssize_t written;
+        if (segment->kind == SEGMENT_FILE) {
+            off_t offset = segment->offset + segment->sent;
+            written = sendfile(connection->fd, segment->file_fd, &offset, segment->length - segment->sent);
+            if (written == 0) {
+                return -1;  // The file is shorter than promised
+            }
+        } else {
+            struct iovec vectors[OUTPUT_IOV_BATCH];
+            int count = 0;
+            for (int i = connection->segment_first; i < connection->segment_count && count < OUTPUT_IOV_BATCH; i++) {
+                OutputSegment *next = &connection->segments[i];
+                if (next->kind == SEGMENT_FILE) {
+                    break;
+                }
+                char *base = next->kind == SEGMENT_OWNED ? next->data : connection->output + next->offset;
+                vectors[count].iov_base = base + next->sent;
+                vectors[count].iov_len = next->length - next->sent;
+                count++;
+            }
+            written = writev(connection->fd, vectors, count);
+        }
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        *progressed = 1;
+        countMetric(METRIC_BYTES_SENT, written);
+
+        // Retire the segments the write got through
+        size_t remaining = written;
+        while (remaining > 0) {
+            segment = &connection->segments[connection->segment_first];
+            size_t taken = segment->length - segment->sent < remaining ? segment->length - segment->sent : remaining;
+            segment->sent += taken;
+            remaining -= taken;
+            if (segment->kind != SEGMENT_FILE) {
+                connection->output_pending -= taken;
+            }
+            if (segment->sent == segment->length) {
+                release_segment(segment);
+                connection->segment_first++;
+            }
+        }
+    }
+    connection->segment_count = connection->segment_first = 0;
+    connection->output_length = 0;
+    return 0;
+}
+
+// Write out what the socket takes of the response queued so far while its
+// handler is still producing the rest, so that a large streamed response
+// never sits in memory whole. The handler may be holding a table's read lock,
+// so this never waits for the client: once the socket is full the rest of the
+// response goes to an unlinked file, which the network thread sends after the
+// handler returns. Runs on whichever thread handles the request and leaves
+// the idle list and epoll to the network thread.
+void drain_output(Connection *connection) {
+    uint64_t started = phaseStart();
+    int progressed = 0;
+    int written = write_segments(connection, &progressed);
+    phaseEnd(PHASE_WRITE, started);
+    if (written < 0) {
+        discard_output(connection);
+        connection->output_failed = 1;
+    } else if (written > 0 && connection->output_pending >= OUTPUT_HIGH_WATER) {
+        // Without a file the output stays in memory rather than waiting
+        connection->overflow_fd = createScratchFile();
+        connection->overflowing = connection->overflow_fd >= 0;
+        connection->overflow_length = 0;
+        connection->overflow_segment = -1;
+    }
+}
+
+// Make room for one more segment and return it
+OutputSegment *add_segment(Connection *connection, SegmentKind kind) {
+    if (connection->segment_count == connection->segment_capacity) {
+        connection->segment_capacity = connection->segment_capacity ? connection->segment_capacity * 2 : 16;
+        connection->segments = realloc(connection->segments, connection->segment_capacity * sizeof(OutputSegment));
+    }
+    OutputSegment *segment = &connection->segments[connection->segment_count++];
+    memset(segment, 0, sizeof(*segment));
+    segment->kind = kind;
+    return segment;
+}
+
+// Append response bytes to the overflow file, growing the segment that sends
+// its end when nothing has been queued behind it
+void overflow_output(Connection *connection, const char *data, size_t length) {
+    if (!write_all(connection->overflow_fd, data, length)) {
+        discard_output(connection);
+        connection->output_failed = 1;
+        return;
+    }
+    OutputSegment *segment;
+    if (connection->overflow_segment == connection->segment_count - 1) {
+        segment = &connection->segments[connection->overflow_segment];
+    } else {
+        segment = add_segment(connection, SEGMENT_FILE);
+        segment->file_fd = dup(connection->overflow_fd);
+        segment->offset = connection->overflow_length;
+        connection->overflow_segment = connection->segment_count - 1;
+    }
+    segment->length += length;
+    connection->overflow_length += length;
+}
+
+// Close the overflow file once its handler is done; the segments keep their
+// own descriptors to it
+void end_overflow(Connection *connection) {
+    if (connection->overflowing) {
+        close(connection->overflow_fd);
+        connection->overflowing = 0;
+    }
+}
+
+// The connection running on this thread that a route is answering, or NULL
+// when the route writes to a socket nobody is tracking
+Connection *sending_connection(int fd) {
+    Connection *connection = current_connection;
+    return connection != NULL && connection->fd == fd ? connection : NULL;
+}
+
+// Queue response bytes for a client, copying them; called by the route
+// handlers for headers and other short pieces
+void connection_send(int fd, const char *data, size_t length) {
+    Connection *connection = sending_connection(fd);
+    if (connection == NULL) {
+        write(fd, data, length);
+        return;
+    }
+    connection->responded = 1;
+    if (connection->output_failed || length == 0) {
+        return;
+    }
+    if (connection->overflowing) {
+        overflow_output(connection, data, length);
+        return;
+    }
+    if (connection->output_length + length > connection->output_capacity) {
+        size_t capacity = connection->output_capacity ? connection->output_capacity : READ_CHUNK_SIZE;
+        while (capacity < connection->output_length + length) {
+            capacity *= 2;
+        }
+        connection->output = realloc(connection->output, capacity);
+        connection->output_capacity = capacity;
+    }
+    // Extend the last segment when it ends where these bytes go
+    OutputSegment *last = connection->segment_count > connection->segment_first
+        ? &connection->segments[connection->segment_count - 1] : NULL;
+    if (last == NULL || last->kind != SEGMENT_BUFFERED || last->offset + last->length != connection->output_length) {
+        last = add_segment(connection, SEGMENT_BUFFERED);
+        last->offset = connection->output_length;
+    }
+    memcpy(connection->output + connection->output_length, data, length);
+    connection->output_length += length;
+    last->length += length;
+    connection->output_pending += length;
+    if (connection->output_pending >= OUTPUT_HIGH_WATER) {
+        drain_output(connection);
+    }
+}
+
+// Queue a malloc'd buffer as it is; the connection frees it once it is sent
+void connection_send_owned(int fd, char *data, size_t length) {
+    Connection *connection = sending_connection(fd);
+    if (connection == NULL) {
+        write(fd, data, length);
+        free(data);
+        return;
+    }
+    connection->responded = 1;
+    if (connection->output_failed || length == 0) {
+        free(data);
+        return;
+    }
+    if (connection->overflowing) {
+        overflow_output(connection, data, length);
+        free(data);
+        return;
+    }
+    OutputSegment *segment = add_segment(connection, SEGMENT_OWNED);
+    segment->data = data;
+    segment->length = length;
+    connection->output_pending += length;
+    if (connection->output_pending >= OUTPUT_HIGH_WATER) {
+        drain_output(connection);
+    }
+}
+
+// Queue length bytes of a file from offset, sent by the kernel without
+// passing through user space. The connection closes file_fd once it is sent.
+void connection_send_file(int fd, int file_fd, size_t offset, size_t length) {
+    Connection *connection = sending_connection(fd);
+    if (connection == NULL) {
+        off_t position = offset;
+        while (length > 0) {
+            ssize_t written = sendfile(fd, file_fd, &position, length);
+            if (written <= 0) {
+                break;
+            }
+            length -= written;
+        }
+        close(file_fd);
+        return;
+    }
+    connection->responded = 1;
+    if (file_fd < 0) {
+        // The response cannot be finished; closing tells the client
+        discard_output(connection);
+        connection->output_failed = 1;
+        return;
+    }
+    if (connection->output_failed || length == 0) {
+        close(file_fd);
+        return;
+    }
+    OutputSegment *segment = add_segment(connection, SEGMENT_FILE);
+    segment->file_fd = file_fd;
+    segment->offset = offset;
+    segment->length = length;
+}
+
+// Whether the response to the request being run should keep the connection
+// open; send_response announces it in the Connection header
+int connection_keeps_alive(int fd) {
+    Connection *connection = current_connection;
+    return connection != NULL && connection->fd == fd && connection->keep_alive;
+}
+
+// Close the connection once the response being sent is out, for a body
+// only the close can end
+void connection_close_after(int fd) {
+    Connection *connection = current_connection;
+    if (connection != NULL && connection->fd == fd) {
+        connection->keep_alive = 0;
+    }
+}
+
+// Give up on the response being sent part way through: what is still
+// queued is dropped and the connection closed, which is all a client
+// already reading the body can be told
+void connection_abort(int fd) {
+    Connection *connection = current_connection;
+    if (connection != NULL && connection->fd == fd) {
+        discard_output(connection);
+        connection->output_failed = 1;
+    }
+}
+
+// Write as much queued output as the socket accepts. Returns 0 once all of
+// it is out, 1 while waiting for the socket to drain and -1 on failure.
+int write_output(Connection *connection) {
+    int progressed = 0;
+    int written = write_segments(connection, &progressed);
+    if (progressed) {
+        touch_connection(connection);
+    }
+    if (written > 0 && !connection->watching_output) {
+        rewatch_fd(connection->fd, EPOLLOUT);
+        connection->watching_output = 1;
+    } else if (written == 0 && connection->watching_output) {
+        rewatch_fd(connection->fd, EPOLLIN);
+        connection->watching_output = 0;
+    }
+    return written;
+}
+
+// Bounded lock-free multi-producer multi-consumer queue of connections
+// (Vyukov's ring). Each slot's sequence number says whose turn it is: equal to
+// the position when free for a producer, one past it when filled for a
+// consumer. Producers and consumers claim positions with a compare-and-swap
+// and never wait on each other.
+typedef struct {
+    atomic_size_t sequence;
+    Connection *connection;
+} TaskSlot;
+
+typedef struct {
+    TaskSlot slots[TASK_QUEUE_SIZE];
+    _Alignas(64) atomic_size_t tail;  // Next position to fill
+    _Alignas(64) atomic_size_t head;  // Next position to take
+} TaskQueue;
+
+void task_queue_init(TaskQueue *queue) {
+    for (size_t i = 0; i < TASK_QUEUE_SIZE; i++) {
+        atomic_init(&queue->slots[i].sequence, i);
+    }
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->head, 0);
+}
+
+// Returns 0 if the queue is full
+int task_queue_push(TaskQueue *queue, Connection *connection) {
+    size_t position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    while (1) {
+        TaskSlot *slot = &queue->slots[position & (TASK_QUEUE_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                slot->connection = connection;
+                atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+                return 1;
+            }
+        } else if (difference < 0) {
+            return 0;
+        } else {
+            position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+}
+
+// Returns NULL if the queue is empty
+Connection *task_queue_pop(TaskQueue *queue) {
+    size_t position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    while (1) {
+        TaskSlot *slot = &queue->slots[position & (TASK_QUEUE_SIZE - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                Connection *connection = slot->connection;
+                atomic_store_explicit(&slot->sequence, position + TASK_QUEUE_SIZE, memory_order_release);
+                return connection;
+            }
+        } else if (difference < 0) {
+            return NULL;
+        } else {
+            position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+}
+
+// Fixed pool of threads that run requests. The network thread pushes each
+// complete request onto pending and posts ready; a worker runs it with its
+// own arena, pushes the connection onto finished and pokes wake_fd, and the
+// network thread then writes the response out. Requests in flight are capped
+// at the queue size, so neither queue can overflow.
+typedef struct {
+    int thread_count;
+    TaskQueue pending;
+    TaskQueue finished;
+    sem_t ready;
+    int wake_fd;
+    size_t in_flight;  // Only touched by the network thread
+} WorkerPool;
+
+WorkerPool worker_pool;
+int worker_threads = -1;  // Set by "threads="; 0 runs requests on the network thread
+
+// Run the request at the front of input on this thread and leave the
+// response in output
+void run_request(Connection *connection, Arena *arena) {
+    current_connection = connection;
+    if (connection->binary) {
+        handle_frame(arena, connection->input, connection->request_length, connection->fd,
+                     &connection->authenticated, server_username, server_password);
+    } else {
+        handle_request(arena, connection->input, &connection->http, connection->fd, server_username, server_password);
+    }
+    current_connection = NULL;
+    end_overflow(connection);
+    arena_reset(arena);
+}
+
+void *worker_main(void *unused) {
+    (void)unused;
+    Arena arena = {0};
+    uint64_t one = 1;
+    while (1) {
+        if (sem_wait(&worker_pool.ready) != 0) {
+            continue;  // EINTR
+        }
+        Connection *connection = task_queue_pop(&worker_pool.pending);
+        if (connection == NULL) {
+            continue;
+        }
+        run_request(connection, &arena);
+        task_queue_push(&worker_pool.finished, connection);
+        write(worker_pool.wake_fd, &one, sizeof(one));
+    }
+    return NULL;
+}
+
+void start_workers(int thread_count) {
+    worker_pool.thread_count = thread_count;
+    task_queue_init(&worker_pool.pending);
+    task_queue_init(&worker_pool.finished);
+    sem_init(&worker_pool.ready, 0, 0);
+    worker_pool.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker_pool.wake_fd < 0) {
+        perror("eventfd failed");
+        exit(EXIT_FAILURE);
+    }
+    watch_fd(worker_pool.wake_fd, EPOLLIN);
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, NULL) != 0) {
+            perror("pthread_create failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+}
+
+// Hand a complete request to the workers. Returns 0 when it should run on
+// the network thread instead: there is no pool or the pool is saturated.
+int submit_request(Connection *connection) {
+    if (worker_pool.thread_count == 0 || worker_pool.in_flight >= TASK_QUEUE_SIZE) {
+        return 0;
+    }
+    // The worker owns the connection now; stop watching it until it is back
+    connection->state = CONNECTION_HANDLING;
+    unlink_idle(connection);
+    unwatch_fd(connection->fd);
+    task_queue_push(&worker_pool.pending, connection);
+    worker_pool.in_flight++;
+    sem_post(&worker_pool.ready);
+    return 1;
+}
+
+// Drop the request just run from input, restoring the first byte of any
+// request pipelined behind it, and move on to writing the response
+void consume_request(Connection *connection) {
+    connection->input[connection->request_length] = connection->request_end;
+    connection->input_length -= connection->request_length;
+    memmove(connection->input, connection->input + connection->request_length, connection->input_length + 1);
+    connection->request_length = 0;
+    http_request_init(&connection->http);
+    if (!connection->responded || connection->output_failed) {
+        connection->keep_alive = 0;  // Nothing or not all was answered; only closing tells the client
+    }
+    connection->responded = 0;
+    connection->state = CONNECTION_WRITING;
+}
+
+int request_too_large(size_t length) {
+    return max_request_size > 0 && length > max_request_size;
+}
+
+// Find the request at the front of input, setting its length once it is
+// complete. On a binary connection that is a frame, whose length field says
+// at once whether it will fit.
+HttpParseResult parse_request(Connection *connection, size_t *length) {
+    if (!connection->binary) {
+        HttpParseResult parsed = http_parse(&connection->http, connection->input, connection->input_length);
+        *length = connection->http.length;
+        return parsed;
+    }
+    if (connection->input_length < 4) {
+        return HTTP_INCOMPLETE;
+    }
+    uint32_t frame_length;
+    memcpy(&frame_length, connection->input, 4);
+    *length = 4 + (size_t)be32toh(frame_length);
+    if (*length < 9 || request_too_large(*length)) {
+        return HTTP_INVALID;  // Shorter than a frame header
+    }
+    return connection->input_length >= *length ? HTTP_COMPLETE : HTTP_INCOMPLETE;
+}
+
+// Answer a request that cannot be framed before its connection is closed,
+// since nothing behind it in input can be trusted. Best effort: the socket
+// has nothing else queued and takes a few bytes.
+void reject_request(Connection *connection) {
+    if (connection->binary || connection->http.invalid_status == NULL) {
+        return;
+    }
+    char response[128];
+    int length = snprintf(response, sizeof(response), "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+                          connection->http.invalid_status);
+    write(connection->fd, response, length);
+}
+
+// Serve the complete requests waiting in input, one at a time, and go back
+// to reading once none is left. Returns 0 once the connection should be
+// closed.
+int serve_requests(Connection *connection) {
+    while (1) {
+        size_t request_length = 0;
+        HttpParseResult parsed = parse_request(connection, &request_length);
+        if (parsed == HTTP_INVALID) {
+            reject_request(connection);
+            return 0;
+        }
+        if (parsed == HTTP_INCOMPLETE) {
+            connection->state = CONNECTION_READING;
+            return !request_too_large(connection->input_length);
+        }
+        if (request_too_large(request_length)) {
+            return 0;
+        }
+        connection->request_length = request_length;
+        connection->request_end = connection->input[request_length];
+        connection->input[request_length] = '\0';
+        connection->keep_alive = connection->binary || connection->http.keep_alive;
+        if (submit_request(connection)) {
+            return 1;  // A worker answers it
+        }
+        run_request(connection, &loop_arena);
+        consume_request(connection);
+        int written = write_output(connection);
+        if (written != 0) {
+            return written > 0;  // Carry on from the loop once the socket drains
+        }
+        if (!connection->keep_alive) {
+            return 0;
+        }
+    }
+}
+
+// Continue writing a response. Returns 0 once the connection should be
+// closed.
+int flush_connection(Connection *connection) {
+    int written = write_output(connection);
+    if (written != 0) {
+        return written > 0;
+    }
+    if (!connection->keep_alive) {
+        return 0;
+    }
+    return serve_requests(connection);
+}
+
+// Take back the connections the workers are done with and send their responses
+void collect_finished(void) {
+    uint64_t count;
+    read(worker_pool.wake_fd, &count, sizeof(count));
+    Connection *connection;
+    while ((connection = task_queue_pop(&worker_pool.finished)) != NULL) {
+        worker_pool.in_flight--;
+        watch_fd(connection->fd, EPOLLIN);
+        touch_connection(connection);
+        consume_request(connection);
+        if (!flush_connection(connection)) {
+            close_connection(connection);
+        }
+    }
+}
+
+// Read whatever has arrived and serve the requests it completes. Reading
+// stops at the first complete request so that a client pipelining a burst
+// cannot make input grow without bound; the rest waits in the socket.
+// Returns 0 once the connection should be closed.
+int read_connection(Connection *connection) {
+    while (1) {
+        if (connection->input_capacity - connection->input_length < READ_CHUNK_SIZE + 1) {
+            size_t capacity = connection->input_capacity ? connection->input_capacity * 2 : 2 * READ_CHUNK_SIZE;
+            connection->input = realloc(connection->input, capacity);
+            connection->input_capacity = capacity;
+        }
+        ssize_t received = read(connection->fd, connection->input + connection->input_length,
+                                connection->input_capacity - connection->input_length - 1);
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;  // Wait for the rest
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        if (received == 0) {
+            return 0;  // The client went away or is done
+        }
+        connection->input_length += received;
+        connection->input[connection->input_length] = '\0';
+        touch_connection(connection);
+        countMetric(METRIC_BYTES_RECEIVED, received);
+
+        // The parser carries on from where the last read left it
+        size_t request_length = 0;
+        HttpParseResult parsed = parse_request(connection, &request_length);
+        if (parsed == HTTP_INVALID) {
+            reject_request(connection);
+            return 0;
+        }
+        if (parsed == HTTP_COMPLETE) {
+            return serve_requests(connection);
+        }
+        if (request_too_large(connection->input_length)) {
+            return 0;
+        }
+    }
+}
+
+// Close connections that have been silent for longer than the idle timeout,
+// whether between requests or stalled part way through one
+void close_idle_connections(void) {
+    time_t cutoff = monotonic_seconds() - idle_timeout;
+    while (least_active != NULL && least_active->last_active < cutoff) {
+        close_connection(least_active);
+    }
+}
+
+// Accept every pending connection on a listening socket
+void accept_connections(int listen_fd) {
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Accept failed");
+            }
+            return;
+        }
+        Connection *connection = open_connection(fd);
+        connection->binary = listen_fd == binary_fd;
+        watch_fd(fd, EPOLLIN);
+    }
+}
+
+// Allow as many open sockets as the hard limit permits
+void raise_file_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int worker_processes = 1;  // Set by "workers="; server processes sharing the port
+
+// Set up a freshly forked server process
+void become_worker(pid_t parent) {
+    // Go down with the parent, even if it is already gone
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent) {
+        exit(0);
+    }
+    // The processes share the log; whole lines keep their output apart
+    setvbuf(stdout, NULL, _IOLBF, 0);
+}
+
+// Fork the server processes, which share the port through SO_REUSEPORT and
+// the database files through file locks and shared version counters, then
+// watch over them: one that crashes is replaced, and stopping this process
+// stops them all. Returns only in a child.
+void run_worker_processes(int count) {
+    if (!shareDatabaseVersions() || !shareStatements()) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+    printf("=> Starting %d worker processes\n", count);
+    fflush(stdout);
+    pid_t parent = getpid();
+    pid_t *children = calloc(count, sizeof(pid_t));
+    for (int i = 0; i < count; i++) {
+        children[i] = fork();
+        if (children[i] < 0) {
+            perror("fork failed");
+            exit(EXIT_FAILURE);
+        }
+        if (children[i] == 0) {
+            free(children);
+            become_worker(parent);
+            return;
+        }
+    }
+
+    int running = count;
+    while (running > 0) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (children[i] != pid) {
+                continue;
+            }
+            if (!WIFSIGNALED(status) || WTERMSIG(status) == SIGINT || WTERMSIG(status) == SIGTERM) {
+                // It exited on purpose, say because it could not bind; do not retry
+                children[i] = 0;
+                running--;
+                break;
+            }
+            printf("=> Worker process %d died of signal %d, restarting it\n", i, WTERMSIG(status));
+            fflush(stdout);
+            children[i] = fork();
+            if (children[i] == 0) {
+                free(children);
+                become_worker(parent);
+                return;
+            }
+            if (children[i] < 0) {
+                running--;
+            }
+            break;
+        }
+    }
+    exit(EXIT_FAILURE);
+}
 
 void handle_sigint(int sig) {
     printf("\n=> Shutting down server...\n", sig);
     if (server_fd >= 0) {
         close(server_fd);  // Close the server socket
     }
+    if (unix_fd >= 0) {
+        unlink(unix_socket_path);
+    }
     exit(0);  // Exit the program
 }
 
+// Open a non-blocking socket listening on port
+int open_listener(int port) {
+    struct sockaddr_in address;
+    int listen_fd;
+    // Create socket file descriptor
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        perror("Socket failed");
+        exit(EXIT_FAILURE);
+    }
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (worker_processes > 1) {
+        // Every process binds the port and the kernel spreads connections
+        // over their accept queues
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    }
+
+    // Bind the socket to the network address and port
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("Bind failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Listen for incoming connections
+    if (listen(listen_fd, SOMAXCONN) < 0) {
+        perror("Listen failed");
+        exit(EXIT_FAILURE);
+    }
+    return listen_fd;
+}
+
+// Open a non-blocking Unix domain socket listening at path, replacing a
+// socket file left behind by an earlier run
+int open_unix_listener(const char *path) {
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Unix socket path is too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("Socket failed");
+        exit(EXIT_FAILURE);
+    }
+    struct stat existing;
+    if (lstat(path, &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+        unlink(path);
+    }
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("Bind failed");
+        exit(EXIT_FAILURE);
+    }
+    if (listen(listen_fd, SOMAXCONN) < 0) {
+        perror("Listen failed");
+        exit(EXIT_FAILURE);
+    }
+    return listen_fd;
+}
+
 void start_server(void) {
     // Create necessary directories
     initialize();
-    int new_socket;
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
-    char buffer[BUFFER_SIZE] = {0};
     int PORT = 3232;
-    char *username = malloc(256);
-    char *password = malloc(256);
+    int binary_port = 0;
+    char *username = calloc(1, 256);
+    char *password = calloc(1, 256);
 
     // Open the config file for reading
     FILE *file = fopen("config", "r");
@@ -39,67 +1167,160 @@ void start_server(void) {
         return;
     }
 
+    // Each line is key=value. Keys are compared whole, since values such as
+    // paths may contain another key's name.
     char line[256];
     while (fgets(line, sizeof(line), file)) {
-        if (strstr(line, "port") != NULL) {
-            PORT = atoi(trim(replaceString(line, "port=", "")));  // Correctly assign port as an integer
-        }
-        if (strstr(line, "username") != NULL) {
-            strcpy(username, trim(replaceString(line, "username=", "")));  // Copy string to username
+        line[strcspn(line, "\r\n")] = '\0';
+        char *separator = strchr(line, '=');
+        if (separator == NULL) {
+            continue;
         }
-        if (strstr(line, "password") != NULL) {
-            strcpy(password, trim(replaceString(line, "password=", "")));  // Copy string to password
+        *separator = '\0';
+        const char *key = trim(line);
+        char *value = trim(separator + 1);
+        if (strcmp(key, "port") == 0) {
+            PORT = atoi(value);
+        } else if (strcmp(key, "binary_port") == 0) {
+            binary_port = atoi(value);  // Port of the binary protocol; 0 leaves it off
+        } else if (strcmp(key, "unix_socket") == 0) {
+            snprintf(unix_socket_path, sizeof(unix_socket_path), "%s", value);  // Path of a Unix domain socket serving HTTP beside the port
+        } else if (strcmp(key, "username") == 0) {
+            snprintf(username, 256, "%s", value);
+        } else if (strcmp(key, "password") == 0) {
+            snprintf(password, 256, "%s", value);
+        } else if (strcmp(key, "sort_memory") == 0) {
+            sort_memory_limit = parse_size(value);  // Bytes a sort may buffer before spilling
+        } else if (strcmp(key, "plan_cache") == 0) {
+            plan_cache_capacity = atoi(value);  // Query plans kept for reuse
+        } else if (strcmp(key, "result_cache") == 0) {
+            result_cache_budget = parse_size(value);  // Bytes of cached read responses
+        } else if (strcmp(key, "result_files") == 0) {
+            result_file_budget = parse_size(value);  // Bytes of large read responses kept in files
+        } else if (strcmp(key, "idle_timeout") == 0) {
+            idle_timeout = atoi(value);  // Seconds before a silent connection is closed
+        } else if (strcmp(key, "workers") == 0) {
+            worker_processes = atoi(value);  // Server processes sharing the port
+        } else if (strcmp(key, "threads") == 0) {
+            worker_threads = atoi(value);  // Request worker threads
+        } else if (strcmp(key, "max_request") == 0) {
+            max_request_size = parse_size(value);  // Bytes a request, body included, may take
+        } else if (strcmp(key, "metrics_auth") == 0) {
+            metrics_auth = atoi(value);  // 0 serves /metrics without credentials
+        } else if (strcmp(key, "slow_ms") == 0) {
+            slow_query_millis = atoi(value);  // Milliseconds past which a request is logged
+        } else if (strcmp(key, "slow_log") == 0) {
+            snprintf(slow_log_path, sizeof(slow_log_path), "%s", value);  // Where slow requests are logged
+        } else if (strcmp(key, "slow_log_size") == 0) {
+            slow_log_size = parse_size(value);  // Bytes of slow log before it is rotated
+        } else if (strcmp(key, "io_uring") == 0) {
+            io_uring_enabled = atoi(value);  // Batch socket polling and table reads through io_uring
         }
     }
     fclose(file);
 
-    // Trim Newlines
-    trim_newlines(username);
-    trim_newlines(password);
+    server_username = username;
+    server_password = password;
 
     // Setup signal handler for SIGINT
     signal(SIGINT, handle_sigint);
+    // A client that disconnects mid-response must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    raise_file_limit();
+    if (io_uring_enabled && !uringSupported()) {
+        printf("=> io_uring is not available here, using epoll and pread\n");
+        io_uring_enabled = 0;
+    }
 
-    // Create socket file descriptor
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("Socket failed");
+    if (!initMetrics()) {
+        perror("mmap failed");
         exit(EXIT_FAILURE);
     }
 
-    // Bind the socket to the network address and port
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    // Opened ahead of the fork: there is no SO_REUSEPORT for a path, so the
+    // worker processes share the one socket instead
+    if (unix_socket_path[0] != '\0') {
+        unix_fd = open_unix_listener(unix_socket_path);
+    }
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("Bind failed");
-        exit(EXIT_FAILURE);
+    if (worker_processes > 1) {
+        run_worker_processes(worker_processes);
     }
 
-    // Listen for incoming connections
-    if (listen(server_fd, 3) < 0) {
-        perror("Listen failed");
+    server_fd = open_listener(PORT);
+    if (binary_port > 0) {
+        binary_fd = open_listener(binary_port);
+    }
+
+    open_poller();
+    watch_fd(server_fd, EPOLLIN);
+    if (binary_fd >= 0) {
+        watch_fd(binary_fd, EPOLLIN);
+    }
+    if (unix_fd >= 0) {
+        watch_fd(unix_fd, EPOLLIN);
+    }
+
+    // One worker thread per CPU unless configured, split between the processes
+    if (worker_threads < 0) {
+        worker_threads = (int)sysconf(_SC_NPROCESSORS_ONLN) / worker_processes;
+        if (worker_threads < 1) {
+            worker_threads = 1;
+        }
+    }
+    if (worker_threads > 0) {
+        start_workers(worker_threads);
+    }
+    if (!startSlowLog()) {
+        perror("Opening the slow log failed");
         exit(EXIT_FAILURE);
     }
 
     printf("=> Simple DB Started on port %d\n", PORT);
+    if (binary_fd >= 0) {
+        printf("=> Binary protocol on port %d\n", binary_port);
+    }
+    if (unix_fd >= 0) {
+        printf("=> Listening on %s\n", unix_socket_path);
+    }
+
+    int ready_fds[MAX_EVENTS];
 
     while (1) {
-        // Accept incoming connection
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-            perror("Accept failed");
+        // Wake up once a second to time out idle connections, if there are any
+        int timeout = idle_timeout > 0 && least_active != NULL ? 1000 : -1;
+        int ready = wait_for_events(ready_fds, MAX_EVENTS, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Waiting for events failed");
             exit(EXIT_FAILURE);
         }
-
-        // Read the incoming request
-        read(new_socket, buffer, BUFFER_SIZE);
-        
-        // Handle the request and send response
-        handle_request(buffer, new_socket, username, password);
-
-        // Close the socket
-        close(new_socket);
-        memset(buffer, 0, BUFFER_SIZE); // Clear buffer for the next request
+        for (int i = 0; i < ready; i++) {
+            int fd = ready_fds[i];
+            if (fd == server_fd || fd == binary_fd || fd == unix_fd) {
+                accept_connections(fd);
+                continue;
+            }
+            if (worker_pool.thread_count > 0 && fd == worker_pool.wake_fd) {
+                collect_finished();
+                continue;
+            }
+            Connection *connection = connections[fd];
+            if (connection == NULL || connection->state == CONNECTION_HANDLING) {
+                continue;
+            }
+            // Errors and hangups surface as a failed read or write
+            int keep = connection->state == CONNECTION_READING
+                ? read_connection(connection)
+                : flush_connection(connection);
+            if (!keep) {
+                close_connection(connection);
+            }
+        }
+        if (idle_timeout > 0) {
+            close_idle_connections();
+        }
     }
 }
-
@@ -0,0 +1,138 @@
+// Checks of the SQL front end and the HTTP parser against cases that once
+// went wrong. Built over the server's own code by "make test"; runs in a
+// scratch directory, so no database of the user's is touched.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/server/server.c"
+#include "../src/server/http.h"
+
+int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+Arena test_arena;
+
+// Run a statement against the test database. Returns 1 on success with the
+// JSON result in out (freed by the caller), or 0 with the message in error.
+int run_sql(const char *sql, char **out, char *error, size_t error_size) {
+    JsonWriter writer;
+    json_init(&writer);
+    error[0] = '\0';
+    int executed = executeQuery(&test_arena, &writer, OUTPUT_JSON, "test", sql, NULL, 0, error, error_size);
+    *out = json_finish(&writer);
+    return executed;
+}
+
+// Whether a statement succeeds and its result is exactly expected
+int sql_returns(const char *sql, const char *expected) {
+    char *out;
+    char error[256];
+    int matched = run_sql(sql, &out, error, sizeof(error)) && strcmp(out, expected) == 0;
+    if (!matched) {
+        fprintf(stderr, "  %s -> %s%s\n", sql, out, error);
+    }
+    free(out);
+    return matched;
+}
+
+int sql_fails(const char *sql) {
+    char *out;
+    char error[256];
+    int executed = run_sql(sql, &out, error, sizeof(error));
+    free(out);
+    return !executed && error[0] != '\0';
+}
+
+void test_trailing_semicolon(void) {
+    CHECK(sql_returns("SELECT COUNT(*) FROM people;", "[{\"count\":2}]"));
+    CHECK(sql_returns("SELECT COUNT(*) FROM people ;  \n", "[{\"count\":2}]"));
+    // A second statement behind the ';' is refused, not silently dropped
+    CHECK(sql_fails("SELECT COUNT(*) FROM people; DELETE FROM people"));
+    CHECK(sql_fails(";"));
+    CHECK(sql_returns("SELECT COUNT(*) FROM people", "[{\"count\":2}]"));
+}
+
+void test_multi_row_insert(void) {
+    CHECK(sql_returns("INSERT INTO people (id, name) VALUES (3, 'carol'), (4, 'dave')", "{\"rows_affected\": 2}"));
+    CHECK(sql_returns("SELECT COUNT(*) FROM people", "[{\"count\":4}]"));
+    // A bad last row keeps the good ones before it out of the table too
+    CHECK(sql_fails("INSERT INTO people (id, name) VALUES (5, 'erin'), (6, 'frank'), (7, 'line\nbreak')"));
+    CHECK(sql_fails("INSERT INTO people (id, name) VALUES (5, 'erin'), (6, 'a,b')"));
+    CHECK(sql_returns("SELECT COUNT(*) FROM people", "[{\"count\":4}]"));
+}
+
+// Fetch the table ordered by order_by; returns the rows or, in error, why not
+int ordered_rows(const char *order_by, char **rows, char *error, size_t error_size) {
+    JsonWriter writer;
+    json_init(&writer);
+    error[0] = '\0';
+    int fetched = fetchOrderedTableData(&writer, "test", "people", NULL, NULL, order_by, error, error_size);
+    *rows = json_finish(&writer);
+    return fetched;
+}
+
+void test_unknown_order_by(void) {
+    char *rows;
+    char error[384];
+    CHECK(!ordered_rows("nosuch", &rows, error, sizeof(error)) && error[0] != '\0');
+    CHECK(rows[0] == '\0');  // Nothing written that could be sent or cached
+    free(rows);
+    CHECK(!ordered_rows("id:sideways", &rows, error, sizeof(error)) && error[0] != '\0');
+    free(rows);
+    CHECK(ordered_rows("id:desc", &rows, error, sizeof(error)) && error[0] == '\0');
+    CHECK(strstr(rows, "\"dave\"") != NULL && strstr(rows, "\"dave\"") < strstr(rows, "\"alice\""));
+    free(rows);
+}
+
+HttpParseResult parse_http(const char *input, HttpRequest *request) {
+    http_request_init(request);
+    return http_parse(request, input, strlen(input));
+}
+
+void test_http_framing(void) {
+    HttpRequest request;
+    CHECK(parse_http("POST /query HTTP/1.1\r\nContent-Length: 2\r\n\r\n{}GET /", &request) == HTTP_COMPLETE);
+    CHECK(request.length == strlen("POST /query HTTP/1.1\r\nContent-Length: 2\r\n\r\n{}"));
+    CHECK(parse_http("POST /query HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n2\r\n{}\r\n0\r\n\r\n", &request) == HTTP_INVALID);
+    CHECK(request.invalid_status != NULL && strncmp(request.invalid_status, "501", 3) == 0);
+    CHECK(parse_http("POST /query HTTP/1.1\r\nContent-Length: 2\r\nContent-Length: 7\r\n\r\n{}", &request) == HTTP_INVALID);
+    CHECK(parse_http("POST /query HTTP/1.1\r\nContent-Length: 2x\r\n\r\n{}", &request) == HTTP_INVALID);
+    CHECK(parse_http("GET /list/db HTTP/1.0\r\n\r\n", &request) == HTTP_COMPLETE && !request.http11 && !request.keep_alive);
+}
+
+int main(void) {
+    char directory[] = "/tmp/simple_db_test_XXXXXX";
+    if (mkdtemp(directory) == NULL || chdir(directory) != 0 || create_directory(DB_DIRECTORY) != 0) {
+        perror("Unable to set up a scratch directory");
+        return 1;
+    }
+    const char *columns[] = {"id", "name"};
+    const char *types[] = {"INTEGER", "TEXT"};
+    if (createDB(&test_arena, "test") <= 0 || createTable(&test_arena, "test", "people", columns, types, 2) <= 0 ||
+        insertTableValues(&test_arena, "test", "people", "1,alice") <= 0 ||
+        insertTableValues(&test_arena, "test", "people", "2,bob") <= 0) {
+        fprintf(stderr, "Unable to create the test database\n");
+        return 1;
+    }
+
+    test_trailing_semicolon();
+    test_multi_row_insert();
+    test_unknown_order_by();
+    test_http_framing();
+
+    deleteDB(&test_arena, "test");
+    rmdir(DB_DIRECTORY);
+    chdir("/");
+    rmdir(directory);
+    printf("%s\n", failures == 0 ? "All tests passed" : "Some tests failed");
+    return failures == 0 ? 0 : 1;
+}